@@ -38,6 +38,7 @@
 #include "GenomicRegion.hpp"
 #include "MethpipeFiles.hpp"
 #include "Epiread.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -285,6 +286,8 @@ main(int argc, const char **argv) {
 
     string outfile;
     string chroms_dir; 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "computes probability of allele-specific methylation at each tuple of CpGs", "<epireads>");
     opt_parse.add_opt("output", 'o', "output file name (default: stdout)", 
@@ -292,6 +295,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("chrom", 'c', "genome sequence file/directory",
               true, chroms_dir);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -313,6 +317,8 @@ main(int argc, const char **argv) {
     }
     const string epi_file(leftover_args.front());
     /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
     
     unordered_map<string, size_t> chrom_sizes;
     get_chrom_sizes(VERBOSE, epi_file, chrom_sizes);
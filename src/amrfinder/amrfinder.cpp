@@ -24,12 +24,16 @@
 #include <vector>
 #include <iostream>
 #include <numeric>
+#include <algorithm>
+#include <atomic>
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "EpireadStats.hpp"
 #include "GenomicRegion.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -285,21 +289,44 @@ total_states(const vector<epiread> &epireads) {
 
 static void
 add_amr(const string &chrom_name, const size_t start_cpg, 
-	const size_t cpg_window, const vector<epiread> &reads, 
+	const size_t cpg_window, const size_t n_reads,
         const double score, vector<GenomicRegion> &amrs) {
   static const string name_label("AMR");
   const size_t end_cpg = start_cpg + cpg_window - 1;
-  const string amr_name(name_label + toa(amrs.size()) + ":" + toa(reads.size()));
+  const string amr_name(name_label + toa(amrs.size()) + ":" + toa(n_reads));
   amrs.push_back(GenomicRegion(chrom_name, start_cpg, end_cpg,
 			       amr_name, score, '+'));
 }
 
 
+struct WindowResult {
+  size_t start_cpg;
+  size_t n_reads;
+  double score;
+};
+
+
+// windows tested, and the significant ones, for a range of windows
+struct WindowChunk {
+  WindowChunk() : windows_tested(0) {}
+  size_t windows_tested;
+  vector<WindowResult> significant;
+};
+
+
+/* the windows are tested in parallel in chunks of consecutive
+   windows. A chunk finds its first read by binary search, as the
+   reads are sorted, and the AMRs are added in the order of the
+   windows so they are named just as if tested one at a time. */
 static size_t
 process_chrom(const bool VERBOSE, const bool PROGRESS,
 	      const size_t min_obs_per_cpg, const size_t window_size,
 	      const EpireadStats &epistat, const string &chrom_name,
-	      const vector<epiread> &epireads, vector<GenomicRegion> &amrs) {
+	      const vector<epiread> &epireads, ThreadPool &pool,
+	      vector<GenomicRegion> &amrs) {
+  static const size_t windows_per_chunk = 1000;
+  StageTimer timer("test_windows");
+
   size_t max_epiread_len = 0;
   for (size_t i = 0; i < epireads.size(); ++i)
     max_epiread_len = std::max(max_epiread_len, epireads[i].length());
@@ -310,28 +337,56 @@ process_chrom(const bool VERBOSE, const bool PROGRESS,
     cerr << "PROCESSING: " << chrom_name << " "
 	 << "[reads: " << epireads.size() << "] "
 	 << "[cpgs: " << chrom_cpgs << "]" << endl;
-  const size_t PROGRESS_TIMING_MODULUS = std::max(1ul, epireads.size()/1000);
+  // no read reaches a window starting past the last read
+  const size_t lim = std::min(chrom_cpgs - window_size + 1,
+                              epireads.back().pos + max_epiread_len);
+  const size_t n_chunks = (lim + windows_per_chunk - 1)/windows_per_chunk;
+  vector<WindowChunk> chunks(n_chunks);
+  std::atomic<size_t> chunks_done(0);
+  parallel_for_each(pool, n_chunks, [&](const size_t c, const size_t tid) {
+      const size_t first = c*windows_per_chunk;
+      const size_t last = std::min(lim, first + windows_per_chunk);
+      size_t start_idx =
+        std::partition_point(epireads.begin(), epireads.end(),
+                             [&](const epiread &r) {
+                               return r.pos + max_epiread_len <= first;
+                             }) - epireads.begin();
+      vector<epiread> current_epireads;
+      for (size_t i = first; i < last && start_idx < epireads.size(); ++i) {
+        current_epireads.clear();
+        get_current_epireads(epireads, max_epiread_len,
+                             window_size, i, start_idx, current_epireads);
+
+        if (total_states(current_epireads) >= min_obs_per_window) {
+          bool is_significant = false;
+          const double score = epistat.test_asm(current_epireads,
+                                                is_significant);
+          if (is_significant) {
+            const WindowResult w = {i, current_epireads.size(), score};
+            chunks[c].significant.push_back(w);
+          }
+          ++chunks[c].windows_tested;
+        }
+      }
+      const size_t done = ++chunks_done;
+      if (PROGRESS && tid == 0)
+        cerr << '\r' << chrom_name << ' '
+             << percent(done, n_chunks) << "%\r";
+    });
+
   size_t windows_tested = 0;
-  size_t start_idx = 0;
-  const size_t lim = chrom_cpgs - window_size + 1;
-  for (size_t i = 0; i < lim && start_idx < epireads.size(); ++i) {
-    if (PROGRESS && i % PROGRESS_TIMING_MODULUS == 0) 
-      cerr << '\r' << chrom_name << ' ' << percent(i, chrom_cpgs) << "%\r";
-    vector<epiread> current_epireads;
-    get_current_epireads(epireads, max_epiread_len,
-			 window_size, i, start_idx, current_epireads);
-
-    if (total_states(current_epireads) >= min_obs_per_window) {
-      bool is_significant = false;
-      const double score = epistat.test_asm(current_epireads, is_significant);
-      if (is_significant)
-
-	add_amr(chrom_name, i, window_size, current_epireads, score, amrs);
-      ++windows_tested;
+  for (size_t c = 0; c < n_chunks; ++c) {
+    windows_tested += chunks[c].windows_tested;
+    for (size_t j = 0; j < chunks[c].significant.size(); ++j) {
+      const WindowResult &w = chunks[c].significant[j];
+      add_amr(chrom_name, w.start_cpg, window_size, w.n_reads, w.score, amrs);
     }
   }
   if (PROGRESS)
     cerr << '\r' << chrom_name << " 100%" << endl;
+  Metrics::count("epireads", epireads.size());
+  Metrics::gauge_max("max_chrom_epireads", epireads.size());
+  Metrics::count("windows_tested", windows_tested);
   return windows_tested;
 }
 
@@ -351,6 +406,7 @@ main(int argc, const char **argv) {
     size_t max_itr = 10;
     size_t window_size = 10;
     size_t gap_limit = 1000;
+    size_t n_threads = 1;
     
     double high_prob = 0.75, low_prob = 0.25;
     double min_obs_per_cpg = 4;
@@ -361,6 +417,8 @@ main(int argc, const char **argv) {
     bool CORRECTION = false;
     bool NOFDR=false;
     
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), 
 			   "identify regions of allele-specific methylation", 
@@ -377,6 +435,7 @@ main(int argc, const char **argv) {
     		      false, gap_limit);
     opt_parse.add_opt("crit", 'C', "critical p-value cutoff (default: 0.01)", 
 		      false, critical_value);
+    add_threads_opt(opt_parse, n_threads);
     // BOOLEAN FLAGS
     opt_parse.add_opt("nofdr", 'f', "omits FDR multiple testing correction",
                       false, NOFDR);
@@ -385,6 +444,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("bic", 'b', "use BIC to compare models", false, USE_BIC);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("progress", 'P', "print progress info", false, PROGRESS);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -406,6 +466,8 @@ main(int argc, const char **argv) {
     }
     const string reads_file(leftover_args.front());
     /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
     
     if (VERBOSE)
       cerr << "AMR TESTING OPTIONS: "
@@ -419,6 +481,7 @@ main(int argc, const char **argv) {
     if (!in)
       throw SMITHLABException("cannot open input file: " + reads_file);
     
+    ThreadPool pool(n_threads);
     vector<GenomicRegion> amrs;
     size_t windows_tested = 0;
     epiread er;
@@ -430,7 +493,7 @@ main(int argc, const char **argv) {
       if (!epireads.empty() && curr_chrom != prev_chrom) {
         windows_tested += 
         process_chrom(VERBOSE, PROGRESS, min_obs_per_cpg, window_size,
-		    epistat, prev_chrom, epireads, amrs);
+		    epistat, prev_chrom, epireads, pool, amrs);
         epireads.clear();
       }
       epireads.push_back(er);
@@ -440,14 +503,16 @@ main(int argc, const char **argv) {
     if (!epireads.empty())
       windows_tested += 
 	process_chrom(VERBOSE, PROGRESS, min_obs_per_cpg, window_size,
-		      epistat, prev_chrom, epireads, amrs);
+		      epistat, prev_chrom, epireads, pool, amrs);
     
     //////////////////////////////////////////////////////////////////
     //////  POSTPROCESSING IDENTIFIED AMRS AND COMPUTING SUMMARY STATS
     if (VERBOSE)
       cerr << "========= POST PROCESSING =========" << endl;
     
+    StageTimer timer("post_processing");
     const size_t windows_accepted = amrs.size();
+    Metrics::count("windows_accepted", windows_accepted);
     if (!amrs.empty()) {
       // Could potentially only get the first n p-vals, but would
       // have to sort here and assume sorted for smithlab_utils, or
@@ -481,6 +546,7 @@ main(int argc, const char **argv) {
       const size_t amrs_passing_fdr = amrs.size();
     
       eliminate_amrs_by_size(gap_limit/2, amrs);
+      Metrics::count("amrs", amrs.size());
     
       if (VERBOSE) {
         cerr << "WINDOWS TESTED: " << windows_tested << endl
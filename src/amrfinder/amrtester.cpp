@@ -31,6 +31,7 @@
 
 #include "Epiread.hpp"
 #include "EpireadStats.hpp"
+#include "Metrics.hpp"
 
 using std::streampos;
 using std::string;
@@ -202,6 +203,8 @@ main(int argc, const char **argv) {
     size_t max_itr = 10;
     double high_prob = 0.75, low_prob = 0.25;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "resolve epi-alleles",
                            "<bed-regions> <mapped-reads>");
@@ -212,6 +215,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("progress", 'P', "print progress info", false, PROGRESS);
     opt_parse.add_opt("bic", 'b', "use BIC to compare models", false, USE_BIC);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -237,6 +241,8 @@ main(int argc, const char **argv) {
     const string reads_file_name(leftover_args.back());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     vector<GenomicRegion> regions;
     ReadBEDFile(regions_file, regions);
     if (!check_sorted(regions))
@@ -32,8 +32,11 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
 
 #include "bsutils.hpp"
+#include "MethCounts.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -46,179 +49,19 @@ using std::accumulate;
 using std::unordered_map;
 
 
-static void
-revcomp(MappedRead &mr) {
-  revcomp_inplace(mr.seq);
-  if (mr.r.pos_strand())
-    mr.r.set_strand('-');
-  else mr.r.set_strand('+');
-}
-
-
-static void
-count_states_pos(const bool INCLUDE_CPGS, const string &chrom,
-                 const MappedRead &r,
-                 vector<size_t> &unconv, vector<size_t> &conv,
-                 vector<size_t> &err, size_t &hanging) {
-
-  const size_t width = r.r.get_width();
-  const size_t offset = r.r.get_start();
-
-  size_t position = offset;
-  assert(offset < chrom.length()); // at least one bp of read on chr
-  for (size_t i = 0; i < width; ++i, ++position) {
-    if (position >= chrom.length()) // some overhang
-      ++hanging;
-
-    if (is_cytosine(chrom[position]) &&
-        (!is_guanine(chrom[position+1]) ||
-         position == chrom.length() ||
-         INCLUDE_CPGS)) {
-
-      if (is_cytosine(r.seq[i])) ++unconv[i];
-      else if (is_thymine(r.seq[i])) ++conv[i];
-      else if (toupper(r.seq[i]) != 'N')
-        ++err[i];
-    }
-  }
-}
-
-
-static void
-count_states_neg(const bool INCLUDE_CPGS, const string &chrom,
-                 const MappedRead &r,
-                 vector<size_t> &unconv, vector<size_t> &conv,
-                 vector<size_t> &err, size_t &hanging) {
-
-  const size_t width = r.r.get_width();
-  const size_t offset = r.r.get_start();
-
-  size_t position = offset + width - 1;
-  assert(offset < chrom.length()); // at least one bp of read on chr
-  for (size_t i = 0; i < width; ++i, --position) {
-    if (position >= chrom.length())
-      ++hanging;
-    if (is_guanine(chrom[position]) &&
-        (position == 0 ||
-         !is_cytosine(chrom[position-1]) ||
-         INCLUDE_CPGS)) {
-
-      if (is_cytosine(r.seq[i])) ++unconv[i];
-      else if (is_thymine(r.seq[i])) ++conv[i];
-      else if (toupper(r.seq[i]) != 'N')
-        ++err[i];
-    }
-  }
-}
-
-
-static void
-write_output(const string &outfile,
-             const vector<size_t> &ucvt_count_p,
-             const vector<size_t> &cvt_count_p,
-             const vector<size_t> &ucvt_count_n,
-             const vector<size_t> &cvt_count_n,
-             const vector<size_t> &err_p, const vector<size_t> &err_n) {
-
-  // Get some totals first
-  const size_t pos_cvt = accumulate(cvt_count_p.begin(),
-                                    cvt_count_p.end(), 0ul);
-  const size_t neg_cvt = accumulate(cvt_count_n.begin(),
-                                    cvt_count_n.end(), 0ul);
-  const size_t total_cvt = pos_cvt + neg_cvt;
-
-  const size_t pos_ucvt =
-    accumulate(ucvt_count_p.begin(), ucvt_count_p.end(), 0ul);
-  const size_t neg_ucvt =
-    accumulate(ucvt_count_n.begin(), ucvt_count_n.end(), 0ul);
-  const size_t total_ucvt = pos_ucvt + neg_ucvt;
-
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-
-  out << "OVERALL CONVERSION RATE = "
-      << static_cast<double>(total_cvt)/(total_cvt + total_ucvt) << endl
-      << "POS CONVERSION RATE = "
-      << static_cast<double>(pos_cvt)/(pos_cvt + pos_ucvt) << '\t'
-      << std::fixed << static_cast<size_t>(pos_cvt + pos_ucvt) << endl
-      << "NEG CONVERSION RATE = "
-      << static_cast<double>(neg_cvt)/(neg_cvt + neg_ucvt) << '\t'
-      << std::fixed << static_cast<size_t>(neg_cvt + neg_ucvt) << endl;
-
-  out << "BASE" << '\t'
-      << "PTOT" << '\t'
-      << "PCONV" << '\t'
-      << "PRATE" << '\t'
-      << "NTOT" << '\t'
-      << "NCONV" << '\t'
-      << "NRATE" << '\t'
-      << "BTHTOT" << '\t'
-      << "BTHCONV" << '\t'
-      << "BTHRATE" << '\t'
-      << "ERR" << '\t'
-      << "ALL" << '\t'
-      << "ERRRATE"  << endl;
-
-  // Figure out how many positions to print in the output, capped at 1000
-  size_t output_len =
-    (ucvt_count_p.size() > 1000) ? 1000 : ucvt_count_p.size();
-
-  while (output_len > 0 &&
-         (ucvt_count_p[output_len-1] + cvt_count_p[output_len-1] +
-          ucvt_count_n[output_len-1] + cvt_count_n[output_len-1] == 0))
-    --output_len;
-
-  // Now actually output the results
-  static const size_t precision_val = 5;
-  for (size_t i = 0; i < output_len; ++i) {
-
-    const size_t total_p = ucvt_count_p[i] + cvt_count_p[i];
-    const size_t total_n = ucvt_count_n[i] + cvt_count_n[i];
-    const size_t total_valid = total_p + total_n;
-    out << (i + 1) << "\t";
-
-    out.precision(precision_val);
-    out << total_p << '\t' << cvt_count_p[i] << '\t'
-        << static_cast<double>(cvt_count_p[i])/max(size_t(1ul), total_p)
-        << '\t';
-
-    out.precision(precision_val);
-    out << total_n << '\t' << cvt_count_n[i] << '\t'
-        << static_cast<double>(cvt_count_n[i])/max(size_t(1ul), total_n)
-        << '\t';
-
-    const double total_cvt = cvt_count_p[i] + cvt_count_n[i];
-    out.precision(precision_val);
-    out << static_cast<size_t>(total_valid)
-        << '\t' << cvt_count_p[i] + cvt_count_n[i] << '\t'
-        << total_cvt/max(1ul, total_valid) << '\t';
-
-    const double total_err = err_p[i] + err_n[i];
-    out.precision(precision_val);
-    const size_t total = total_valid + err_p[i] + err_n[i];
-    out << err_p[i] + err_n[i] << '\t' << static_cast<size_t>(total) << '\t'
-        << total_err/max(1ul, total) << endl;
-  }
-}
-
-
 typedef unordered_map<string, string> chrom_file_map;
 static void
-get_chrom(const bool VERBOSE, const MappedRead &mr,
-          const chrom_file_map& chrom_files,
-          GenomicRegion &chrom_region, string &chrom) {
+get_chrom(const string &chrom_name, const chrom_file_map& chrom_files,
+          string &chrom) {
 
-  const chrom_file_map::const_iterator fn(chrom_files.find(mr.r.get_chrom()));
+  const chrom_file_map::const_iterator fn(chrom_files.find(chrom_name));
   if (fn == chrom_files.end())
-    throw SMITHLABException("could not find chrom: " + mr.r.get_chrom());
+    throw SMITHLABException("could not find chrom: " + chrom_name);
 
   chrom.clear();
-  read_fasta_file(fn->second, mr.r.get_chrom(), chrom);
+  read_fasta_file(fn->second, chrom_name, chrom);
   if (chrom.empty())
-    throw SMITHLABException("could not find chrom: " + mr.r.get_chrom());
-
-  chrom_region.set_chrom(mr.r.get_chrom());
+    throw SMITHLABException("could not find chrom: " + chrom_name);
 }
 
 
@@ -227,9 +70,6 @@ main(int argc, const char **argv) {
 
   try {
 
-    // ASSUMED MAXIMUM LENGTH OF A FRAGMENT
-    static const size_t OUTPUT_SIZE = 10000;
-
     bool VERBOSE = false;
     bool INCLUDE_CPGS = false;
     bool A_RICH_READS = false;
@@ -240,6 +80,8 @@ main(int argc, const char **argv) {
 
     double max_mismatches = std::numeric_limits<double>::max();
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Program to compute the "
                            "BS conversion rate from BS-seq "
@@ -259,6 +101,7 @@ main(int argc, const char **argv) {
                       false , max_mismatches);
     opt_parse.add_opt("a-rich", 'A', "reads are A-rich", false, A_RICH_READS);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -281,6 +124,8 @@ main(int argc, const char **argv) {
     const string mapped_reads_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (VERBOSE && max_mismatches != std::numeric_limits<double>::max())
       cerr << "MAX_MISMATCHES=" << max_mismatches << endl;
 
@@ -293,40 +138,43 @@ main(int argc, const char **argv) {
     if (!in)
       throw SMITHLABException("cannot open file: " + mapped_reads_file);
 
-    vector<size_t> unconv_count_pos(OUTPUT_SIZE, 0ul);
-    vector<size_t> conv_count_pos(OUTPUT_SIZE, 0ul);
-    vector<size_t> unconv_count_neg(OUTPUT_SIZE, 0ul);
-    vector<size_t> conv_count_neg(OUTPUT_SIZE, 0ul);
-    vector<size_t> err_pos(OUTPUT_SIZE, 0ul);
-    vector<size_t> err_neg(OUTPUT_SIZE, 0ul);
+    ConversionCounts conversion;
 
     string chrom;
+    size_t chrom_id = 0; // from the reader; 0 before the first read
     MappedRead mr;
-    GenomicRegion chrom_region; // exists only for faster comparison
-    size_t hanging = 0;
+    MappedReadReader reader(in);
 
-    while (in >> mr) {
+    StageTimer timer("count_conversion");
+    size_t n_reads = 0;
+    while (reader.read(mr)) {
+      ++n_reads;
 
       if (A_RICH_READS)
-        revcomp(mr);
+        revcomp_a_rich_read(mr);
 
       // get the correct chrom if it has changed
-      if (chrom.empty() || !mr.r.same_chrom(chrom_region))
-        get_chrom(VERBOSE, mr, chrom_files, chrom_region, chrom);
+      if (reader.chrom_id() != chrom_id) {
+        get_chrom(reader.chrom(), chrom_files, chrom);
+        chrom_id = reader.chrom_id();
+      }
 
       // do the work for this mapped read
-      if (mr.r.pos_strand())
-        count_states_pos(INCLUDE_CPGS, chrom, mr,
-                         unconv_count_pos, conv_count_pos, err_pos, hanging);
-      else
-        count_states_neg(INCLUDE_CPGS, chrom, mr,
-                         unconv_count_neg, conv_count_neg, err_neg, hanging);
+      conversion.add_read(INCLUDE_CPGS, chrom, mr);
     }
-    write_output(outfile, unconv_count_pos,
-                 conv_count_pos, unconv_count_neg,
-                 conv_count_neg, err_pos, err_neg);
-    if (hanging > 0) // some overhanging reads
-      cerr << "Warning: a nonzero number (" << hanging << ") of reads mapped"
+    if (in.bad())
+      throw SMITHLABException("error reading file: " + mapped_reads_file);
+    timer.stop();
+    Metrics::count("reads", n_reads);
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+    conversion.write(out);
+
+    if (conversion.hanging > 0) // some overhanging reads
+      cerr << "Warning: a nonzero number (" << conversion.hanging
+           << ") of reads mapped"
            << " to the very end of a chromosome. For high numbers, make"
            << " sure you are using the same assembly you mapped with."
            << endl;
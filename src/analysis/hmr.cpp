@@ -31,7 +31,10 @@
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
 #include "TwoStateHMM.hpp"
+#include "ThreadPool.hpp"
+#include "RandomStream.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -209,9 +212,8 @@ shuffle_cpgs(const size_t seed,
              const double fg_alpha, const double fg_beta,
              const double bg_alpha, const double bg_beta,
              vector<double> &domain_scores) {
-  //srand(time(0) + getpid());
-  srand(seed);
-  random_shuffle(meth.begin(), meth.end());
+  RandomStream rs(seed);
+  rs.shuffle(meth.begin(), meth.end());
   vector<bool> classes;
   vector<double> scores;
   hmm.PosteriorDecoding(meth, reset_points, start_trans, trans,
@@ -319,6 +321,7 @@ main(int argc, const char **argv) {
     size_t desert_size = 1000;
     size_t max_iterations = 10;
     size_t seed = 408;
+    size_t n_threads = 1;
 
     // run mode flags
     bool VERBOSE = false;
@@ -331,6 +334,8 @@ main(int argc, const char **argv) {
     string params_in_file;
     string params_out_file;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Program for identifying "
                            "HMRs in methylation data", "<cpg-BED-file>");
@@ -354,6 +359,8 @@ main(int argc, const char **argv) {
                       false, params_out_file);
     opt_parse.add_opt("seed", 's', "specify random seed",
                       false, seed);
+    add_threads_opt(opt_parse, n_threads);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -377,6 +384,8 @@ main(int argc, const char **argv) {
     const string cpgs_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     // separate the regions by chrom and by desert
     vector<SimpleGenomicRegion> cpgs;
     // vector<double> meth;
@@ -385,7 +394,9 @@ main(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "[READING CPGS AND METH PROPS]" << endl;
 
+    StageTimer timer("load_cpgs");
     methpipe::load_cpgs(cpgs_file, cpgs, meth, reads);
+    Metrics::count("cpgs", cpgs.size());
 
     if (PARTIAL_METH) make_partial_meth(reads, meth);
     if (VERBOSE)
@@ -397,13 +408,16 @@ main(int argc, const char **argv) {
     // separate the regions by chrom and by desert, and eliminate
     // those isolated CpGs
     vector<size_t> reset_points;
+    timer.next("separate_regions");
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
+    Metrics::count("cpgs_covered", cpgs.size());
 
     vector<double> start_trans(2, 0.5), end_trans(2, 1e-10);
     vector<vector<double> > trans(2, vector<double>(2, 0.25));
     trans[0][0] = trans[1][1] = 0.75;
 
-    const TwoStateHMMB hmm(min_prob, tolerance, max_iterations, VERBOSE);
+    const TwoStateHMMB hmm(min_prob, tolerance, max_iterations, VERBOSE,
+                           false, n_threads);
 
     double fg_alpha = 0;
     double fg_beta = 0;
@@ -428,6 +442,7 @@ main(int argc, const char **argv) {
       bg_beta = 0.33*n_reads;
     }
 
+    timer.next("training");
     if (max_iterations > 0)
       hmm.BaumWelchTraining(meth, reset_points, start_trans, trans,
                             end_trans, fg_alpha, fg_beta, bg_alpha, bg_beta);
@@ -443,6 +458,7 @@ main(int argc, const char **argv) {
      */
     vector<bool> classes;
     vector<double> scores;
+    timer.next("posterior_decoding");
     hmm.PosteriorDecoding(meth, reset_points, start_trans, trans,
                           end_trans, fg_alpha, fg_beta, bg_alpha,
                           bg_beta, classes, scores);
@@ -451,14 +467,17 @@ main(int argc, const char **argv) {
     get_domain_scores(classes, meth, reset_points, domain_scores);
 
     vector<double> random_scores;
+    timer.next("shuffle_cpgs");
     shuffle_cpgs(seed, hmm, meth, reset_points, start_trans, trans, end_trans,
                  fg_alpha, fg_beta, bg_alpha, bg_beta, random_scores);
 
     vector<double> p_values;
+    timer.next("p_values");
     assign_p_values(random_scores, domain_scores, p_values);
 
     if (fdr_cutoff == numeric_limits<double>::max())
       fdr_cutoff = get_fdr_cutoff(p_values, 0.01);
+    Metrics::gauge("fdr_cutoff", fdr_cutoff);
 
     if (!params_out_file.empty())
       {
@@ -469,7 +488,10 @@ main(int argc, const char **argv) {
       }
 
     vector<GenomicRegion> domains;
+    timer.next("build_domains");
     build_domains(VERBOSE, cpgs, scores, reset_points, classes, domains);
+    Metrics::count("domains", domains.size());
+    timer.next("write_output");
 
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
@@ -481,12 +503,14 @@ main(int argc, const char **argv) {
         domains[i].set_name("HYPO" + smithlab::toa(good_hmr_count++));
         out << domains[i] << '\n';
       }
+    Metrics::count("hmrs", good_hmr_count);
 
     /***********************************
      * STEP 6: (OPTIONAL) WRITE POSTERIOR
      */
 
     if (!hypo_post_outfile.empty() || !meth_post_outfile.empty()) {
+      timer.next("posterior_scores");
       bool fg_class = true;
       vector<double> fg_posterior;
       hmm.PosteriorScores(meth, reset_points, start_trans, trans,
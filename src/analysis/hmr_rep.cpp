@@ -31,6 +31,8 @@
 #include "OptionParser.hpp"
 #include "TwoStateHMM.hpp"
 #include "MethpipeFiles.hpp"
+#include "RandomStream.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -187,7 +189,8 @@ separate_regions(const bool VERBOSE, const size_t desert_size,
 }
 
 static void
-shuffle_cpgs_rep(const TwoStateHMMB &hmm,
+shuffle_cpgs_rep(const size_t seed,
+		 const TwoStateHMMB &hmm,
 		 vector<vector<pair<double, double> > > meth,
 		 vector<size_t> reset_points,
 		 const vector<double> &start_trans,
@@ -197,11 +200,13 @@ shuffle_cpgs_rep(const TwoStateHMMB &hmm,
 		 const vector<double> bg_alpha, const vector<double> bg_beta,
 		 vector<double> &domain_scores) {
 
-  srand(time(0) + getpid());
   size_t NREP = meth.size();
 
-  for (size_t r =0 ; r < NREP; ++r)
-    random_shuffle(meth[r].begin(), meth[r].end());
+  // each replicate is shuffled with its own stream
+  for (size_t r =0 ; r < NREP; ++r) {
+    RandomStream rs(seed, r);
+    rs.shuffle(meth[r].begin(), meth[r].end());
+  }
 
   vector<bool> classes;
   vector<double> scores;
@@ -318,6 +323,7 @@ main(int argc, const char **argv) {
     bool DEBUG = false;
     size_t desert_size = 1000;
     size_t max_iterations = 10;
+    size_t seed = 408;
 
     // run mode flags
     bool VERBOSE = false;
@@ -329,6 +335,8 @@ main(int argc, const char **argv) {
     string params_in_files;
     string params_out_file;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Program for identifying "
 			   "HMRs from methylomes of replicates ",
@@ -351,6 +359,9 @@ main(int argc, const char **argv) {
 		      false, params_in_files);
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to this file",
 		      false, params_out_file);
+    opt_parse.add_opt("seed", 's', "specify random seed",
+                      false, seed);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -374,6 +385,8 @@ main(int argc, const char **argv) {
     const string cpgs_files = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     vector<string> cpgs_file =  smithlab::split(cpgs_files, sep, false);
     vector<string> params_in_file;
     if(!params_in_files.empty()) {
@@ -388,6 +401,7 @@ main(int argc, const char **argv) {
     vector<vector<pair<double, double> > > meth;
     vector<vector<size_t> > reads;
 
+    StageTimer timer("load_cpgs");
     for (size_t i = 0; i < NREP; ++i) {
       vector<SimpleGenomicRegion> cpgs_rep;
       vector<pair<double, double> > meth_rep;
@@ -397,6 +411,7 @@ main(int argc, const char **argv) {
 
       methpipe::load_cpgs(cpgs_file[i], cpgs_rep, meth_rep, reads_rep);
 
+      Metrics::count("cpgs", cpgs_rep.size());
       cpgs.push_back(cpgs_rep);
       meth.push_back(meth_rep);
       reads.push_back(reads_rep);
@@ -419,6 +434,7 @@ main(int argc, const char **argv) {
     // separate the regions by chrom and by desert, and eliminate
     // those isolated CpGs
     vector<size_t> reset_points;
+    timer.next("separate_regions");
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
 
     /****************** Read in params *****************/
@@ -454,6 +470,7 @@ main(int argc, const char **argv) {
       }
     }
 
+    timer.next("training");
     if (max_iterations > 0)
       hmm.BaumWelchTraining_rep(meth, reset_points,
     				start_trans, trans, end_trans,
@@ -472,6 +489,7 @@ main(int argc, const char **argv) {
 
     vector<bool> classes;
     vector<double> scores;
+    timer.next("posterior_decoding");
     hmm.PosteriorDecoding_rep(meth, reset_points, start_trans, trans, end_trans,
 			      reps_fg_alpha, reps_fg_beta,
 			      reps_bg_alpha, reps_bg_beta, classes, scores);
@@ -480,7 +498,8 @@ main(int argc, const char **argv) {
     get_domain_scores_rep(classes, meth, reset_points, domain_scores);
 
     vector<double> random_scores;
-    shuffle_cpgs_rep(hmm, meth, reset_points, start_trans, trans, end_trans,
+    timer.next("shuffle_cpgs");
+    shuffle_cpgs_rep(seed, hmm, meth, reset_points, start_trans, trans, end_trans,
 		     reps_fg_alpha, reps_fg_beta, reps_bg_alpha, reps_bg_beta,
                      random_scores);
 
@@ -497,7 +516,10 @@ main(int argc, const char **argv) {
     }
 
     vector<GenomicRegion> domains;
+    timer.next("build_domains");
     build_domains(VERBOSE, cpgs[0], scores, reset_points, classes, domains);
+    Metrics::count("domains", domains.size());
+    timer.next("write_output");
 
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
@@ -509,11 +531,13 @@ main(int argc, const char **argv) {
 	domains[i].set_name("HYPO" + smithlab::toa(good_hmr_count++));
 	out << domains[i] << '\n';
       }
+    Metrics::count("hmrs", good_hmr_count);
     /***********************************
      * STEP 6: (OPTIONAL) WRITE POSTERIOR
      */
 
     if (!hypo_post_outfile.empty() || !meth_post_outfile.empty()) {
+      timer.next("posterior_scores");
       bool fg_class = true;
       vector<double> fg_posterior;
       hmm.PosteriorScores_rep(meth, reset_points, start_trans, trans,
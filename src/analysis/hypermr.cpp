@@ -28,6 +28,7 @@
 #include "OptionParser.hpp"
 #include "ThreeStateHMM.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -368,6 +369,8 @@ main(int argc, const char **argv)
       string params_in_file;
       string params_out_file;
 
+      string metrics_file;
+
       /****************** COMMAND LINE OPTIONS ********************/
       OptionParser opt_parse(argv[0], "A program for segmenting DNA "
                              "methylation data"
@@ -396,6 +399,7 @@ main(int argc, const char **argv)
                         false, params_in_file);
       opt_parse.add_opt("params-out", 'p', "HMM parameters file",
                         false, params_out_file);
+      add_metrics_opt(opt_parse, metrics_file);
 
       vector<string> leftover_args;
       opt_parse.parse(argc, argv, leftover_args);
@@ -422,6 +426,8 @@ main(int argc, const char **argv)
       const string cpgs_file = leftover_args.front();
       /****************** END COMMAND LINE OPTIONS *****************/
 
+      MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
       // separate the regions by chrom and by desert
       vector<SimpleGenomicRegion> cpgs;
       // vector<double> meth;
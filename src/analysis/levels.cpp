@@ -32,15 +32,20 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
-#include <numeric>
-#include <cmath>
+#include <cstdlib>
+#include <cctype>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "MethpipeFiles.hpp"
 
-#include "bsutils.hpp"
+#include "MethpipeSite.hpp"
+#include "MethLevels.hpp"
+#include "OrderedPipeline.hpp"
+#include "ThreadPool.hpp"
+#include "TextScan.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -48,135 +53,49 @@ using std::cout;
 using std::cerr;
 using std::endl;
 
-struct Site {
-  string chrom;
-  size_t pos;
-  string strand;
-  string context;
-  double meth;
-  size_t n_reads;
-
-  size_t n_meth() const {return std::round(meth*n_reads);}
-
-  void add(const Site &other) {
-    if (!is_mutated() && other.is_mutated())
-      context += 'x';
-    // ADS: order matters below as n_reads update invalidates n_meth()
-    // function until meth has been updated
-    const size_t total_c_reads = n_meth() + other.n_meth();
-    n_reads += other.n_reads;
-    meth = static_cast<double>(total_c_reads)/n_reads;
-  }
-
-  // ADS: function below has redundant check for is_cpg, which is
-  // expensive and might be ok to remove
-  bool is_mate_of(const Site &first) {
-    return (first.pos + 1 == pos && first.is_cpg() && is_cpg() &&
-            first.strand == "+" && strand == "-");
-  }
-  ////////////////////////////////////////////////////////////////////////
-  /////  Functions below test the type of site. These are CpG, CHH, and
-  /////  CHG divided into two kinds: CCG and CXG, the former including a
-  /////  CpG within. Also included is a function that tests if a site
-  /////  has a mutation.
-  /////  WARNING: None of these functions test for the length of their
-  /////  argument string, which could cause problems.
-  ////////////////////////////////////////////////////////////////////////
-  bool is_cpg() const {
-    return (context[0] == 'C' && context[1] == 'p' && context[2] == 'G');
-  }
-  bool is_chh() const {
-    return (context[0] == 'C' && context[1] == 'H' && context[2] == 'H');
-  }
-  bool is_ccg() const {
-    return (context[0] == 'C' && context[1] == 'C' && context[2] == 'G');
-  }
-  bool is_cxg() const {
-    return (context[0] == 'C' && context[1] == 'X' && context[2] == 'G');
-  }
-  bool is_mutated() const {
-    return context[3] == 'x';
-  }
-};
-
-
-struct CountSet {
-  size_t total_sites;
-  size_t sites_covered;
-  size_t max_coverage;
-  size_t mutations;
-  size_t total_c, total_t;
-  size_t called_meth, called_unmeth;
-  double mean_agg;
-  CountSet() : total_sites(0), sites_covered(0), max_coverage(0),
-               mutations(0), total_c(0), total_t(0),
-               called_meth(0), called_unmeth(0),
-               mean_agg(0.0) {}
-
-  void update(const Site &s) {
-    if (s.is_mutated()) {
-      ++mutations;
-    }
-    else if (s.n_reads > 0) {
-      ++sites_covered;
-      max_coverage = std::max(max_coverage, s.n_reads);
-      total_c += s.n_meth();
-      total_t += s.n_reads - s.n_meth();
-      mean_agg += s.meth;
-      double lower = 0.0, upper = 0.0;
-      wilson_ci_for_binomial(alpha, s.n_reads, s.meth, lower, upper);
-      called_meth += (lower > 0.5);
-      called_unmeth += (upper < 0.5);
-    }
-    ++total_sites;
-  }
-
-  size_t coverage() const {return total_c + total_t;}
-  size_t total_called() const {return called_meth + called_unmeth;}
+/* reads the fields of one line of methcounts output in place, so
+   the strings in "site" keep their capacity from one line to the
+   next; this replaces a stringstream for each line. */
+static void
+parse_site(const string &line, MSite &site) {
+  const char *p = skip_space(line.c_str());
+  const char *q = skip_token(p);
+  site.chrom.assign(p, q);
+  char *e = 0;
+  site.pos = strtoul(q, &e, 10);
+  p = skip_space(e);
+  site.strand = *p;
+  p = skip_space(skip_token(p));
+  q = skip_token(p);
+  site.context.assign(p, q);
+  site.meth = strtod(q, &e);
+  q = e;
+  site.n_reads = strtoul(q, &e, 10);
+  if (e == q || site.chrom.empty() || site.context.empty() ||
+      (site.strand != '+' && site.strand != '-'))
+    throw SMITHLABException("bad line in methcounts file:\n" + line);
+}
 
-  double weighted_mean_meth() const {
-    return static_cast<double>(total_c)/coverage();
-  }
-  double fractional_meth() const {
-    return static_cast<double>(called_meth)/total_called();
-  }
-  double mean_meth() const {
-    return mean_agg/sites_covered;
-  }
 
-  string format_summary(const string &context) const {
-    std::ostringstream oss;
-    const bool good = (sites_covered != 0);
-    oss << "METHYLATION LEVELS (" + context + " CONTEXT):\n"
-        << '\t' << "sites" << '\t' << total_sites << '\n'
-        << '\t' << "sites_covered" << '\t' << sites_covered << '\n'
-        << '\t' << "fraction_covered" << '\t'
-        << static_cast<double>(sites_covered)/total_sites << '\n'
-        << '\t' << "mean_depth" << '\t'
-        << static_cast<double>(coverage())/total_sites << '\n'
-        << '\t' << "mean_depth_covered" << '\t'
-        << static_cast<double>(coverage())/sites_covered << '\n'
-        << '\t' << "max_depth" << '\t' << max_coverage << '\n'
-        << '\t' << "mutations" << '\t' << mutations << '\n'
-        << '\t' << "mean_meth" << '\t'
-        << (good ? toa(mean_meth()) : "N/A")  << '\n'
-        << '\t' << "w_mean_meth" << '\t'
-        << (good ? toa(weighted_mean_meth()) : "N/A") << '\n'
-        << '\t' << "frac_meth" << '\t'
-        << (good ? toa(fractional_meth()) : "N/A");
-    return oss.str();
-  }
-
-  static double alpha;
+// a chunk of consecutive lines, counted on its own
+struct SiteBatch {
+  SiteBatch() : n_lines(0), levels(0.0) {}
+  vector<string> lines;
+  size_t n_lines;
+  MSite site;
+  MethLevels levels;
 };
 
-double CountSet::alpha = 0.95;
-
 
-static std::istream &
-get_meth_unmeth(std::istream &in, Site &site) {
-  return methpipe::read_site(in, site.chrom, site.pos, site.strand,
-                             site.context, site.meth, site.n_reads);
+static bool
+fill_batch(std::istream &in, const size_t batch_size, SiteBatch &b) {
+  if (b.lines.size() < batch_size)
+    b.lines.resize(batch_size);
+  b.n_lines = 0;
+  while (b.n_lines < batch_size && getline(in, b.lines[b.n_lines]))
+    if (!b.lines[b.n_lines].empty() && b.lines[b.n_lines][0] != '#')
+      ++b.n_lines;
+  return b.n_lines > 0;
 }
 
 
@@ -186,16 +105,30 @@ main(int argc, const char **argv) {
   try {
 
     bool VERBOSE = false;
+    bool BY_CHROM = false;
+    double alpha = 0.95;
+    size_t n_threads = 1;
+    string bins_arg;
     string outfile;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "compute methylation levels",
                            "<methcounts-file>");
     opt_parse.add_opt("output", 'o', "output file (default: stdout)",
                       false, outfile);
     opt_parse.add_opt("alpha", 'a', "alpha for confidence interval",
-                      false, CountSet::alpha);
+                      false, alpha);
+    opt_parse.add_opt("by-chrom", 'C', "also give the summaries for each "
+                      "chromosome", false, BY_CHROM);
+    opt_parse.add_opt("bins", 'b', "also give the summaries for sites in "
+                      "bins of coverage, given as a comma-separated list of "
+                      "the lower ends of bins after the first (e.g. 1,5,10)",
+                      false, bins_arg);
+    add_threads_opt(opt_parse, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (opt_parse.help_requested()) {
@@ -218,56 +151,60 @@ main(int argc, const char **argv) {
     const string meth_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     std::ifstream in(meth_file.c_str());
     if (!in)
       throw SMITHLABException("bad input file: " + meth_file);
 
-    CountSet cpg, cpg_symm, chh, cxg, ccg, all_c;
-    Site site, prev_site;
-    size_t chrom_count = 0;
-
-    while (get_meth_unmeth(in, site)) {
-
-      if (site.chrom != prev_site.chrom) {
-        ++chrom_count;
-        if (VERBOSE)
-          cerr << "PROCESSING:\t" << site.chrom << "\n";
+    vector<size_t> bin_edges;
+    if (!bins_arg.empty()) {
+      const vector<string> parts(smithlab::split(bins_arg, ","));
+      for (size_t i = 0; i < parts.size(); ++i) {
+        char *e = 0;
+        bin_edges.push_back(strtoul(parts[i].c_str(), &e, 10));
+        if (*e != '\0' || parts[i].empty() ||
+            (i > 0 && bin_edges[i] <= bin_edges[i - 1]))
+          throw SMITHLABException("bad coverage bins: " + bins_arg);
       }
-
-      if (site.is_cpg()) {
-        cpg.update(site);
-        if (site.is_mate_of(prev_site)) {
-          site.add(prev_site);
-          cpg_symm.update(site);
-        }
-      }
-      else if (site.is_chh())
-        chh.update(site);
-      else if (site.is_ccg())
-        ccg.update(site);
-      else if (site.is_cxg())
-        cxg.update(site);
-      else
-        throw SMITHLABException("bad site context: " + site.context);
-
-      all_c.update(site);
-
-      prev_site = site;
     }
 
+    /* the reader splits the file into chunks of lines anywhere,
+       each chunk is parsed and counted by a worker on its own, and the
+       counts are added in the order of the file by the writer, which
+       completes the symmetric CpGs that span two chunks. */
+    static const size_t lines_per_batch = 100000;
+    MethLevels levels(alpha, BY_CHROM, bin_edges);
+    size_t n_chroms_reported = 0;
+    vector<SiteBatch> batches(2*n_threads + 2);
+    run_ordered_pipeline(n_threads, batches,
+                         [&](SiteBatch &b) {
+                           return fill_batch(in, lines_per_batch, b);
+                         },
+                         [&](SiteBatch &b, const size_t) {
+                           b.levels = MethLevels(alpha, BY_CHROM, bin_edges);
+                           b.levels.begin_chunk();
+                           for (size_t i = 0; i < b.n_lines; ++i) {
+                             parse_site(b.lines[i], b.site);
+                             b.levels.update(b.site);
+                           }
+                         },
+                         [&](SiteBatch &b) {
+                           levels += b.levels;
+                           const vector<string> &names =
+                             levels.get_chrom_names();
+                           for (; n_chroms_reported < names.size();
+                                ++n_chroms_reported)
+                             if (VERBOSE)
+                               cerr << "PROCESSING:\t"
+                                    << names[n_chroms_reported] << "\n";
+                         });
+
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
     std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
 
-    out << "NUMBER OF CHROMOSOMES:" << '\t' << chrom_count << endl;
-
-    out << all_c.format_summary("all cytosine") << endl
-        << cpg.format_summary("CpG") << endl
-        << cpg_symm.format_summary("symmetric CpG") << endl
-        << chh.format_summary("CHH") << endl
-        << ccg.format_summary("CCG") << endl
-        << cxg.format_summary("CXG") << endl;
-
+    levels.write(out);
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
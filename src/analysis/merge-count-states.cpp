@@ -0,0 +1,365 @@
+/*    merge-count-states: add the count states written by methcounts
+ *    and give the methcounts output for all of them together
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The states are added in one pass, a chrom at a time, holding only
+ * the sequence of that chrom. The output is the same as methcounts
+ * would give for all the reads behind the states, so when a library
+ * is sequenced again, methcounts -R on the new reads and this program
+ * give the output for the whole library. The added state can also be
+ * written, to be added to again later.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "MethpipeFiles.hpp"
+#include "MethpipeSite.hpp"
+
+#include "MethCounts.hpp"
+#include "CountState.hpp"
+#include "ParallelBGZF.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::unique_ptr;
+using std::unordered_map;
+
+
+typedef unordered_map<string, string> chrom_file_map;
+static void
+get_chrom(const string &chrom_name, const chrom_file_map &chrom_files,
+          string &chrom) {
+
+  const chrom_file_map::const_iterator fn(chrom_files.find(chrom_name));
+  if (fn == chrom_files.end())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+
+  chrom.clear();
+  read_fasta_file(fn->second, chrom_name, chrom);
+  if (chrom.empty())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+}
+
+
+/* StateInput: one state file, with the chrom it is on and its next
+   site in that chrom */
+struct StateInput {
+  explicit StateInput(const string &fn) :
+    filename(fn), file(fn, 1), in(file.rdbuf()), reader(in, fn),
+    has_chrom(false), has_site(false) {}
+
+  void next_chrom() {
+    const string prev(reader.chrom_name());
+    has_chrom = reader.next_chrom();
+    if (has_chrom && !prev.empty() && reader.chrom_name() <= prev)
+      throw SMITHLABException("chroms out of order: " + filename);
+  }
+  void next_site() {has_site = reader.next_site(site);}
+
+  const string filename;
+  InputFile file;
+  std::istream in;
+  CountStateReader reader;
+  bool has_chrom;
+  bool has_site;
+  SiteCounts site;
+};
+
+
+/* MergedSites: the sum of the states on one chrom at each site, in
+   order of position, as they are needed */
+class MergedSites {
+public:
+  MergedSites(const vector<StateInput *> &i, const size_t cs) :
+    on_chrom(i), chrom_size(cs) {
+    for (size_t j = 0; j < on_chrom.size(); ++j)
+      on_chrom[j]->next_site();
+  }
+
+  bool next(SiteCounts &s) {
+    size_t pos = chrom_size;
+    for (size_t j = 0; j < on_chrom.size(); ++j)
+      if (on_chrom[j]->has_site)
+        pos = std::min(pos, on_chrom[j]->site.pos);
+    if (pos == chrom_size)
+      return false;
+    s = SiteCounts();
+    s.pos = pos;
+    for (size_t j = 0; j < on_chrom.size(); ++j)
+      if (on_chrom[j]->has_site && on_chrom[j]->site.pos == pos) {
+        s += on_chrom[j]->site;
+        on_chrom[j]->next_site();
+      }
+    return true;
+  }
+
+private:
+  const vector<StateInput *> &on_chrom;
+  const size_t chrom_size;
+};
+
+
+/* the sites of the chrom are those of methcounts, as in
+   get_sites, with the counts of a position taken from the merged
+   state when it has that position and zero otherwise. The merged
+   sites are also given to the state output, if any. */
+static size_t
+write_chrom(RecordWriter *out, RecordWriter *sym_out,
+            CpGSymmetrizer &symmetrizer, CountStateWriter *state_out,
+            const string &chrom_name, const string &chrom,
+            const bool CPG_ONLY, MergedSites &merged) {
+  static const string strands[] = {"-", "+"};
+  static const SiteCounts none;
+  MSite site, sym;
+  site.chrom = chrom_name;
+  SiteCounts s;
+  bool has_site = merged.next(s);
+  size_t n_sites = 0;
+  for (size_t i = 0; out && i < chrom.size(); ++i) {
+    const char base = chrom[i];
+    if (!is_cytosine(base) && !is_guanine(base))
+      continue;
+    while (has_site && s.pos < i) {
+      if (state_out) state_out->add_site(s);
+      has_site = merged.next(s);
+      ++n_sites;
+    }
+    const SiteCounts &c = (has_site && s.pos == i) ? s : none;
+    set_site(chrom, i, c.unconverted, c.converted,
+             has_mutated(c.opposite_g, c.opposite_total), site);
+    if (CPG_ONLY && !site.is_cpg())
+      continue;
+    methpipe::write_site(*out, site.chrom, site.pos,
+                         strands[site.strand == '+'], site.context,
+                         site.meth, site.n_reads);
+    if (sym_out && symmetrizer.add(site, sym))
+      methpipe::write_site(*sym_out, sym.chrom, sym.pos, strands[1],
+                           sym.context, sym.meth, sym.n_reads);
+  }
+  for (; has_site; has_site = merged.next(s)) {
+    if (state_out) state_out->add_site(s);
+    ++n_sites;
+  }
+  return n_sites;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    bool CPG_ONLY = false;
+    bool SYM_MUTATED = false;
+
+    string chrom_file;
+    string fasta_suffix = "fa";
+    string outfile;
+    string symmetric_file;
+    string state_file;
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "add count states from "
+                           "methcounts -R and write methylation levels "
+                           "for all of them", "<state-1> <state-2> ...");
+    opt_parse.add_opt("output", 'o', "methcounts output file "
+                      "(default: stdout)", false, outfile);
+    opt_parse.add_opt("chrom", 'c', "file or dir of chroms (FASTA format; "
+                      ".fa suffix), needed for methcounts output", false,
+                      chrom_file);
+    opt_parse.add_opt("suffix", 's', "suffix of FASTA files "
+                      "(assumes -c specifies dir)", false, fasta_suffix);
+    opt_parse.add_opt("cpg-only", 'n', "print only CpG context cytosines",
+                      false, CPG_ONLY);
+    opt_parse.add_opt("symmetric", 'S', "also write symmetric CpG methylation "
+                      "levels, as from symmetric-cpgs, to this file", false,
+                      symmetric_file);
+    opt_parse.add_opt("sym-muts", 'M', "include mutated CpG sites in the "
+                      "symmetric CpG output", false, SYM_MUTATED);
+    opt_parse.add_opt("state", 'R', "write the added count state to this "
+                      "file", false, state_file);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const vector<string> state_files(leftover_args);
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    // without a genome only the added state can be written
+    const bool WRITE_LEVELS = !chrom_file.empty();
+    if (!WRITE_LEVELS && state_file.empty())
+      throw SMITHLABException("need chroms (-c) or a state output (-R)");
+    if (!WRITE_LEVELS && !symmetric_file.empty())
+      throw SMITHLABException("symmetric output needs chroms (-c)");
+
+    chrom_file_map chrom_files;
+    if (WRITE_LEVELS) {
+      identify_and_read_chromosomes(chrom_file, fasta_suffix, chrom_files);
+      if (VERBOSE)
+        cerr << "CHROMS_FOUND=" << chrom_files.size() << endl;
+    }
+
+    vector<unique_ptr<StateInput> > inputs;
+    for (size_t i = 0; i < state_files.size(); ++i) {
+      inputs.push_back(unique_ptr<StateInput>(new StateInput(state_files[i])));
+      inputs.back()->next_chrom();
+    }
+
+    unique_ptr<OutputFile> of;
+    unique_ptr<std::ostream> out_stream;
+    unique_ptr<RecordWriter> out;
+    if (WRITE_LEVELS) {
+      of.reset(new OutputFile(outfile, 1));
+      out_stream.reset(new std::ostream(of->rdbuf()));
+      out.reset(new RecordWriter(*out_stream));
+    }
+
+    unique_ptr<OutputFile> sym_of;
+    unique_ptr<std::ostream> sym_stream;
+    unique_ptr<RecordWriter> sym_out;
+    if (!symmetric_file.empty()) {
+      sym_of.reset(new OutputFile(symmetric_file, 1));
+      sym_stream.reset(new std::ostream(sym_of->rdbuf()));
+      sym_out.reset(new RecordWriter(*sym_stream));
+    }
+    CpGSymmetrizer symmetrizer(SYM_MUTATED);
+
+    unique_ptr<OutputFile> state_of;
+    unique_ptr<std::ostream> state_stream;
+    unique_ptr<CountStateWriter> state_out;
+    if (!state_file.empty()) {
+      state_of.reset(new OutputFile(state_file, 1));
+      state_stream.reset(new std::ostream(state_of->rdbuf()));
+      state_out.reset(new CountStateWriter(*state_stream));
+    }
+
+    StageTimer timer("merge_states");
+    string chrom;
+    vector<StateInput *> on_chrom;
+    for (;;) {
+      // the next chrom is the first, in order, of any of the inputs
+      const StateInput *first = 0;
+      for (size_t i = 0; i < inputs.size(); ++i)
+        if (inputs[i]->has_chrom && (!first ||
+             inputs[i]->reader.chrom_name() < first->reader.chrom_name()))
+          first = inputs[i].get();
+      if (!first)
+        break;
+      const string chrom_name(first->reader.chrom_name());
+      const size_t chrom_size = first->reader.chrom_size();
+
+      on_chrom.clear();
+      for (size_t i = 0; i < inputs.size(); ++i)
+        if (inputs[i]->has_chrom &&
+            inputs[i]->reader.chrom_name() == chrom_name) {
+          if (inputs[i]->reader.chrom_size() != chrom_size)
+            throw SMITHLABException("size of " + chrom_name + " differs in " +
+                                    inputs[i]->filename + " and " +
+                                    first->filename);
+          on_chrom.push_back(inputs[i].get());
+        }
+      if (VERBOSE)
+        cerr << "PROCESSING:\t" << chrom_name << '\t'
+             << on_chrom.size() << " STATES" << endl;
+
+      chrom.clear();
+      if (WRITE_LEVELS) {
+        get_chrom(chrom_name, chrom_files, chrom);
+        if (chrom.size() != chrom_size)
+          throw SMITHLABException("size of " + chrom_name + " differs in " +
+                                  first->filename + " and the genome");
+      }
+      if (state_out)
+        state_out->start_chrom(chrom_name, chrom_size);
+      MergedSites merged(on_chrom, chrom_size);
+      const size_t n_sites = write_chrom(out.get(), sym_out.get(),
+                                         symmetrizer, state_out.get(),
+                                         chrom_name, chrom, CPG_ONLY, merged);
+      if (state_out)
+        state_out->end_chrom();
+      Metrics::count("chroms");
+      Metrics::count("sites", n_sites);
+
+      for (size_t i = 0; i < on_chrom.size(); ++i)
+        on_chrom[i]->next_chrom();
+    }
+    MSite sym;
+    if (sym_out && symmetrizer.finish(sym))
+      methpipe::write_site(*sym_out, sym.chrom, sym.pos, "+",
+                           sym.context, sym.meth, sym.n_reads);
+
+    if (out) {
+      out->flush();
+      of->close();
+    }
+    if (sym_out) {
+      sym_out->flush();
+      sym_of->close();
+    }
+    if (state_out) {
+      state_out->flush();
+      state_of->close();
+    }
+    timer.stop();
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -27,15 +27,24 @@
 #include <numeric>
 #include <sstream>
 #include <iomanip>
+#include <memory>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
 #include "MethpipeFiles.hpp"
 
 #include "bsutils.hpp"
+#include "MethCounts.hpp"
+#include "CountState.hpp"
+#include "ThreadPool.hpp"
+#include "ParallelBGZF.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+#include "GenomeShards.hpp"
 
 using std::string;
 using std::vector;
@@ -45,210 +54,294 @@ using std::endl;
 using std::max;
 using std::accumulate;
 using std::unordered_map;
-
-/* The three functions below here should probably be moved into
-   bsutils.hpp. I am not sure if the DDG function is needed, but it
-   seems like if one considers strand, and the CHH is not symmetric,
-   then one needs this. Also, Qiang should be consulted on this
-   because he spent much time thinking about it in the context of
-   plants. */
-bool
-is_chh(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    is_cytosine(s[i]) &&
-    !is_guanine(s[i + 1]) &&
-    !is_guanine(s[i + 2]);
+using std::shared_ptr;
+
+/* the symmetric CpG output, if requested, is made from the same
+   sites in the same pass, and is the output of symmetric-cpgs for the
+   main output. The count state, if requested, has every cytosine with
+   reads, even with -n. Only sites in [start, end) are output; the
+   sites just outside are given to the symmetrizer, so a CpG split
+   between two regions is output whole by the region with its C. */
+static void
+write_output(RecordWriter &out, RecordWriter *sym_out,
+             CpGSymmetrizer &symmetrizer, CountStateWriter *state_out,
+             const string &chrom_name, const string &chrom,
+             const vector<CountSet<unsigned short> > &counts,
+             const size_t start, const size_t end, bool CPG_ONLY) {
+  static const string strands[] = {"-", "+"};
+  if (state_out)
+    write_count_state(*state_out, chrom_name, chrom, counts, start, end);
+  MSite sym;
+  const size_t first = (start > 0) ? start - 1 : 0;
+  const size_t last = std::min(end + 1, counts.size());
+  get_sites(chrom_name, chrom, counts, first, last, CPG_ONLY,
+            [&](const MSite &s) {
+      if (s.pos >= start && s.pos < end)
+        methpipe::write_site(out, s.chrom, s.pos, strands[s.strand == '+'],
+                             s.context, s.meth, s.n_reads);
+      if (sym_out && symmetrizer.add(s, sym) &&
+          sym.pos >= start && sym.pos < end)
+        methpipe::write_site(*sym_out, sym.chrom, sym.pos, strands[1],
+                             sym.context, sym.meth, sym.n_reads);
+    });
+  if (sym_out && symmetrizer.finish(sym) && sym.pos >= start && sym.pos < end)
+    methpipe::write_site(*sym_out, sym.chrom, sym.pos, strands[1],
+                         sym.context, sym.meth, sym.n_reads);
 }
 
 
-bool
-is_ddg(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    !is_cytosine(s[i]) &&
-    !is_cytosine(s[i + 1]) &&
-    is_guanine(s[i + 2]);
-}
+typedef unordered_map<string, string> chrom_file_map;
+static void
+get_chrom(const string &chrom_name, const chrom_file_map &chrom_files,
+          string &chrom) {
 
+  const chrom_file_map::const_iterator fn(chrom_files.find(chrom_name));
+  if (fn == chrom_files.end())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
 
-bool
-is_c_at_g(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    is_cytosine(s[i]) &&
-    !is_cytosine(s[i + 1]) &&
-    !is_guanine(s[i + 1]) &&
-    is_guanine(s[i + 2]);
+  chrom.clear();
+  read_fasta_file(fn->second, chrom_name, chrom);
+  if (chrom.empty())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
 }
 
 
-/* Right now the CountSet objects below are much larger than they need
-   to be, for the things we are computing. However, it's not clear
-   that the minimum information would really put the memory
-   requirement of the program into a more reasonable range, so keeping
-   all the information seems reasonable. */
-
-template <class count_type>
-struct CountSet {
-
-  string tostring() const {
-    std::ostringstream oss;
-    oss << pA << '\t' << pC << '\t' << pG << '\t' << pT << '\t'
-        << nA << '\t' << nC << '\t' << nG << '\t' << nT << '\t' << N;
-    return oss.str();
-  }
-  void add_count_pos(const char x) {
-    if (x == 'T') ++pT; // conditions ordered for efficiency
-    else if (x == 'C') ++pC;
-    else if (x == 'G') ++pG;
-    else if (x == 'A') ++pA;
-    else ++N;
-  }
-  void add_count_neg(const char x) {
-    if (x == 'T') ++nT; // conditions ordered for efficiency
-    else if (x == 'C') ++nC;
-    else if (x == 'G') ++nG;
-    else if (x == 'A') ++nA;
-    else ++N;
-  }
-  count_type pos_total() const {return pA + pC + pG + pT;}
-  count_type neg_total() const {return nA + nC + nG + nT;}
-
-  count_type unconverted_cytosine() const {return pC;}
-  count_type converted_cytosine() const {return pT;}
-  count_type unconverted_guanine() const {return nC;}
-  count_type converted_guanine() const {return nT;}
-
-  // using "int" here because it is smaller
-  count_type pA, pC, pG, pT;
-  count_type nA, nC, nG, nT;
-  count_type N;
+/* A batch holds consecutive reads from one chrom, along with the
+ * chrom sequence. The chrom is shared between batches, so the reader
+ * can load the next chrom while earlier batches are still counted.
+ * The batch also has the part of the chrom whose sites are output:
+ * all of it, unless regions were requested.
+ */
+struct ReadBatch {
+  ReadBatch() : n_reads(0), start(0), end(0) {}
+  string text; // the lines of the batch, each ending in a newline
+  vector<size_t> line_starts;
+  vector<MappedRead> reads;
+  string read_name; // space for parsing
+  MappedRead a_rich_read; // space for bsrate on A-rich reads
+  size_t n_reads;
+  string chrom_name;
+  shared_ptr<const string> chrom;
+  size_t start;
+  size_t end;
 };
 
 
-/* The "tag" returned by this function should be exclusive, so that
- * the order of checking conditions doesn't matter. There is also a
- * bit of a hack in that the unsigned "pos" could wrap, but this still
- * works as long as the chromosome size is not the maximum size of a
- * size_t.
- */
-string
-get_methylation_context_tag(const string &s, const size_t pos) {
-  if (is_cytosine(s[pos])) {
-    if (is_cpg(s, pos)) return "CpG";
-    else if (is_chh(s, pos)) return "CHH";
-    else if (is_c_at_g(s, pos)) return "CXG";
-    else return "CCG";
+class ReadBatchReader {
+public:
+  ReadBatchReader(std::istream &i, const string &fn,
+                  const chrom_file_map &cf,
+                  const vector<GenomeInterval> &r, const bool v,
+                  const bool first_chrom_has_reads = false,
+                  const size_t mrl = string::npos) :
+    reader(i), filename(fn), chrom_files(cf), regions(r), VERBOSE(v),
+    max_read_length(mrl), chrom_id(0), region_idx(0), in_region(false),
+    region_batches(0), prev_start(0),
+    chrom_has_reads(first_chrom_has_reads), read_chrom_id(0) {}
+  bool fill(ReadBatch &b, const size_t batch_size) {
+    return regions.empty() ? fill_all(b, batch_size) :
+      fill_region(b, batch_size);
   }
-  if (is_guanine(s[pos])) {
-    if (is_cpg(s, pos - 1)) return "CpG";
-    else if (is_ddg(s, pos - 2)) return "CHH";
-    else if (is_c_at_g(s, pos - 2)) return "CXG";
-    else return "CCG";
-  }
-  return "N";
-}
 
+private:
+  bool fill_all(ReadBatch &b, const size_t batch_size);
+  bool fill_region(ReadBatch &b, const size_t batch_size);
+  void load_chrom(const string &chrom_name);
+  void add_line(ReadBatch &b, const char *line, const char *line_end) {
+    b.line_starts.push_back(b.text.size());
+    b.text.append(line, line_end);
+    b.text.push_back('\n');
+    ++b.n_reads;
+  }
 
-template <class count_type>
-static void
-count_states_pos(const string &chrom, const MappedRead &r,
-                 vector<CountSet<count_type> > &counts) {
-  const size_t width = r.r.get_width();
-
-  size_t position = r.r.get_start();
-  assert(position < chrom.length());
-  for (size_t i = 0; i < width; ++i, ++position)
-    if (position < chrom.length())
-      counts[position].add_count_pos(r.seq[i]);
-}
+  MappedReadReader reader;
+  const string filename;
+  const chrom_file_map &chrom_files;
+  const vector<GenomeInterval> &regions;
+  const bool VERBOSE;
+  // reads starting this far before the first region were skipped
+  // (npos if none were)
+  const size_t max_read_length;
+  string chrom_name;
+  size_t chrom_id;
+  shared_ptr<const string> chrom;
+
+  // the current region, with its end set to within the chrom
+  size_t region_idx;
+  bool in_region;
+  size_t region_batches;
+  size_t region_end;
+  size_t prev_start;
+  // whether any read is on the chrom of the region, as without regions
+  // a chrom with no reads has no output
+  bool chrom_has_reads;
+  // the chrom of the reads, which may be before the region
+  string read_chrom;
+  size_t read_chrom_id;
+};
 
 
-template <class count_type>
-static void
-count_states_neg(const string &chrom, const MappedRead &r,
-                 vector<CountSet<count_type> > &counts) {
-  const size_t width = r.r.get_width();
-
-  size_t position = r.r.get_start() + width - 1;
-  assert(r.r.get_start() < chrom.length());
-  for (size_t i = 0; i < width; ++i, --position)
-    if (position < chrom.length())
-      counts[position].add_count_neg(r.seq[i]);
+void
+ReadBatchReader::load_chrom(const string &name) {
+  // make sure all reads from same chrom are contiguous in the file
+  if (name < chrom_name)
+    throw SMITHLABException("chroms out of order: " + filename);
+
+  static const double gigs_per_base =
+    (1.0 + sizeof(CountSet<unsigned short>))/(1073741824.0);
+
+  std::shared_ptr<string> s = std::make_shared<string>();
+  get_chrom(name, chrom_files, *s);
+  chrom = s;
+  chrom_name = name;
+  if (VERBOSE)
+    cerr << "PROCESSING:\t" << chrom_name << '\t'
+         << "(REQD MEM = "
+         << std::setprecision(3)
+         << chrom->length()*gigs_per_base << "GB)" << endl;
 }
 
 
-/* This "has_mutated" function looks on the opposite strand to see
- * if the apparent conversion from C->T was actually already in the
- * DNA because of a mutation or SNP.
- */
-template <class count_type>
-static bool
-has_mutated(const char base, const CountSet<count_type> &cs) {
-  static const double MUTATION_DEFINING_FRACTION = 0.5;
-  return is_cytosine(base) ?
-    (cs.nG < MUTATION_DEFINING_FRACTION*(cs.neg_total())) :
-    (cs.pG < MUTATION_DEFINING_FRACTION*(cs.pos_total()));
+bool
+ReadBatchReader::fill_all(ReadBatch &b, const size_t batch_size) {
+  b.text.clear();
+  b.line_starts.clear();
+  b.n_reads = 0;
+  const char *line = 0, *line_end = 0;
+  while (b.n_reads < batch_size && reader.next_line(line, line_end)) {
+    if (reader.chrom_id() != chrom_id) {
+      if (b.n_reads > 0) {
+        reader.put_back(); // starts the next batch
+        break;
+      }
+      load_chrom(reader.chrom());
+      chrom_id = reader.chrom_id();
+    }
+    add_line(b, line, line_end);
+  }
+  b.line_starts.push_back(b.text.size());
+  b.chrom_name = chrom_name;
+  b.chrom = chrom;
+  b.start = 0;
+  b.end = chrom ? chrom->size() : 0;
+  return b.n_reads > 0;
 }
 
 
-template <class count_type>
-static void
-write_output(std::ostream &out,
-             const string &chrom_name, const string &chrom,
-             const vector<CountSet<count_type> > &counts,
-             bool CPG_ONLY) {
-
-  for (size_t i = 0; i < counts.size(); ++i) {
-    const char base = chrom[i];
-    if (is_cytosine(base) || is_guanine(base)) {
-      const double unconverted = is_cytosine(base) ?
-        counts[i].unconverted_cytosine() : counts[i].unconverted_guanine();
-      const double converted = is_cytosine(base) ?
-        counts[i].converted_cytosine() : counts[i].converted_guanine();
-      const double meth = unconverted/(converted + unconverted);
-      const string tag = get_methylation_context_tag(chrom, i) +
-        (has_mutated(base, counts[i]) ? "x" : "");
-      if (!CPG_ONLY || (!tag.compare("CpG")||!tag.compare("CpGx"))) {
-        methpipe::write_site(out, chrom_name, i,
-                             (is_cytosine(base) ? "+" : "-"),
-                             tag, meth, converted + unconverted);
+/* with regions, a batch has the reads of one region that cover
+   its sites or the sites on either side of it (see write_output). A
+   read straddling the end of a region is counted in each region it
+   covers, but each region outputs only its own sites, so no site is
+   counted twice. As the reads are sorted, a region ends at the first
+   read starting after it. A region with no reads gives one empty
+   batch, so its sites are still output, but only if its chrom has
+   reads elsewhere: as without regions, a chrom with no reads gives no
+   output. Reads on the chrom before or after the region are seen in
+   reading up to the region and the first read past it, except for
+   reads skipped by seeking to the first region, which are checked
+   before the seek (see has_mapped_reads_on). */
+bool
+ReadBatchReader::fill_region(ReadBatch &b, const size_t batch_size) {
+  b.text.clear();
+  b.line_starts.clear();
+  b.n_reads = 0;
+  const char *line = 0, *line_end = 0;
+  while (region_idx < regions.size()) {
+    const GenomeInterval &r = regions[region_idx];
+    if (!in_region) {
+      load_chrom(r.chrom);
+      region_end = std::min(r.end, chrom->size());
+      in_region = true;
+      region_batches = 0;
+      prev_start = 0;
+      if (region_idx > 0)
+        chrom_has_reads = false;
+    }
+    const size_t first = (r.start > 0) ? r.start - 1 : 0;
+    // at the end of the chrom, any reads hanging off it
+    const size_t last = (region_end == chrom->size()) ?
+      string::npos : region_end + 1;
+    bool region_done = false;
+    while (b.n_reads < batch_size && !region_done) {
+      if (!reader.next_line(line, line_end)) {
+        region_done = true;
+        break;
+      }
+      if (reader.chrom_id() != read_chrom_id) {
+        if (reader.chrom() < read_chrom)
+          throw SMITHLABException("chroms out of order: " + filename);
+        read_chrom = reader.chrom();
+        read_chrom_id = reader.chrom_id();
+      }
+      const int cmp = reader.chrom().compare(r.chrom);
+      size_t start = 0, end = 0;
+      if (cmp < 0)
+        continue;
+      if (cmp == 0)
+        chrom_has_reads = true;
+      if (cmp == 0 &&
+          !mapped_read_format::parse_interval(line, line_end, start, end))
+        throw SMITHLABException("bad mapped read line:\n" + reader.line());
+      // reads as long on the chrom of the first region may have been
+      // skipped though they cover it, so its counts would be wrong
+      if (cmp == 0 && region_idx == 0 && end - start > max_read_length)
+        throw SMITHLABException("read longer than " + toa(max_read_length) +
+                                " bases, the most for a region of "
+                                "uncompressed input:\n" + reader.line());
+      if (cmp > 0 || start >= last) {
+        reader.put_back(); // starts the next region
+        region_done = true;
       }
+      else {
+        if (start < prev_start)
+          throw SMITHLABException("reads not sorted by position, as "
+                                  "needed for regions: " + filename);
+        prev_start = start;
+        if (end > first)
+          add_line(b, line, line_end);
+      }
+    }
+    if (region_done) {
+      ++region_idx;
+      in_region = false;
+    }
+    if (b.n_reads > 0 ||
+        (region_done && region_batches == 0 && chrom_has_reads)) {
+      ++region_batches;
+      b.line_starts.push_back(b.text.size());
+      b.chrom_name = chrom_name;
+      b.chrom = chrom;
+      b.start = std::min(r.start, region_end);
+      b.end = region_end;
+      return true;
     }
   }
+  return false;
 }
 
 
-typedef unordered_map<string, string> chrom_file_map;
-static void
-get_chrom(const MappedRead &mr,
-          const chrom_file_map &chrom_files,
-          GenomicRegion &chrom_region, string &chrom) {
-
-  const chrom_file_map::const_iterator fn(chrom_files.find(mr.r.get_chrom()));
-  if (fn == chrom_files.end())
-    throw SMITHLABException("could not find chrom: " + mr.r.get_chrom());
-
-  chrom.clear();
-  read_fasta_file(fn->second, mr.r.get_chrom(), chrom);
-  if (chrom.empty())
-    throw SMITHLABException("could not find chrom: " + mr.r.get_chrom());
-
-  chrom_region.set_chrom(mr.r.get_chrom());
-}
-
 int
 main(int argc, const char **argv) {
 
   try {
 
-    static const double gigs_per_base =
-      (1.0 + sizeof(CountSet<unsigned short>))/(1073741824.0);
-
     bool VERBOSE = false;
     bool CPG_ONLY = false;
+    size_t n_threads = 1;
 
     string chrom_file;
     string outfile;
+    string bsrate_file;
+    bool BSRATE_ALL = false;
+    bool BSRATE_A_RICH = false;
+    string symmetric_file;
+    bool SYM_MUTATED = false;
+    string state_file;
     string fasta_suffix = "fa";
+    string region_spec;
+    string shard_spec;
+
+    string metrics_file;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "get methylation levels from "
@@ -261,7 +354,29 @@ main(int argc, const char **argv) {
                       "(assumes -c specifies dir)", false , fasta_suffix);
     opt_parse.add_opt("cpg-only", 'n', "print only CpG context cytosines",
                       false, CPG_ONLY);
+    opt_parse.add_opt("bsrate", 'B', "also write the bisulfite conversion "
+                      "rate, as from bsrate, to this file", false, bsrate_file);
+    opt_parse.add_opt("bsrate-all", '\0', "count all Cs for -B, including "
+                      "CpGs (as bsrate -N)", false, BSRATE_ALL);
+    opt_parse.add_opt("bsrate-a-rich", '\0', "reads are A-rich for -B "
+                      "(as bsrate -A)", false, BSRATE_A_RICH);
+    opt_parse.add_opt("symmetric", 'S', "also write symmetric CpG methylation "
+                      "levels, as from symmetric-cpgs, to this file", false,
+                      symmetric_file);
+    opt_parse.add_opt("sym-muts", 'M', "include mutated CpG sites in the "
+                      "symmetric CpG output", false, SYM_MUTATED);
+    opt_parse.add_opt("state", 'R', "also write the raw counts, which "
+                      "merge-count-states can add, to this file", false,
+                      state_file);
+    opt_parse.add_opt("region", 'r', "count only the sites in this region: "
+                      "chrom, or chrom:start-end with start from 0 "
+                      "(needs reads sorted by position)", false, region_spec);
+    opt_parse.add_opt("shard", '\0', "count only the sites in shard i of n "
+                      "equal parts of the genome, as i/n (needs reads "
+                      "sorted by position)", false, shard_spec);
+    add_threads_opt(opt_parse, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -280,6 +395,8 @@ main(int argc, const char **argv) {
     const string mapped_reads_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (!outfile.empty() && !is_valid_output_file(outfile))
       throw SMITHLABException("bad output file: " + outfile);
 
@@ -288,52 +405,176 @@ main(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "CHROMS_FOUND=" << chrom_files.size() << endl;
 
-    std::ifstream in(mapped_reads_file.c_str());
-    if (!in)
-      throw SMITHLABException("cannot open file: " + mapped_reads_file);
+    if (!region_spec.empty() && !shard_spec.empty())
+      throw SMITHLABException("give a region or a shard, not both");
+    vector<GenomeInterval> regions;
+    if (!region_spec.empty()) {
+      regions.push_back(parse_genome_region(region_spec));
+      if (chrom_files.find(regions.front().chrom) == chrom_files.end())
+        throw SMITHLABException("could not find chrom: " +
+                                regions.front().chrom);
+    }
+    else if (!shard_spec.empty()) {
+      size_t shard = 0, n_shards = 0;
+      parse_shard_spec(shard_spec, shard, n_shards);
+      vector<std::pair<string, size_t> > chrom_sizes;
+      get_chrom_sizes(chrom_files, chrom_sizes);
+      get_genome_shard(chrom_sizes, shard, n_shards, regions);
+    }
+    if (VERBOSE)
+      for (size_t i = 0; i < regions.size(); ++i)
+        cerr << "REGION:\t" << regions[i].chrom << ':' << regions[i].start
+             << '-' << (regions[i].end == string::npos ? string("end") :
+                        toa(regions[i].end)) << endl;
+
+    // BGZF input is decompressed, and output to names ending in ".gz"
+    // compressed, in background threads
+    InputFile inf(mapped_reads_file, n_threads);
+    std::istream in(inf.rdbuf());
+
+    /* a read covering a region starts at most the maximum read
+       length before it, so for plain input the reads before that are
+       skipped without being read, and a longer read is an error.
+       Compressed input is read from the start, and the reads before
+       the regions are dropped. */
+    bool first_chrom_has_reads = false;
+    size_t max_read_length = string::npos;
+    if (!regions.empty()) {
+      has_mapped_reads_on(in, regions.front().chrom, first_chrom_has_reads);
+      const size_t longest = ConversionCounts::OUTPUT_SIZE;
+      const size_t start = regions.front().start;
+      const size_t skip_to = start > longest + 1 ? start - longest - 1 : 0;
+      if (seek_mapped_reads(in, regions.front().chrom, skip_to) &&
+          skip_to > 0)
+        max_read_length = longest;
+    }
+
+    OutputFile of(outfile, n_threads);
+    std::ostream out_stream(of.rdbuf());
+    RecordWriter out(out_stream);
+
+    std::unique_ptr<OutputFile> sym_of;
+    std::unique_ptr<std::ostream> sym_stream;
+    std::unique_ptr<RecordWriter> sym_writer;
+    if (!symmetric_file.empty()) {
+      sym_of.reset(new OutputFile(symmetric_file, n_threads));
+      sym_stream.reset(new std::ostream(sym_of->rdbuf()));
+      sym_writer.reset(new RecordWriter(*sym_stream));
+    }
+    RecordWriter *sym_out = sym_writer.get();
+    CpGSymmetrizer symmetrizer(SYM_MUTATED);
+
+    std::unique_ptr<OutputFile> state_of;
+    std::unique_ptr<std::ostream> state_stream;
+    std::unique_ptr<CountStateWriter> state_writer;
+    if (!state_file.empty()) {
+      state_of.reset(new OutputFile(state_file, n_threads));
+      state_stream.reset(new std::ostream(state_of->rdbuf()));
+      state_writer.reset(new CountStateWriter(*state_stream));
+    }
+    CountStateWriter *state_out = state_writer.get();
+
+    /* the reader thread splits the reads into batches, workers
+       parse the reads and, if requested, count conversion for bsrate
+       with one set of counts per thread. Accumulating the counts at
+       each chrom position is done in order by the writer, which also
+       outputs each chrom once all its reads have been counted. */
+    static const size_t reads_per_batch = 50000;
+    ReadBatchReader reader(in, mapped_reads_file, chrom_files, regions,
+                           VERBOSE, first_chrom_has_reads, max_read_length);
+    const bool COUNT_CONVERSION = !bsrate_file.empty();
+    const size_t n_workers = std::max(n_threads, static_cast<size_t>(1));
+    vector<ConversionCounts> conversion(COUNT_CONVERSION ? n_workers : 0);
 
     // this is where all the counts are accumulated
     vector<CountSet<unsigned short> > counts;
+    string chrom_name; // name of the chrom for the current counts
+    shared_ptr<const string> chrom;
+    size_t start = 0, end = 0; // the sites of the chrom to output
+
+    vector<ReadBatch> batches(2*n_threads + 2);
+    StageTimer timer("count_reads");
+    run_ordered_pipeline(n_threads, batches,
+                         [&](ReadBatch &b) {
+                           return reader.fill(b, reads_per_batch);
+                         },
+                         [&](ReadBatch &b, const size_t tid) {
+                           if (b.reads.size() < b.n_reads)
+                             b.reads.resize(b.n_reads);
+                           const char *text = b.text.data();
+                           for (size_t i = 0; i < b.n_reads; ++i) {
+                             parse_mapped_read(text + b.line_starts[i],
+                                               text + b.line_starts[i + 1] - 1,
+                                               b.read_name, b.reads[i]);
+                             // a read is in the conversion rate of
+                             // the region it starts in
+                             const size_t start = b.reads[i].r.get_start();
+                             if (!COUNT_CONVERSION || start < b.start ||
+                                 (start >= b.end && b.end != b.chrom->size()))
+                               continue;
+                             if (BSRATE_A_RICH) {
+                               b.a_rich_read = b.reads[i];
+                               revcomp_a_rich_read(b.a_rich_read);
+                               conversion[tid].add_read(BSRATE_ALL, *b.chrom,
+                                                        b.a_rich_read);
+                             }
+                             else conversion[tid].add_read(BSRATE_ALL, *b.chrom,
+                                                           b.reads[i]);
+                           }
+                         },
+                         [&](ReadBatch &b) {
+                           // if chrom changes, output previous results
+                           if (!chrom || b.chrom_name != chrom_name) {
+                             if (!counts.empty())
+                               write_output(out, sym_out, symmetrizer,
+                                            state_out, chrom_name, *chrom,
+                                            counts, start, end, CPG_ONLY);
+                             chrom_name = b.chrom_name;
+                             chrom = b.chrom;
+                             start = b.start;
+                             end = b.end;
+                             counts.clear();
+                             counts.resize(chrom->size());
+                             Metrics::count("chroms");
+                           }
+                           Metrics::count("reads", b.n_reads);
+                           for (size_t i = 0; i < b.n_reads; ++i)
+                             if (b.reads[i].r.pos_strand())
+                               count_states_pos(*chrom, b.reads[i], counts);
+                             else count_states_neg(*chrom, b.reads[i], counts);
+                         });
+    // ALWAYS output the chromosome, even if all sites are uncovered.
+    if (chrom)
+      write_output(out, sym_out, symmetrizer, state_out, chrom_name, *chrom,
+                   counts, start, end, CPG_ONLY);
+    if (in.bad())
+      throw SMITHLABException("error reading file: " + mapped_reads_file);
+    out.flush();
+    of.close();
+    if (sym_of) {
+      sym_out->flush();
+      sym_of->close();
+    }
+    if (state_of) {
+      state_out->flush();
+      state_of->close();
+    }
 
-    string chrom; // holds the current chromosome being processed
-    GenomicRegion chrom_region; // holds chrom name for fast comparisons
-
-    std::ofstream of;
-    if (!outfile.empty()) of.open(outfile.c_str());
-    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-
-    MappedRead mr;
-    while (in >> mr) {
-
-      // if chrom changes, output previous results, get new one
-      if (chrom.empty() || !mr.r.same_chrom(chrom_region)) {
-
-        // make sure all reads from same chrom are contiguous in the file
-        if (mr.r.get_chrom() < chrom_region.get_chrom())
-          throw SMITHLABException("chroms out of order: " + mapped_reads_file);
-
-        if (!counts.empty()) // if we have results, output them
-          write_output(out, chrom_region.get_chrom(), chrom, counts, CPG_ONLY);
-
-        // load the new chromosome and reset the counts
-        get_chrom(mr, chrom_files, chrom_region, chrom);
-        if (VERBOSE)
-          cerr << "PROCESSING:\t" << chrom_region.get_chrom() << '\t'
-               << "(REQD MEM = "
-               << std::setprecision(3)
-               << chrom.length()*gigs_per_base << "GB)" << endl;
-
-        counts.clear();
-        counts.resize(chrom.size());
-      }
-
-      // do the work for this mapped read, depending on strand
-      if (mr.r.pos_strand())
-        count_states_pos(chrom, mr, counts);
-      else count_states_neg(chrom, mr, counts);
+    timer.stop();
+
+    if (COUNT_CONVERSION) {
+      for (size_t i = 1; i < conversion.size(); ++i)
+        conversion.front() += conversion[i];
+      std::ofstream bsrate_out(bsrate_file.c_str());
+      if (!bsrate_out)
+        throw SMITHLABException("bad output file: " + bsrate_file);
+      conversion.front().write(bsrate_out);
+      if (conversion.front().hanging > 0)
+        cerr << "Warning: a nonzero number (" << conversion.front().hanging
+             << ") of reads mapped to the very end of a chromosome. For"
+             << " high numbers, make sure you are using the same assembly"
+             << " you mapped with." << endl;
     }
-    // ALWAYS output the chromosome, even if all sites are uncovered.
-    write_output(out, chrom_region.get_chrom(), chrom, counts, CPG_ONLY);
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
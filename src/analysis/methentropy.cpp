@@ -22,6 +22,7 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
+#include "Metrics.hpp"
 
 
 using std::string;
@@ -329,6 +330,8 @@ main(int argc, const char **argv) {
     size_t cpg_window = 4;
     string outfile;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "compute methylation entropy in sliding window",
@@ -340,6 +343,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("output", 'o', "output file (default: stdout)",
                       false, outfile);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -363,6 +367,8 @@ main(int argc, const char **argv) {
     const string epi_file = leftover_args.back();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     std::ifstream in(epi_file.c_str());
     if (!in)
       throw SMITHLABException("cannot open input file: " + epi_file);
@@ -32,6 +32,10 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
+#include "ThreadPool.hpp"
+#include "ParallelBGZF.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -67,20 +71,20 @@ convert_meth_states_pos(const string &chrom,
   const size_t offset = mr.r.get_start();
 
   size_t cpg_count = 0;
-  string states;
+  seq.clear();
   size_t first_cpg = std::numeric_limits<size_t>::max();
   //size_t last_cpg = first_cpg;
   for (size_t i = 0; i < width; ++i) {
     if (offset + i < chrom.length() && is_cpg(chrom, offset + i)) {
       if (mr.seq[i] == 'C') {
-        states += 'C';
+        seq += 'C';
         ++cpg_count;
       }
       else if (mr.seq[i] == 'T') {
-        states += 'T';
+        seq += 'T';
         ++cpg_count;
       }
-      else states += 'N';
+      else seq += 'N';
       if (first_cpg == std::numeric_limits<size_t>::max()) {
         first_cpg = i;
       }
@@ -89,7 +93,6 @@ convert_meth_states_pos(const string &chrom,
   }
   if (first_cpg != std::numeric_limits<size_t>::max()) {
     start_pos = cpgs.find(offset + first_cpg)->second;
-    seq = states;
   }
   return cpg_count > 0;
 }
@@ -107,20 +110,20 @@ convert_meth_states_neg(const string &chrom,
   revcomp_inplace(mr.seq);
 
   size_t cpg_count = 0;
-  string states;
+  seq.clear();
   size_t first_cpg = std::numeric_limits<size_t>::max();
   //size_t last_cpg = first_cpg;
   for (size_t i = 0; i < width; ++i) {
     if (offset + i > 0 && is_cpg(chrom, offset + i - 1)) {
       if (mr.seq[i] == 'G') {
-        states += 'C';
+        seq += 'C';
         ++cpg_count;
       }
       else if (mr.seq[i] == 'A') {
-        states += 'T';
+        seq += 'T';
         ++cpg_count;
       }
-      else states += 'N';
+      else seq += 'N';
       if (first_cpg == std::numeric_limits<size_t>::max()) {
         first_cpg = i;
       }
@@ -132,7 +135,6 @@ convert_meth_states_neg(const string &chrom,
       the_cpg(cpgs.find(offset + first_cpg - 1));
     assert(the_cpg != cpgs.end());
     start_pos = the_cpg->second;
-    seq = states;
   }
   return cpg_count > 0;
 }
@@ -145,11 +147,14 @@ main(int argc, const char **argv) {
   try {
 
     bool VERBOSE = false;
+    size_t n_threads = 1;
 
     string chrom_file;
     string outfile;
     string fasta_suffix = "fa";
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(argv[0], "convert read sequences "
                            "in MappedRead format to methylation states "
@@ -158,7 +163,9 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("output", 'o', "output file name", false, outfile);
     opt_parse.add_opt("chrom", 'c', "file or dir of chroms (.fa extn)",
                       true , chrom_file);
+    add_threads_opt(opt_parse, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -182,51 +189,62 @@ main(int argc, const char **argv) {
     const string mapped_reads_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     unordered_map<string, string> chrom_files;
     identify_chromosomes(chrom_file, fasta_suffix, chrom_files);
     if (VERBOSE) {
       cerr << "CHROMS:\t" << chrom_files.size() << endl;
     }
 
-    std::ifstream in(mapped_reads_file.c_str());
-    if (!in)
-      throw SMITHLABException("cannot open input file " + mapped_reads_file);
+    InputFile inf(mapped_reads_file, n_threads);
+    std::istream in(inf.rdbuf());
 
-    std::ofstream of;
-    if (!outfile.empty()) of.open(outfile.c_str());
-    std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
+    // epireads go to a BGZF file if the name ends in ".gz"
+    OutputFile of(outfile, n_threads);
+    std::ostream out(of.rdbuf());
 
     unordered_map<size_t, size_t> cpgs;
     vector<string> chrom_names, chroms;
     string chrom_name;
+    size_t chrom_id = 0; // from the reader; 0 before the first read
     MappedRead mr;
-    GenomicRegion chrom_region("chr0", 0, 0);
-    while (!in.eof() && in >> mr) {
+    MappedReadReader reader(in);
+    size_t start_pos = std::numeric_limits<size_t>::max();
+    string seq;
+    size_t n_reads = 0, n_epireads = 0;
+    while (reader.read(mr)) {
+      ++n_reads;
       // get the correct chrom if it has changed
-      if (chroms.empty() || !mr.r.same_chrom(chrom_region)) {
+      if (reader.chrom_id() != chrom_id) {
         const unordered_map<string, string>::const_iterator
-          fn(chrom_files.find(mr.r.get_chrom()));
+          fn(chrom_files.find(reader.chrom()));
         if (fn == chrom_files.end())
-          throw SMITHLABException("could not find chrom: " + mr.r.get_chrom());
+          throw SMITHLABException("could not find chrom: " + reader.chrom());
         chrom_names.clear();
         chroms.clear();
         read_fasta_file(fn->second.c_str(), chrom_names, chroms);
         if (VERBOSE)
           cerr << "PROCESSING: " << chrom_names.front() << endl;
         collect_cpgs(chroms.front(), cpgs);
-        chrom_region.set_chrom(chrom_names.front());
         chrom_name = chrom_names.front();
+        chrom_id = reader.chrom_id();
       }
-      size_t start_pos = std::numeric_limits<size_t>::max();
-      string seq;
       const bool has_cpgs = mr.r.pos_strand() ?
         convert_meth_states_pos(chroms.front(), cpgs, mr, start_pos, seq) :
         convert_meth_states_neg(chroms.front(), cpgs, mr, start_pos, seq);
-      if (has_cpgs)
+      if (has_cpgs) {
+        ++n_epireads;
         out << chrom_name << '\t'
             << start_pos << '\t'
             << seq << '\n';
+      }
     }
+    if (in.bad())
+      throw SMITHLABException("error reading file: " + mapped_reads_file);
+    Metrics::count("reads", n_reads);
+    Metrics::count("epireads", n_epireads);
+    of.close();
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -38,6 +38,8 @@
 #include "OptionParser.hpp"
 #include "TwoStateHMM.hpp"
 #include "MethpipeFiles.hpp"
+#include "RandomStream.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -376,7 +378,8 @@ separate_regions(const bool VERBOSE, const size_t desert_size,
 
 
 static void
-shuffle_cpgs(const TwoStateHMMB &hmm,
+shuffle_cpgs(const size_t seed,
+             const TwoStateHMMB &hmm,
              vector<pair<double, double> > meth,
              vector<size_t> reset_points,
              const vector<double> &start_trans,
@@ -385,11 +388,10 @@ shuffle_cpgs(const TwoStateHMMB &hmm,
              const double fg_alpha, const double fg_beta,
              const double bg_alpha, const double bg_beta,
              vector<double> &domain_scores) {
-  srand(time(0) + getpid());
-
   static const size_t n_shuffles = 100;
   for (size_t i = 0; i < n_shuffles; ++i) {
-    random_shuffle(meth.begin(), meth.end());
+    RandomStream rs(seed, i);
+    rs.shuffle(meth.begin(), meth.end());
     vector<bool> classes;
     vector<double> scores;
     hmm.PosteriorDecoding(meth, reset_points, start_trans, trans,
@@ -572,6 +574,7 @@ main(int argc, const char **argv) {
 
     size_t desert_size = 20000;
     size_t max_iterations = 10;
+    size_t seed = 408;
 
     // run mode flags
     bool VERBOSE = false;
@@ -587,6 +590,8 @@ main(int argc, const char **argv) {
 
     size_t bin_size = 1000;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "identify PMDs in a methylome",
                            "<cpg-meth-file>");
@@ -602,6 +607,9 @@ main(int argc, const char **argv) {
                       false, params_in_file);
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to file",
                       false, params_out_file);
+    opt_parse.add_opt("seed", 's', "specify random seed",
+                      false, seed);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -627,12 +635,16 @@ main(int argc, const char **argv) {
     FORMAT = methpipe::is_methpipe_file_single(cpgs_file);
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (VERBOSE)
       cerr << "[READING CPGS AND METH PROPS]" << endl;
     vector<pair<double, double> > meth;
     vector<size_t> reads;
     vector<SimpleGenomicRegion> cpgs;
+    StageTimer timer("load_intervals");
     load_intervals(bin_size, cpgs_file, cpgs, meth, reads, FORMAT);
+    Metrics::count("bins", cpgs.size());
 
     if (VERBOSE)
       cerr << "CPG SITES LOADED: " << cpgs.size() << endl;
@@ -640,6 +652,7 @@ main(int argc, const char **argv) {
     // separate the regions by chrom and by desert, and eliminate
     // those isolated CpGs
     vector<size_t> reset_points;
+    timer.next("separate_regions");
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
 
     vector<double> start_trans(2, 0.5), end_trans(2, 1e-10);
@@ -667,6 +680,7 @@ main(int argc, const char **argv) {
       bg_beta = 0.33*n_reads;
     }
 
+    timer.next("training");
     if (max_iterations > 0)
       hmm.BaumWelchTraining(meth, reset_points, start_trans, trans,
                             end_trans, fg_alpha, fg_beta, bg_alpha, bg_beta);
@@ -682,6 +696,7 @@ main(int argc, const char **argv) {
      */
     vector<bool> classes;
     vector<double> scores;
+    timer.next("posterior_decoding");
     hmm.PosteriorDecoding(meth, reset_points, start_trans, trans,
                           end_trans, fg_alpha, fg_beta, bg_alpha,
                           bg_beta, classes, scores);
@@ -693,7 +708,8 @@ main(int argc, const char **argv) {
       cerr << "[RANDOMIZING SCORES FOR FDR]" << endl;
 
     vector<double> random_scores;
-    shuffle_cpgs(hmm, meth, reset_points, start_trans, trans, end_trans,
+    timer.next("shuffle_cpgs");
+    shuffle_cpgs(seed, hmm, meth, reset_points, start_trans, trans, end_trans,
                  fg_alpha, fg_beta, bg_alpha, bg_beta, random_scores);
 
     vector<double> p_values;
@@ -701,6 +717,7 @@ main(int argc, const char **argv) {
 
     if (score_cutoff_for_fdr == numeric_limits<double>::max())
       score_cutoff_for_fdr = get_score_cutoff_for_fdr(p_values, fdr_cutoff);
+    Metrics::gauge("score_cutoff_for_fdr", score_cutoff_for_fdr);
 
     if (!params_out_file.empty()) {
       std::ofstream out(params_out_file.c_str(), std::ios::app);
@@ -709,7 +726,9 @@ main(int argc, const char **argv) {
       out.close();
     }
     vector<GenomicRegion> domains;
+    timer.next("build_domains");
     build_domains(VERBOSE, cpgs, scores, reset_points, classes, domains);
+    Metrics::count("domains", domains.size());
 
     size_t good_hmr_count = 0;
     vector<GenomicRegion> good_domains;
@@ -720,7 +739,11 @@ main(int argc, const char **argv) {
       }
     }
 
+    Metrics::count("pmds", good_domains.size());
+
+    timer.next("optimize_boundaries");
     optimize_boundaries(bin_size, cpgs_file, good_domains, FORMAT);
+    timer.next("write_output");
 
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
@@ -25,8 +25,12 @@
 #include <fstream>
 #include <algorithm>
 #include <numeric>
-#include <list>
+#include <deque>
+#include <memory>
 #include <utility>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
@@ -35,6 +39,9 @@
 #include "MethpipeFiles.hpp"
 
 #include "bsutils.hpp"
+#include "MethIndex.hpp"
+#include "TextScan.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -42,20 +49,6 @@ using std::cout;
 using std::cerr;
 using std::endl;
 using std::pair;
-using std::ios_base;
-
-
-static pair<bool, bool>
-meth_unmeth_calls(const size_t n_meth, const size_t n_unmeth) {
-  static const double alpha = 0.95;
-  // get info for binomial test
-  double lower = 0.0, upper = 0.0;
-  const size_t total = n_meth + n_unmeth;
-  wilson_ci_for_binomial(alpha, total,
-                         static_cast<double>(n_meth)/total, lower, upper);
-  return std::make_pair(lower > 0.5, upper < 0.5);
-}
-
 
 
 static std::pair<size_t, size_t>
@@ -169,181 +162,213 @@ process_with_cpgs_loaded(const bool METHPIPE_FORMAT,
 ////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
 ///
-///  CODE BELOW HERE IS FOR SEARCHING ON DISK
+///  CODE BELOW HERE IS FOR A SINGLE PASS OVER THE SITES
 ///
 
+// the line for a region, with its counts added to the name
 static void
-move_to_start_of_line(std::ifstream &in) {
-  char next;
-  while (in.good() && in.get(next) && next != '\n') {
-    in.unget();
-    in.unget();
+write_region_stats(const bool PRINT_NAN, const bool PRINT_ADDITIONAL_LEVELS,
+                   const RegionStats &s, GenomicRegion &region,
+                   std::ostream &out) {
+  const string name = region.get_name() + ":" +
+    toa(s.total_cpgs) + ":" + toa(s.cpgs_with_reads) + ":" +
+    toa(s.meth) + ":" + toa(s.reads);
+  region.set_name(name);
+  region.set_score(static_cast<double>(s.meth)/s.reads);
+
+  if (PRINT_NAN || std::isfinite(region.get_score())) {
+    out << region;
+    if (PRINT_ADDITIONAL_LEVELS)
+      out << '\t'
+          << static_cast<double>(s.called_meth)/s.called_total << '\t'
+          << s.mean_meth/s.cpgs_with_reads;
+    out << '\n';
   }
-  if (in.bad())
-    // hope this only happens when hitting the start of the file
-    in.clear();
 }
 
 
-static void
-find_start_line(const string &chr, const size_t idx, std::ifstream &cpg_in) {
-
-  cpg_in.seekg(0, ios_base::beg);
-  const size_t begin_pos = cpg_in.tellg();
-  cpg_in.seekg(0, ios_base::end);
-  const size_t end_pos = cpg_in.tellg();
-
-  if (end_pos - begin_pos < 2)
-    throw SMITHLABException("empty meth file");
-
-  size_t step_size = (end_pos - begin_pos)/2;
-
-  cpg_in.seekg(0, ios_base::beg);
-  string low_chr;
-  size_t low_idx = 0;
-  cpg_in >> low_chr >> low_idx;
-
-  // MAGIC: need the -2 here to get past the EOF and possibly a '\n'
-  cpg_in.seekg(-2, ios_base::end);
-  move_to_start_of_line(cpg_in);
-  string high_chr;
-  size_t high_idx;
-  cpg_in >> high_chr >> high_idx;
-
-  size_t pos = step_size;
-  cpg_in.seekg(pos, ios_base::beg);
-  move_to_start_of_line(cpg_in);
-
-  while (step_size > 0) {
-    string mid_chr;
-    size_t mid_idx = 0;
-    cpg_in >> mid_chr >> mid_idx;
-    step_size /= 2;
-    if (chr < mid_chr || (chr == mid_chr && idx <= mid_idx)) {
-      std::swap(mid_chr, high_chr);
-      std::swap(mid_idx, high_idx);
-      pos -= step_size;
-    }
-    else {
-      std::swap(mid_chr, low_chr);
-      std::swap(mid_idx, low_idx);
-      pos += step_size;
-    }
-    cpg_in.seekg(pos, ios_base::beg);
-    move_to_start_of_line(cpg_in);
+/* RegionSweep: reads the sites of one file once, in order, and gives
+ * the stats for each region in the order of the regions. Regions that
+ * have started but not yet been given out are kept in "pending", and
+ * each site is added to those of them that contain it, so regions may
+ * overlap. Both the sites and the regions must be sorted.
+ */
+class RegionSweep {
+public:
+  RegionSweep(const vector<GenomicRegion> &r, const string &fn) :
+    regions(r), filename(fn), in(fn.c_str()), pos(0), meth(0.0),
+    n_reads(0), has_site(false), at_end(false), n_output(0), n_started(0) {
+    if (!in)
+      throw SMITHLABException("cannot open file: " + filename);
+    METHPIPE_FORMAT = methpipe::is_methpipe_file_single(filename);
   }
-}
 
+  // the stats for the next region
+  void next(RegionStats &s);
 
+private:
+  bool read_site();
+  void parse_site();
+  bool site_past(const GenomicRegion &r) const {
+    const int c = chrom.compare(r.get_chrom());
+    return c > 0 || (c == 0 && pos >= r.get_end());
+  }
+  bool site_reached(const GenomicRegion &r) const {
+    const int c = chrom.compare(r.get_chrom());
+    return c > 0 || (c == 0 && pos >= r.get_start());
+  }
 
-static std::ifstream &
-load_cpg(const bool METHPIPE_FORMAT, std::ifstream &cpg_in,
-         GenomicRegion &cpg) {
-
+  const vector<GenomicRegion> &regions;
+  const string filename;
+  std::ifstream in;
+  bool METHPIPE_FORMAT;
+
+  string line;
+  string chrom;
+  size_t pos;
+  double meth;
+  size_t n_reads;
+  bool has_site;
+  bool at_end;
+
+  size_t n_output;
+  size_t n_started;
+  std::deque<RegionStats> pending;
+};
+
+
+void
+RegionSweep::parse_site() {
+  // each number must be found where it starts, or the line is bad
+  const char *p = skip_space(line.c_str());
+  const char *q = skip_token(p);
+  chrom.assign(p, q);
+  bool good = !chrom.empty();
+  char *e = 0;
+  pos = strtoul(q, &e, 10);
+  good = good && e != q;
   if (METHPIPE_FORMAT) {
-    string chrom, seq, strand;
-    size_t pos = 0, coverage = 0;
-    double meth = 0.0;
-    methpipe::read_site(cpg_in, chrom, pos, strand, seq, meth, coverage);
-    cpg = GenomicRegion(chrom, pos, pos + 1, seq + ":" + toa(coverage),
-                        meth, strand[0]);
+    // chrom, pos, strand, context, meth, n_reads
+    p = skip_token(skip_space(skip_token(skip_space(e))));
+    meth = strtod(p, &e);
+    good = good && e != p;
+    p = e;
+    n_reads = strtoul(p, &e, 10);
+    good = good && e != p;
   }
   else {
-    cpg_in >> cpg;
+    // chrom, start, end, context:n_reads, meth, strand
+    p = e;
+    strtoul(p, &e, 10);
+    good = good && e != p;
+    p = skip_space(e);
+    q = skip_token(p);
+    const char *colon = q;
+    while (colon != p && *(colon - 1) != ':') --colon;
+    n_reads = strtoul(colon, &e, 10);
+    good = good && e != colon && e == q;
+    meth = strtod(q, &e);
+    good = good && e != q;
   }
-
-  return cpg_in;
+  if (!good)
+    throw SMITHLABException("bad line in file " + filename + ":\n" + line);
 }
 
 
-static bool
-cpg_not_past_region(const GenomicRegion &region, const size_t end_pos,
-		    const GenomicRegion &cpg) {
-  return (cpg.same_chrom(region) && cpg.get_end() <= end_pos) ||
-    cpg.get_chrom() < region.get_chrom();
+bool
+RegionSweep::read_site() {
+  const string prev_chrom(has_site ? chrom : string());
+  const size_t prev_pos = pos;
+  do {
+    if (!getline(in, line)) {
+      at_end = true;
+      return false;
+    }
+  } while (line.empty() || line[0] == '#');
+  parse_site();
+  if (has_site && (chrom < prev_chrom ||
+                   (chrom == prev_chrom && pos < prev_pos)))
+    throw SMITHLABException("CpGs not sorted in file: " + filename);
+  has_site = true;
+
+  for (; n_started < regions.size() && site_reached(regions[n_started]);
+       ++n_started)
+    pending.push_back(RegionStats());
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    const GenomicRegion &r = regions[n_output + i];
+    if (pos < r.get_end() && r.get_start() <= pos && chrom == r.get_chrom())
+      pending[i].add(meth, n_reads);
+  }
+  return true;
 }
 
 
-static void
-get_cpg_stats(const bool METHPIPE_FORMAT,
-              std::ifstream &cpg_in, const GenomicRegion region,
-              size_t &meth, size_t &reads, size_t &total_cpgs,
-              size_t &cpgs_with_reads,
-              size_t &called_total, size_t &called_meth,
-              double &mean_meth) {
-
-  string chrom(region.get_chrom());
-  const size_t start_pos = region.get_start();
-  const size_t end_pos = region.get_end();
-  find_start_line(chrom, start_pos, cpg_in);
-
-  GenomicRegion cpg;
-  while (load_cpg(METHPIPE_FORMAT, cpg_in, cpg) &&
-	 (cpg_not_past_region(region, end_pos, cpg))) {
-    if (start_pos <= cpg.get_start() && cpg.same_chrom(region)) {
-      ++total_cpgs;
-      const size_t n_reads = atoi(smithlab::split(cpg.get_name(), ":").back().c_str());
-      if (n_reads > 0) {
-        const double meth_freq = cpg.get_score();
-        const size_t n_meth = roundf(meth_freq*n_reads);
-        const size_t n_unmeth = roundf((1.0 - meth_freq)*n_reads);
-        meth += n_meth;
-        reads += n_reads;
-        ++cpgs_with_reads;
-
-        const pair<bool, bool> calls = meth_unmeth_calls(n_meth, n_unmeth);
-        called_total += (calls.first || calls.second);
-        called_meth += calls.first;
-
-        mean_meth += static_cast<double>(n_meth)/n_reads;
-      }
-    }
+void
+RegionSweep::next(RegionStats &s) {
+  if (n_started == n_output) {
+    pending.push_back(RegionStats());
+    ++n_started;
   }
-  cpg_in.clear();
+  while (!at_end && !(has_site && site_past(regions[n_output])))
+    read_site();
+  s = pending.front();
+  pending.pop_front();
+  ++n_output;
 }
 
 
 static void
-process_with_cpgs_on_disk(const bool METHPIPE_FORMAT,
-                          const bool PRINT_NAN,
-                          const bool PRINT_ADDITIONAL_LEVELS,
-                          const string &cpgs_file,
-                          vector<GenomicRegion> &regions,
-                          std::ostream &out) {
-
-  std::ifstream in(cpgs_file.c_str());
-  for (size_t i = 0; i < regions.size() && in; ++i) {
-
-    size_t meth = 0, read = 0;
-    size_t cpgs_with_reads = 0;
-    size_t called_total = 0, called_meth = 0;
-    size_t total_cpgs = 0;
-    double mean_meth = 0.0;
+process_with_sweep(const bool PRINT_NAN,
+                   const bool PRINT_ADDITIONAL_LEVELS,
+                   const string &cpgs_file,
+                   vector<GenomicRegion> &regions,
+                   std::ostream &out) {
+
+  RegionSweep sweep(regions, cpgs_file);
+  RegionStats s;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    sweep.next(s);
+    write_region_stats(PRINT_NAN, PRINT_ADDITIONAL_LEVELS, s, regions[i], out);
+  }
+}
 
-    get_cpg_stats(METHPIPE_FORMAT,
-                  in, regions[i], meth, read, total_cpgs, cpgs_with_reads,
-                  called_total, called_meth, mean_meth);
 
-    const string name = regions[i].get_name() + ":" +
-      toa(total_cpgs) + ":" + toa(cpgs_with_reads) + ":" +
-      toa(meth) + ":" + toa(read);
-    regions[i].set_name(name);
-    regions[i].set_score(static_cast<double>(meth)/read);
+/* one row for each region and one column for each file, giving
+   the weighted mean methylation level, or NA with no reads. All files
+   are read at the same time, each once. */
+static void
+process_matrix(const vector<string> &cpgs_files,
+               const vector<GenomicRegion> &regions,
+               std::ostream &out) {
+
+  vector<std::unique_ptr<RegionSweep> > sweeps;
+  out << "region";
+  for (size_t i = 0; i < cpgs_files.size(); ++i) {
+    sweeps.push_back(std::unique_ptr<RegionSweep>(
+                       new RegionSweep(regions, cpgs_files[i])));
+    out << '\t' << strip_path(remove_extension(cpgs_files[i]));
+  }
+  out << '\n';
 
-    if (PRINT_NAN || std::isfinite(regions[i].get_score())) {
-      out << regions[i];
-      if (PRINT_ADDITIONAL_LEVELS)
-        out << '\t'
-            << static_cast<double>(called_meth)/called_total << '\t'
-            << mean_meth/cpgs_with_reads;
-      out << endl;
+  RegionStats s;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    out << regions[i].get_chrom() << ':' << regions[i].get_start() << ':'
+        << regions[i].get_end() << ':' << regions[i].get_name();
+    for (size_t j = 0; j < sweeps.size(); ++j) {
+      sweeps[j]->next(s);
+      out << '\t';
+      if (s.reads > 0)
+        out << static_cast<double>(s.meth)/s.reads;
+      else out << "NA";
     }
+    out << '\n';
   }
 }
 
 
 ///
-///  END OF CODE FOR SEARCHING ON DISK
+///  END OF CODE FOR A SINGLE PASS OVER THE SITES
 ///
 ////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -351,6 +376,30 @@ process_with_cpgs_on_disk(const bool METHPIPE_FORMAT,
 ////////////////////////////////////////////////////////////////////////
 
 
+/* the stats for each region from the index made by methindex,
+   so the time does not depend on the size of the regions or of the
+   methylome; the sites must have been sorted for the index */
+static void
+process_with_index(const bool PRINT_NAN,
+                   const bool PRINT_ADDITIONAL_LEVELS,
+                   const string &cpgs_file,
+                   vector<GenomicRegion> &regions,
+                   std::ostream &out) {
+
+  const string index_file(meth_index_name(cpgs_file));
+  if (!std::ifstream(index_file.c_str()))
+    throw SMITHLABException("no index (run methindex): " + index_file);
+  const MethIndex index(index_file, get_filesize(cpgs_file));
+
+  RegionStats s;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    index.query(regions[i].get_chrom(), regions[i].get_start(),
+                regions[i].get_end(), s);
+    write_region_stats(PRINT_NAN, PRINT_ADDITIONAL_LEVELS, s, regions[i], out);
+  }
+}
+
+
 
 int
 main(int argc, const char **argv) {
@@ -361,22 +410,28 @@ main(int argc, const char **argv) {
     bool PRINT_NAN = false;
     bool LOAD_ENTIRE_FILE = false;
     bool PRINT_ADDITIONAL_LEVELS = false;
+    bool USE_INDEX = false;
 
     string outfile;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Compute average CpG "
                            "methylation in each of a set of genomic intervals",
-                           "<intervals-bed> <cpgs-bed>");
+                           "<intervals-bed> <cpgs-bed> [<cpgs-bed> ...]");
     opt_parse.add_opt("output", 'o', "Name of output file (default: stdout)",
                       false, outfile);
     opt_parse.add_opt("print-nan", 'P', "print all records (even if NaN score)",
                       false, PRINT_NAN);
     opt_parse.add_opt("preload", 'L', "load all CpG sites",
                       false, LOAD_ENTIRE_FILE);
+    opt_parse.add_opt("index", 'I', "use the index of the CpGs file "
+                      "made by methindex", false, USE_INDEX);
     opt_parse.add_opt("more-levels", 'M', "print more meth level information",
                       false, PRINT_ADDITIONAL_LEVELS);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -392,14 +447,17 @@ main(int argc, const char **argv) {
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
-    if (leftover_args.size() != 2) {
+    if (leftover_args.size() < 2) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
     const string regions_file = leftover_args.front();
-    const string cpgs_file = leftover_args.back();
+    const vector<string> cpgs_files(leftover_args.begin() + 1,
+                                    leftover_args.end());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (VERBOSE)
       cerr << "FORMAT = NAME : CPGS : CPGS_WITH_READS : "
         "METH_READS : TOTAL_READS" << endl;
@@ -413,6 +471,15 @@ main(int argc, const char **argv) {
     if (!outfile.empty()) of.open(outfile.c_str());
     std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
 
+    if (cpgs_files.size() > 1) {
+      if (LOAD_ENTIRE_FILE || USE_INDEX)
+        throw SMITHLABException("preload and index only work with one "
+                                "CpGs file");
+      process_matrix(cpgs_files, regions, out);
+      return EXIT_SUCCESS;
+    }
+    const string cpgs_file = cpgs_files.front();
+
     const bool METHPIPE_FORMAT =
       methpipe::is_methpipe_file_single(cpgs_file);
 
@@ -420,14 +487,20 @@ main(int argc, const char **argv) {
       cerr << "CPG FILE FORMAT: "
            << (METHPIPE_FORMAT ? "METHPIPE" : "BED") << endl;
 
-    if (LOAD_ENTIRE_FILE)
+    if (USE_INDEX) {
+      if (!METHPIPE_FORMAT)
+        throw SMITHLABException("index only works with methcounts "
+                                "format: " + cpgs_file);
+      process_with_index(PRINT_NAN, PRINT_ADDITIONAL_LEVELS,
+                         cpgs_file, regions, out);
+    }
+    else if (LOAD_ENTIRE_FILE)
       process_with_cpgs_loaded(METHPIPE_FORMAT, VERBOSE, PRINT_NAN,
                                PRINT_ADDITIONAL_LEVELS,
                                cpgs_file, regions, out);
     else
-      process_with_cpgs_on_disk(METHPIPE_FORMAT, PRINT_NAN,
-                                PRINT_ADDITIONAL_LEVELS,
-                                cpgs_file, regions, out);
+      process_with_sweep(PRINT_NAN, PRINT_ADDITIONAL_LEVELS,
+                         cpgs_file, regions, out);
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -0,0 +1,542 @@
+/*    sc-methcounts: count the methylated and unmethylated reads at
+ *    each CpG for many single cells in one pass
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The reads of all cells are taken together in order of position, so
+ * each chrom is loaded once, and the counts are kept only for the
+ * CpGs near the current read: a CpG before it can get no more reads,
+ * and its counts are written to the cell matrix (see CellMatrix.hpp).
+ * Memory does not depend on the number of cells or on chrom length,
+ * where running methcounts on each cell needs counts for every base of
+ * the chrom, for each cell.
+ *
+ * The reads come either from one file per cell, or from one file with
+ * the cell of each read given by a barcode at the start of its name.
+ * The counts at a CpG are those of the symmetric CpG output of
+ * methcounts for the cell, adding both strands, but mutations are not
+ * called, as a single cell seldom has reads on both strands.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <sys/resource.h>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
+
+#include "bsutils.hpp"
+#include "MethpipeSite.hpp"
+#include "MethLevels.hpp"
+#include "CellMatrix.hpp"
+#include "ThreadPool.hpp"
+#include "ParallelBGZF.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::unique_ptr;
+using std::unordered_map;
+
+
+typedef unordered_map<string, string> chrom_file_map;
+static void
+get_chrom(const string &chrom_name, const chrom_file_map &chrom_files,
+          string &chrom) {
+
+  const chrom_file_map::const_iterator fn(chrom_files.find(chrom_name));
+  if (fn == chrom_files.end())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+
+  chrom.clear();
+  read_fasta_file(fn->second, chrom_name, chrom);
+  if (chrom.empty())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+}
+
+
+/* CellInput: one file of reads, sorted by chrom and start, giving its
+   reads one at a time with the cell of each. For one file per cell
+   the cell is that of the file; otherwise it is found from the
+   barcode in the read name, and reads of other cells are skipped. */
+class CellInput {
+public:
+  CellInput(const string &fn, std::istream &i, const size_t c) :
+    filename(fn), reader(i, 1ul << 16), cell(c), n_other_cells(0),
+    barcodes(0), chrom_id(0) {}
+  CellInput(const string &fn, std::istream &i,
+            const unordered_map<string, size_t> &b, const string &d) :
+    filename(fn), reader(i), cell(0), n_other_cells(0), barcodes(&b),
+    delim(d), chrom_id(0) {}
+
+  bool next();
+
+  const string filename;
+  MappedReadReader reader;
+  size_t cell;
+  string chrom;
+  MappedRead mr;
+  size_t n_other_cells;
+
+private:
+  const unordered_map<string, size_t> *barcodes;
+  const string delim;
+  size_t chrom_id;
+  string name;
+};
+
+
+bool
+CellInput::next() {
+  const char *line = 0, *line_end = 0;
+  while (reader.next_line(line, line_end)) {
+    const size_t prev_start = mr.r.get_start();
+    parse_mapped_read(line, line_end, name, mr);
+    if (reader.chrom_id() != chrom_id) {
+      if (chrom_id != 0 && reader.chrom() < chrom)
+        throw SMITHLABException("chroms out of order: " + filename);
+      chrom = reader.chrom();
+      chrom_id = reader.chrom_id();
+    }
+    else if (mr.r.get_start() < prev_start)
+      throw SMITHLABException("reads not sorted by position: " + filename);
+    if (!barcodes)
+      return true;
+    const size_t end = name.find(delim);
+    auto b = (end == string::npos) ? barcodes->end() :
+      barcodes->find(name.substr(0, end));
+    if (b != barcodes->end()) {
+      cell = b->second;
+      return true;
+    }
+    ++n_other_cells;
+  }
+  return false;
+}
+
+
+// orders inputs for a heap with the first read at the top
+struct LaterRead {
+  explicit LaterRead(const vector<unique_ptr<CellInput> > &i) : inputs(i) {}
+  bool operator()(const size_t a, const size_t b) const {
+    const CellInput &x = *inputs[a], &y = *inputs[b];
+    const int cmp = x.chrom.compare(y.chrom);
+    if (cmp != 0) return cmp > 0;
+    const size_t x_start = x.mr.r.get_start(), y_start = y.mr.r.get_start();
+    return x_start > y_start || (x_start == y_start && a > b);
+  }
+  const vector<unique_ptr<CellInput> > &inputs;
+};
+
+
+/* SiteWindow: the CpGs with reads whose counts may still change, in
+   order of position, each with the counts of the cells with reads
+   there */
+class SiteWindow {
+public:
+  void add(const size_t pos, const size_t cell, const bool meth) {
+    std::deque<Site>::iterator s = sites.end();
+    while (s != sites.begin() && (s - 1)->pos >= pos) --s;
+    if (s == sites.end() || s->pos != pos) {
+      s = sites.insert(s, Site());
+      s->pos = pos;
+    }
+    vector<CellCount>::iterator c = s->counts.begin();
+    while (c != s->counts.end() && c->cell != cell) ++c;
+    if (c == s->counts.end())
+      c = s->counts.insert(c, CellCount(cell));
+    if (meth) ++c->n_meth;
+    else ++c->n_unmeth;
+  }
+
+  // gives "f" each CpG before "limit", with counts sorted by cell, and
+  // removes it
+  template <class SiteHandler>
+  void flush(const size_t limit, SiteHandler f) {
+    while (!sites.empty() && sites.front().pos < limit) {
+      Site &s = sites.front();
+      sort(s.counts.begin(), s.counts.end());
+      f(s.pos, s.counts);
+      sites.pop_front();
+    }
+  }
+
+private:
+  struct Site {
+    size_t pos;
+    vector<CellCount> counts;
+  };
+  std::deque<Site> sites;
+};
+
+
+/* the reads count as in methcounts, a C or T in the read over
+   the C of a CpG on its strand showing the CpG methylated or not; the
+   G of a CpG counts for the CpG at the C before it. */
+static void
+add_read(const string &chrom, const MappedRead &mr, const size_t cell,
+         SiteWindow &window) {
+  const size_t start = mr.r.get_start();
+  const size_t width = std::min(mr.r.get_width(), mr.seq.length());
+  if (mr.r.pos_strand()) {
+    for (size_t i = 0; i < width; ++i)
+      if (start + i < chrom.length() && is_cpg(chrom, start + i)) {
+        if (mr.seq[i] == 'C') window.add(start + i, cell, true);
+        else if (mr.seq[i] == 'T') window.add(start + i, cell, false);
+      }
+  }
+  else {
+    const size_t last = mr.r.get_start() + mr.r.get_width() - 1;
+    for (size_t i = 0; i < width; ++i) {
+      const size_t pos = last - i;
+      if (pos > 0 && pos < chrom.length() && is_cpg(chrom, pos - 1)) {
+        if (mr.seq[i] == 'C') window.add(pos - 1, cell, true);
+        else if (mr.seq[i] == 'T') window.add(pos - 1, cell, false);
+      }
+    }
+  }
+}
+
+
+static size_t
+count_cpgs(const string &chrom) {
+  size_t n_cpgs = 0;
+  for (size_t i = 0; i + 1 < chrom.length(); ++i)
+    n_cpgs += is_cpg(chrom, i);
+  return n_cpgs;
+}
+
+
+// a cell name from its file: the file name without its suffix
+static string
+cell_name_from_file(const string &filename) {
+  const string base = strip_path(filename);
+  const size_t dot = base.rfind('.');
+  return (dot == 0 || dot == string::npos) ? base : base.substr(0, dot);
+}
+
+
+/* thousands of cells may each have a file, all open at once, so
+   the limit on open files is raised as far as allowed */
+static void
+raise_open_file_limit(const size_t n_files) {
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) != 0 ||
+      lim.rlim_cur == RLIM_INFINITY || lim.rlim_cur >= n_files + 64)
+    return;
+  lim.rlim_cur = (lim.rlim_max == RLIM_INFINITY) ? n_files + 64 :
+    std::min(static_cast<rlim_t>(n_files + 64), lim.rlim_max);
+  setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+
+static void
+write_cell_levels(std::ostream &out, const vector<string> &cells,
+                  const vector<LevelsCounter> &levels) {
+  out << "cell" << '\t' << "sites" << '\t' << "sites_covered" << '\t'
+      << "fraction_covered" << '\t' << "mean_depth" << '\t'
+      << "mean_depth_covered" << '\t' << "max_depth" << '\t'
+      << "mean_meth" << '\t' << "w_mean_meth" << '\t' << "frac_meth" << endl;
+  for (size_t i = 0; i < cells.size(); ++i) {
+    const LevelsCounter &l = levels[i];
+    const bool good = (l.sites_covered != 0);
+    out << cells[i] << '\t' << l.total_sites << '\t' << l.sites_covered
+        << '\t' << static_cast<double>(l.sites_covered)/l.total_sites
+        << '\t' << static_cast<double>(l.coverage())/l.total_sites
+        << '\t' << static_cast<double>(l.coverage())/l.sites_covered
+        << '\t' << l.max_coverage
+        << '\t' << (good ? toa(l.mean_meth()) : "N/A")
+        << '\t' << (good ? toa(l.weighted_mean_meth()) : "N/A")
+        << '\t' << (good ? toa(l.fractional_meth()) : "N/A")
+        << endl;
+  }
+}
+
+
+// the matrix as text: chrom, position, cell, methylated and all reads
+static void
+dump_matrix(const string &matrix_file, const string &outfile,
+            const size_t n_threads) {
+  InputFile inf(matrix_file, n_threads);
+  std::istream in(inf.rdbuf());
+  CellMatrixReader reader(in, matrix_file);
+  OutputFile of(outfile, n_threads);
+  std::ostream out_stream(of.rdbuf());
+  RecordWriter out(out_stream);
+  const vector<string> &cells = reader.cells();
+  vector<CellCount> counts;
+  size_t pos = 0;
+  while (reader.next_chrom()) {
+    const string &chrom = reader.chrom_name();
+    while (reader.next_site(pos, counts))
+      for (size_t i = 0; i < counts.size(); ++i)
+        out.put(chrom).put('\t').put_uint(pos).put('\t')
+          .put(cells[counts[i].cell]).put('\t').put_uint(counts[i].n_meth)
+          .put('\t').put_uint(counts[i].n_meth + counts[i].n_unmeth)
+          .put('\n');
+  }
+  if (in.bad())
+    throw SMITHLABException("error reading file: " + matrix_file);
+  out.flush();
+  of.close();
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    bool DUMP = false;
+    size_t n_threads = 1;
+    double alpha = 0.95;
+
+    string chrom_file;
+    string outfile;
+    string levels_file;
+    string cells_file;
+    string barcode_delim = ":";
+    string fasta_suffix = "fa";
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "count methylation at each "
+                           "CpG for many single cells into one sparse "
+                           "matrix", "-c <chroms> <cell-reads> ...");
+    opt_parse.add_opt("output", 'o', "cell matrix file; compressed for "
+                      "names ending in .gz (default: stdout)", false, outfile);
+    opt_parse.add_opt("chrom", 'c', "file or dir of chroms (FASTA format; "
+                      ".fa suffix)", false, chrom_file);
+    opt_parse.add_opt("suffix", 's', "suffix of FASTA files "
+                      "(assumes -c specifies dir)", false, fasta_suffix);
+    opt_parse.add_opt("levels", 'L', "write summary statistics for each "
+                      "cell, as from levels, to this file", false,
+                      levels_file);
+    opt_parse.add_opt("alpha", 'a', "alpha for confidence interval, for "
+                      "the statistics", false, alpha);
+    opt_parse.add_opt("barcodes", 'b', "reads of all cells are in one file, "
+                      "with the cell a barcode at the start of each read "
+                      "name; this file lists the barcodes of the cells",
+                      false, cells_file);
+    opt_parse.add_opt("delim", 'd', "text after the barcode in read names "
+                      "(default: \":\")", false, barcode_delim);
+    opt_parse.add_opt("dump", 'D', "write a cell matrix file given in "
+                      "place of reads as text", false, DUMP);
+    add_threads_opt(opt_parse, n_threads);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested() || leftover_args.empty()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const vector<string> reads_files(leftover_args);
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    if (!outfile.empty() && !is_valid_output_file(outfile))
+      throw SMITHLABException("bad output file: " + outfile);
+
+    if (DUMP) {
+      if (reads_files.size() != 1)
+        throw SMITHLABException("give one cell matrix to dump");
+      dump_matrix(reads_files.front(), outfile, n_threads);
+      return EXIT_SUCCESS;
+    }
+    if (chrom_file.empty())
+      throw SMITHLABException("chroms (-c) are required");
+    if (!cells_file.empty() && reads_files.size() != 1)
+      throw SMITHLABException("give one reads file with barcodes");
+
+    chrom_file_map chrom_files;
+    identify_and_read_chromosomes(chrom_file, fasta_suffix, chrom_files);
+    if (VERBOSE)
+      cerr << "CHROMS_FOUND=" << chrom_files.size() << endl;
+
+    // the cells, and an input for each file of reads
+    vector<string> cells;
+    unordered_map<string, size_t> barcodes;
+    vector<unique_ptr<InputFile> > files;
+    vector<unique_ptr<std::istream> > streams;
+    vector<unique_ptr<CellInput> > inputs;
+    if (!cells_file.empty()) {
+      std::ifstream in(cells_file.c_str());
+      if (!in)
+        throw SMITHLABException("cannot open input file: " + cells_file);
+      string barcode;
+      while (in >> barcode)
+        if (barcodes.insert(std::make_pair(barcode, cells.size())).second)
+          cells.push_back(barcode);
+      files.push_back(unique_ptr<InputFile>
+                      (new InputFile(reads_files.front(), n_threads)));
+      streams.push_back(unique_ptr<std::istream>
+                        (new std::istream(files.back()->rdbuf())));
+      inputs.push_back(unique_ptr<CellInput>
+                       (new CellInput(reads_files.front(), *streams.back(),
+                                      barcodes, barcode_delim)));
+    }
+    else {
+      // compressed files would each need threads to read, so the
+      // files of cells must be plain text
+      raise_open_file_limit(reads_files.size());
+      for (size_t i = 0; i < reads_files.size(); ++i) {
+        if (ParallelBGZFReader::is_bgzf(reads_files[i]))
+          throw SMITHLABException("files of single cells must not be "
+                                  "compressed: " + reads_files[i]);
+        cells.push_back(cell_name_from_file(reads_files[i]));
+        files.push_back(unique_ptr<InputFile>
+                        (new InputFile(reads_files[i], 1)));
+        streams.push_back(unique_ptr<std::istream>
+                          (new std::istream(files.back()->rdbuf())));
+        inputs.push_back(unique_ptr<CellInput>
+                         (new CellInput(reads_files[i], *streams.back(), i)));
+      }
+    }
+    if (VERBOSE)
+      cerr << "CELLS=" << cells.size() << endl;
+
+    OutputFile of(outfile, n_threads);
+    std::ostream out_stream(of.rdbuf());
+    CellMatrixWriter out(out_stream, cells);
+
+    vector<LevelsCounter> levels(cells.size());
+    // as levels on the methcounts output of a cell, its sites are the
+    // CpGs of the chroms on which it has reads
+    vector<size_t> cell_cpgs(cells.size(), 0);
+    vector<size_t> cell_last_chrom(cells.size(), 0);
+    size_t n_chroms = 0, n_cpgs = 0, n_sites = 0, n_reads = 0;
+    MSite site;
+    site.context = "CpG";
+    auto write_site = [&](const size_t pos, const vector<CellCount> &counts) {
+      out.add_site(pos, counts);
+      for (size_t i = 0; i < counts.size(); ++i) {
+        site.n_reads = counts[i].n_meth + counts[i].n_unmeth;
+        site.meth = static_cast<double>(counts[i].n_meth)/site.n_reads;
+        levels[counts[i].cell].update(site, alpha);
+      }
+      ++n_sites;
+    };
+
+    /* the reads of all inputs are merged by position with a
+       heap; a read on the - strand may count for the CpG just before
+       its start, so CpGs are written once the reads start past the
+       CpG after them. */
+    StageTimer timer("count_reads");
+    LaterRead later(inputs);
+    std::priority_queue<size_t, vector<size_t>, LaterRead> heap(later);
+    for (size_t i = 0; i < inputs.size(); ++i)
+      if (inputs[i]->next())
+        heap.push(i);
+
+    SiteWindow window;
+    string chrom_name, chrom;
+    while (!heap.empty()) {
+      const size_t i = heap.top();
+      heap.pop();
+      CellInput &input = *inputs[i];
+      if (input.chrom != chrom_name) {
+        if (!chrom_name.empty()) {
+          window.flush(chrom.length(), write_site);
+          out.end_chrom();
+        }
+        chrom_name = input.chrom;
+        get_chrom(chrom_name, chrom_files, chrom);
+        n_cpgs = count_cpgs(chrom);
+        ++n_chroms;
+        out.start_chrom(chrom_name, chrom.length(), n_cpgs);
+        if (VERBOSE)
+          cerr << "PROCESSING:\t" << chrom_name << endl;
+        Metrics::count("chroms");
+      }
+      if (cell_last_chrom[input.cell] != n_chroms) {
+        cell_last_chrom[input.cell] = n_chroms;
+        cell_cpgs[input.cell] += n_cpgs;
+      }
+      const size_t start = input.mr.r.get_start();
+      window.flush((start > 0) ? start - 1 : 0, write_site);
+      add_read(chrom, input.mr, input.cell, window);
+      ++n_reads;
+      if (input.next())
+        heap.push(i);
+    }
+    if (!chrom_name.empty()) {
+      window.flush(chrom.length(), write_site);
+      out.end_chrom();
+    }
+    for (size_t i = 0; i < streams.size(); ++i)
+      if (streams[i]->bad())
+        throw SMITHLABException("error reading file: " +
+                                inputs[i]->filename);
+    out.flush();
+    of.close();
+    timer.stop();
+    Metrics::count("reads", n_reads);
+    Metrics::count("sites", n_sites);
+    if (!cells_file.empty()) {
+      Metrics::count("reads_other_cells", inputs.front()->n_other_cells);
+      if (VERBOSE)
+        cerr << "READS_OF_OTHER_CELLS=" << inputs.front()->n_other_cells
+             << endl;
+    }
+
+    if (!levels_file.empty()) {
+      for (size_t i = 0; i < levels.size(); ++i)
+        levels[i].total_sites = cell_cpgs[i];
+      std::ofstream levels_out(levels_file.c_str());
+      if (!levels_out)
+        throw SMITHLABException("bad output file: " + levels_file);
+      write_cell_levels(levels_out, cells, levels);
+    }
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MICROBENCH_HPP
+#define MICROBENCH_HPP
+
+/* Timing of small functions for the micro-benchmark programs. A
+ * function is called in batches, doubling the batch until a batch
+ * takes long enough to time, and then for the requested time. The
+ * result of each call is added to a sum that is reported, so the
+ * compiler can not drop calls whose results are otherwise unused.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <functional>
+
+struct MicrobenchResult {
+  std::string name;
+  std::string unit;     // what one item is, e.g. "site" or "fit"
+  size_t n_calls;
+  size_t n_items;
+  double seconds;
+  double checksum;      // sum of the results, printed so it is used
+};
+
+inline double
+microbench_now() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* "f" is one call to the code being timed, returns a value that
+   depends on the work done, and sets "n_items" to the number of items
+   (sites, reads, iterations) it processed */
+inline MicrobenchResult
+run_microbench(const std::string &name, const std::string &unit,
+               const double min_seconds,
+               const std::function<double(size_t &)> &f) {
+  MicrobenchResult r;
+  r.name = name;
+  r.unit = unit;
+  r.n_calls = 0;
+  r.n_items = 0;
+  r.seconds = 0.0;
+  r.checksum = 0.0;
+
+  // warm up caches and any allocation done by the first call
+  size_t n_items = 0;
+  r.checksum += f(n_items);
+
+  size_t batch = 1;
+  while (r.seconds < min_seconds) {
+    const double start = microbench_now();
+    for (size_t i = 0; i < batch; ++i) {
+      r.checksum += f(n_items);
+      r.n_items += n_items;
+    }
+    r.seconds += microbench_now() - start;
+    r.n_calls += batch;
+    if (batch < (1ul << 20)) batch *= 2;
+  }
+  return r;
+}
+
+inline void
+write_microbench_header(std::ostream &out) {
+  out << "benchmark\tunit\tcalls\titems\tseconds\t"
+      << "ns_per_item\titems_per_second\tchecksum" << std::endl;
+}
+
+inline void
+write_microbench(std::ostream &out, const MicrobenchResult &r) {
+  const double per_item = r.n_items > 0 ? r.seconds/r.n_items : 0.0;
+  out << r.name << '\t' << r.unit << '\t' << r.n_calls << '\t'
+      << r.n_items << '\t' << r.seconds << '\t' << 1e9*per_item << '\t'
+      << (per_item > 0.0 ? 1.0/per_item : 0.0) << '\t'
+      << r.checksum << std::endl;
+}
+
+#endif
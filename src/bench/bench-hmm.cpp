@@ -0,0 +1,175 @@
+/*    bench-hmm: micro-benchmarks for the two-state HMM of hmr and pmd
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* this is separate from bench-kernels because TwoStateHMM.o and
+   BetaBin.o each define a "betabin", so they can not be linked into
+   one program. */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "TwoStateHMM.hpp"
+#include "RandomStream.hpp"
+#include "Microbench.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+/* counts of methylated and unmethylated reads at CpGs, in blocks of
+   high methylation broken by HMRs, and the reset points between
+   blocks as hmr would find them at CpG deserts */
+static void
+simulate_methylome(RandomStream &rng, const size_t n_sites,
+                   const size_t block_size,
+                   vector<pair<double, double> > &vals,
+                   vector<size_t> &reset_points) {
+  vals.clear();
+  reset_points.clear();
+  bool in_hmr = false;
+  for (size_t i = 0; i < n_sites; ++i) {
+    if (i % block_size == 0)
+      reset_points.push_back(i);
+    if (rng.uniform() < (in_hmr ? 0.05 : 0.01))
+      in_hmr = !in_hmr;
+    const double level = in_hmr ? 0.1 : 0.8;
+    const size_t n_reads = 1 + rng.uniform_int(20);
+    size_t n_meth = 0;
+    for (size_t j = 0; j < n_reads; ++j)
+      n_meth += (rng.uniform() < level);
+    vals.push_back(make_pair(n_meth, n_reads - n_meth));
+  }
+  reset_points.push_back(n_sites);
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string outfile;
+    double min_seconds = 1.0;
+    size_t n_sites = 100000;
+    size_t block_size = 5000;
+    size_t seed = 408;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "time the forward-backward "
+                           "and Viterbi algorithms of the two-state HMM "
+                           "on a simulated methylome", "");
+    opt_parse.add_opt("output", 'o', "output file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("time", 'T', "min seconds for each benchmark",
+                      false, min_seconds);
+    opt_parse.add_opt("sites", 'n', "CpG sites in the methylome",
+                      false, n_sites);
+    opt_parse.add_opt("block", 'b', "CpG sites between reset points",
+                      false, block_size);
+    opt_parse.add_opt("seed", 's', "random seed", false, seed);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (!leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (n_sites == 0 || block_size == 0)
+      throw SMITHLABException("sites and block size must be positive");
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
+    if (!out)
+      throw SMITHLABException("bad output file: " + outfile);
+
+    RandomStream rng(seed);
+    vector<pair<double, double> > vals;
+    vector<size_t> reset_points;
+    simulate_methylome(rng, n_sites, block_size, vals, reset_points);
+
+    // the starting parameters of hmr
+    static const double min_prob = 1e-10, tolerance = 1e-10;
+    vector<double> start_trans(2, 0.5), end_trans(2, 1e-10);
+    vector<vector<double> > trans(2, vector<double>(2, 0.25));
+    trans[0][0] = trans[1][1] = 0.75;
+    const double n_reads = 10.0;
+    const double fg_alpha = 0.33*n_reads, fg_beta = 0.67*n_reads;
+    const double bg_alpha = 0.67*n_reads, bg_beta = 0.33*n_reads;
+
+    const TwoStateHMMB hmm(min_prob, tolerance, 1, false);
+
+    write_microbench_header(out);
+
+    /* forward_algorithm is private to the HMM; PosteriorScores runs it
+       and backward_algorithm once over each block, with little else */
+    vector<double> scores;
+    write_microbench(out, run_microbench("forward_backward", "site",
+                                         min_seconds, [&](size_t &n_items) {
+        hmm.PosteriorScores(vals, reset_points, start_trans, trans, end_trans,
+                            fg_alpha, fg_beta, bg_alpha, bg_beta,
+                            true, scores);
+        n_items = vals.size();
+        return scores.empty() ? 0.0 : scores.back();
+      }));
+
+    vector<bool> classes;
+    write_microbench(out, run_microbench("viterbi", "site",
+                                         min_seconds, [&](size_t &n_items) {
+        const double score =
+          hmm.ViterbiDecoding(vals, reset_points, start_trans, trans,
+                              end_trans, fg_alpha, fg_beta, bg_alpha, bg_beta,
+                              classes);
+        n_items = vals.size();
+        return score;
+      }));
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+/*    bench-kernels: micro-benchmarks for the beta-binomial density,
+ *    the radmeth regression and the epiallele EM of amrfinder
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "BetaBin.hpp"
+#include "Epiread.hpp"
+#include "EpireadStats.hpp"
+#include "regression.hpp"
+#include "RandomStream.hpp"
+#include "Microbench.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+// counts of methylated and unmethylated reads, as hmr gives the HMM
+static void
+simulate_counts(RandomStream &rng, const size_t n_sites,
+                vector<pair<double, double> > &vals) {
+  vals.clear();
+  for (size_t i = 0; i < n_sites; ++i) {
+    const size_t n_reads = 1 + rng.uniform_int(30);
+    const double level = (rng.uniform() < 0.2) ? 0.1 : 0.8;
+    size_t n_meth = 0;
+    for (size_t j = 0; j < n_reads; ++j)
+      n_meth += (rng.uniform() < level);
+    vals.push_back(make_pair(n_meth, n_reads - n_meth));
+  }
+}
+
+
+// one site of a two-group design, as radmeth regression sees it
+static void
+simulate_regression(RandomStream &rng, const size_t n_samples,
+                    Regression &r) {
+  Design &d = r.design;
+  d.factor_names.clear();
+  d.factor_names.push_back("base");
+  d.factor_names.push_back("case");
+  d.sample_names.clear();
+  d.matrix.clear();
+  for (size_t i = 0; i < n_samples; ++i) {
+    const bool is_case = (2*i >= n_samples);
+    d.sample_names.push_back((is_case ? "case_" : "control_") + toa(i));
+    d.matrix.push_back(vector<double>(2, 1.0));
+    d.matrix.back()[1] = is_case;
+  }
+
+  SiteProportions &p = r.props;
+  p.chrom = "chr1";
+  p.position = 0;
+  p.strand = "+";
+  p.context = "CpG";
+  p.total.clear();
+  p.meth.clear();
+  const double control_level = 0.2 + 0.6*rng.uniform();
+  const double case_level = (rng.uniform() < 0.5) ?
+    control_level : 1.0 - control_level;
+  for (size_t i = 0; i < n_samples; ++i) {
+    const double level = d.matrix[i][1] ? case_level : control_level;
+    const size_t n_reads = 5 + rng.uniform_int(20);
+    size_t n_meth = 0;
+    for (size_t j = 0; j < n_reads; ++j)
+      n_meth += (rng.uniform() < level);
+    p.total.push_back(n_reads);
+    p.meth.push_back(n_meth);
+  }
+}
+
+
+// epireads from two epialleles in a window of CpGs, as amrfinder tests
+static void
+simulate_window(RandomStream &rng, const size_t n_cpgs, const size_t n_reads,
+                vector<epiread> &reads) {
+  reads.clear();
+  for (size_t i = 0; i < n_reads; ++i) {
+    const size_t pos = rng.uniform_int(n_cpgs - 1);
+    const size_t len = 1 + rng.uniform_int(n_cpgs - pos);
+    const double level = (rng.uniform() < 0.5) ? 0.9 : 0.1;
+    string seq(len, 'T');
+    for (size_t j = 0; j < len; ++j)
+      if (rng.uniform() < level) seq[j] = 'C';
+    reads.push_back(epiread("chr1", pos, seq));
+  }
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string outfile;
+    double min_seconds = 1.0;
+    size_t n_samples = 6;
+    size_t window_size = 10;
+    size_t seed = 408;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "time the beta-binomial "
+                           "density, radmeth regression and the epiallele "
+                           "EM of amrfinder on simulated data", "");
+    opt_parse.add_opt("output", 'o', "output file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("time", 'T', "min seconds for each benchmark",
+                      false, min_seconds);
+    opt_parse.add_opt("samples", 'n', "samples in the regression design",
+                      false, n_samples);
+    opt_parse.add_opt("window", 'w', "CpGs in each epiread window",
+                      false, window_size);
+    opt_parse.add_opt("seed", 's', "random seed", false, seed);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (!leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (n_samples < 2 || window_size < 2)
+      throw SMITHLABException("need at least 2 samples and 2 CpGs per window");
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
+    if (!out)
+      throw SMITHLABException("bad output file: " + outfile);
+
+    write_microbench_header(out);
+
+    // betabin::operator(): the emission density of the HMMs
+    {
+      RandomStream rng(seed, 0);
+      vector<pair<double, double> > vals;
+      simulate_counts(rng, 4096, vals);
+      const betabin distro(0.67*15, 0.33*15);
+      write_microbench(out, run_microbench("betabin", "site", min_seconds,
+        [&](size_t &n_items) {
+          double total = 0.0;
+          for (size_t i = 0; i < vals.size(); ++i)
+            total += distro(vals[i]);
+          n_items = vals.size();
+          return total;
+        }));
+    }
+
+    /* neg_loglik is internal to the regression, so it is timed through
+       fit, which calls it and its gradient once for each iteration */
+    {
+      RandomStream rng(seed, 1);
+      vector<Regression> sites(64);
+      for (size_t i = 0; i < sites.size(); ++i)
+        simulate_regression(rng, n_samples, sites[i]);
+      MicrobenchResult r = run_microbench("regression_iteration", "iteration",
+                                          min_seconds, [&](size_t &n_items) {
+          double total = 0.0;
+          n_items = 0;
+          for (size_t i = 0; i < sites.size(); ++i) {
+            fit(sites[i]);
+            total += sites[i].max_loglik;
+            n_items += sites[i].n_iterations;
+          }
+          return total;
+        });
+      write_microbench(out, r);
+      r.name = "regression_fit";
+      r.unit = "site";
+      r.n_items = r.n_calls*sites.size();
+      write_microbench(out, r);
+    }
+
+    // resolve_epialleles: the two-allele EM for one window of amrfinder
+    {
+      static const size_t max_itr = 10;
+      static const double low_prob = 0.25, high_prob = 0.75, mixing = 0.5;
+      RandomStream rng(seed, 2);
+      vector<vector<epiread> > windows(64);
+      for (size_t i = 0; i < windows.size(); ++i)
+        simulate_window(rng, window_size, 5*window_size, windows[i]);
+      vector<double> indicators, a1, a2;
+      write_microbench(out, run_microbench("resolve_epialleles", "window",
+                                           min_seconds, [&](size_t &n_items) {
+          double total = 0.0;
+          for (size_t i = 0; i < windows.size(); ++i) {
+            a1.assign(window_size, low_prob);
+            a2.assign(window_size, high_prob);
+            total += resolve_epialleles(max_itr, windows[i], mixing,
+                                        indicators, a1, a2);
+          }
+          n_items = windows.size();
+          return total;
+        }));
+    }
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
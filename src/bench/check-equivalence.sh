@@ -0,0 +1,363 @@
+#!/bin/bash
+#
+#  check-equivalence.sh: check that the fast modes of the methpipe
+#  programs give the same results as their reference modes
+#
+#  Copyright (C) 2026 The methpipe contributors
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#  Two data sets are simulated with methpipe-sim from fixed seeds: a
+#  small one with one chrom, and a larger one closer to real data,
+#  with several chroms, lower coverage and incomplete conversion. On
+#  each, every program is run in its reference mode (one thread,
+#  plain output, the separate tool) and in its fast mode, and the
+#  outputs are compared with compare-outputs:
+#
+#    exact    methcounts, levels, methstates, duplicate-remover,
+#             methpipe-sort against sort and duplicate-remover,
+#             merge-count-states on two lanes against methcounts on
+#             all reads, methcounts on shards of the genome put
+#             together by merge-shards, merge-count-states and
+#             merge-bsrate, with a chrom that has no reads, the
+#             symmetric CpG and bsrate outputs of methcounts, and
+#             sc-methcounts on reads split into cells, as files and
+#             as barcodes, against methcounts and symmetric-cpgs on
+#             each cell, and its levels for each cell against levels,
+#             and methpipe-run on SAM input with chroms out of name
+#             order against to-mr, sort, duplicate-remover and
+#             methcounts
+#    numeric  methpipe-run levels against levels, hmr posteriors, amrfinder and radmeth p-values,
+#             roimethstat levels, and roimethstat using a methindex
+#             index against its sweep over the sites (the mean level
+#             from the index is a difference of running sums), within
+#             NUM_REL and NUM_ABS
+#    overlap  hmr domains, with a Jaccard index of at least JACCARD
+#
+#  The exit status is 0 only if every comparison passes.
+
+usage() {
+    cat >&2 <<EOF
+Usage: $(basename "$0") [options]
+  -b DIR    directory with the methpipe programs (default: ../../bin)
+  -t N      threads for the fast modes (default: 4)
+  -d DIR    directory for data and outputs (default: equivalence-out)
+EOF
+    exit 1
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BIN=$HERE/../../bin
+THREADS=4
+DIR=equivalence-out
+
+# tolerances for the numeric and overlap comparisons
+NUM_REL=1e-6
+NUM_ABS=1e-9
+JACCARD=0.99
+
+while getopts "b:t:d:h" opt; do
+    case $opt in
+        b) BIN=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        d) DIR=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+PROGS="methcounts merge-count-states merge-shards merge-bsrate sc-methcounts symmetric-cpgs bsrate methstates \
+duplicate-remover methpipe-sort to-mr methpipe-run levels hmr amrfinder radmeth roimethstat methindex"
+for prog in $PROGS; do
+    if [ ! -x "$BIN/$prog" ]; then
+        echo "ERROR: $BIN/$prog not found; install methpipe first" >&2
+        exit 1
+    fi
+done
+
+mkdir -p "$DIR"
+N_PASSED=0
+N_FAILED=0
+
+# check NAME MODE REFERENCE FAST compares two outputs and reports
+# the result; a missing output counts as a failure
+check() {
+    local name=$1 mode=$2 ref=$3 fast=$4 message
+    if [ ! -f "$ref" ] || [ ! -f "$fast" ]; then
+        message="missing output"
+    else
+        message=$("$HERE/compare-outputs" -m "$mode" -r "$NUM_REL" \
+            -a "$NUM_ABS" -j "$JACCARD" "$ref" "$fast" 2>&1) && {
+            printf "PASS\t%s\t%s\t%s\n" "$name" "$mode" "$message"
+            N_PASSED=$((N_PASSED + 1))
+            return
+        }
+    fi
+    printf "FAIL\t%s\t%s\t%s\n" "$name" "$mode" "$message"
+    N_FAILED=$((N_FAILED + 1))
+}
+
+# run OUTPUT COMMAND... runs a program quietly, leaving its
+# output missing if it fails so the check after it fails. Some
+# programs (amrfinder) write no file when they find nothing.
+run() {
+    local out=$1
+    shift
+    rm -f "$out"
+    if "$@" 2> "$out.log"; then
+        [ -f "$out" ] || : > "$out"
+    else
+        echo "ERROR: $* failed; see $out.log" >&2
+        rm -f "$out"
+    fi
+}
+
+# check_data NAME SIMULATION_ARGS... simulates one data set and
+# compares the two modes of each program on it
+check_data() {
+    local name=$1
+    shift
+    local D=$DIR/$name R=$DIR/$name.ref F=$DIR/$name.fast
+    echo "[SIMULATING $name]" >&2
+    "$HERE/methpipe-sim" "$@" -f genome,reads,epireads,meth,table "$D" || {
+        echo "ERROR: methpipe-sim failed" >&2
+        exit 1
+    }
+    # a chrom with no reads, as chrY or chrM may have, which no output
+    # should have sites for: a copy of the start of the first chrom
+    awk '/^>/ {n++} n == 1 && !/^>/ && m++ < 2500' "$D.fa" \
+        | { echo ">chr1_random"; cat; } >> "$D.fa"
+
+    echo "[CHECKING $name]" >&2
+
+    # methcounts: threads and BGZF output, and the symmetric CpG and
+    # conversion outputs against symmetric-cpgs and bsrate
+    run "$R.meth" "$BIN/methcounts" -t 1 -c "$D.fa" -o "$R.meth" "$D.mr"
+    run "$F.meth.gz" "$BIN/methcounts" -t "$THREADS" -c "$D.fa" \
+        -S "$F.sym" -B "$F.bsrate" -o "$F.meth.gz" "$D.mr"
+    [ -f "$F.meth.gz" ] && gzip -dc "$F.meth.gz" > "$F.meth"
+    check "$name/methcounts" exact "$R.meth" "$F.meth"
+
+    run "$R.sym" "$BIN/symmetric-cpgs" -o "$R.sym" "$R.meth"
+    check "$name/methcounts-symmetric" exact "$R.sym" "$F.sym"
+
+    run "$R.bsrate" "$BIN/bsrate" -c "$D.fa" -o "$R.bsrate" "$D.mr"
+    check "$name/methcounts-bsrate" exact "$R.bsrate" "$F.bsrate"
+    run "$R.bsrate-all" "$BIN/bsrate" -N -A -c "$D.fa" -o "$R.bsrate-all" \
+        "$D.mr"
+    run "$F.bsrate-all" "$BIN/methcounts" -t "$THREADS" -c "$D.fa" \
+        --bsrate-all --bsrate-a-rich -B "$F.bsrate-all" -o /dev/null "$D.mr"
+    check "$name/methcounts-bsrate-all" exact "$R.bsrate-all" "$F.bsrate-all"
+
+    # count states: the reads split into two lanes, each counted
+    # alone, then added
+    awk 'NR % 3 == 0' "$D.mr" > "$D.lane1.mr"
+    awk 'NR % 3 != 0' "$D.mr" > "$D.lane2.mr"
+    run "$F.lane1.state" "$BIN/methcounts" -c "$D.fa" -R "$F.lane1.state" \
+        -o "$F.lane1.meth" "$D.lane1.mr"
+    run "$F.lane2.state" "$BIN/methcounts" -c "$D.fa" -R "$F.lane2.state" \
+        -o "$F.lane2.meth" "$D.lane2.mr"
+    run "$F.merged.meth" "$BIN/merge-count-states" -c "$D.fa" \
+        -o "$F.merged.meth" "$F.lane1.state" "$F.lane2.state"
+    check "$name/merge-count-states" exact "$R.meth" "$F.merged.meth"
+
+    # shards: methcounts on each of several parts of the genome, with
+    # reads straddling the boundaries and the chrom with no reads, then
+    # put together
+    local shard shard_files=
+    for shard in 1 2 3 4 5; do
+        run "$F.shard$shard.meth" "$BIN/methcounts" --shard "$shard/5" \
+            -c "$D.fa" -S "$F.shard$shard.sym" -B "$F.shard$shard.bsrate" \
+            -R "$F.shard$shard.state" -o "$F.shard$shard.meth" "$D.mr"
+        shard_files="$shard_files $F.shard$shard.meth"
+    done
+    run "$F.shards.meth" "$BIN/merge-shards" -o "$F.shards.meth" $shard_files
+    check "$name/methcounts-shards" exact "$R.meth" "$F.shards.meth"
+    run "$F.shards.sym" "$BIN/merge-shards" -o "$F.shards.sym" \
+        ${shard_files//.meth/.sym}
+    check "$name/methcounts-shards-symmetric" exact "$R.sym" "$F.shards.sym"
+    run "$F.shards.state.meth" "$BIN/merge-count-states" -c "$D.fa" \
+        -o "$F.shards.state.meth" ${shard_files//.meth/.state}
+    check "$name/methcounts-shards-states" exact "$R.meth" \
+        "$F.shards.state.meth"
+    # merge-bsrate writes its own format, so the reference is the
+    # bsrate output passed through it alone
+    run "$R.merged.bsrate" "$BIN/merge-bsrate" -o "$R.merged.bsrate" \
+        "$R.bsrate"
+    run "$F.shards.bsrate" "$BIN/merge-bsrate" -o "$F.shards.bsrate" \
+        ${shard_files//.meth/.bsrate}
+    check "$name/methcounts-shards-bsrate" exact "$R.merged.bsrate" \
+        "$F.shards.bsrate"
+
+    # single cells: the reads dealt to 4 cells, in a file for each and
+    # in one file with barcodes, where cell 3 keeps only its reads on
+    # the first chrom; the reference is methcounts and symmetric-cpgs
+    # on each cell, with the counts of covered CpGs, and levels on
+    # each cell for the symmetric CpG statistics
+    local cell cell_files= barcodes=$D.cells
+    local first_chrom=$(head -n 1 "$D.mr" | cut -f 1)
+    local keep_read='NR % 4 != 3 || $1 == first'
+    : > "$R.cells"
+    : > "$barcodes"
+    echo cell sites sites_covered fraction_covered mean_depth \
+         mean_depth_covered max_depth mean_meth w_mean_meth frac_meth |
+        tr ' ' '\t' > "$R.cells.levels"
+    for cell in 0 1 2 3; do
+        awk -v c=$cell -v first="$first_chrom" "NR % 4 == c && ($keep_read)" \
+            "$D.mr" > "$D.cell$cell.mr"
+        cell_files="$cell_files $D.cell$cell.mr"
+        echo "$name.cell$cell" >> "$barcodes"
+        run "$R.cell$cell.meth" "$BIN/methcounts" -c "$D.fa" \
+            -o "$R.cell$cell.meth" "$D.cell$cell.mr"
+        run "$R.cell$cell.sym" "$BIN/symmetric-cpgs" -m \
+            -o "$R.cell$cell.sym" "$R.cell$cell.meth"
+        awk -v c="$name.cell$cell" -v OFS='\t' \
+            '$6 > 0 {printf "%s\t%s\t%s\t%d\t%d\n", $1, $2, c, $5*$6 + 0.5, $6}' \
+            "$R.cell$cell.sym" >> "$R.cells"
+        run "$R.cell$cell.levels" "$BIN/levels" -o "$R.cell$cell.levels" \
+            "$R.cell$cell.meth"
+        awk -v c="$name.cell$cell" '/symmetric CpG/ {s = 1; next}
+            /^METHYLATION/ {s = 0} s && $1 != "mutations" {row = row "\t" $2}
+            END {print c row}' "$R.cell$cell.levels" >> "$R.cells.levels"
+    done
+    LC_ALL=C sort -s -k1,1 -k2,2n "$R.cells" > "$R.cells.sorted"
+    awk -v n="$name" -v first="$first_chrom" -v OFS='\t' \
+        "$keep_read"' {$4 = n ".cell" (NR % 4) ":" $4; print}' \
+        "$D.mr" > "$D.barcoded.mr"
+    run "$F.cells.gz" "$BIN/sc-methcounts" -c "$D.fa" -o "$F.cells.gz" \
+        -L "$F.cells.levels" $cell_files
+    run "$F.cells" "$BIN/sc-methcounts" -D -o "$F.cells" "$F.cells.gz"
+    check "$name/sc-methcounts" exact "$R.cells.sorted" "$F.cells"
+    check "$name/sc-methcounts-levels" exact "$R.cells.levels" \
+        "$F.cells.levels"
+    run "$F.barcoded.cells" "$BIN/sc-methcounts" -c "$D.fa" -b "$barcodes" \
+        -o "$F.barcoded.cells" "$D.barcoded.mr"
+    run "$F.barcoded.txt" "$BIN/sc-methcounts" -D -o "$F.barcoded.txt" \
+        "$F.barcoded.cells"
+    check "$name/sc-methcounts-barcodes" exact "$F.cells" "$F.barcoded.txt"
+
+    run "$R.epiread" "$BIN/methstates" -t 1 -c "$D.fa" -o "$R.epiread" "$D.mr"
+    run "$F.epiread" "$BIN/methstates" -t "$THREADS" -c "$D.fa" \
+        -o "$F.epiread" "$D.mr"
+    check "$name/methstates" exact "$R.epiread" "$F.epiread"
+
+    run "$R.dedup" "$BIN/duplicate-remover" -t 1 -S "$R.dedup-stats" \
+        -o "$R.dedup" "$D.mr"
+    run "$F.dedup" "$BIN/duplicate-remover" -t "$THREADS" \
+        -S "$F.dedup-stats" -o "$F.dedup" "$D.mr"
+    check "$name/duplicate-remover" exact "$R.dedup" "$F.dedup"
+    check "$name/duplicate-remover-stats" exact "$R.dedup-stats" \
+        "$F.dedup-stats"
+
+    # methpipe-sort -d: the reads in reverse, so ties are out of order,
+    # against GNU sort and duplicate-remover
+    tac "$D.mr" > "$D.unsorted.mr"
+    LC_ALL=C sort -s -k1,1 -k2,2n -k3,3n -k6,6 "$D.unsorted.mr" \
+        > "$R.sorted.mr"
+    run "$R.sort-dedup" "$BIN/duplicate-remover" -s -S "$R.sort-stats" \
+        -o "$R.sort-dedup" "$R.sorted.mr"
+    run "$F.sort-dedup" "$BIN/methpipe-sort" -t "$THREADS" -m 2M -d -s \
+        -S "$F.sort-stats" -o "$F.sort-dedup" "$D.unsorted.mr"
+    check "$name/methpipe-sort" exact "$R.sort-dedup" "$F.sort-dedup"
+    check "$name/methpipe-sort-stats" exact "$R.sort-stats" "$F.sort-stats"
+
+    # methpipe-run: the reads as SAM, with the chroms in reverse order
+    # of name so the output must put them back in order, against the
+    # separate programs; levels sums the sites in another order
+    LC_ALL=C sort -s -k1,1r -k2,2n "$D.mr" | awk -v OFS='\t' '
+        function rc(s,   r, i, c) {
+            r = ""
+            for (i = length(s); i > 0; i--) {
+                c = substr(s, i, 1)
+                r = r (c == "A" ? "T" : c == "C" ? "G" : \
+                       c == "G" ? "C" : c == "T" ? "A" : c)
+            }
+            return r
+        }
+        function rev(s,   r, i) {
+            r = ""
+            for (i = length(s); i > 0; i--) r = r substr(s, i, 1)
+            return r
+        }
+        NR == FNR {
+            if (/^>/) {name = substr($1, 2); order[++n] = name}
+            else len[name] += length($0)
+            next
+        }
+        !($1 in seen) {seen[$1] = 1; chroms[++m] = $1}
+        {
+            minus = ($6 == "-")
+            line[NR] = $4 OFS (minus ? 16 : 0) OFS $1 OFS $2 + 1 OFS 255 \
+                OFS length($7) "M" OFS "*" OFS 0 OFS 0 \
+                OFS (minus ? rc($7) : $7) OFS (minus ? rev($8) : $8) \
+                OFS "NM:i:" int($5)
+        }
+        END {
+            print "@HD", "VN:1.0", "SO:coordinate"
+            for (i = 1; i <= m; i++) print "@SQ", "SN:" chroms[i], "LN:" len[chroms[i]]
+            for (i = NR - FNR + 1; i <= NR; i++) print line[i]
+        }' "$D.fa" - > "$D.run.sam"
+    run "$R.run.mr" "$BIN/to-mr" -m general -o "$R.run.mr" "$D.run.sam"
+    LC_ALL=C sort -k1,1 -k2,2n -k3,3n -k6,6 "$R.run.mr" > "$R.run.sorted.mr"
+    run "$R.run.dedup" "$BIN/duplicate-remover" -S "$R.run-stats" \
+        -o "$R.run.dedup" "$R.run.sorted.mr"
+    run "$R.run.meth" "$BIN/methcounts" -c "$D.fa" -o "$R.run.meth" \
+        "$R.run.dedup"
+    run "$R.run.levels" "$BIN/levels" -o "$R.run.levels" "$R.run.meth"
+    run "$F.run.meth" "$BIN/methpipe-run" -t "$THREADS" -c "$D.fa" \
+        -m general -T "$DIR" -l "$F.run.levels" -S "$F.run-stats" \
+        -R "$F.run.dedup" -o "$F.run.meth" "$D.run.sam"
+    check "$name/methpipe-run" exact "$R.run.meth" "$F.run.meth"
+    check "$name/methpipe-run-reads" exact "$R.run.dedup" "$F.run.dedup"
+    check "$name/methpipe-run-stats" exact "$R.run-stats" "$F.run-stats"
+    check "$name/methpipe-run-levels" numeric "$R.run.levels" \
+        "$F.run.levels"
+
+    run "$R.levels" "$BIN/levels" -o "$R.levels" "$D.meth"
+    run "$F.levels" "$BIN/levels" -t "$THREADS" -o "$F.levels" "$D.meth"
+    check "$name/levels" exact "$R.levels" "$F.levels"
+
+    run "$R.hmr" "$BIN/hmr" -t 1 --post-hypo "$R.post" -o "$R.hmr" "$D.meth"
+    run "$F.hmr" "$BIN/hmr" -t "$THREADS" --post-hypo "$F.post" \
+        -o "$F.hmr" "$D.meth"
+    check "$name/hmr" overlap "$R.hmr" "$F.hmr"
+    check "$name/hmr-posteriors" numeric "$R.post" "$F.post"
+
+    run "$R.amr" "$BIN/amrfinder" -t 1 -c "$D.fa" -o "$R.amr" "$D.epiread"
+    run "$F.amr" "$BIN/amrfinder" -t "$THREADS" -c "$D.fa" \
+        -o "$F.amr" "$D.epiread"
+    check "$name/amrfinder" numeric "$R.amr" "$F.amr"
+
+    run "$R.pvals" "$BIN/radmeth" regression -t 1 -f case \
+        -o "$R.pvals" "$D.design" "$D.table"
+    run "$F.pvals" "$BIN/radmeth" regression -t "$THREADS" -f case \
+        -o "$F.pvals" "$D.design" "$D.table"
+    check "$name/radmeth-regression" numeric "$R.pvals" "$F.pvals"
+
+    run "$R.roi" "$BIN/roimethstat" -o "$R.roi" "$D.bed" "$D.meth"
+    run "$F.roi" "$BIN/roimethstat" -L -o "$F.roi" "$D.bed" "$D.meth"
+    check "$name/roimethstat" numeric "$R.roi" "$F.roi"
+
+    run "$D.meth.midx" "$BIN/methindex" "$D.meth"
+    run "$R.roi-more" "$BIN/roimethstat" -M -P -o "$R.roi-more" \
+        "$D.bed" "$D.meth"
+    run "$F.roi-index" "$BIN/roimethstat" -I -M -P -o "$F.roi-index" \
+        "$D.bed" "$D.meth"
+    check "$name/roimethstat-index" numeric "$R.roi-more" "$F.roi-index"
+}
+
+check_data small -g 500K -c 10 -s 1
+check_data real-like -g 2M -C 500K -c 6 -m 8 -b 0.98 -n 8 -s 2
+
+echo "$N_PASSED passed, $N_FAILED failed" >&2
+[ "$N_FAILED" -eq 0 ]
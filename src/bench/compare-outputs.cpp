@@ -0,0 +1,299 @@
+/*    compare-outputs: compare the output of a program in a fast mode
+ *    with its output in the reference mode
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Three ways to compare:
+ *
+ * exact: the files are the same, byte for byte.
+ *
+ * numeric: the files have the same lines and fields, and fields that
+ * are numbers differ by no more than the tolerance; other fields must
+ * be the same.
+ *
+ * overlap: the files are sets of intervals (BED), and the bases they
+ * cover must have a Jaccard index of at least the given value. This
+ * is for domains, whose ends may move when scores change slightly.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cstdlib>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::min;
+using std::max;
+using std::unordered_map;
+
+
+static bool
+compare_exact(const string &ref_file, const string &fast_file,
+              string &message) {
+  std::ifstream ref(ref_file.c_str(), std::ios::binary);
+  std::ifstream fast(fast_file.c_str(), std::ios::binary);
+  if (!ref || !fast)
+    throw SMITHLABException("cannot open: " + (ref ? fast_file : ref_file));
+  string ref_line, fast_line;
+  size_t line_number = 0;
+  for (;;) {
+    const bool got_ref = static_cast<bool>(getline(ref, ref_line));
+    const bool got_fast = static_cast<bool>(getline(fast, fast_line));
+    ++line_number;
+    if (!got_ref && !got_fast)
+      break;
+    if (got_ref != got_fast || ref_line != fast_line) {
+      message = "first difference at line " + toa(line_number) + ":\n< " +
+        (got_ref ? ref_line : "(end of file)") + "\n> " +
+        (got_fast ? fast_line : "(end of file)");
+      return false;
+    }
+  }
+  // the same lines, but one file may end without a newline
+  ref.clear();
+  fast.clear();
+  ref.seekg(0, std::ios::end);
+  fast.seekg(0, std::ios::end);
+  if (ref.tellg() != fast.tellg()) {
+    message = "sizes differ at the end of the files";
+    return false;
+  }
+  message = toa(line_number - 1) + " lines identical";
+  return true;
+}
+
+
+static bool
+parse_number(const string &s, double &x) {
+  if (s.empty()) return false;
+  char *end = 0;
+  x = strtod(s.c_str(), &end);
+  return *end == '\0';
+}
+
+
+static bool
+compare_numeric(const string &ref_file, const string &fast_file,
+                const double rel_tol, const double abs_tol,
+                string &message) {
+  std::ifstream ref(ref_file.c_str());
+  std::ifstream fast(fast_file.c_str());
+  if (!ref || !fast)
+    throw SMITHLABException("cannot open: " + (ref ? fast_file : ref_file));
+
+  string ref_line, fast_line, ref_field, fast_field;
+  size_t line_number = 0;
+  double max_diff = 0.0;
+  for (;;) {
+    const bool got_ref = static_cast<bool>(getline(ref, ref_line));
+    const bool got_fast = static_cast<bool>(getline(fast, fast_line));
+    ++line_number;
+    if (!got_ref && !got_fast)
+      break;
+    if (got_ref != got_fast) {
+      message = "different number of lines, from line " + toa(line_number);
+      return false;
+    }
+    std::istringstream ref_is(ref_line), fast_is(fast_line);
+    size_t field = 0;
+    for (;;) {
+      const bool got_ref_field = static_cast<bool>(ref_is >> ref_field);
+      const bool got_fast_field = static_cast<bool>(fast_is >> fast_field);
+      ++field;
+      if (!got_ref_field && !got_fast_field)
+        break;
+      double a = 0.0, b = 0.0;
+      bool same = (got_ref_field == got_fast_field);
+      if (same && ref_field != fast_field) {
+        same = parse_number(ref_field, a) && parse_number(fast_field, b);
+        if (same && std::isfinite(a) && std::isfinite(b)) {
+          const double diff = std::fabs(a - b);
+          max_diff = max(max_diff, diff);
+          same = diff <= abs_tol + rel_tol*max(std::fabs(a), std::fabs(b));
+        }
+        else same = same && (a == b || (std::isnan(a) && std::isnan(b)));
+      }
+      if (!same) {
+        message = "line " + toa(line_number) + ", field " + toa(field) +
+          " differs:\n< " + ref_line + "\n> " + fast_line;
+        return false;
+      }
+    }
+  }
+  message = toa(line_number - 1) + " lines within tolerance (max abs diff " +
+    toa(max_diff) + ")";
+  return true;
+}
+
+
+// the intervals of a BED file, by chrom, merged so they are disjoint
+static void
+load_intervals(const string &filename,
+               unordered_map<string, vector<pair<size_t, size_t> > > &r) {
+  std::ifstream in(filename.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open: " + filename);
+  string line, chrom;
+  size_t start = 0, end = 0;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0)
+      continue;
+    std::istringstream is(line);
+    if (!(is >> chrom >> start >> end) || end < start)
+      throw SMITHLABException("bad interval in " + filename + ":\n" + line);
+    r[chrom].push_back(std::make_pair(start, end));
+  }
+  for (auto &c : r) {
+    vector<pair<size_t, size_t> > &v = c.second;
+    sort(v.begin(), v.end());
+    size_t j = 0;
+    for (size_t i = 1; i < v.size(); ++i) {
+      if (v[i].first <= v[j].second)
+        v[j].second = max(v[j].second, v[i].second);
+      else v[++j] = v[i];
+    }
+    v.resize(v.empty() ? 0 : j + 1);
+  }
+}
+
+
+static size_t
+total_size(const vector<pair<size_t, size_t> > &v) {
+  size_t total = 0;
+  for (size_t i = 0; i < v.size(); ++i)
+    total += v[i].second - v[i].first;
+  return total;
+}
+
+
+static bool
+compare_overlap(const string &ref_file, const string &fast_file,
+                const double min_jaccard, string &message) {
+  unordered_map<string, vector<pair<size_t, size_t> > > ref, fast;
+  load_intervals(ref_file, ref);
+  load_intervals(fast_file, fast);
+
+  size_t ref_size = 0, fast_size = 0, shared = 0;
+  size_t ref_count = 0, fast_count = 0;
+  for (auto &c : ref) {
+    ref_size += total_size(c.second);
+    ref_count += c.second.size();
+  }
+  for (auto &c : fast) {
+    fast_size += total_size(c.second);
+    fast_count += c.second.size();
+    auto r = ref.find(c.first);
+    if (r == ref.end())
+      continue;
+    const vector<pair<size_t, size_t> > &a = r->second, &b = c.second;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+      const size_t lo = max(a[i].first, b[j].first);
+      const size_t hi = min(a[i].second, b[j].second);
+      if (lo < hi) shared += hi - lo;
+      if (a[i].second < b[j].second) ++i;
+      else ++j;
+    }
+  }
+  const size_t either = ref_size + fast_size - shared;
+  const double jaccard = (either == 0) ? 1.0 : double(shared)/either;
+  message = toa(ref_count) + " and " + toa(fast_count) + " intervals, " +
+    "Jaccard index of bases " + toa(jaccard);
+  return jaccard >= min_jaccard;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string mode = "exact";
+    double rel_tol = 1e-6;
+    double abs_tol = 1e-9;
+    double min_jaccard = 0.99;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "compare the output of a "
+                           "program in a fast mode with the output in "
+                           "the reference mode", "<reference> <fast>");
+    opt_parse.add_opt("mode", 'm', "exact, numeric or overlap "
+                      "(default: exact)", false, mode);
+    opt_parse.add_opt("rel", 'r', "relative tolerance for numbers",
+                      false, rel_tol);
+    opt_parse.add_opt("abs", 'a', "absolute tolerance for numbers",
+                      false, abs_tol);
+    opt_parse.add_opt("jaccard", 'j', "min Jaccard index for overlap",
+                      false, min_jaccard);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 2) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string ref_file = leftover_args.front();
+    const string fast_file = leftover_args.back();
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    string message;
+    bool same = false;
+    if (mode == "exact")
+      same = compare_exact(ref_file, fast_file, message);
+    else if (mode == "numeric")
+      same = compare_numeric(ref_file, fast_file, rel_tol, abs_tol, message);
+    else if (mode == "overlap")
+      same = compare_overlap(ref_file, fast_file, min_jaccard, message);
+    else throw SMITHLABException("unknown mode: " + mode);
+
+    cout << message << endl;
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return 2;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return 2;
+  }
+}
@@ -0,0 +1,625 @@
+/*    methpipe-sim: simulate a genome, a methylome and bisulfite
+ *    sequencing data from it, for benchmarks
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The genome is split into chroms of at most a given size, and each
+ * chrom is simulated and written before the next is started, so
+ * memory is bounded by the chrom size and the outputs can be as large
+ * as a whole genome. Every random number comes from a stream for one
+ * chrom and one purpose (layout, sequence, levels, reads, ...), so
+ * the same seed gives the same files on any system, and changing for
+ * example the coverage of reads does not change the genome.
+ *
+ * The methylome has high methylation except in HMRs, PMDs, with
+ * intermediate and variable methylation, and AMRs, where each read
+ * comes from one of a methylated and an unmethylated allele. HMRs and
+ * AMRs are CpG islands in the sequence. Some HMRs are DMRs: they
+ * are methylated in the "case" samples of the proportion table. The
+ * true regions are written as BED.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstring>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "MethpipeFiles.hpp"
+#include "RandomStream.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::min;
+using std::unique_ptr;
+
+
+// the purposes of the random streams for each chrom
+enum {LAYOUT_STREAM, SEQUENCE_STREAM, LEVEL_STREAM, READ_STREAM,
+      METH_STREAM, SAMPLE_STREAM, N_STREAMS};
+
+static RandomStream
+chrom_stream(const size_t seed, const size_t chrom_id, const size_t purpose) {
+  return RandomStream(seed, N_STREAMS*chrom_id + purpose);
+}
+
+// base composition
+static const double GENOME_GC = 0.41;
+static const double ISLAND_GC = 0.6;
+static const double CPG_DEPLETION = 0.8;        // of CpGs outside islands
+static const double ISLAND_CPG_DEPLETION = 0.3;
+
+// methylation levels, as ranges from which each CpG draws its level
+static const double BACKGROUND_LEVEL[] = {0.75, 0.95};
+static const double PMD_LEVEL[] = {0.25, 0.6};
+static const double HMR_LEVEL[] = {0.0, 0.12};
+static const double DMR_CASE_LEVEL[] = {0.6, 0.9};
+static const double AMR_ALLELE_LEVEL[] = {0.05, 0.95};
+
+// mean gaps between regions, and their sizes
+static const double PMD_GAP = 1500000, HMR_GAP = 50000, AMR_GAP = 200000;
+static const size_t PMD_SIZE[] = {100000, 600000};
+static const size_t HMR_SIZE[] = {500, 3000};
+static const size_t AMR_SIZE[] = {300, 1000};
+static const double DMR_FRACTION = 0.25; // of HMRs
+
+
+struct SimRegion {
+  SimRegion(const size_t s, const size_t e) : start(s), end(e) {}
+  size_t start;
+  size_t end;
+};
+
+
+struct ChromModel {
+  string name;
+  string seq;
+  vector<SimRegion> pmds;
+  vector<SimRegion> hmrs;
+  vector<SimRegion> amrs;
+  vector<bool> is_dmr;      // for each HMR
+  vector<size_t> cpgs;      // position of the C of each CpG
+  vector<float> level;      // methylation in the reference and controls
+  vector<float> case_level; // methylation in the case samples
+  vector<bool> allelic;     // CpGs in AMRs
+};
+
+
+static double
+uniform_in(RandomStream &rng, const double range[]) {
+  return range[0] + (range[1] - range[0])*rng.uniform();
+}
+
+static size_t
+exponential(RandomStream &rng, const double mean) {
+  return static_cast<size_t>(-mean*std::log(1.0 - rng.uniform()));
+}
+
+// the normal approximation is fine for the coverage we simulate
+static size_t
+poisson(RandomStream &rng, const double mean) {
+  if (mean > 30.0) {
+    const double u1 = 1.0 - rng.uniform(), u2 = rng.uniform();
+    const double z = std::sqrt(-2.0*std::log(u1))*std::cos(2.0*M_PI*u2);
+    return static_cast<size_t>(std::max(0.0, std::floor(mean +
+                                                         std::sqrt(mean)*z +
+                                                         0.5)));
+  }
+  const double limit = std::exp(-mean);
+  size_t k = 0;
+  for (double p = rng.uniform(); p > limit; p *= rng.uniform())
+    ++k;
+  return k;
+}
+
+static size_t
+binomial(RandomStream &rng, const size_t n, const double p) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; ++i)
+    k += (rng.uniform() < p);
+  return k;
+}
+
+
+/* true if "pos" is in one of the sorted, disjoint regions; positions
+   must be given in increasing order, with "idx" kept between calls,
+   and it is left at the region containing "pos" */
+static bool
+in_region(const vector<SimRegion> &regions, const size_t pos, size_t &idx) {
+  while (idx < regions.size() && regions[idx].end <= pos) ++idx;
+  return idx < regions.size() && regions[idx].start <= pos;
+}
+
+
+static void
+place_regions(RandomStream &rng, const size_t chrom_size,
+              const double mean_gap, const size_t size_range[],
+              vector<SimRegion> &regions) {
+  for (size_t pos = exponential(rng, mean_gap); pos < chrom_size;
+       pos += exponential(rng, mean_gap)) {
+    const size_t size = size_range[0] +
+      rng.uniform_int(size_range[1] - size_range[0] + 1);
+    regions.push_back(SimRegion(pos, min(chrom_size, pos + size)));
+    pos = regions.back().end;
+  }
+}
+
+
+static void
+simulate_layout(RandomStream &rng, const size_t chrom_size, ChromModel &c) {
+  place_regions(rng, chrom_size, PMD_GAP, PMD_SIZE, c.pmds);
+  place_regions(rng, chrom_size, HMR_GAP, HMR_SIZE, c.hmrs);
+  place_regions(rng, chrom_size, AMR_GAP, AMR_SIZE, c.amrs);
+  for (size_t i = 0; i < c.hmrs.size(); ++i)
+    c.is_dmr.push_back(rng.uniform() < DMR_FRACTION);
+}
+
+
+static void
+simulate_sequence(RandomStream &rng, const size_t chrom_size, ChromModel &c) {
+  c.seq.resize(chrom_size);
+  size_t h = 0, a = 0;
+  for (size_t i = 0; i < chrom_size; ++i) {
+    const bool island = in_region(c.hmrs, i, h) || in_region(c.amrs, i, a);
+    const double gc = island ? ISLAND_GC : GENOME_GC;
+    const double u = rng.uniform();
+    char base = (u < gc) ? ((u < 0.5*gc) ? 'C' : 'G') :
+      ((u < gc + 0.5*(1.0 - gc)) ? 'A' : 'T');
+    if (base == 'G' && i > 0 && c.seq[i - 1] == 'C' &&
+        rng.uniform() < (island ? ISLAND_CPG_DEPLETION : CPG_DEPLETION))
+      base = (rng.uniform() < 0.5) ? 'A' : 'T';
+    c.seq[i] = base;
+  }
+}
+
+
+static void
+simulate_levels(RandomStream &rng, ChromModel &c) {
+  size_t p = 0, h = 0, a = 0;
+  for (size_t i = 0; i + 1 < c.seq.length(); ++i)
+    if (c.seq[i] == 'C' && c.seq[i + 1] == 'G') {
+      const bool in_pmd = in_region(c.pmds, i, p);
+      const bool in_hmr = in_region(c.hmrs, i, h);
+      const bool in_amr = in_region(c.amrs, i, a);
+      double level = uniform_in(rng, in_hmr ? HMR_LEVEL :
+                                (in_pmd ? PMD_LEVEL : BACKGROUND_LEVEL));
+      double case_level = (in_hmr && c.is_dmr[h]) ?
+        uniform_in(rng, DMR_CASE_LEVEL) : level;
+      if (in_amr) // half the reads come from each allele
+        level = case_level = 0.5*(AMR_ALLELE_LEVEL[0] + AMR_ALLELE_LEVEL[1]);
+      c.cpgs.push_back(i);
+      c.level.push_back(level);
+      c.case_level.push_back(case_level);
+      c.allelic.push_back(in_amr);
+    }
+}
+
+
+static void
+write_fasta(std::ostream &out, const ChromModel &c) {
+  static const size_t line_width = 60;
+  out << '>' << c.name << '\n';
+  for (size_t i = 0; i < c.seq.length(); i += line_width)
+    out.write(c.seq.data() + i, min(line_width, c.seq.length() - i)) << '\n';
+}
+
+
+static void
+write_truth(RecordWriter &out, const ChromModel &c) {
+  struct Labeled {
+    size_t start;
+    size_t end;
+    const char *label;
+    bool operator<(const Labeled &other) const {
+      return start < other.start ||
+        (start == other.start && end < other.end);
+    }
+  };
+  vector<Labeled> regions;
+  for (size_t i = 0; i < c.pmds.size(); ++i)
+    regions.push_back(Labeled{c.pmds[i].start, c.pmds[i].end, "PMD"});
+  for (size_t i = 0; i < c.hmrs.size(); ++i)
+    regions.push_back(Labeled{c.hmrs[i].start, c.hmrs[i].end,
+          c.is_dmr[i] ? "DMR" : "HMR"});
+  for (size_t i = 0; i < c.amrs.size(); ++i)
+    regions.push_back(Labeled{c.amrs[i].start, c.amrs[i].end, "AMR"});
+  std::stable_sort(regions.begin(), regions.end());
+  for (size_t i = 0; i < regions.size(); ++i)
+    out.put(c.name).put('\t').put_uint(regions[i].start).put('\t')
+      .put_uint(regions[i].end).put('\t')
+      .put(regions[i].label, std::strlen(regions[i].label))
+      .put("\t0\t+\n", 5);
+}
+
+
+/* reads start at exponential gaps, so they are sorted; reads
+   at the same position are kept in strand order, as duplicate-remover
+   requires, by putting any after a - strand read on the - strand. A C is
+   kept if it is a methylated CpG, and otherwise converted to T at the
+   conversion rate; for reads on the - strand this is done to the Gs
+   before the reverse complement. A read from an AMR takes all its
+   states from one allele. The epiread for a read has the CpGs with
+   their C (or G for the - strand) in the read, as methstates gives. */
+static size_t
+simulate_reads(RandomStream &rng, const size_t read_len,
+               const double coverage, const double conversion,
+               const ChromModel &c, size_t &read_id,
+               RecordWriter *reads_out, RecordWriter *epireads_out) {
+  const string &g = c.seq;
+  const size_t chrom_size = g.length();
+  const double mean_gap = read_len/coverage;
+  string seq, qual, states;
+  size_t n_reads = 0;
+  size_t first_cpg = 0;
+  size_t prev_start = chrom_size;
+  bool prev_pos_strand = true;
+  for (size_t start = exponential(rng, mean_gap); start < chrom_size;
+       start += exponential(rng, mean_gap)) {
+    const size_t end = min(chrom_size, start + read_len);
+    const bool pos_strand = (rng() & 1u) &&
+      (start != prev_start || prev_pos_strand);
+    prev_start = start;
+    prev_pos_strand = pos_strand;
+    const double allele_level = AMR_ALLELE_LEVEL[rng() & 1u];
+
+    while (first_cpg < c.cpgs.size() && c.cpgs[first_cpg] + 1 < start)
+      ++first_cpg;
+    size_t k = first_cpg;
+    size_t epiread_cpg = c.cpgs.size();
+
+    seq.assign(g, start, end - start);
+    states.clear();
+    for (size_t i = start; i < end; ++i) {
+      const char target = pos_strand ? 'C' : 'G';
+      if (g[i] != target) continue;
+      // the CpG, if any, that this C (or G for the - strand) is in
+      if (!pos_strand && i == 0) continue;
+      const size_t cpg_pos = pos_strand ? i : i - 1;
+      while (k < c.cpgs.size() && c.cpgs[k] < cpg_pos) ++k;
+      const bool is_cpg = k < c.cpgs.size() && c.cpgs[k] == cpg_pos;
+      const bool is_meth = is_cpg && rng.uniform() <
+        (c.allelic[k] ? allele_level : c.level[k]);
+      const bool converted = !is_meth && rng.uniform() < conversion;
+      if (converted)
+        seq[i - start] = pos_strand ? 'T' : 'A';
+      if (is_cpg) {
+        if (states.empty()) epiread_cpg = k;
+        states += converted ? 'T' : 'C';
+      }
+    }
+    if (!pos_strand)
+      revcomp_inplace(seq);
+
+    if (reads_out) {
+      qual.assign(seq.length(), 'B');
+      reads_out->put(c.name).put('\t').put_uint(start).put('\t')
+        .put_uint(end).put("\tsim", 4).put_uint(read_id).put("\t0\t", 3)
+        .put(pos_strand ? '+' : '-').put('\t').put(seq).put('\t')
+        .put(qual).put('\n');
+    }
+    if (epireads_out && !states.empty())
+      epireads_out->put(c.name).put('\t').put_uint(epiread_cpg).put('\t')
+        .put(states).put('\n');
+    ++read_id;
+    ++n_reads;
+  }
+  return n_reads;
+}
+
+
+// counts at each CpG, as "methcounts -n -S" would give
+static void
+simulate_meth(RandomStream &rng, const double coverage, const ChromModel &c,
+              RecordWriter &out) {
+  static const string strand("+"), context("CpG");
+  for (size_t i = 0; i < c.cpgs.size(); ++i) {
+    const size_t n_reads = poisson(rng, coverage);
+    const size_t n_meth = binomial(rng, n_reads, c.level[i]);
+    methpipe::write_site(out, c.name, c.cpgs[i], strand, context,
+                         n_reads > 0 ? double(n_meth)/n_reads : 0.0, n_reads);
+  }
+}
+
+
+/* the proportion table for radmeth, with counts simulated for each
+   sample; the same counts are written as methcounts files for the
+   samples if "sample_out" is not empty */
+static void
+simulate_samples(RandomStream &rng, const double coverage,
+                 const size_t n_samples, const ChromModel &c,
+                 RecordWriter *table_out,
+                 vector<unique_ptr<RecordWriter> > &sample_out) {
+  static const string strand("+"), context("CpG");
+  vector<size_t> n_reads(n_samples), n_meth(n_samples);
+  for (size_t i = 0; i < c.cpgs.size(); ++i) {
+    for (size_t j = 0; j < n_samples; ++j) {
+      const bool is_case = (2*j >= n_samples);
+      n_reads[j] = poisson(rng, coverage);
+      n_meth[j] = binomial(rng, n_reads[j],
+                           is_case ? c.case_level[i] : c.level[i]);
+    }
+    if (table_out) {
+      table_out->put(c.name).put(':').put_uint(c.cpgs[i]).put(":+:CpG", 6);
+      for (size_t j = 0; j < n_samples; ++j)
+        table_out->put('\t').put_uint(n_reads[j]).put('\t')
+          .put_uint(n_meth[j]);
+      table_out->put('\n');
+    }
+    for (size_t j = 0; j < sample_out.size(); ++j)
+      methpipe::write_site(*sample_out[j], c.name, c.cpgs[i], strand, context,
+                           n_reads[j] > 0 ?
+                           double(n_meth[j])/n_reads[j] : 0.0, n_reads[j]);
+  }
+}
+
+
+// sizes like "1M" or "3.1G", with decimal suffixes
+static size_t
+parse_size(const string &s) {
+  char *end = 0;
+  double x = strtod(s.c_str(), &end);
+  const string suffix(end);
+  if (suffix == "K" || suffix == "k") x *= 1e3;
+  else if (suffix == "M" || suffix == "m") x *= 1e6;
+  else if (suffix == "G" || suffix == "g") x *= 1e9;
+  else if (!suffix.empty() || end == s.c_str())
+    throw SMITHLABException("bad size: " + s);
+  if (!(x >= 1.0))
+    throw SMITHLABException("bad size: " + s);
+  return static_cast<size_t>(x);
+}
+
+
+static std::ofstream *
+open_output(const string &filename) {
+  std::ofstream *out = new std::ofstream(filename.c_str());
+  if (!(*out))
+    throw SMITHLABException("bad output file: " + filename);
+  return out;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+
+    string genome_size_arg = "1M";
+    string chrom_size_arg = "50M";
+    size_t read_len = 100;
+    double read_coverage = 10.0;
+    double meth_coverage = 10.0;
+    double conversion = 0.99;
+    size_t n_samples = 6;
+    size_t seed = 408;
+    string files_arg = "genome,reads,epireads,meth,table";
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "simulate a genome, "
+                           "a methylome and bisulfite sequencing data "
+                           "for benchmarks", "<output-prefix>");
+    opt_parse.add_opt("size", 'g', "genome size, e.g. 1M or 3G "
+                      "(default: 1M)", false, genome_size_arg);
+    opt_parse.add_opt("chrom-size", 'C', "max chrom size (default: 50M)",
+                      false, chrom_size_arg);
+    opt_parse.add_opt("length", 'l', "read length", false, read_len);
+    opt_parse.add_opt("coverage", 'c', "coverage of reads", false,
+                      read_coverage);
+    opt_parse.add_opt("meth-coverage", 'm', "mean reads per CpG in "
+                      "methcounts files and tables", false, meth_coverage);
+    opt_parse.add_opt("conversion", 'b', "bisulfite conversion rate",
+                      false, conversion);
+    opt_parse.add_opt("samples", 'n', "samples in the proportion table, "
+                      "half of them cases", false, n_samples);
+    opt_parse.add_opt("files", 'f', "comma-separated files to write, from "
+                      "genome, reads, epireads, meth, table and samples "
+                      "(default: all but samples)", false, files_arg);
+    opt_parse.add_opt("seed", 's', "random seed", false, seed);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string prefix = leftover_args.front();
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    const size_t genome_size = parse_size(genome_size_arg);
+    const size_t max_chrom_size = parse_size(chrom_size_arg);
+    if (read_len == 0 || !(read_coverage > 0.0) || !(meth_coverage > 0.0) ||
+        conversion < 0.0 || conversion > 1.0 || n_samples < 2)
+      throw SMITHLABException("bad read length, coverage, conversion rate "
+                              "or number of samples");
+
+    bool write_genome = false, write_reads = false, write_epireads = false,
+      write_meth = false, write_table = false, write_samples = false;
+    const vector<string> files(smithlab::split(files_arg, ","));
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (files[i] == "genome") write_genome = true;
+      else if (files[i] == "reads") write_reads = true;
+      else if (files[i] == "epireads") write_epireads = true;
+      else if (files[i] == "meth") write_meth = true;
+      else if (files[i] == "table") write_table = true;
+      else if (files[i] == "samples") write_samples = true;
+      else throw SMITHLABException("unknown file type: " + files[i]);
+    }
+
+    // the same test for a case as in simulate_samples
+    const size_t n_controls = (n_samples + 1)/2;
+    vector<string> sample_names;
+    for (size_t i = 0; i < n_samples; ++i)
+      sample_names.push_back(i >= n_controls ?
+                             "case_" + toa(i + 1 - n_controls) :
+                             "control_" + toa(i + 1));
+
+    // the design is small, and written before the data
+    if (write_table) {
+      std::ofstream design(prefix + ".design");
+      if (!design)
+        throw SMITHLABException("bad output file: " + prefix + ".design");
+      design << "base\tcase" << '\n';
+      for (size_t i = 0; i < n_samples; ++i)
+        design << sample_names[i] << "\t1\t" << (i >= n_controls) << '\n';
+    }
+
+    unique_ptr<std::ofstream> genome_file, reads_file, epireads_file,
+      meth_file, table_file;
+    unique_ptr<RecordWriter> reads_out, epireads_out, meth_out, table_out;
+    vector<unique_ptr<std::ofstream> > sample_files;
+    vector<unique_ptr<RecordWriter> > sample_out;
+    if (write_genome)
+      genome_file.reset(open_output(prefix + ".fa"));
+    if (write_reads) {
+      reads_file.reset(open_output(prefix + ".mr"));
+      reads_out.reset(new RecordWriter(*reads_file));
+    }
+    if (write_epireads) {
+      epireads_file.reset(open_output(prefix + ".epiread"));
+      epireads_out.reset(new RecordWriter(*epireads_file));
+    }
+    if (write_meth) {
+      meth_file.reset(open_output(prefix + ".meth"));
+      meth_out.reset(new RecordWriter(*meth_file));
+    }
+    if (write_table) {
+      table_file.reset(open_output(prefix + ".table"));
+      table_out.reset(new RecordWriter(*table_file));
+      for (size_t i = 0; i < n_samples; ++i)
+        table_out->put(sample_names[i]).put(i + 1 < n_samples ? '\t' : '\n');
+    }
+    if (write_samples)
+      for (size_t i = 0; i < n_samples; ++i) {
+        sample_files.push_back(unique_ptr<std::ofstream>(
+          open_output(prefix + "_" + sample_names[i] + ".meth")));
+        sample_out.push_back(unique_ptr<RecordWriter>(
+          new RecordWriter(*sample_files.back())));
+      }
+    std::ofstream truth_file(prefix + ".bed");
+    if (!truth_file)
+      throw SMITHLABException("bad output file: " + prefix + ".bed");
+    RecordWriter truth_out(truth_file);
+
+    // names sort in the same order as the chroms are written
+    const size_t n_chroms = (genome_size + max_chrom_size - 1)/max_chrom_size;
+    const size_t name_width = toa(n_chroms).length();
+
+    size_t read_id = 0, total_reads = 0, total_cpgs = 0;
+    for (size_t chrom_id = 0; chrom_id < n_chroms; ++chrom_id) {
+      const size_t chrom_size =
+        min(max_chrom_size, genome_size - chrom_id*max_chrom_size);
+      ChromModel c;
+      c.name = toa(chrom_id + 1);
+      c.name = "chr" + string(name_width - c.name.length(), '0') + c.name;
+      if (VERBOSE)
+        cerr << "[SIMULATING: " << c.name << " (" << chrom_size << "bp)]"
+             << endl;
+
+      RandomStream layout_rng(chrom_stream(seed, chrom_id, LAYOUT_STREAM));
+      simulate_layout(layout_rng, chrom_size, c);
+      RandomStream sequence_rng(chrom_stream(seed, chrom_id, SEQUENCE_STREAM));
+      simulate_sequence(sequence_rng, chrom_size, c);
+      RandomStream level_rng(chrom_stream(seed, chrom_id, LEVEL_STREAM));
+      simulate_levels(level_rng, c);
+      total_cpgs += c.cpgs.size();
+
+      write_truth(truth_out, c);
+      if (genome_file)
+        write_fasta(*genome_file, c);
+      if (reads_out || epireads_out) {
+        RandomStream read_rng(chrom_stream(seed, chrom_id, READ_STREAM));
+        total_reads += simulate_reads(read_rng, read_len, read_coverage,
+                                      conversion, c, read_id, reads_out.get(),
+                                      epireads_out.get());
+      }
+      if (meth_out) {
+        RandomStream meth_rng(chrom_stream(seed, chrom_id, METH_STREAM));
+        simulate_meth(meth_rng, meth_coverage, c, *meth_out);
+      }
+      if (table_out || !sample_out.empty()) {
+        RandomStream sample_rng(chrom_stream(seed, chrom_id, SAMPLE_STREAM));
+        simulate_samples(sample_rng, meth_coverage, n_samples, c,
+                         table_out.get(), sample_out);
+      }
+    }
+    Metrics::count("chroms", n_chroms);
+    Metrics::count("cpgs", total_cpgs);
+    Metrics::count("reads", total_reads);
+    if (VERBOSE)
+      cerr << "[CPGS: " << total_cpgs << "]" << endl
+           << "[READS: " << total_reads << "]" << endl;
+
+    // flush the buffers before checking the files
+    truth_out.flush();
+    if (reads_out) reads_out->flush();
+    if (epireads_out) epireads_out->flush();
+    if (meth_out) meth_out->flush();
+    if (table_out) table_out->flush();
+    for (size_t i = 0; i < sample_out.size(); ++i)
+      sample_out[i]->flush();
+    if (!truth_file || (genome_file && !(*genome_file)) ||
+        (reads_file && !(*reads_file)) ||
+        (epireads_file && !(*epireads_file)) ||
+        (meth_file && !(*meth_file)) || (table_file && !(*table_file)))
+      throw SMITHLABException("error writing output with prefix: " + prefix);
+    for (size_t i = 0; i < sample_files.size(); ++i)
+      if (!(*sample_files[i]))
+        throw SMITHLABException("error writing output with prefix: " +
+                                prefix);
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
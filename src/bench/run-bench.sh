@@ -0,0 +1,137 @@
+#!/bin/bash
+#
+#  run-bench.sh: simulate data with methpipe-sim, time the methpipe
+#  programs on it and run the micro-benchmarks
+#
+#  Copyright (C) 2026 The methpipe contributors
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+#  Each program is run with --metrics, and its JSON report is kept in
+#  the output directory next to the data. The summary, in
+#  results.tsv, has one line for each program: the size of its input,
+#  wall and CPU time, throughput and peak memory. The micro-benchmark
+#  results are in kernels.tsv.
+
+set -e
+
+usage() {
+    cat >&2 <<EOF
+Usage: $(basename "$0") [options]
+  -b DIR    directory with the methpipe programs (default: ../../bin)
+  -g SIZE   size of the simulated genome, e.g. 1M or 3G (default: 1M)
+  -c COV    coverage of simulated reads (default: 10)
+  -t N      threads for the programs that take them (default: 1)
+  -d DIR    directory for data and results (default: bench-out)
+  -s SECS   min seconds for each micro-benchmark (default: 1)
+EOF
+    exit 1
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BIN=$HERE/../../bin
+SIZE=1M
+COVERAGE=10
+THREADS=1
+DIR=bench-out
+MICRO_SECONDS=1
+
+while getopts "b:g:c:t:d:s:h" opt; do
+    case $opt in
+        b) BIN=$OPTARG ;;
+        g) SIZE=$OPTARG ;;
+        c) COVERAGE=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        d) DIR=$OPTARG ;;
+        s) MICRO_SECONDS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+for prog in methcounts hmr pmd amrfinder radmeth merge-methcounts roimethstat; do
+    if [ ! -x "$BIN/$prog" ]; then
+        echo "ERROR: $BIN/$prog not found; install methpipe first" >&2
+        exit 1
+    fi
+done
+
+mkdir -p "$DIR"
+D=$DIR/sim
+RESULTS=$DIR/results.tsv
+
+echo "[SIMULATING $SIZE GENOME IN $DIR]" >&2
+"$HERE/methpipe-sim" -g "$SIZE" -c "$COVERAGE" \
+    -f genome,reads,epireads,meth,table,samples \
+    --metrics "$DIR/methpipe-sim.json" "$D"
+
+printf "program\tinput_bytes\tinput_lines\twall_seconds\tcpu_seconds\t" \
+       > "$RESULTS"
+printf "mb_per_second\tlines_per_second\tpeak_rss_mb\n" >> "$RESULTS"
+
+# run_timed NAME "INPUT FILES" N_WORDS COMMAND...  runs the
+# command with --metrics after its first N_WORDS words (2 for radmeth
+# subcommands) and adds its line to the results
+run_timed() {
+    local name=$1 inputs=$2 n_words=$3
+    shift 3
+    local json=$DIR/$name.json
+    echo "[RUNNING $name]" >&2
+    "${@:1:$n_words}" --metrics "$json" "${@:$((n_words + 1))}"
+    local bytes lines times peak
+    bytes=$(cat $inputs | wc -c)
+    lines=$(cat $inputs | wc -l)
+    times=$(sed -n 's/.*"name": "total", "calls": [0-9]*, "wall_seconds": \([^,]*\), "cpu_seconds": \([^}]*\)}.*/\1 \2/p' "$json")
+    peak=$(sed -n 's/.*"peak_rss_bytes": \([0-9]*\).*/\1/p' "$json")
+    echo "$name $bytes $lines $times $peak" | awk -v OFS='\t' '{
+        wall = ($4 > 0) ? $4 : 1e-9;
+        print $1, $2, $3, $4, $5, $2/wall/1e6, $3/wall, $6/1e6
+    }' >> "$RESULTS"
+}
+
+run_timed methcounts "$D.mr" 1 \
+    "$BIN/methcounts" -t "$THREADS" -c "$D.fa" -o "$DIR/methcounts.meth" "$D.mr"
+
+run_timed hmr "$D.meth" 1 \
+    "$BIN/hmr" -t "$THREADS" -o "$DIR/hmr.bed" "$D.meth"
+
+run_timed pmd "$D.meth" 1 \
+    "$BIN/pmd" -o "$DIR/pmd.bed" "$D.meth"
+
+run_timed amrfinder "$D.epiread" 1 \
+    "$BIN/amrfinder" -t "$THREADS" -c "$D.fa" -o "$DIR/amr.bed" "$D.epiread"
+
+run_timed radmeth-regression "$D.table" 2 \
+    "$BIN/radmeth" regression -t "$THREADS" -f case -o "$DIR/radmeth.pvals" \
+    "$D.design" "$D.table"
+
+run_timed radmeth-adjust "$DIR/radmeth.pvals" 2 \
+    "$BIN/radmeth" adjust -o "$DIR/radmeth.adjusted" "$DIR/radmeth.pvals"
+
+run_timed radmeth-merge "$DIR/radmeth.adjusted" 2 \
+    "$BIN/radmeth" merge -o "$DIR/radmeth.dmrs" "$DIR/radmeth.adjusted"
+
+SAMPLES=$(ls "$D"_*.meth)
+run_timed merge-methcounts "$SAMPLES" 1 \
+    "$BIN/merge-methcounts" -o "$DIR/merged.meth" $SAMPLES
+
+run_timed roimethstat "$D.bed $D.meth" 1 \
+    "$BIN/roimethstat" -o "$DIR/roimethstat.bed" "$D.bed" "$D.meth"
+
+echo "[MICRO-BENCHMARKS]" >&2
+"$HERE/bench-kernels" -T "$MICRO_SECONDS" > "$DIR/kernels.tsv"
+"$HERE/bench-hmm" -T "$MICRO_SECONDS" | tail -n +2 >> "$DIR/kernels.tsv"
+
+cat "$RESULTS"
+echo
+cat "$DIR/kernels.tsv"
@@ -74,6 +74,14 @@ ThreeStateHDHMM::ThreeStateHDHMM(
     tolerance(tol), max_iterations(max_itr),
     VERBOSE(v), MAX_LEN(_MAX_LEN)
 {
+    // segments are never longer than the longest block of observations
+    size_t max_block = 0;
+    for (size_t i = 1; i < reset_points.size(); ++i)
+        max_block = max(max_block, reset_points[i] - reset_points[i - 1]);
+    gain_duration_ll.resize(max(min(MAX_LEN, max_block),
+                                static_cast<size_t>(1)) + 1);
+    loss_duration_ll.resize(gain_duration_ll.size());
+
     for (size_t i = 0; i < observations.size(); ++i)
     {
         meth_lp[i] = 
@@ -109,6 +117,7 @@ ThreeStateHDHMM::set_parameters(
     gain_duration = _gain_duration;
     same_duration = _same_duration;
     loss_duration = _loss_duration;
+    update_duration_likelihood();
 
     // initialize transition matrix 
     trans  = _trans;
@@ -149,29 +158,39 @@ ThreeStateHDHMM::update_observation_likelihood()
     assert(observations.size() == gain_log_likelihood.size());
     assert(observations.size() == same_log_likelihood.size());
     assert(observations.size() == loss_log_likelihood.size());
-    
-    gain_log_likelihood.front() =
-        gain_emission.log_likelihood(observations.front());
-    same_log_likelihood.front() =
-        same_emission.log_likelihood(observations.front());
-    loss_log_likelihood.front() =
-        loss_emission.log_likelihood(observations.front());
-    
+
+    // one call per state for all the observations, then the
+    // cumulative sums, which are the same as adding one at a time
+    gain_emission.batch_log_likelihood(observations, gain_log_likelihood);
+    same_emission.batch_log_likelihood(observations, same_log_likelihood);
+    loss_emission.batch_log_likelihood(observations, loss_log_likelihood);
+    std::partial_sum(gain_log_likelihood.begin(), gain_log_likelihood.end(),
+                     gain_log_likelihood.begin());
+    std::partial_sum(same_log_likelihood.begin(), same_log_likelihood.end(),
+                     same_log_likelihood.begin());
+    std::partial_sum(loss_log_likelihood.begin(), loss_log_likelihood.end(),
+                     loss_log_likelihood.begin());
+
     for (size_t i = 1; i < observations.size(); ++i)
     {
-        gain_log_likelihood[i] = gain_log_likelihood[i - 1]
-            + gain_emission.log_likelihood(observations[i]);
-        same_log_likelihood[i] = same_log_likelihood[i - 1]
-            + same_emission.log_likelihood(observations[i]);
-        loss_log_likelihood[i] = loss_log_likelihood[i - 1]
-            + loss_emission.log_likelihood(observations[i]);
-
         assert(isfinite(gain_log_likelihood[i]));
         assert(isfinite(same_log_likelihood[i]));
         assert(isfinite(loss_log_likelihood[i]));
     }
 }
 
+void
+ThreeStateHDHMM::update_duration_likelihood()
+{
+    // the forward and backward algorithms need the duration of every
+    // segment length at every position, so they are found once here
+    vector<double> lengths(gain_duration_ll.size());
+    for (size_t l = 0; l < lengths.size(); ++l)
+        lengths[l] = l;
+    gain_duration.batch_log_likelihood(lengths, gain_duration_ll);
+    loss_duration.batch_log_likelihood(lengths, loss_duration_ll);
+}
+
 double
 ThreeStateHDHMM::gain_segment_log_likelihood(
     const size_t start, const size_t end)
@@ -208,6 +227,11 @@ ThreeStateHDHMM::forward_algorithm(const size_t start, const size_t end)
 #ifdef DEBUG
     cerr << "check enter forward_algorithm: "<< "OK" << endl;
 #endif
+    const double log_gain_same = log(trans[GAIN][SAME]);
+    const double log_loss_same = log(trans[LOSS][SAME]);
+    const double log_same_gain = log(trans[SAME][GAIN]);
+    const double log_same_loss = log(trans[SAME][LOSS]);
+    const double log_same_same = log(trans[SAME][SAME]);
     assert(start < end);
     
     for (size_t i = start; i < end; ++i)
@@ -215,12 +239,12 @@ ThreeStateHDHMM::forward_algorithm(const size_t start, const size_t end)
 
     forward[start].gain =
         lp_start.gain + gain_segment_log_likelihood(start, start + 1)
-        + gain_duration.log_likelihood(1);
+        + gain_duration_ll[1];
     forward[start].same =
         lp_start.same + same_segment_log_likelihood(start, start + 1);
     forward[start].loss =
         lp_start.loss + loss_segment_log_likelihood(start, start + 1)
-        + loss_duration.log_likelihood(1);
+        + loss_duration_ll[1];
 
     for (size_t i = start + 1; i < end; ++i)
     {
@@ -235,20 +259,20 @@ ThreeStateHDHMM::forward_algorithm(const size_t start, const size_t end)
             const double gain_seg_llh =  (beginning == start) ?
                 lp_start.gain  
                 + gain_segment_log_likelihood(beginning, ending)
-                + gain_duration.log_likelihood(l)
+                + gain_duration_ll[l]
                 :
-                forward[beginning - 1].same + log(trans[SAME][GAIN])
+                forward[beginning - 1].same + log_same_gain
                 + gain_segment_log_likelihood(beginning, ending)
-                + gain_duration.log_likelihood(l);
+                + gain_duration_ll[l];
             
             forward[i].gain = log_sum_log(forward[i].gain, gain_seg_llh);
         }
 
         // in non-change segment 
         forward[i].same =
-            log_sum_log(forward[i-1].gain + log(trans[GAIN][SAME]),
-                        forward[i-1].loss + log(trans[LOSS][SAME]),
-                        forward[i-1].same + log(trans[SAME][SAME]))
+            log_sum_log(forward[i-1].gain + log_gain_same,
+                        forward[i-1].loss + log_loss_same,
+                        forward[i-1].same + log_same_same)
             + same_segment_log_likelihood(i, i + 1);
         
         // in segment losing methylation
@@ -261,11 +285,11 @@ ThreeStateHDHMM::forward_algorithm(const size_t start, const size_t end)
             const double loss_seg_llh =  (beginning == start) ?
                 lp_start.loss  
                 + loss_segment_log_likelihood(beginning, ending)
-                + loss_duration.log_likelihood(l)
+                + loss_duration_ll[l]
                 :
-                forward[beginning - 1].same + log(trans[SAME][LOSS])
+                forward[beginning - 1].same + log_same_loss
                 + loss_segment_log_likelihood(beginning, ending)
-                + loss_duration.log_likelihood(l);
+                + loss_duration_ll[l];
             
             forward[i].loss = log_sum_log(forward[i].loss, loss_seg_llh);
         }
@@ -290,6 +314,11 @@ ThreeStateHDHMM::backward_algorithm(const size_t start, const size_t end)
 #ifdef DEBUG
     cerr << "check enter backward_algorithm: "<< "OK" << endl;
 #endif
+    const double log_gain_same = log(trans[GAIN][SAME]);
+    const double log_loss_same = log(trans[LOSS][SAME]);
+    const double log_same_gain = log(trans[SAME][GAIN]);
+    const double log_same_loss = log(trans[SAME][LOSS]);
+    const double log_same_same = log(trans[SAME][SAME]);
     const int start_int(start), end_int(end);
     
     for (int i = start_int; i < end_int; ++i)
@@ -305,19 +334,19 @@ ThreeStateHDHMM::backward_algorithm(const size_t start, const size_t end)
         assert(i >= start_int && i < end_int);
         // Terminate a segment gaining methylation
         backward[i].gain =
-            log(trans[GAIN][SAME])
+            log_gain_same
             + same_segment_log_likelihood(i + 1, i + 2)
             + backward[i + 1].same;
 
         // Terminate a segment losing methylation
         backward[i].loss =
-            log(trans[LOSS][SAME])
+            log_loss_same
             + same_segment_log_likelihood(i + 1, i + 2)
             + backward[i + 1].same;
 
         // Remain at a no-change segment
         backward[i].same =
-            log(trans[SAME][SAME])
+            log_same_same
             + same_segment_log_likelihood(i + 1, i + 2)
             + backward[i + 1].same;
 
@@ -330,14 +359,14 @@ ThreeStateHDHMM::backward_algorithm(const size_t start, const size_t end)
 
             const double next_seg_llh = 
                 log_sum_log(
-                    log(trans[SAME][GAIN])  // transite to GAINing segments
+                    log_same_gain  // transite to GAINing segments
                     + gain_segment_log_likelihood(beginning, ending)
-                    + gain_duration.log_likelihood(l)
+                    + gain_duration_ll[l]
                     + backward[ending - 1].gain,
  
-                    log(trans[SAME][LOSS]) // transite to LOSSing segments 
+                    log_same_loss // transite to LOSSing segments 
                     + loss_segment_log_likelihood(beginning, ending)
-                    + loss_duration.log_likelihood(l)
+                    + loss_duration_ll[l]
                     + backward[ending - 1].loss);
             backward[i].same = log_sum_log(backward[i].same, next_seg_llh);
         }
@@ -369,7 +398,7 @@ ThreeStateHDHMM::backward_algorithm(const size_t start, const size_t end)
         const double gain_seg_llh =
             lp_start.gain  
             + gain_segment_log_likelihood(beginning, ending)
-            + gain_duration.log_likelihood(l)
+            + gain_duration_ll[l]
             + backward[ending - 1].gain;
         llh = log_sum_log(llh, gain_seg_llh);
 
@@ -377,7 +406,7 @@ ThreeStateHDHMM::backward_algorithm(const size_t start, const size_t end)
         const double loss_seg_llh =
             lp_start.loss  
             + loss_segment_log_likelihood(beginning, ending)
-            + loss_duration.log_likelihood(l)
+            + loss_duration_ll[l]
             + backward[ending - 1].loss;
         llh = log_sum_log(llh, loss_seg_llh);
     }
@@ -399,6 +428,8 @@ ThreeStateHDHMM::estimate_state_posterior(const size_t start, const size_t end)
 #ifdef DEBUG
     cerr << "check enter estimate_state_posterior: "<< "OK" << endl;
 #endif
+    const double log_same_gain = log(trans[SAME][GAIN]);
+    const double log_same_loss = log(trans[SAME][LOSS]);
 
     vector<double> gain_evidence(end - start, 0), same_evidence(end - start, 0),
         loss_evidence(end - start, 0);
@@ -412,12 +443,12 @@ ThreeStateHDHMM::estimate_state_posterior(const size_t start, const size_t end)
         {
             const double evidence = (s == start) ?
                 lp_start.gain
-                + gain_duration.log_likelihood(e - s)
+                + gain_duration_ll[e - s]
                 + gain_segment_log_likelihood(s, e)
                 + backward[e - 1].gain
                 :
-                forward[s - 1].same + log(trans[SAME][GAIN]) 
-                + gain_duration.log_likelihood(e - s)
+                forward[s - 1].same + log_same_gain 
+                + gain_duration_ll[e - s]
                 + gain_segment_log_likelihood(s, e)
                 + backward[e - 1].gain;
             
@@ -444,12 +475,12 @@ ThreeStateHDHMM::estimate_state_posterior(const size_t start, const size_t end)
         {
             const double evidence = (s == start) ?
                 lp_start.loss
-                + loss_duration.log_likelihood(e - s)
+                + loss_duration_ll[e - s]
                 + loss_segment_log_likelihood(s, e)
                 + backward[e - 1].loss
                 :
-                forward[s - 1].same + log(trans[SAME][LOSS]) 
-                + loss_duration.log_likelihood(e - s)
+                forward[s - 1].same + log_same_loss 
+                + loss_duration_ll[e - s]
                 + loss_segment_log_likelihood(s, e)
                 + backward[e - 1].loss;
             
@@ -535,6 +566,8 @@ ThreeStateHDHMM::estimate_parameters()
     if (loss_lengths.size() > 0)
         loss_duration.estimate_params_ml(loss_lengths);
 
+    update_duration_likelihood();
+
 
     // estiamting transition probabilities
     trans[SAME][SAME] = 1 - same_duration.get_params().front();
@@ -668,6 +701,7 @@ ThreeStateHDHMM::BaumWelchTraining()
             gain_duration = old_gain_duration;
             same_duration = old_same_duration;
             loss_duration = old_loss_duration;
+            update_duration_likelihood();
 
             if (VERBOSE)
                 cerr << "CONVERGED" << endl << endl;
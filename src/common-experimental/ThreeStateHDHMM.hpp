@@ -95,11 +95,15 @@ private:
 
     void update_observation_likelihood();
 
+    void update_duration_likelihood();
+
     ////////   data   ////////
     std::vector<double> observations;
     std::vector<size_t> reset_points;
     std::vector<double> meth_lp, unmeth_lp;
     std::vector<double> gain_log_likelihood, same_log_likelihood, loss_log_likelihood;
+    // log likelihood of each segment length for the durations
+    std::vector<double> gain_duration_ll, loss_duration_ll;
 
     //  HMM internal data 
     Distro gain_emission, same_emission, loss_emission;
@@ -24,6 +24,7 @@
 #include <cmath>
 #include <gsl/gsl_cdf.h>
 #include <vector>
+#include <algorithm>
 
 #include "nonparametric-test.hpp"
 #include "numerical_utils.hpp"
@@ -88,42 +89,46 @@ NonParametricTest::wilcoxon_test(const std::vector<double> &x,
                                  const bool alternative)
 {
     assert(x.size() == y.size());
+    WilcoxonWorkspace ws;
+    return x.empty() ? 1.0 :
+        wilcoxon_test(&x.front(), &y.front(), x.size(), ws, alternative);
+}
 
-    vector<double> diffs;
-    for (size_t i = 0; i < x.size(); ++i)
+double 
+NonParametricTest::wilcoxon_test(const double *x, const double *y,
+                                 const size_t n, WilcoxonWorkspace &ws,
+                                 const bool alternative)
+{
+    vector<double> &diffs = ws.diffs;
+    diffs.clear();
+    for (size_t i = 0; i < n; ++i)
     {
         const double diff = x[i] - y[i];
         if (fabs(diff) > episilon) diffs.push_back(diff);
     }
 
     std::sort(diffs.begin(), diffs.end(), cmp_abs);
-    vector<double> ranks(diffs.size());
-    for (size_t i = 0; i < diffs.size(); ++i) ranks[i] = i + 1;  
+
+    // ranks start at 1, and tied values share the mean of their ranks
+    double w_pos(0), w_neg(0);
     size_t start = 0;
-    while (start < ranks.size())
+    while (start < diffs.size())
     {
-        double rank_sum = ranks[start];
         size_t end = start + 1;
-        while (end < ranks.size()
+        while (end < diffs.size()
                && fabs(fabs(diffs[end]) - fabs(diffs[start])) < episilon)
-        {
-            rank_sum += ranks[end];
             ++end;
-        }
+        const double rank = (start + 1 + end) / 2.0;
         for (size_t i = start; i < end; ++i)
-            ranks[i] = rank_sum / (end - start);
+            if (diffs[i] > 0)
+                w_pos += rank;
+            else
+                w_neg += rank;
         start = end;
     }
 
-    double w_pos(0), w_neg(0);
-    for (size_t i = 0; i < ranks.size(); ++i)
-        if (diffs[i] > 0)
-            w_pos += ranks[i];
-        else
-            w_neg += ranks[i];
-
-    if (ranks.size() > 0)
-        return wilcoxon_p_value(w_pos, w_neg, ranks.size(), alternative);
+    if (diffs.size() > 0)
+        return wilcoxon_p_value(w_pos, w_neg, diffs.size(), alternative);
     else
         return 1.0;
 }
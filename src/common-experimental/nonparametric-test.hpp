@@ -22,6 +22,7 @@
 #define NON_PARAMETRIC_TEST_HPP
 
 #include <vector>
+#include <cstddef>
 
 namespace NonParametricTest
 {
@@ -34,6 +35,18 @@ namespace NonParametricTest
     wilcoxon_test(const std::vector<double> &x,
                   const std::vector<double> &y,
                   const bool alternative = false);
+
+    // the buffer used by wilcoxon_test, which a caller running many
+    // tests can keep so that it is allocated only once
+    struct WilcoxonWorkspace
+    {
+        std::vector<double> diffs;
+    };
+
+    // the same test for the "n" pairs starting at "x" and "y"
+    double
+    wilcoxon_test(const double *x, const double *y, const size_t n,
+                  WilcoxonWorkspace &ws, const bool alternative = false);
 };
 
 #endif
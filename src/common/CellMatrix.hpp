@@ -0,0 +1,143 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Cell matrix files: the methylation of many single cells at each
+ * symmetric CpG, as written by sc-methcounts. Each cell has reads at
+ * only a few percent of the CpGs, so only the counts that are not
+ * zero are kept, a column of the matrix at a time: for each CpG with
+ * reads in any cell, the cells with reads there and, for each, the
+ * reads showing the CpG methylated and unmethylated.
+ *
+ * After the magic string are the names of the cells, then a block for
+ * each chrom (see ChromBlocks.hpp), in sorted order, with the number
+ * of CpGs of the chrom after its length. Each CpG has its number of
+ * cells, and for each the distance from the previous cell and the two
+ * counts, as varints. The file is BGZF compressed if its name ends in
+ * ".gz", as for other outputs.
+ */
+
+#ifndef CELL_MATRIX_HPP
+#define CELL_MATRIX_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <stdint.h>
+
+#include "smithlab_utils.hpp"
+#include "ChromBlocks.hpp"
+
+struct CellCount {
+  CellCount() : cell(0), n_meth(0), n_unmeth(0) {}
+  explicit CellCount(const uint32_t c) : cell(c), n_meth(0), n_unmeth(0) {}
+  bool operator<(const CellCount &other) const {return cell < other.cell;}
+  uint32_t cell;
+  uint32_t n_meth;
+  uint32_t n_unmeth;
+};
+
+
+static const char CELL_MATRIX_MAGIC[] = "MPCELLS1";
+
+
+class CellMatrixWriter {
+public:
+  CellMatrixWriter(std::ostream &o, const std::vector<std::string> &cells) :
+    out(o, CELL_MATRIX_MAGIC) {
+    out.put_varint(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+      out.put_string(cells[i]);
+  }
+
+  void start_chrom(const std::string &name, const size_t chrom_size,
+                   const size_t n_cpgs) {
+    out.start_chrom(name, chrom_size);
+    out.put_varint(n_cpgs);
+  }
+  // the counts must be sorted by cell
+  void add_site(const size_t pos, const std::vector<CellCount> &counts) {
+    out.put_pos(pos);
+    out.put_varint(counts.size());
+    uint32_t prev_cell = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      out.put_varint(counts[i].cell - prev_cell);
+      out.put_varint(counts[i].n_meth);
+      out.put_varint(counts[i].n_unmeth);
+      prev_cell = counts[i].cell;
+    }
+  }
+  void end_chrom() {out.end_chrom();}
+
+  void flush() {out.flush();}
+
+private:
+  ChromBlockWriter out;
+};
+
+
+class CellMatrixReader {
+public:
+  CellMatrixReader(std::istream &i, const std::string &fn) :
+    in(i, fn, CELL_MATRIX_MAGIC, "cell matrix"), n_cpgs(0) {
+    cell_names.resize(in.get_varint());
+    for (size_t i = 0; i < cell_names.size(); ++i)
+      in.get_string(cell_names[i]);
+  }
+
+  const std::vector<std::string> &cells() const {return cell_names;}
+
+  // moves to the next chrom, after any sites left in this one; false
+  // at the end of the file
+  bool next_chrom() {
+    std::vector<CellCount> counts;
+    size_t p = 0;
+    while (next_site(p, counts));
+    if (in.at_end())
+      return false;
+    in.start_chrom();
+    n_cpgs = in.get_varint();
+    return true;
+  }
+  const std::string &chrom_name() const {return in.chrom_name();}
+  size_t chrom_size() const {return in.chrom_size();}
+  size_t chrom_cpgs() const {return n_cpgs;}
+
+  // the next CpG of this chrom with reads, and the counts of the cells
+  // with reads there; false after the last one
+  bool next_site(size_t &site_pos, std::vector<CellCount> &counts) {
+    if (!in.next_pos(site_pos))
+      return false;
+    counts.resize(in.get_varint());
+    uint32_t cell = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      cell += in.get_varint();
+      if (cell >= cell_names.size())
+        in.bad();
+      counts[i].cell = cell;
+      counts[i].n_meth = in.get_varint();
+      counts[i].n_unmeth = in.get_varint();
+    }
+    return true;
+  }
+
+private:
+  ChromBlockReader in;
+  std::vector<std::string> cell_names;
+  size_t n_cpgs;
+};
+
+#endif
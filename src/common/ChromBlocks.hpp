@@ -0,0 +1,186 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHROM_BLOCKS_HPP
+#define CHROM_BLOCKS_HPP
+
+/* Varints and the chrom blocks of the binary files of methpipe (count
+ * states and cell matrices). A varint has 7 bits of the number in
+ * each byte, low bits first, with the high bit set in all bytes but
+ * the last. A file starts with an 8 byte magic string, and has a
+ * block for each chrom: the name (a varint length and the bytes) and
+ * the length of the chrom, anything else the format puts there, then
+ * the sites, each starting with the distance from the previous site
+ * plus one, and a 0 at the end of the block.
+ */
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <cstring>
+#include <stdint.h>
+
+#include "smithlab_utils.hpp"
+#include "TextFormat.hpp"
+
+static const size_t MAX_VARINT_SIZE = 10;
+static const size_t CHROM_BLOCK_MAGIC_SIZE = 8;
+
+// writes "x" as a varint at "p" and returns the end
+inline char *
+encode_varint(uint64_t x, char *p) {
+  while (x >= 0x80) {
+    *p++ = static_cast<char>(x | 0x80);
+    x >>= 7;
+  }
+  *p++ = static_cast<char>(x);
+  return p;
+}
+
+
+inline void
+put_varint(std::vector<char> &b, const uint64_t x) {
+  char v[MAX_VARINT_SIZE];
+  b.insert(b.end(), v, encode_varint(x, v));
+}
+
+
+/* reads a varint from the bytes given by "get_byte"; false if it does
+   not end within 64 bits */
+template <class GetByte>
+bool
+decode_varint(GetByte get_byte, uint64_t &x) {
+  x = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    const unsigned char c = get_byte();
+    x |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+
+class ChromBlockWriter {
+public:
+  ChromBlockWriter(std::ostream &o, const char *magic) : out(o), prev_pos(0) {
+    out.put(magic, CHROM_BLOCK_MAGIC_SIZE);
+  }
+
+  void put_varint(const uint64_t x) {
+    char v[MAX_VARINT_SIZE];
+    out.put(v, encode_varint(x, v) - v);
+  }
+  void put_string(const std::string &s) {
+    put_varint(s.size());
+    out.put(s);
+  }
+
+  void start_chrom(const std::string &name, const size_t chrom_size) {
+    put_string(name);
+    put_varint(chrom_size);
+    prev_pos = 0;
+  }
+  // the sites must be in increasing order within a chrom
+  void put_pos(const size_t pos) {
+    put_varint(pos - prev_pos + 1);
+    prev_pos = pos;
+  }
+  void end_chrom() {put_varint(0);}
+
+  void flush() {out.flush();}
+
+private:
+  RecordWriter out;
+  size_t prev_pos;
+};
+
+
+/* ChromBlockReader: reads from the stream buffer of "in" directly;
+   "kind" names the format in errors */
+class ChromBlockReader {
+public:
+  ChromBlockReader(std::istream &i, const std::string &fn, const char *magic,
+                   const std::string &k) :
+    in(*i.rdbuf()), filename(fn), kind(k), size(0), pos(0), in_chrom(false) {
+    char m[CHROM_BLOCK_MAGIC_SIZE];
+    if (in.sgetn(m, CHROM_BLOCK_MAGIC_SIZE) !=
+        static_cast<std::streamsize>(CHROM_BLOCK_MAGIC_SIZE) ||
+        std::memcmp(m, magic, CHROM_BLOCK_MAGIC_SIZE) != 0)
+      throw SMITHLABException("not a " + kind + " file: " + filename);
+  }
+
+  char get_byte() {
+    const int c = in.sbumpc();
+    if (c == std::char_traits<char>::eof())
+      throw SMITHLABException("truncated " + kind + " file: " + filename);
+    return static_cast<char>(c);
+  }
+  uint64_t get_varint() {
+    uint64_t x = 0;
+    if (!decode_varint([this]() {return get_byte();}, x))
+      bad();
+    return x;
+  }
+  void get_string(std::string &s) {
+    s.resize(get_varint());
+    for (size_t i = 0; i < s.size(); ++i)
+      s[i] = get_byte();
+  }
+  void bad() const {
+    throw SMITHLABException("bad " + kind + " file: " + filename);
+  }
+
+  bool at_end() {return in.sgetc() == std::char_traits<char>::eof();}
+
+  // reads the name and length of the next chrom; the rest of the block
+  // before its sites is left to the caller
+  void start_chrom() {
+    get_string(name);
+    size = get_varint();
+    pos = 0;
+    in_chrom = true;
+  }
+  const std::string &chrom_name() const {return name;}
+  size_t chrom_size() const {return size;}
+
+  // the position of the next site of this chrom; false after the last
+  bool next_pos(size_t &site_pos) {
+    if (!in_chrom) return false;
+    const uint64_t delta = get_varint();
+    if (delta == 0) {
+      in_chrom = false;
+      return false;
+    }
+    pos += delta - 1;
+    if (pos >= size)
+      bad();
+    site_pos = pos;
+    return true;
+  }
+
+private:
+  std::streambuf &in;
+  const std::string filename;
+  const std::string kind;
+  std::string name;
+  size_t size;
+  size_t pos;
+  bool in_chrom;
+};
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Count state files: the raw counts behind methcounts output, which
+ * can be added exactly, unlike the rounded levels of the output. For
+ * each cytosine on either strand with any reads, the state has the
+ * reads showing it unconverted and converted, and the counts from
+ * the other strand that decide whether it has mutated: the reads with
+ * a G at that position, and all reads there. Together with the
+ * reference genome, this is all methcounts needs for its output.
+ *
+ * The file has a block for each chrom (see ChromBlocks.hpp), in the
+ * order methcounts saw them, with the four counts of each site as
+ * varints after its position.
+ */
+
+#ifndef COUNT_STATE_HPP
+#define COUNT_STATE_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <stdint.h>
+
+#include "smithlab_utils.hpp"
+#include "MethCounts.hpp"
+#include "ChromBlocks.hpp"
+
+struct SiteCounts {
+  SiteCounts() : pos(0), unconverted(0), converted(0),
+                 opposite_g(0), opposite_total(0) {}
+  SiteCounts &operator+=(const SiteCounts &other) {
+    unconverted += other.unconverted;
+    converted += other.converted;
+    opposite_g += other.opposite_g;
+    opposite_total += other.opposite_total;
+    return *this;
+  }
+  bool empty() const {return unconverted + converted + opposite_total == 0;}
+
+  size_t pos;
+  uint64_t unconverted;
+  uint64_t converted;
+  uint64_t opposite_g;
+  uint64_t opposite_total;
+};
+
+
+static const char COUNT_STATE_MAGIC[] = "MPSTATE1";
+
+
+class CountStateWriter {
+public:
+  explicit CountStateWriter(std::ostream &o) : out(o, COUNT_STATE_MAGIC) {}
+
+  void start_chrom(const std::string &name, const size_t chrom_size) {
+    out.start_chrom(name, chrom_size);
+  }
+  void add_site(const SiteCounts &s) {
+    out.put_pos(s.pos);
+    out.put_varint(s.unconverted);
+    out.put_varint(s.converted);
+    out.put_varint(s.opposite_g);
+    out.put_varint(s.opposite_total);
+  }
+  void end_chrom() {out.end_chrom();}
+
+  void flush() {out.flush();}
+
+private:
+  ChromBlockWriter out;
+};
+
+
+class CountStateReader {
+public:
+  CountStateReader(std::istream &i, const std::string &fn) :
+    in(i, fn, COUNT_STATE_MAGIC, "count state") {}
+
+  // moves to the next chrom, after any sites left in this one; false
+  // at the end of the file
+  bool next_chrom() {
+    SiteCounts s;
+    while (next_site(s));
+    if (in.at_end())
+      return false;
+    in.start_chrom();
+    return true;
+  }
+  const std::string &chrom_name() const {return in.chrom_name();}
+  size_t chrom_size() const {return in.chrom_size();}
+
+  // the next site of this chrom; false after the last one
+  bool next_site(SiteCounts &s) {
+    if (!in.next_pos(s.pos))
+      return false;
+    s.unconverted = in.get_varint();
+    s.converted = in.get_varint();
+    s.opposite_g = in.get_varint();
+    s.opposite_total = in.get_varint();
+    return true;
+  }
+
+private:
+  ChromBlockReader in;
+};
+
+
+/* writes the state of one chrom from the counts of methcounts, with
+   only the sites in [start, end); the states of disjoint parts of a
+   chrom add up to the state of all of it */
+template <class count_type>
+void
+write_count_state(CountStateWriter &out, const std::string &chrom_name,
+                  const std::string &chrom,
+                  const std::vector<CountSet<count_type> > &counts,
+                  const size_t start, const size_t end) {
+  out.start_chrom(chrom_name, chrom.size());
+  SiteCounts s;
+  for (size_t i = start; i < end; ++i) {
+    const CountSet<count_type> &c = counts[i];
+    if (is_cytosine(chrom[i])) {
+      s.unconverted = c.unconverted_cytosine();
+      s.converted = c.converted_cytosine();
+      s.opposite_g = c.nG;
+      s.opposite_total = c.neg_total();
+    }
+    else if (is_guanine(chrom[i])) {
+      s.unconverted = c.unconverted_guanine();
+      s.converted = c.converted_guanine();
+      s.opposite_g = c.pG;
+      s.opposite_total = c.pos_total();
+    }
+    else continue;
+    if (!s.empty()) {
+      s.pos = i;
+      out.add_site(s);
+    }
+  }
+  out.end_chrom();
+}
+
+
+template <class count_type>
+void
+write_count_state(CountStateWriter &out, const std::string &chrom_name,
+                  const std::string &chrom,
+                  const std::vector<CountSet<count_type> > &counts) {
+  write_count_state(out, chrom_name, chrom, counts, 0, counts.size());
+}
+
+#endif
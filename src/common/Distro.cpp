@@ -21,6 +21,7 @@
 
 #include "Distro.hpp"
 #include "smithlab_utils.hpp"
+#include "RandomStream.hpp"
 
 #include <cmath>
 #include <algorithm>
@@ -90,20 +91,47 @@ Distro_::log_sum_log_vec(const vector<double> &vals, size_t limit) {
 //   rng = gsl_rng_clone(other.rng);
 // }
 
+/* the gsl_rng used for sampling draws from a RandomStream, so
+   the gsl_ran_* functions give the same values for a given (seed,
+   stream) whatever GSL_RNG_TYPE says, and objects sampled in
+   parallel can each be given their own stream. */
+static void
+stream_rng_set(void *state, unsigned long int s) {
+  *static_cast<RandomStream *>(state) = RandomStream(s);
+}
+
+static unsigned long int
+stream_rng_get(void *state) {
+  return (*static_cast<RandomStream *>(state))();
+}
+
+static double
+stream_rng_get_double(void *state) {
+  return static_cast<RandomStream *>(state)->uniform();
+}
+
+static const gsl_rng_type stream_rng_type = {
+  "philox4x32", UINT32_MAX, 0, sizeof(RandomStream),
+  &stream_rng_set, &stream_rng_get, &stream_rng_get_double
+};
+
 Distro_::Distro_() {
-  gsl_rng_env_setup();
-  rng = gsl_rng_alloc(gsl_rng_default);
+  rng = gsl_rng_alloc(&stream_rng_type);
 }
 
 Distro_::Distro_(const std::vector<double> p) : params(p) {
-  gsl_rng_env_setup();
-  rng = gsl_rng_alloc(gsl_rng_default);
+  rng = gsl_rng_alloc(&stream_rng_type);
 }
 
 Distro_::~Distro_() {gsl_rng_free(rng);}
 void 
 Distro_::seed(int s) {gsl_rng_set(rng, s);}
 
+void
+Distro_::seed(const uint64_t s, const uint64_t stream) {
+  *static_cast<RandomStream *>(rng->state) = RandomStream(s, stream);
+}
+
 string
 Distro_::tostring() const {
   std::ostringstream os;
@@ -124,6 +152,13 @@ Distro_::log_likelihood(std::vector<double>::const_iterator a,
   return l;
 }
 
+void
+Distro_::batch_log_likelihood(const double *vals, const size_t n_vals,
+                              double *out) const {
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = this->log_likelihood(vals[i]);
+}
+
 double 
 Distro_::operator()(const double val) const {
   return exp(log_likelihood(val));
@@ -253,6 +288,14 @@ Distro::log_likelihood(std::vector<double>::const_iterator a,
   return d->log_likelihood(a, b);
 }
 
+void
+Distro::batch_log_likelihood(const vector<double> &vals,
+                             vector<double> &out) const {
+  out.resize(vals.size());
+  if (!vals.empty())
+    d->batch_log_likelihood(&vals.front(), vals.size(), &out.front());
+}
+
 double
 Distro::log_likelihood(double val) const {return d->log_likelihood(val);}
 
@@ -381,6 +424,15 @@ ExpDistro::log_likelihood(const double val) const {
   return -log(params[0]) - val/params[0];
 }
 
+void
+ExpDistro::batch_log_likelihood(const double *vals, const size_t n_vals,
+                                double *out) const {
+  const double mu = params[0];
+  const double log_mu = log(mu);
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = -log_mu - vals[i]/mu;
+}
+
 double
 ExpDistro::log_likelihood(const double &val,
                           const double &scale) const
@@ -397,7 +449,6 @@ ExpDistro&
 ExpDistro::operator=(const ExpDistro &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -467,6 +518,16 @@ Gamma::log_likelihood(const double val) const {
   return (k - 1) * log(val) - val / theta - gsl_sf_lngamma_k_plus_k_log_theta;
 }
 
+void
+Gamma::batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const {
+  const double k_minus_one = params[0] - 1;
+  const double theta = params[1];
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = k_minus_one * log(vals[i]) - vals[i] / theta -
+      gsl_sf_lngamma_k_plus_k_log_theta;
+}
+
 double
 Gamma::log_likelihood(const double &val,
                       const double &scale) const
@@ -484,7 +545,6 @@ Gamma::operator=(const Gamma &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
     check_params_and_set_helpers();
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -572,6 +632,16 @@ PoisDistro::log_likelihood(const double val) const {
     gsl_sf_lnfact(static_cast<size_t>(val));
 }
 
+void
+PoisDistro::batch_log_likelihood(const double *vals, const size_t n_vals,
+                                 double *out) const {
+  const double lambda = params.front();
+  const double log_lambda = log(lambda);
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = -lambda + vals[i]*log_lambda -
+      gsl_sf_lnfact(static_cast<size_t>(vals[i]));
+}
+
 double
 PoisDistro::log_likelihood(const double &val,
                           const double &scale) const
@@ -591,7 +661,6 @@ PoisDistro&
 PoisDistro::operator=(const PoisDistro &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -690,6 +759,13 @@ NegBinomDistro::log_likelihood(const double val) const {
   return P;
 }
 
+void
+NegBinomDistro::batch_log_likelihood(const double *vals, const size_t n_vals,
+                                     double *out) const {
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = NegBinomDistro::log_likelihood(vals[i]);
+}
+
 double
 NegBinomDistro::log_likelihood(const double &val,
                                const double &scale) const
@@ -722,7 +798,6 @@ NegBinomDistro&
 NegBinomDistro::operator=(const NegBinomDistro &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
     set_helpers();
   }
   return *this;
@@ -979,6 +1054,15 @@ GeoDistro::log_likelihood(const double val) const {
   return log(params[0]) + (val - 1)*log(1 - params[0]);
 }
 
+void
+GeoDistro::batch_log_likelihood(const double *vals, const size_t n_vals,
+                                double *out) const {
+  const double log_p = log(params[0]);
+  const double log_q = log(1 - params[0]);
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = log_p + (vals[i] - 1)*log_q;
+}
+
 double
 GeoDistro::log_likelihood(const double &val,
                           const double &scale) const
@@ -998,7 +1082,6 @@ GeoDistro&
 GeoDistro::operator=(const GeoDistro &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -1071,6 +1154,16 @@ Beta::log_likelihood(const double val) const {
         + (beta - 1.0) * log(1.0 - val);
 }
 
+void
+Beta::batch_log_likelihood(const double *vals, const size_t n_vals,
+                           double *out) const {
+  const double alpha_minus_one = alpha - 1.0;
+  const double beta_minus_one = beta - 1.0;
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = -lnbeta_helper + alpha_minus_one * log(vals[i])
+      + beta_minus_one * log(1.0 - vals[i]);
+}
+
 double
 Beta::log_likelihood(const double &val,
                      const double &scale) const
@@ -1089,7 +1182,6 @@ Beta&
 Beta::operator=(const Beta &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -1251,6 +1343,13 @@ Binom::log_likelihood(const double val) const {
         log(gsl_ran_binomial_pdf(static_cast<int>(val), p, n));
 }
 
+void
+Binom::batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const {
+  for (size_t i = 0; i < n_vals; ++i)
+    out[i] = log(gsl_ran_binomial_pdf(static_cast<int>(vals[i]), p, n));
+}
+
 double
 Binom::log_likelihood(const double &val,
                      const double &scale) const
@@ -1269,7 +1368,6 @@ Binom&
 Binom::operator=(const Binom &rhs) {
   if (this != &rhs) {
     this->Distro_::params = rhs.Distro_::params;
-    rng = gsl_rng_alloc(gsl_rng_default);
   }
   return *this;
 }
@@ -26,6 +26,7 @@
 #include <vector>
 #include <iostream>
 #include <string>
+#include <stdint.h>
 
 #include <gsl/gsl_rng.h>
 
@@ -41,6 +42,8 @@ public:
   virtual ~Distro_();
   
   void seed(int s);
+  // sample from stream "stream" of the RandomStream for seed "s"
+  void seed(const uint64_t s, const uint64_t stream);
 
   virtual size_t required_params() const = 0;
   virtual double sample() const = 0;
@@ -52,6 +55,10 @@ public:
 				  const std::vector<double> &) = 0;
   virtual double log_likelihood(double val) const = 0;
   virtual double log_likelihood(const double &val, const double &scale) const = 0;
+  // the log likelihood of each of "n_vals" values, put in "out"; this
+  // makes one virtual call for all of them
+  virtual void batch_log_likelihood(const double *vals, const size_t n_vals,
+                                    double *out) const;
   double operator()(double val) const;
   double operator()(const std::vector<double> &) const;
   double log_likelihood(const std::vector<double> &vals) const;
@@ -96,6 +103,7 @@ public:
   ~Distro();
   
   void seed(int s) {d->seed(s);}
+  void seed(const uint64_t s, const uint64_t stream) {d->seed(s, stream);}
   
   double operator()() const {return d->sample();}
   double operator()(double val) const;
@@ -113,6 +121,12 @@ public:
 			std::vector<double>::const_iterator b) const;
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const {
+    d->batch_log_likelihood(vals, n_vals, out);
+  }
+  void batch_log_likelihood(const std::vector<double> &vals,
+                            std::vector<double> &out) const;
   std::string tostring() const;
   std::vector<double> get_params() const {return d->get_params();}
 
@@ -153,6 +167,8 @@ public:
 			  const std::vector<double> &probs);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 };
 
 
@@ -178,6 +194,8 @@ public:
 			  const std::vector<double> &probs);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 
 private:
   void check_params_and_set_helpers();
@@ -208,6 +226,8 @@ public:
                           const std::vector<double> &probs);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -232,6 +252,8 @@ public:
                           const std::vector<double> &probs);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -259,6 +281,8 @@ public:
 
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
   
 private:
 
@@ -294,6 +318,8 @@ public:
                           const std::vector<double> &weights);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 private:
   double alpha, beta, lnbeta_helper;
 };
@@ -320,6 +346,8 @@ public:
                           const std::vector<double> &weights);
   double log_likelihood(double val) const;
     double log_likelihood(const double &val, const double &scale) const;
+  void batch_log_likelihood(const double *vals, const size_t n_vals,
+                            double *out) const;
 private:
   double p;
   int n;
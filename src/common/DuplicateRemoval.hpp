@@ -0,0 +1,243 @@
+/*
+ *    Copyright (C) 2013-2018 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith, Ben Decato, Song Qiang
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The choice of which reads to keep among duplicates, as done by
+ * duplicate-remover. Reads are duplicates if they have the same
+ * chrom, start, end and strand, and optionally the same methylation
+ * state at each CpG (or each C) covered by any read in the group.
+ */
+
+#ifndef DUPLICATE_REMOVAL_HPP
+#define DUPLICATE_REMOVAL_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "MappedRead.hpp"
+#include "bsutils.hpp"
+#include "RandomStream.hpp"
+
+/* ReadKey: the fields that define the sort order and equivalence of
+   mapped reads, kept separately so comparing a read with the front of
+   its group never needs a copy of the whole read */
+struct ReadKey {
+  std::string chrom;
+  size_t start;
+  size_t end;
+  char strand;
+};
+
+
+inline bool
+precedes(const ReadKey &a, const ReadKey &b) {
+  const int chrom_cmp = a.chrom.compare(b.chrom);
+  return chrom_cmp < 0 ||
+    (chrom_cmp == 0 &&
+     (a.start < b.start ||
+      (a.start == b.start &&
+       (a.end < b.end ||
+        (a.end == b.end && a.strand < b.strand)))));
+}
+
+
+inline bool
+equivalent(const ReadKey &a, const ReadKey &b) {
+  return a.start == b.start && a.end == b.end &&
+    a.strand == b.strand && a.chrom == b.chrom;
+}
+
+
+struct DuplicateStats {
+  DuplicateStats() : reads_in(0), reads_out(0), good_bases_in(0),
+                     good_bases_out(0), reads_with_duplicates(0) {}
+  void add(const DuplicateStats &other) {
+    reads_in += other.reads_in;
+    reads_out += other.reads_out;
+    good_bases_in += other.good_bases_in;
+    good_bases_out += other.good_bases_out;
+    reads_with_duplicates += other.reads_with_duplicates;
+  }
+  void add_group(const MappedRead *mr, const size_t n,
+                 const std::vector<size_t> &keepers) {
+    for (size_t j = 0; j < n; ++j)
+      good_bases_in += mr[j].seq.length();
+    for (size_t j = 0; j < keepers.size(); ++j)
+      good_bases_out += mr[keepers[j]].seq.length();
+    reads_in += n;
+    reads_out += keepers.size();
+    reads_with_duplicates += (keepers.size() < n);
+  }
+  std::string tostring() const {
+    std::ostringstream oss;
+    oss << "TOTAL READS IN:\t" << reads_in << "\n"
+        << "GOOD BASES IN:\t" << good_bases_in << "\n"
+        << "TOTAL READS OUT:\t" << reads_out << "\n"
+        << "GOOD BASES OUT:\t" << good_bases_out << "\n"
+        << "DUPLICATES REMOVED:\t" << reads_in - reads_out << "\n"
+        << "READS WITH DUPLICATES:\t" << reads_with_duplicates << "\n";
+    return oss.str();
+  }
+  size_t reads_in;
+  size_t reads_out;
+  size_t good_bases_in;
+  size_t good_bases_out;
+  size_t reads_with_duplicates;
+};
+
+
+/* DuplicateSelector: selection of survivors is a function of the seed
+   and the identity of the group (location and methylation pattern)
+   only, never of the order in which groups are processed. Reruns with
+   the same seed, any number of threads, or separate runs over pieces
+   of the input, all keep the same reads. Each thread needs its own
+   DuplicateSelector, as it holds buffers reused between groups. */
+class DuplicateSelector {
+public:
+  DuplicateSelector(const bool us, const bool ac, const uint64_t s) :
+    USE_SEQUENCE(us), ALL_C(ac), seed(s) {}
+
+  // indices in [0, n) of the reads in "mr" to keep, in increasing order
+  void select(const ReadKey &key, const MappedRead *mr, const size_t n,
+              std::vector<size_t> &keepers) {
+    keepers.clear();
+    const uint64_t group_hash = hash_key(key);
+    if (USE_SEQUENCE) {
+      select_by_meth_pattern(mr, n, group_hash, keepers);
+      std::sort(keepers.begin(), keepers.end());
+    }
+    else keepers.push_back(select_survivor(group_hash, n));
+  }
+
+private:
+  static uint64_t
+  mix64(uint64_t x) {
+    // the finalizer from splitmix64
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  static uint64_t
+  hash_key(const ReadKey &key) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < key.chrom.length(); ++i)
+      h = (h ^ static_cast<unsigned char>(key.chrom[i]))*1099511628211ull;
+    h = mix64(h ^ key.start);
+    h = mix64(h ^ key.end);
+    return mix64(h ^ static_cast<unsigned char>(key.strand));
+  }
+
+  // one draw from the stream of this group
+  size_t
+  select_survivor(const uint64_t group_hash, const size_t n) const {
+    RandomStream rs(seed, group_hash);
+    return rs.uniform_int(n);
+  }
+
+  void select_by_meth_pattern(const MappedRead *mr, const size_t n,
+                              const uint64_t group_hash,
+                              std::vector<size_t> &keepers);
+
+  const bool USE_SEQUENCE;
+  const bool ALL_C;
+  const uint64_t seed;
+
+  // scratch space for comparing methylation patterns
+  std::vector<bool> is_site;
+  std::vector<size_t> sites;
+  std::vector<uint64_t> words;
+  std::vector<uint64_t> pattern_hash;
+  std::unordered_map<uint64_t, std::vector<size_t> > patterns;
+  std::vector<std::vector<size_t> > same_pattern;
+};
+
+
+/* the sites used to distinguish reads in a group are those
+   positions where any read has a CpG (or a C with ALL_C). Each read's
+   methylation state over those sites is packed into 64-bit words and
+   hashed, and reads are grouped by hash, comparing the packed words
+   only when two hashes are equal. */
+inline void
+DuplicateSelector::select_by_meth_pattern(const MappedRead *mr, const size_t n,
+                                          const uint64_t group_hash,
+                                          std::vector<size_t> &keepers) {
+
+  const size_t lim = mr[0].seq.length();
+  is_site.assign(lim, false);
+  for (size_t j = 0; j < n; ++j) {
+    const std::string &seq = mr[j].seq;
+    const size_t len = std::min(lim, seq.length());
+    for (size_t i = 0; i < len; ++i)
+      if (ALL_C ? is_cytosine(seq[i]) :
+          (i + 1 < lim && is_cytosine(seq[i]) && is_guanine(seq[i + 1])))
+        is_site[i] = true;
+  }
+  sites.clear();
+  for (size_t i = 0; i < lim; ++i)
+    if (is_site[i])
+      sites.push_back(i);
+
+  const size_t n_words = (sites.size() + 63)/64;
+  words.assign(n*n_words, 0ull);
+  pattern_hash.resize(n);
+  for (size_t j = 0; j < n; ++j) {
+    uint64_t *w = words.data() + j*n_words;
+    for (size_t k = 0; k < sites.size(); ++k)
+      if (sites[k] < mr[j].seq.length() && is_cytosine(mr[j].seq[sites[k]]))
+        w[k/64] |= (1ull << (k % 64));
+    uint64_t h = group_hash;
+    for (size_t k = 0; k < n_words; ++k)
+      h = mix64(h ^ w[k]);
+    pattern_hash[j] = h;
+  }
+
+  // each entry is a list of reads whose patterns are identical
+  patterns.clear();
+  size_t n_patterns = 0;
+  for (size_t j = 0; j < n; ++j) {
+    std::vector<size_t> &ids = patterns[pattern_hash[j]];
+    size_t k = 0;
+    while (k < ids.size() &&
+           !std::equal(words.begin() + j*n_words,
+                       words.begin() + (j + 1)*n_words,
+                       words.begin() + same_pattern[ids[k]].front()*n_words))
+      ++k;
+    if (k == ids.size()) {
+      ids.push_back(n_patterns);
+      if (n_patterns == same_pattern.size())
+        same_pattern.push_back(std::vector<size_t>());
+      same_pattern[n_patterns++].clear();
+    }
+    same_pattern[ids[k]].push_back(j);
+  }
+
+  for (size_t k = 0; k < n_patterns; ++k) {
+    const std::vector<size_t> &reads = same_pattern[k];
+    keepers.push_back(reads[select_survivor(pattern_hash[reads.front()],
+                                            reads.size())]);
+  }
+}
+
+#endif
@@ -57,7 +57,7 @@ log_likelihood(const std::vector<epiread> &reads, const std::vector<double> &ind
 double
 resolve_epialleles(const size_t max_itr,
 		   const std::vector<epiread> &reads, 
-		   std::vector<double> &indicators, 
+		   const double &mixing, std::vector<double> &indicators,
 		   std::vector<double> &a1, std::vector<double> &a2);
 
 double
@@ -0,0 +1,174 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Parts of the genome for one process to work on, so that the work on
+ * a genome can be split between many processes, for example on a
+ * cluster. A region is given as "chrom", or "chrom:start-end" with a
+ * 0-based start and an end just past it, as in BED. A shard is given
+ * as "i/n": the i-th of n pieces of equal size, counting from 1, with
+ * the chroms laid end to end in the sorted order of their names, which
+ * is the order of methcounts output. Either becomes a list of
+ * intervals, at most one on each chrom, in that order.
+ */
+
+#ifndef GENOME_SHARDS_HPP
+#define GENOME_SHARDS_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdlib>
+
+#include "smithlab_utils.hpp"
+
+struct GenomeInterval {
+  GenomeInterval() : start(0), end(0) {}
+  GenomeInterval(const std::string &c, const size_t s, const size_t e) :
+    chrom(c), start(s), end(e) {}
+  std::string chrom;
+  size_t start;
+  size_t end; // std::string::npos for the end of the chrom
+};
+
+
+namespace genome_shards {
+  inline bool
+  parse_count(const std::string &s, size_t &x) {
+    if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    x = std::strtoul(s.c_str(), 0, 10);
+    return true;
+  }
+}
+
+
+inline GenomeInterval
+parse_genome_region(const std::string &spec) {
+  using genome_shards::parse_count;
+  const size_t colon = spec.rfind(':');
+  if (colon == std::string::npos)
+    return GenomeInterval(spec, 0, std::string::npos);
+  const size_t dash = spec.find('-', colon);
+  GenomeInterval r(spec.substr(0, colon), 0, 0);
+  if (r.chrom.empty() || dash == std::string::npos ||
+      !parse_count(spec.substr(colon + 1, dash - colon - 1), r.start) ||
+      !parse_count(spec.substr(dash + 1), r.end) || r.end < r.start)
+    throw SMITHLABException("bad region (chrom:start-end): " + spec);
+  return r;
+}
+
+
+// the shard "i/n" as its number, counting from 1, and the number of
+// shards
+inline void
+parse_shard_spec(const std::string &spec, size_t &shard, size_t &n_shards) {
+  using genome_shards::parse_count;
+  const size_t slash = spec.find('/');
+  if (slash == std::string::npos ||
+      !parse_count(spec.substr(0, slash), shard) ||
+      !parse_count(spec.substr(slash + 1), n_shards) ||
+      shard == 0 || shard > n_shards)
+    throw SMITHLABException("bad shard (i/n, with 1 <= i <= n): " + spec);
+}
+
+
+/* the lengths of the chroms in "chrom_files", sorted by name. A
+   FASTA index (".fai") next to a file is used if there is one, and
+   otherwise the file is read, but not kept, so this takes little
+   memory even for a large genome. */
+inline void
+get_chrom_sizes(const std::unordered_map<std::string, std::string> &chrom_files,
+                std::vector<std::pair<std::string, size_t> > &sizes) {
+  std::vector<std::string> files;
+  for (auto &c : chrom_files)
+    files.push_back(c.second);
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+
+  std::unordered_map<std::string, size_t> found;
+  std::string line, name;
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::ifstream fai((files[i] + ".fai").c_str());
+    if (fai) {
+      size_t len = 0;
+      while (getline(fai, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos ||
+            !genome_shards::parse_count(line.substr(tab + 1,
+                line.find('\t', tab + 1) - tab - 1), len))
+          throw SMITHLABException("bad FASTA index: " + files[i] + ".fai");
+        found[line.substr(0, tab)] = len;
+      }
+      continue;
+    }
+    std::ifstream in(files[i].c_str());
+    if (!in)
+      throw SMITHLABException("cannot open input file: " + files[i]);
+    size_t *len = 0;
+    while (getline(in, line)) {
+      if (!line.empty() && line[0] == '>') {
+        name = line.substr(1, line.find_first_of(" \t\r", 1) - 1);
+        len = &found[name];
+        *len = 0;
+      }
+      else if (len) {
+        const size_t last = line.find_last_not_of(" \t\r");
+        if (last != std::string::npos)
+          *len += last + 1;
+      }
+    }
+  }
+
+  sizes.clear();
+  for (auto &c : chrom_files) {
+    auto f = found.find(c.first);
+    if (f == found.end())
+      throw SMITHLABException("could not find chrom: " + c.first);
+    sizes.push_back(std::make_pair(c.first, f->second));
+  }
+  std::sort(sizes.begin(), sizes.end());
+}
+
+
+// the intervals of shard "shard" of "n_shards" over chroms with the
+// given sizes, in sorted order
+inline void
+get_genome_shard(const std::vector<std::pair<std::string, size_t> > &sizes,
+                 const size_t shard, const size_t n_shards,
+                 std::vector<GenomeInterval> &intervals) {
+  size_t total = 0;
+  for (size_t i = 0; i < sizes.size(); ++i)
+    total += sizes[i].second;
+  const size_t lo = (shard - 1)*total/n_shards;
+  const size_t hi = shard*total/n_shards;
+
+  intervals.clear();
+  size_t offset = 0;
+  for (size_t i = 0; i < sizes.size() && offset < hi; ++i) {
+    const size_t chrom_end = offset + sizes[i].second;
+    if (chrom_end > lo)
+      intervals.push_back(GenomeInterval(sizes[i].first,
+                                         std::max(lo, offset) - offset,
+                                         std::min(hi, chrom_end) - offset));
+    offset = chrom_end;
+  }
+}
+
+#endif
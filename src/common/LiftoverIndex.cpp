@@ -0,0 +1,277 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LiftoverIndex.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+
+static const char index_magic[8] = {'M', 'P', 'L', 'I', 'F', 'T', '0', '1'};
+
+// the fixed part at the start of a binary index
+struct IndexHeader {
+  char magic[8];
+  uint64_t n_chroms;
+  uint64_t n_blocks;
+  uint64_t n_entries;
+  uint64_t names_bytes; // including padding to a multiple of 8
+};
+
+
+static size_t
+padded(const size_t n) {
+  return (n + 7)/8*8;
+}
+
+
+bool
+LiftoverIndex::is_binary(const string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char buf[sizeof(index_magic)];
+  return in.read(buf, sizeof(buf)) &&
+    std::equal(buf, buf + sizeof(buf), index_magic);
+}
+
+
+void
+LiftoverIndex::read(const string &filename) {
+  if (is_binary(filename))
+    read_binary(filename);
+  else read_text(filename);
+}
+
+
+uint32_t
+LiftoverIndex::get_chrom_id(const string &chrom) {
+  const std::unordered_map<string, uint32_t>::const_iterator
+    i(chrom_ids.find(chrom));
+  if (i != chrom_ids.end())
+    return i->second;
+  const uint32_t id = chrom_names.size();
+  chrom_names.push_back(chrom);
+  chrom_ids[chrom] = id;
+  return id;
+}
+
+
+static uint32_t
+get_pos(const size_t pos, const string &line) {
+  if (pos > std::numeric_limits<uint32_t>::max())
+    throw SMITHLABException("position too large in index line:\n" + line);
+  return pos;
+}
+
+
+static uint32_t
+get_strand(const string &strand, const string &line) {
+  if (strand != "+" && strand != "-")
+    throw SMITHLABException("bad strand in index line:\n" + line);
+  return strand == "-";
+}
+
+
+void
+LiftoverIndex::set_blocks(const vector<Block> &blocks) {
+  ranges.assign(2*chrom_names.size(), std::make_pair(0ul, 0ul));
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const Block &b = blocks[i];
+    if (b.chrom >= chrom_names.size() || b.strand > 1 ||
+        b.begin > b.end || b.end > n_entries)
+      throw SMITHLABException("corrupt liftover index");
+    ranges[2*b.chrom + b.strand] = std::make_pair(b.begin, b.end);
+  }
+}
+
+
+/* in the text index a later line for the same source site
+   replaces any earlier one, so among sites with the same position the
+   last one read is kept */
+void
+LiftoverIndex::read_text(const string &filename) {
+  std::ifstream in(filename.c_str());
+  if (!in)
+    throw SMITHLABException("problem opening index file");
+
+  // sites for each source chrom and strand, in order read
+  vector<vector<pair<uint32_t, Entry> > > sites;
+  string line, to_chrom, from_name, to_strand;
+  size_t to_pos = 0, to_end = 0, to_score = 0;
+  while (getline(in, line)) {
+    std::istringstream iss(line);
+    if (!(iss >> to_chrom >> to_pos >> to_end >> from_name
+          >> to_score >> to_strand)) {
+      if (line.find_first_not_of(" \t") == string::npos) continue;
+      throw SMITHLABException("bad index line:\n" + line);
+    }
+    const size_t dim1 = from_name.find_first_of(":");
+    const size_t dim2 = from_name.find(":", dim1 + 1);
+    const size_t dim3 = from_name.find(":", dim2 + 1);
+    if (dim3 == string::npos)
+      throw SMITHLABException("bad index line:\n" + line);
+    const uint32_t from_chrom = get_chrom_id(from_name.substr(0, dim1));
+    const uint32_t from_strand =
+      get_strand(from_name.substr(dim3 + 1), line);
+    Entry e;
+    e.from_pos = get_pos(atoi(from_name.substr(dim1 + 1, dim2 - dim1).c_str()),
+                         line);
+    e.to_pos = get_pos(to_pos, line);
+    e.to_chrom_strand =
+      2*get_chrom_id(to_chrom) + get_strand(to_strand, line);
+    const size_t b = 2*from_chrom + from_strand;
+    if (sites.size() <= b)
+      sites.resize(b + 1);
+    sites[b].push_back(std::make_pair(sites[b].size(), e));
+  }
+
+  vector<Block> blocks;
+  owned_entries.clear();
+  for (size_t b = 0; b < sites.size(); ++b) {
+    vector<pair<uint32_t, Entry> > &s = sites[b];
+    if (s.empty()) continue;
+    std::sort(s.begin(), s.end(), [](const pair<uint32_t, Entry> &x,
+                                     const pair<uint32_t, Entry> &y) {
+                return x.second.from_pos < y.second.from_pos ||
+                  (x.second.from_pos == y.second.from_pos &&
+                   x.first < y.first);
+              });
+    Block block = {static_cast<uint32_t>(b/2), static_cast<uint32_t>(b % 2),
+                   owned_entries.size(), 0};
+    for (size_t i = 0; i < s.size(); ++i)
+      if (i + 1 == s.size() || s[i + 1].second.from_pos != s[i].second.from_pos)
+        owned_entries.push_back(s[i].second);
+    block.end = owned_entries.size();
+    blocks.push_back(block);
+    vector<pair<uint32_t, Entry> >().swap(s);
+  }
+  entries = owned_entries.data();
+  n_entries = owned_entries.size();
+  set_blocks(blocks);
+}
+
+
+void
+LiftoverIndex::read_binary(const string &filename) {
+  mapped.reset(new MappedFile(filename));
+  const char *p = mapped->data();
+  const size_t size = mapped->size();
+
+  IndexHeader h;
+  if (size < sizeof(h))
+    throw SMITHLABException("corrupt liftover index: " + filename);
+  std::memcpy(&h, p, sizeof(h));
+  const size_t blocks_offset = sizeof(h) + h.names_bytes;
+  const size_t entries_offset = blocks_offset + h.n_blocks*sizeof(Block);
+  if (h.names_bytes % 8 != 0 ||
+      entries_offset + h.n_entries*sizeof(Entry) != size)
+    throw SMITHLABException("corrupt liftover index: " + filename);
+
+  chrom_names.clear();
+  chrom_ids.clear();
+  const char *name = p + sizeof(h);
+  for (size_t i = 0; i < h.n_chroms; ++i) {
+    const char *name_end = static_cast<const char *>(
+      std::memchr(name, '\0', p + blocks_offset - name));
+    if (!name_end)
+      throw SMITHLABException("corrupt liftover index: " + filename);
+    get_chrom_id(string(name, name_end));
+    name = name_end + 1;
+  }
+
+  vector<Block> blocks(h.n_blocks);
+  if (h.n_blocks > 0)
+    std::memcpy(&blocks[0], p + blocks_offset, h.n_blocks*sizeof(Block));
+
+  owned_entries.clear();
+  entries = reinterpret_cast<const Entry *>(p + entries_offset);
+  n_entries = h.n_entries;
+  set_blocks(blocks);
+}
+
+
+void
+LiftoverIndex::write(const string &filename) const {
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if (!out)
+    throw SMITHLABException("bad output file: " + filename);
+
+  string names;
+  for (size_t i = 0; i < chrom_names.size(); ++i)
+    names += chrom_names[i] + '\0';
+  names.resize(padded(names.size()), '\0');
+
+  vector<Block> blocks;
+  for (size_t i = 0; i < ranges.size(); ++i)
+    if (ranges[i].first < ranges[i].second) {
+      const Block b = {static_cast<uint32_t>(i/2),
+                       static_cast<uint32_t>(i % 2),
+                       ranges[i].first, ranges[i].second};
+      blocks.push_back(b);
+    }
+
+  IndexHeader h;
+  std::copy(index_magic, index_magic + sizeof(index_magic), h.magic);
+  h.n_chroms = chrom_names.size();
+  h.n_blocks = blocks.size();
+  h.n_entries = n_entries;
+  h.names_bytes = names.size();
+
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+  out.write(names.data(), names.size());
+  if (!blocks.empty())
+    out.write(reinterpret_cast<const char *>(&blocks[0]),
+              blocks.size()*sizeof(Block));
+  if (n_entries > 0)
+    out.write(reinterpret_cast<const char *>(entries),
+              n_entries*sizeof(Entry));
+  if (!out)
+    throw SMITHLABException("error writing file: " + filename);
+}
+
+
+bool
+LiftoverIndex::lift(const string &chrom, const char strand, const size_t pos,
+                    const string *&to_chrom, size_t &to_pos,
+                    char &to_strand) const {
+  const std::unordered_map<string, uint32_t>::const_iterator
+    id(chrom_ids.find(chrom));
+  if (id == chrom_ids.end() || (strand != '+' && strand != '-'))
+    return false;
+  const pair<uint64_t, uint64_t> &r = ranges[2*id->second + (strand == '-')];
+  const Entry *first = entries + r.first;
+  const Entry *last = entries + r.second;
+  const Entry *e = std::lower_bound(first, last, pos,
+                                    [](const Entry &x, const size_t p) {
+                                      return x.from_pos < p;
+                                    });
+  if (e == last || e->from_pos != pos)
+    return false;
+  to_chrom = &chrom_names[e->to_chrom_strand/2];
+  to_pos = e->to_pos;
+  to_strand = (e->to_chrom_strand % 2) ? '-' : '+';
+  return true;
+}
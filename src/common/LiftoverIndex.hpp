@@ -0,0 +1,92 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIFTOVER_INDEX_HPP
+#define LIFTOVER_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "MappedFile.hpp"
+
+/* LiftoverIndex: the sites of fast-liftover, from (chrom, strand,
+ * position) in the source to (chrom, position, strand) in the
+ * target. Chroms are given ids, and for each source chrom and strand
+ * the sites are packed into an array sorted by source position, so a
+ * site takes 12 bytes and a lookup is a binary search.
+ *
+ * The index can be built from the text format:
+ *
+ *   chr21  26608683  26608684  chr1:3007015:3007016:-  0  +
+ *
+ * (target chrom, position and end, then the source chrom, position,
+ * end and strand, a score and the target strand) or loaded from the
+ * binary format written by "write", which is mapped into memory
+ * rather than read. The binary format is in the byte order of the
+ * machine that wrote it.
+ */
+class LiftoverIndex {
+public:
+  LiftoverIndex() : entries(0), n_entries(0) {}
+
+  // reads either format, checking the start of the file
+  void read(const std::string &filename);
+  void write(const std::string &filename) const;
+
+  static bool is_binary(const std::string &filename);
+
+  // returns false if the site is not in the index; the target chrom
+  // is valid for the lifetime of the index
+  bool lift(const std::string &chrom, const char strand, const size_t pos,
+            const std::string *&to_chrom, size_t &to_pos,
+            char &to_strand) const;
+
+  size_t size() const {return n_entries;}
+
+private:
+  struct Entry {
+    uint32_t from_pos;
+    uint32_t to_pos;
+    uint32_t to_chrom_strand; // chrom id times 2, plus 1 for - strand
+  };
+  struct Block {
+    uint32_t chrom;
+    uint32_t strand;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  void read_text(const std::string &filename);
+  void read_binary(const std::string &filename);
+  uint32_t get_chrom_id(const std::string &chrom);
+  void set_blocks(const std::vector<Block> &blocks);
+
+  std::vector<std::string> chrom_names;
+  std::unordered_map<std::string, uint32_t> chrom_ids;
+  // for each chrom and strand, the range of its sites in "entries"
+  std::vector<std::pair<uint64_t, uint64_t> > ranges;
+
+  const Entry *entries;
+  size_t n_entries;
+  std::vector<Entry> owned_entries;
+  std::unique_ptr<MappedFile> mapped;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MappedFile.hpp"
+
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+
+MappedFile::MappedFile(const string &filename) : addr(0), n_bytes(0) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw SMITHLABException("cannot open file: " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw SMITHLABException("cannot get size of file: " + filename);
+  }
+  // a pipe or device has no size to map, and would seem empty
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    throw SMITHLABException("not a regular file: " + filename);
+  }
+  n_bytes = st.st_size;
+  // a zero-length mapping is an error, so empty files have no data
+  if (n_bytes > 0) {
+    void *m = mmap(0, n_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      close(fd);
+      throw SMITHLABException("cannot map file: " + filename);
+    }
+    addr = static_cast<const char *>(m);
+  }
+  close(fd);
+}
+
+
+MappedFile::~MappedFile() {
+  if (addr)
+    munmap(const_cast<char *>(addr), n_bytes);
+}
+
+
+void
+MappedFile::advise_sequential() const {
+  if (addr)
+    madvise(const_cast<char *>(addr), n_bytes, MADV_SEQUENTIAL);
+}
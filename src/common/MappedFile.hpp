@@ -0,0 +1,47 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+
+/* MappedFile: the contents of a file mapped read-only into memory for
+ * as long as the object exists. Pages are read by the OS as they are
+ * touched, so only the parts of the file that are used take memory.
+ * Only regular files can be mapped; others, such as pipes, throw.
+ */
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &filename);
+  ~MappedFile();
+
+  const char *data() const {return addr;}
+  size_t size() const {return n_bytes;}
+
+  // hint that the file will be read from start to end
+  void advise_sequential() const;
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const char *addr;
+  size_t n_bytes;
+};
+
+#endif
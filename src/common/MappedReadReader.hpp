@@ -0,0 +1,360 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_READ_READER_HPP
+#define MAPPED_READ_READER_HPP
+
+/* Reading of the mapped reads format without a string or an
+ * istringstream for each line, and writing of it without ostream
+ * insertion. Lines are found in a large buffer, and
+ * each is parsed into a MappedRead that the caller keeps from one read
+ * to the next, so once the strings in it are long enough, reading
+ * does no allocation at all.
+ *
+ * The chrom is not set in the GenomicRegion of the MappedRead: doing
+ * so updates a table of chrom names shared by all GenomicRegions,
+ * which worker threads must not touch while a reader thread is adding
+ * to it. The reader instead gives the chrom name, and a number that
+ * changes exactly when the chrom changes from one line to the next,
+ * so the test for a new chrom is a comparison of integers.
+ */
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+
+#include "smithlab_utils.hpp"
+#include "MappedRead.hpp"
+#include "TextFormat.hpp"
+
+namespace mapped_read_format {
+  inline bool
+  is_space(const char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  inline const char *
+  skip_space(const char *p, const char *end) {
+    while (p != end && is_space(*p)) ++p;
+    return p;
+  }
+
+  inline const char *
+  skip_token(const char *p, const char *end) {
+    while (p != end && !is_space(*p)) ++p;
+    return p;
+  }
+
+  inline const char *
+  parse_uint(const char *p, const char *end, size_t &x) {
+    const char *const start = p;
+    x = 0;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p)
+      x = 10*x + (*p - '0');
+    return p == start ? 0 : p;
+  }
+
+  // the start and end of the read on the line in [line, end), for
+  // tools that only need its position; false if they are missing
+  inline bool
+  parse_interval(const char *line, const char *end,
+                 size_t &start, size_t &stop) {
+    const char *p = skip_token(skip_space(line, end), end);
+    p = parse_uint(skip_space(p, end), end, start);
+    if (p) p = parse_uint(skip_space(p, end), end, stop);
+    return p && start < stop;
+  }
+}
+
+
+/* fills a MappedRead from the text in [line, end), except for
+   the chrom. The "name" is space for the read name, kept by the
+   caller so that it is reused. A line that is not a mapped read
+   throws, with the line in the message. */
+inline void
+parse_mapped_read(const char *line, const char *end,
+                  std::string &name, MappedRead &mr) {
+  using namespace mapped_read_format;
+
+  const char *chrom = skip_space(line, end);
+  const char *p = skip_token(chrom, end);
+  bool good = (p != chrom);
+
+  size_t start = 0, stop = 0;
+  p = parse_uint(skip_space(p, end), end, start);
+  good = good && p;
+  if (p) p = parse_uint(skip_space(p, end), end, stop);
+  good = good && p;
+  if (!p) p = end;
+
+  p = skip_space(p, end);
+  const char *q = skip_token(p, end);
+  name.assign(p, q);
+
+  p = skip_space(q, end);
+  q = skip_token(p, end);
+  // the line is followed by a newline or a '\0', so strtod stops at
+  // the end of the score
+  const double score = (p == q) ? 0.0 : strtod(p, 0);
+  good = good && (p != q);
+
+  p = skip_space(q, end);
+  const char strand = (p == end) ? '\0' : *p;
+
+  p = skip_space(skip_token(p, end), end);
+  q = skip_token(p, end);
+  mr.seq.assign(p, q);
+
+  // the quality scores may be left off
+  p = skip_space(q, end);
+  q = skip_token(p, end);
+  mr.scr.assign(p, q);
+
+  if (!good || stop <= start || name.empty() || mr.seq.empty() ||
+      (strand != '+' && strand != '-'))
+    throw SMITHLABException("bad mapped read line:\n" +
+                            std::string(line, end));
+
+  mr.r.set_start(start);
+  mr.r.set_end(stop);
+  mr.r.set_name(name);
+  mr.r.set_score(score);
+  mr.r.set_strand(strand);
+}
+
+
+// the same text as "operator<<" for a MappedRead, with the chrom given
+inline void
+write_mapped_read(RecordWriter &out, const std::string &chrom,
+                  const MappedRead &mr) {
+  out.put(chrom).put('\t').put_uint(mr.r.get_start()).put('\t')
+    .put_uint(mr.r.get_end()).put('\t').put(mr.r.get_name()).put('\t')
+    .put_double(mr.r.get_score()).put('\t').put(mr.r.get_strand()).put('\t')
+    .put(mr.seq).put('\t').put(mr.scr).put('\n');
+}
+
+
+class MappedReadReader {
+public:
+  explicit MappedReadReader(std::istream &i,
+                            const size_t buffer_size = 1ul << 20) :
+    in(i), buf(buffer_size + 1), pos(0), len(0), at_eof(false),
+    line_b(0), line_e(0), held(false), chrom_number(0) {
+    buf[0] = '\0';
+  }
+
+  /* the next non-empty line, in [b, e), which stays valid until the
+     following call; this is all that tools that parse elsewhere, for
+     example in worker threads, need from the reader */
+  bool next_line(const char *&b, const char *&e);
+
+  // the next read, except for its chrom (see above)
+  bool read(MappedRead &mr) {
+    const char *b = 0, *e = 0;
+    if (!next_line(b, e))
+      return false;
+    parse_mapped_read(b, e, name, mr);
+    return true;
+  }
+
+  // the next call to next_line or read gives the same line again
+  void put_back() {held = true;}
+
+  // the chrom of the most recent line, and a number for it that is
+  // 0 before the first line and changes whenever the chrom does
+  const std::string &chrom() const {return chrom_name;}
+  size_t chrom_id() const {return chrom_number;}
+
+  // the text of the most recent line, as for error messages
+  const char *line_begin() const {return line_b;}
+  const char *line_end() const {return line_e;}
+  std::string line() const {return std::string(line_b, line_e);}
+
+private:
+  bool refill();
+  void set_chrom();
+
+  std::istream &in;
+  std::vector<char> buf; // one extra char holds a '\0' after the text
+  size_t pos;
+  size_t len;
+  bool at_eof;
+
+  const char *line_b;
+  const char *line_e;
+  bool held;
+
+  std::string chrom_name;
+  size_t chrom_number;
+  std::string name;
+};
+
+
+/* moves any partial line to the front of the buffer and reads after
+   it, doubling the buffer if one line fills all of it */
+inline bool
+MappedReadReader::refill() {
+  if (at_eof)
+    return false;
+  const size_t capacity = buf.size() - 1;
+  if (pos > 0) {
+    std::memmove(buf.data(), buf.data() + pos, len - pos);
+    len -= pos;
+    pos = 0;
+  }
+  else if (len == capacity)
+    buf.resize(2*capacity + 1);
+  in.read(buf.data() + len, buf.size() - 1 - len);
+  const size_t n_read = in.gcount();
+  len += n_read;
+  buf[len] = '\0';
+  if (!in) {
+    at_eof = true;
+    // reaching the end sets failbit, which callers do not expect from
+    // a stream that has been read to the end line by line
+    if (!in.bad()) in.clear(std::ios_base::eofbit);
+  }
+  return n_read > 0;
+}
+
+
+inline void
+MappedReadReader::set_chrom() {
+  using namespace mapped_read_format;
+  const char *b = skip_space(line_b, line_e);
+  const char *e = skip_token(b, line_e);
+  const size_t n = e - b;
+  if (chrom_number == 0 || n != chrom_name.size() ||
+      chrom_name.compare(0, n, b, n) != 0) {
+    chrom_name.assign(b, e);
+    ++chrom_number;
+  }
+}
+
+
+inline bool
+MappedReadReader::next_line(const char *&b, const char *&e) {
+  if (held) {
+    held = false;
+    b = line_b;
+    e = line_e;
+    return true;
+  }
+  for (;;) {
+    const char *start = buf.data() + pos;
+    const char *nl = static_cast<const char *>
+      (std::memchr(start, '\n', len - pos));
+    if (!nl) {
+      if (refill())
+        continue;
+      if (pos == len)
+        return false;
+      nl = buf.data() + len; // last line has no newline
+    }
+    pos = std::min(len, static_cast<size_t>(nl - buf.data()) + 1);
+    if (nl == start || (nl == start + 1 && *start == '\r'))
+      continue; // empty line
+    line_b = start;
+    line_e = nl;
+    set_chrom();
+    b = line_b;
+    e = line_e;
+    return true;
+  }
+}
+
+
+/* for reads sorted by chrom and then start, moves "in" to the
+   start of a line that is not after the first read on "chrom"
+   starting at or after "pos", using a binary search over the bytes of
+   the file. A program that needs only the reads of one part of the
+   genome then reads little more than those. Returns false, leaving
+   "in" as it was, if the stream cannot seek, as for compressed input,
+   which must then be read from the start. */
+inline bool
+seek_mapped_reads(std::istream &in, const std::string &chrom,
+                  const size_t pos) {
+  static const size_t min_span = 1ul << 16;
+  const std::streampos begin = in.tellg();
+  if (begin == std::streampos(-1) || !in.seekg(0, std::ios_base::end)) {
+    in.clear();
+    return false;
+  }
+  size_t lo = static_cast<size_t>(begin);
+  size_t hi = static_cast<size_t>(in.tellg());
+
+  std::string line;
+  while (hi - lo > min_span) {
+    // lo is the start of a line before the target, or of the file
+    const size_t mid = lo + (hi - lo)/2;
+    in.seekg(mid - 1);
+    in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    const size_t line_start = in ? static_cast<size_t>(in.tellg()) : hi;
+    if (line_start >= hi || !getline(in, line)) {
+      in.clear();
+      hi = mid;
+      continue;
+    }
+    const char *b = line.data(), *e = line.data() + line.size();
+    const char *c = mapped_read_format::skip_space(b, e);
+    const char *c_end = mapped_read_format::skip_token(c, e);
+    size_t start = 0, stop = 0;
+    if (!mapped_read_format::parse_interval(b, e, start, stop))
+      throw SMITHLABException("bad mapped read line:\n" + line);
+    const int cmp = chrom.compare(0, std::string::npos, c, c_end - c);
+    if (cmp > 0 || (cmp == 0 && start < pos))
+      lo = line_start;
+    else hi = mid;
+  }
+  in.clear();
+  in.seekg(lo);
+  return true;
+}
+
+
+/* For reads sorted as for seek_mapped_reads, sets "found" to whether
+   any read is on "chrom", and leaves "in" where it was. Returns false
+   if the stream cannot seek. */
+inline bool
+has_mapped_reads_on(std::istream &in, const std::string &chrom, bool &found) {
+  const std::streampos begin = in.tellg();
+  if (!seek_mapped_reads(in, chrom, 0))
+    return false;
+  found = false;
+  std::string line;
+  while (getline(in, line)) {
+    const char *b = line.data(), *e = line.data() + line.size();
+    const char *c = mapped_read_format::skip_space(b, e);
+    const char *c_end = mapped_read_format::skip_token(c, e);
+    if (c == c_end)
+      continue;
+    const int cmp = chrom.compare(0, std::string::npos, c, c_end - c);
+    if (cmp <= 0) {
+      found = (cmp == 0);
+      break;
+    }
+  }
+  in.clear();
+  in.seekg(begin);
+  return true;
+}
+
+#endif
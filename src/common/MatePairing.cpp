@@ -0,0 +1,491 @@
+/*
+ *    Copyright (C) 2009-2018 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Meng Zhou, Qiang Song, Andrew Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MatePairing.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "smithlab_utils.hpp"
+
+#include "bam.h"
+#include "bam_endian.h"
+
+using std::string;
+using std::vector;
+using std::max;
+using std::min;
+
+
+/********Below are functions for merging pair-end reads********/
+static void
+fill_overlap(const bool pos_str, const MappedRead &mr, const size_t start,
+             const size_t end, const size_t offset, string &seq, string &scr) {
+  const size_t a = pos_str ? (start - mr.r.get_start()) : (mr.r.get_end() - end);
+  const size_t b = pos_str ? (end -  mr.r.get_start()) : (mr.r.get_end() - start);
+  copy(mr.seq.begin() + a, mr.seq.begin() + b, seq.begin() + offset);
+  copy(mr.scr.begin() + a, mr.scr.begin() + b, scr.begin() + offset);
+}
+
+// the length of a read name without the suffix that tells the mates
+// apart; a name that is not longer than the suffix is used whole
+static size_t
+name_without_suffix(const size_t name_len, const size_t suffix_len) {
+  return name_len > suffix_len ? name_len - suffix_len : name_len;
+}
+
+/* "merged" is reused across calls by the worker threads, so the
+   sequence and score strings are assigned in place rather than built
+   as new strings for each pair */
+static void
+merge_mates(const size_t suffix_len, const size_t range,
+            const MappedRead &one, const MappedRead &two,
+            MappedRead &merged, int &len) {
+
+  const bool pos_str = one.r.pos_strand();
+  const size_t overlap_start = max(one.r.get_start(), two.r.get_start());
+  const size_t overlap_end = min(one.r.get_end(), two.r.get_end());
+
+  const size_t one_left = pos_str ?
+    one.r.get_start() : max(overlap_end, one.r.get_start());
+  const size_t one_right =
+    pos_str ? min(overlap_start, one.r.get_end()) : one.r.get_end();
+
+  const size_t two_left = pos_str ?
+    max(overlap_end, two.r.get_start()) : two.r.get_start();
+  const size_t two_right = pos_str ?
+    two.r.get_end() : min(overlap_start, two.r.get_end());
+
+  len = pos_str ? (two_right - one_left) : (one_right - two_left);
+
+  // assert(len > 0);
+  // if the above assertion fails, it usually means the mair is discordant (end1
+  // downstream of end2). Also it means the SAM flag of this pair of reads is
+  // not properly set. To avoid termination, currently this assertion is ignored
+  // but no output will be generated for discordant pairs.
+
+  // assert(one_left <= one_right && two_left <= two_right);
+  // assert(overlap_start >= overlap_end || static_cast<size_t>(len) ==
+  //    ((one_right - one_left) + (two_right - two_left) + (overlap_end - overlap_start)));
+
+  if (len > 0) {
+    merged.seq.assign(len, 'N');
+    merged.scr.assign(len, 'B');
+    string &seq = merged.seq;
+    string &scr = merged.scr;
+    if (len <= static_cast<int>(range)) {
+      // lim_one: offset in merged sequence where overlap starts
+      const size_t lim_one = one_right - one_left;
+      copy(one.seq.begin(), one.seq.begin() + lim_one, seq.begin());
+      copy(one.scr.begin(), one.scr.begin() + lim_one, scr.begin());
+
+      const size_t lim_two = two_right - two_left;
+      copy(two.seq.end() - lim_two, two.seq.end(), seq.end() - lim_two);
+      copy(two.scr.end() - lim_two, two.scr.end(), scr.end() - lim_two);
+
+      // deal with overlapping part
+      if (overlap_start < overlap_end) {
+        const size_t one_bads = count(one.seq.begin(), one.seq.end(), 'N');
+        const int info_one = one.seq.length() - (one_bads + one.r.get_score());
+
+        const size_t two_bads = count(two.seq.begin(), two.seq.end(), 'N');
+        const int info_two = two.seq.length() - (two_bads + two.r.get_score());
+
+        // use the mate with the most info to fill in the overlap
+        if (info_one >= info_two)
+          fill_overlap(pos_str, one, overlap_start, overlap_end, lim_one, seq, scr);
+        else
+          fill_overlap(pos_str, two, overlap_start, overlap_end, lim_one, seq, scr);
+      }
+    }
+
+    merged.r = one.r;
+    merged.r.set_start(pos_str ? one.r.get_start() : two.r.get_start());
+    merged.r.set_end(merged.r.get_start() + len);
+    merged.r.set_score(one.r.get_score() + two.r.get_score());
+    const string name(one.r.get_name());
+    const size_t name_len = name_without_suffix(name.size(), suffix_len);
+    merged.r.set_name("FRAG:" + name.substr(0, name_len));
+  }
+}
+
+static void
+revcomp(MappedRead &mr) {
+  // set the strand to the opposite of the current value
+  mr.r.set_strand(mr.r.pos_strand() ? '-' : '+');
+  // reverse complement the sequence, and reverse the quality scores
+  revcomp_inplace(mr.seq);
+  std::reverse(mr.scr.begin(), mr.scr.end());
+}
+/********Above are functions for merging pair-end reads********/
+
+
+/********Below are functions for decoding BAM records********/
+/* A BAM record is kept undecoded as the bytes following its
+   "block_size" field: the 32 byte core, then read name, CIGAR,
+   sequence, qualities and tags. Only the core and the read name are
+   needed to pair mates; the rest is decoded by the worker threads. */
+static const size_t BAM_CORE_BYTES = 32;
+
+struct BAMCore {
+  int32_t tid, pos, mtid, mpos;
+  uint32_t flag, l_qname, n_cigar;
+  int32_t l_qseq;
+};
+
+static void
+get_bam_core(const string &raw, BAMCore &c) {
+  uint32_t x[8];
+  memcpy(x, raw.data(), BAM_CORE_BYTES);
+  c.tid = x[0];
+  c.pos = x[1];
+  c.l_qname = x[2] & 0xff;
+  c.flag = x[3] >> 16;
+  c.n_cigar = x[3] & 0xffff;
+  c.l_qseq = x[4];
+  c.mtid = x[5];
+  c.mpos = x[6];
+}
+
+static bool
+read_bam_block(ParallelBGZFReader &in, string &raw) {
+  char buf[4];
+  const size_t n = in.read(buf, 4);
+  if (n == 0) return false;
+  uint32_t block_size = 0;
+  memcpy(&block_size, buf, 4);
+  if (n != 4 || block_size < BAM_CORE_BYTES)
+    throw SMITHLABException("truncated BAM record");
+  raw.resize(block_size);
+  if (in.read(&raw[0], block_size) != block_size)
+    throw SMITHLABException("truncated BAM record");
+  return true;
+}
+
+static void
+read_bam_header(ParallelBGZFReader &in, vector<string> &chrom_names) {
+  char magic[4];
+  if (in.read(magic, 4) != 4 || strncmp(magic, "BAM\1", 4) != 0)
+    throw SMITHLABException("not a BAM file");
+  int32_t l_text = 0, n_ref = 0;
+  in.read(reinterpret_cast<char *>(&l_text), 4);
+  string text(l_text, '\0');
+  in.read(&text[0], l_text);
+  in.read(reinterpret_cast<char *>(&n_ref), 4);
+  for (int32_t i = 0; i < n_ref; ++i) {
+    int32_t l_name = 0, l_ref = 0;
+    in.read(reinterpret_cast<char *>(&l_name), 4);
+    string name(l_name, '\0');
+    if (in.read(&name[0], l_name) != static_cast<size_t>(l_name))
+      throw SMITHLABException("truncated BAM header");
+    in.read(reinterpret_cast<char *>(&l_ref), 4);
+    chrom_names.push_back(name.substr(0, name.find('\0')));
+  }
+}
+
+/* This mirrors how SAMReader converts a SAM line for the "general"
+   and "bismark" mappers: the CIGAR is applied so that the sequence
+   covers the reference interval, the sequence is given in the
+   orientation of the read, the score is the NM tag, and a read is
+   T-rich if it is the first end (or bismark says it is C->T). */
+static void
+bam_to_samrecord(const vector<string> &chrom_names, const string &raw,
+                 SAMRecord &samr) {
+
+  static const char nt16[] = "=ACMGRSVTWYHKDBN";
+
+  bam1_t b;
+  BAMCore core;
+  get_bam_core(raw, core);
+  b.core.tid = core.tid;
+  b.core.pos = core.pos;
+  b.core.l_qname = core.l_qname;
+  b.core.flag = core.flag;
+  b.core.n_cigar = core.n_cigar;
+  b.core.l_qseq = core.l_qseq;
+  b.data = reinterpret_cast<uint8_t *>(const_cast<char *>(raw.data())) +
+    BAM_CORE_BYTES;
+  b.data_len = b.m_data = raw.size() - BAM_CORE_BYTES;
+  b.l_aux = b.data_len - core.n_cigar*4 - core.l_qname -
+    core.l_qseq - (core.l_qseq + 1)/2;
+
+  MappedRead &mr = samr.mr;
+  mr.seq.clear();
+  mr.scr.clear();
+
+  const uint32_t *cigar = bam1_cigar(&b);
+  const uint8_t *seq = bam1_seq(&b);
+  const uint8_t *qual = bam1_qual(&b);
+  const bool has_qual = (core.l_qseq > 0 && qual[0] != 0xff);
+  size_t q = 0;
+  for (size_t i = 0; i < core.n_cigar; ++i) {
+    const uint32_t op = cigar[i] & BAM_CIGAR_MASK;
+    const uint32_t op_len = cigar[i] >> BAM_CIGAR_SHIFT;
+    if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF)
+      for (size_t j = 0; j < op_len; ++j, ++q) {
+        mr.seq += nt16[bam1_seqi(seq, q)];
+        mr.scr += (has_qual ? static_cast<char>(qual[q] + 33) : 'B');
+      }
+    else if (op == BAM_CINS || op == BAM_CSOFT_CLIP)
+      q += op_len;
+    else if (op == BAM_CDEL || op == BAM_CREF_SKIP) {
+      mr.seq.append(op_len, 'N');
+      mr.scr.append(op_len, 'B');
+    }
+  }
+
+  const bool rc = (core.flag & BAM_FREVERSE);
+  if (rc) {
+    revcomp_inplace(mr.seq);
+    std::reverse(mr.scr.begin(), mr.scr.end());
+  }
+
+  mr.r.set_chrom(chrom_names[core.tid]);
+  mr.r.set_start(core.pos);
+  mr.r.set_end(core.pos + mr.seq.length());
+  mr.r.set_name(bam1_qname(&b));
+  mr.r.set_strand(rc ? '-' : '+');
+  const uint8_t *nm = bam_aux_get(&b, "NM");
+  mr.r.set_score(nm ? bam_aux2i(nm) : 0);
+
+  const uint8_t *xr = bam_aux_get(&b, "XR");
+  const char *conversion = xr ? bam_aux2Z(xr) : 0;
+  samr.is_Trich = conversion ? (strncmp(conversion, "CT", 2) == 0) :
+    (!(core.flag & BAM_FPAIRED) || (core.flag & BAM_FREAD1));
+  samr.is_mapping_paired = (core.flag & BAM_FPROPER_PAIR);
+}
+/********Above are functions for decoding BAM records********/
+
+
+/********Below are functions for pairing mates********/
+static ReadJob &
+new_job(vector<ReadJob> &jobs, size_t &n_jobs, const size_t n_mates) {
+  if (n_jobs == jobs.size())
+    jobs.push_back(ReadJob());
+  ReadJob &job = jobs[n_jobs++];
+  job.n_mates = n_mates;
+  return job;
+}
+
+// 64-bit FNV-1a; mates are looked up by a hash of the name without
+// its suffix, and names are compared only when the hashes agree
+static uint64_t
+hash_name(const char *name, const size_t len) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ static_cast<unsigned char>(name[i]))*1099511628211ull;
+  return h;
+}
+
+MatePairer::MatePairer(const string &filename, const string &mapper,
+                       const size_t sl, const size_t msl,
+                       const size_t n_threads) :
+  suffix_len(sl), max_segment_length(msl), cur_chrom_id(0), cur_pos(0),
+  started(false), finished(false), check_sorted(false), n_records(0),
+  serial(0) {
+  if ((mapper == "general" || mapper == "bismark") &&
+      ParallelBGZFReader::is_bgzf(filename)) {
+    if (bam_is_big_endian())
+      throw SMITHLABException("BAM decoding requires little-endian host");
+    bam_reader.reset(new ParallelBGZFReader(filename, n_threads));
+    read_bam_header(*bam_reader, chrom_names);
+    // GenomicRegion keeps a global table of chromosome names; each
+    // name is registered here, before any worker thread sets one
+    for (size_t i = 0; i < chrom_names.size(); ++i)
+      GenomicRegion().set_chrom(chrom_names[i]);
+  }
+  else sam_reader.reset(new SAMReader(filename, mapper));
+}
+
+
+string
+MatePairer::held_name(const MateRecord &rec) const {
+  if (rec.raw.empty()) {
+    const string name(rec.samr.mr.r.get_name());
+    return name.substr(0, name_without_suffix(name.size(), suffix_len));
+  }
+  BAMCore core;
+  get_bam_core(rec.raw, core);
+  // l_qname counts the NUL at the end of the name
+  const size_t name_len = (core.l_qname > 0) ? core.l_qname - 1 : 0;
+  return rec.raw.substr(BAM_CORE_BYTES,
+                        name_without_suffix(name_len, suffix_len));
+}
+
+
+bool
+MatePairer::next_record() {
+  const Location prev(cur_chrom_id, cur_pos);
+  if (bam_reader) {
+    BAMCore core;
+    do {
+      if (!read_bam_block(*bam_reader, cur.raw)) return false;
+      get_bam_core(cur.raw, core);
+    } while (core.flag & (BAM_FUNMAP | BAM_FSECONDARY));
+    cur_chrom_id = core.tid;
+    cur_pos = core.pos;
+    cur_is_paired = (core.flag & BAM_FPROPER_PAIR);
+    cur_expiry = (core.mtid == core.tid) ? max(core.pos, core.mpos) : core.pos;
+  }
+  else {
+    if (!(*sam_reader >> cur.samr, sam_reader->is_good())) return false;
+    cur.raw.clear();
+    const GenomicRegion &r = cur.samr.mr.r;
+    const std::pair<std::unordered_map<string, size_t>::iterator, bool>
+      id(chrom_ids.insert(std::make_pair(r.get_chrom(), chrom_ids.size())));
+    if (id.second)
+      chrom_names.push_back(r.get_chrom());
+    cur_chrom_id = id.first->second;
+    cur_pos = r.get_start();
+    cur_is_paired = cur.samr.is_mapping_paired;
+    cur_expiry = r.get_end() + max_segment_length;
+  }
+  cur.chrom_id = cur_chrom_id;
+  if (check_sorted && started && Location(cur_chrom_id, cur_pos) < prev)
+    throw SMITHLABException("input not sorted by position at record " +
+                            smithlab::toa(n_records + 1));
+  started = true;
+  ++n_records;
+  return true;
+}
+
+
+void
+MatePairer::unhold(const Held &h) {
+  held_locations.erase(held_locations.find(Location(h.rec.chrom_id, h.pos)));
+}
+
+
+void
+MatePairer::release_expired(vector<ReadJob> &jobs, size_t &n_jobs,
+                            const bool all) {
+  while (!expiry.empty() &&
+         (all || expiry.top().chrom_id < cur_chrom_id ||
+          (expiry.top().chrom_id == cur_chrom_id &&
+           expiry.top().pos < cur_pos))) {
+    const Expiry e(expiry.top());
+    expiry.pop();
+    auto range(held.equal_range(e.key));
+    for (auto i(range.first); i != range.second; ++i)
+      if (i->second.serial == e.serial) {
+        unhold(i->second);
+        std::swap(new_job(jobs, n_jobs, 1).mates[0], i->second.rec);
+        held.erase(i);
+        break;
+      }
+  }
+}
+
+
+bool
+MatePairer::fill(vector<ReadJob> &jobs, size_t &n_jobs,
+                 const size_t batch_size) {
+  n_jobs = 0;
+  while (n_jobs < batch_size) {
+    if (!next_record()) {
+      release_expired(jobs, n_jobs, true);
+      finished = true;
+      break;
+    }
+    if (!held.empty())
+      release_expired(jobs, n_jobs, false);
+
+    if (!cur_is_paired) {
+      std::swap(new_job(jobs, n_jobs, 1).mates[0], cur);
+      continue;
+    }
+
+    const string name(held_name(cur));
+    const uint64_t key = hash_name(name.data(), name.length());
+    auto range(held.equal_range(key));
+    auto mate(range.first);
+    while (mate != range.second && held_name(mate->second.rec) != name)
+      ++mate;
+
+    if (mate != range.second) {
+      unhold(mate->second);
+      ReadJob &job = new_job(jobs, n_jobs, 2);
+      std::swap(job.mates[0], mate->second.rec);
+      std::swap(job.mates[1], cur);
+      held.erase(mate);
+    }
+    else {
+      const Expiry e = {cur_chrom_id, cur_expiry, serial, key};
+      expiry.push(e);
+      held_locations.insert(Location(cur_chrom_id, cur_pos));
+      Held h = {serial++, std::move(cur), cur_pos};
+      held.insert(std::make_pair(key, std::move(h)));
+    }
+  }
+  return n_jobs > 0;
+}
+
+
+bool
+MatePairer::get_frontier(size_t &chrom_id, size_t &pos) const {
+  if (finished)
+    return false;
+  Location frontier(cur_chrom_id, cur_pos);
+  if (!started)
+    frontier = Location(0, 0);
+  if (!held_locations.empty())
+    frontier = min(frontier, *held_locations.begin());
+  chrom_id = frontier.first;
+  pos = frontier.second;
+  return true;
+}
+
+
+size_t
+finish_read_job(const size_t suffix_len, const size_t max_segment_length,
+                const vector<string> &chrom_names, ReadJob &job,
+                MappedRead &merged, const MappedRead *out[2]) {
+
+  for (size_t i = 0; i < job.n_mates; ++i)
+    if (!job.mates[i].raw.empty())
+      bam_to_samrecord(chrom_names, job.mates[i].raw, job.mates[i].samr);
+
+  SAMRecord &first = job.mates[0].samr;
+  if (job.n_mates == 1) {
+    if (!first.is_Trich) revcomp(first.mr);
+    out[0] = &first.mr;
+    return 1;
+  }
+
+  if (job.mates[1].samr.is_Trich) std::swap(job.mates[0], job.mates[1]);
+  SAMRecord &second = job.mates[1].samr;
+  revcomp(second.mr);
+
+  int len = 0;
+  merge_mates(suffix_len, max_segment_length, first.mr, second.mr, merged, len);
+  // discordant pairs (len <= 0) produce no output
+  if (len > 0 && len <= static_cast<int>(max_segment_length)) {
+    out[0] = &merged;
+    return 1;
+  }
+  else if (len > 0) {
+    out[0] = &first.mr;
+    out[1] = &second.mr;
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *    Copyright (C) 2009-2018 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Meng Zhou, Qiang Song, Andrew Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The conversion of SAM/BAM records into MappedRead format done by
+ * to-mr: pairing the mates of each fragment as records are read, and
+ * converting each single read or pair into reads in the MappedRead
+ * format. Pairing is serial; "finish_read_job" can be run by any
+ * number of threads. Building this requires the samtools headers.
+ */
+
+#ifndef MATE_PAIRING_HPP
+#define MATE_PAIRING_HPP
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "SAM.hpp"
+#include "MappedRead.hpp"
+#include "ParallelBGZF.hpp"
+
+struct MateRecord {
+  SAMRecord samr;  // decoded record
+  std::string raw; // undecoded BAM record; empty if "samr" is filled in
+  size_t chrom_id; // index of the chrom in order of the input
+};
+
+// a unit of work for the threads: one single read or one mate pair
+struct ReadJob {
+  MateRecord mates[2];
+  size_t n_mates;
+};
+
+/* MatePairer: the serial stage. It reads records in file order and
+   holds each properly paired read until its mate arrives. A held read
+   is given up as a single end once the input has moved past the
+   position where its mate could still appear: the mate position from
+   the BAM record, or MAX_SEGMENT_LENGTH past the end of the read for
+   input read through SAMReader. With sorted input the number of held
+   reads is therefore bounded by the depth over one fragment length. */
+class MatePairer {
+public:
+  MatePairer(const std::string &filename, const std::string &mapper,
+             const size_t suffix_len, const size_t max_segment_length,
+             const size_t n_threads);
+
+  // fills jobs[0, n_jobs) with up to "batch_size" jobs; the vector
+  // grows as needed and the jobs in it are reused between calls
+  bool fill(std::vector<ReadJob> &jobs, size_t &n_jobs,
+            const size_t batch_size);
+
+  size_t get_n_records() const {return n_records;}
+
+  // names of chroms by chrom_id; for SAM input this grows as reading
+  // proceeds and must only be used from the thread calling "fill"
+  const std::vector<std::string> &get_chrom_names() const {
+    return chrom_names;
+  }
+
+  /* For input sorted by position, every read in the output of a job
+     not yet returned by "fill" starts at or after the (chrom_id, pos)
+     given by this function. Returns false once the input has been
+     exhausted and all jobs returned. */
+  bool get_frontier(size_t &chrom_id, size_t &pos) const;
+
+  // throw an exception if records are not in order of position
+  void require_sorted() {check_sorted = true;}
+
+private:
+  struct Held {
+    size_t serial;
+    MateRecord rec;
+    size_t pos;
+  };
+  // min-heap order on (chrom, position) after which a mate is not expected
+  struct Expiry {
+    size_t chrom_id, pos, serial;
+    uint64_t key;
+    bool operator<(const Expiry &other) const {
+      return chrom_id > other.chrom_id ||
+        (chrom_id == other.chrom_id && pos > other.pos);
+    }
+  };
+  typedef std::pair<size_t, size_t> Location;
+
+  bool next_record();
+  void release_expired(std::vector<ReadJob> &jobs, size_t &n_jobs,
+                       const bool all);
+  std::string held_name(const MateRecord &rec) const;
+  void unhold(const Held &h);
+
+  const size_t suffix_len;
+  const size_t max_segment_length;
+  std::unique_ptr<ParallelBGZFReader> bam_reader;
+  std::unique_ptr<SAMReader> sam_reader;
+  std::vector<std::string> chrom_names;
+  std::unordered_map<std::string, size_t> chrom_ids;
+
+  MateRecord cur;
+  size_t cur_chrom_id;
+  size_t cur_pos;
+  bool cur_is_paired;
+  size_t cur_expiry;
+  bool started;
+  bool finished;
+  bool check_sorted;
+
+  std::unordered_multimap<uint64_t, Held> held;
+  std::priority_queue<Expiry> expiry;
+  std::multiset<Location> held_locations;
+  size_t n_records;
+  size_t serial;
+};
+
+/* Converts the records of a job into the reads to-mr would output: a
+   single end is given in the orientation of the T-rich strand, and a
+   pair is merged into one fragment read in "merged", unless the
+   fragment is longer than "max_segment_length", in which case both
+   ends are output separately. Returns the number of output reads, put
+   in "out"; out[i] comes from job.mates[i] (the merged read from
+   job.mates[0]). Discordant pairs give no output. */
+size_t
+finish_read_job(const size_t suffix_len, const size_t max_segment_length,
+                const std::vector<std::string> &chrom_names, ReadJob &job,
+                MappedRead &merged, const MappedRead *out[2]);
+
+#endif
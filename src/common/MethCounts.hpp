@@ -0,0 +1,452 @@
+/*
+ *    Copyright (C) 2011-2018 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith and Song Qiang
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The counting shared by methcounts and bsrate: both walk each mapped
+ * read against the reference chromosome, methcounts accumulating the
+ * bases observed at each reference position (CountSet) and bsrate
+ * accumulating conversion events at each position in the read
+ * (ConversionCounts). Having both here lets one pass over the reads
+ * produce both results, and lets methcounts sites be produced without
+ * going through text. The ConversionCounts are indexed by read
+ * position, not by genome position, so each thread can keep its own
+ * and they can be summed in any order at the end.
+ */
+
+#ifndef METH_COUNTS_HPP
+#define METH_COUNTS_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+
+#include "MappedRead.hpp"
+#include "MethpipeSite.hpp"
+#include "bsutils.hpp"
+
+/* Right now the CountSet objects below are much larger than they need
+   to be, for the things we are computing. However, it's not clear
+   that the minimum information would really put the memory
+   requirement of the program into a more reasonable range, so keeping
+   all the information seems reasonable. */
+
+template <class count_type>
+struct CountSet {
+
+  std::string tostring() const {
+    std::ostringstream oss;
+    oss << pA << '\t' << pC << '\t' << pG << '\t' << pT << '\t'
+        << nA << '\t' << nC << '\t' << nG << '\t' << nT << '\t' << N;
+    return oss.str();
+  }
+  void add_count_pos(const char x) {
+    if (x == 'T') ++pT; // conditions ordered for efficiency
+    else if (x == 'C') ++pC;
+    else if (x == 'G') ++pG;
+    else if (x == 'A') ++pA;
+    else ++N;
+  }
+  void add_count_neg(const char x) {
+    if (x == 'T') ++nT; // conditions ordered for efficiency
+    else if (x == 'C') ++nC;
+    else if (x == 'G') ++nG;
+    else if (x == 'A') ++nA;
+    else ++N;
+  }
+  count_type pos_total() const {return pA + pC + pG + pT;}
+  count_type neg_total() const {return nA + nC + nG + nT;}
+
+  count_type unconverted_cytosine() const {return pC;}
+  count_type converted_cytosine() const {return pT;}
+  count_type unconverted_guanine() const {return nC;}
+  count_type converted_guanine() const {return nT;}
+
+  // using "int" here because it is smaller
+  count_type pA, pC, pG, pT;
+  count_type nA, nC, nG, nT;
+  count_type N;
+};
+
+
+template <class count_type>
+void
+count_states_pos(const std::string &chrom, const MappedRead &r,
+                 std::vector<CountSet<count_type> > &counts) {
+  const size_t width = r.r.get_width();
+
+  size_t position = r.r.get_start();
+  assert(position < chrom.length());
+  for (size_t i = 0; i < width; ++i, ++position)
+    if (position < chrom.length())
+      counts[position].add_count_pos(r.seq[i]);
+}
+
+
+template <class count_type>
+void
+count_states_neg(const std::string &chrom, const MappedRead &r,
+                 std::vector<CountSet<count_type> > &counts) {
+  const size_t width = r.r.get_width();
+
+  size_t position = r.r.get_start() + width - 1;
+  assert(r.r.get_start() < chrom.length());
+  for (size_t i = 0; i < width; ++i, --position)
+    if (position < chrom.length())
+      counts[position].add_count_neg(r.seq[i]);
+}
+
+
+/* The three functions below here should probably be moved into
+   bsutils.hpp. I am not sure if the DDG function is needed, but it
+   seems like if one considers strand, and the CHH is not symmetric,
+   then one needs this. Also, Qiang should be consulted on this
+   because he spent much time thinking about it in the context of
+   plants. */
+inline bool
+is_chh(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    is_cytosine(s[i]) &&
+    !is_guanine(s[i + 1]) &&
+    !is_guanine(s[i + 2]);
+}
+
+
+inline bool
+is_ddg(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    !is_cytosine(s[i]) &&
+    !is_cytosine(s[i + 1]) &&
+    is_guanine(s[i + 2]);
+}
+
+
+inline bool
+is_c_at_g(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    is_cytosine(s[i]) &&
+    !is_cytosine(s[i + 1]) &&
+    !is_guanine(s[i + 1]) &&
+    is_guanine(s[i + 2]);
+}
+
+
+/* The "tag" returned by this function should be exclusive, so that
+ * the order of checking conditions doesn't matter. There is also a
+ * bit of a hack in that the unsigned "pos" could wrap, but this still
+ * works as long as the chromosome size is not the maximum size of a
+ * size_t.
+ */
+inline std::string
+get_methylation_context_tag(const std::string &s, const size_t pos) {
+  if (is_cytosine(s[pos])) {
+    if (is_cpg(s, pos)) return "CpG";
+    else if (is_chh(s, pos)) return "CHH";
+    else if (is_c_at_g(s, pos)) return "CXG";
+    else return "CCG";
+  }
+  if (is_guanine(s[pos])) {
+    if (is_cpg(s, pos - 1)) return "CpG";
+    else if (is_ddg(s, pos - 2)) return "CHH";
+    else if (is_c_at_g(s, pos - 2)) return "CXG";
+    else return "CCG";
+  }
+  return "N";
+}
+
+
+/* This "has_mutated" function looks on the opposite strand to see
+ * if the apparent conversion from C->T was actually already in the
+ * DNA because of a mutation or SNP.
+ */
+inline bool
+has_mutated(const double opposite_g, const double opposite_total) {
+  static const double MUTATION_DEFINING_FRACTION = 0.5;
+  return opposite_g < MUTATION_DEFINING_FRACTION*opposite_total;
+}
+
+
+template <class count_type>
+bool
+has_mutated(const char base, const CountSet<count_type> &cs) {
+  return is_cytosine(base) ?
+    has_mutated(cs.nG, cs.neg_total()) :
+    has_mutated(cs.pG, cs.pos_total());
+}
+
+
+/* Sets the fields of "site" other than the chrom for the cytosine, on
+ * either strand, at position "pos" of "chrom", from the reads on its
+ * strand that show it unconverted or converted.
+ */
+inline void
+set_site(const std::string &chrom, const size_t pos,
+         const double unconverted, const double converted,
+         const bool mutated, MSite &site) {
+  site.context = get_methylation_context_tag(chrom, pos);
+  if (mutated)
+    site.context += 'x';
+  site.pos = pos;
+  site.strand = is_cytosine(chrom[pos]) ? '+' : '-';
+  site.n_reads = converted + unconverted;
+  site.meth = site.n_reads == 0 ? 0.0 : unconverted/site.n_reads;
+}
+
+
+/* Calls "f" with an MSite for each cytosine on either strand of
+ * "chrom" at positions in [start, end), in order of position, as
+ * methcounts outputs them. The MSite is reused between calls. Sites
+ * with no coverage have a methylation level of 0.
+ */
+template <class count_type, class SiteHandler>
+void
+get_sites(const std::string &chrom_name, const std::string &chrom,
+          const std::vector<CountSet<count_type> > &counts,
+          const size_t start, const size_t end,
+          const bool CPG_ONLY, SiteHandler f) {
+
+  MSite site;
+  site.chrom = chrom_name;
+  for (size_t i = start; i < end; ++i) {
+    const char base = chrom[i];
+    if (is_cytosine(base) || is_guanine(base)) {
+      const double unconverted = is_cytosine(base) ?
+        counts[i].unconverted_cytosine() : counts[i].unconverted_guanine();
+      const double converted = is_cytosine(base) ?
+        counts[i].converted_cytosine() : counts[i].converted_guanine();
+      set_site(chrom, i, unconverted, converted,
+               has_mutated(base, counts[i]), site);
+      if (!CPG_ONLY || site.is_cpg())
+        f(site);
+    }
+  }
+}
+
+
+// the same, for the whole chrom
+template <class count_type, class SiteHandler>
+void
+get_sites(const std::string &chrom_name, const std::string &chrom,
+          const std::vector<CountSet<count_type> > &counts,
+          const bool CPG_ONLY, SiteHandler f) {
+  get_sites(chrom_name, chrom, counts, 0, counts.size(), CPG_ONLY, f);
+}
+
+
+// an A-rich read as bsrate -A counts it: reverse complemented, and on
+// the other strand
+inline void
+revcomp_a_rich_read(MappedRead &mr) {
+  revcomp_inplace(mr.seq);
+  mr.r.set_strand(mr.r.pos_strand() ? '-' : '+');
+}
+
+
+/* ConversionCounts: the per-read-position counts of bsrate. For each
+ * position in a read the number of unconverted (C), converted (T)
+ * and other (error) bases are counted over reference cytosines, for
+ * reads mapping to each strand. The "hanging" count is the number of
+ * read bases falling past the end of the chromosome.
+ */
+struct ConversionCounts {
+
+  // ASSUMED MAXIMUM LENGTH OF A FRAGMENT
+  static const size_t OUTPUT_SIZE = 10000;
+
+  ConversionCounts() :
+    unconv_pos(OUTPUT_SIZE, 0ul), conv_pos(OUTPUT_SIZE, 0ul),
+    unconv_neg(OUTPUT_SIZE, 0ul), conv_neg(OUTPUT_SIZE, 0ul),
+    err_pos(OUTPUT_SIZE, 0ul), err_neg(OUTPUT_SIZE, 0ul), hanging(0) {}
+
+  void add_read(const bool INCLUDE_CPGS, const std::string &chrom,
+                const MappedRead &r) {
+    if (r.r.pos_strand())
+      count_pos(INCLUDE_CPGS, chrom, r);
+    else count_neg(INCLUDE_CPGS, chrom, r);
+  }
+
+  ConversionCounts &operator+=(const ConversionCounts &other) {
+    add_to(other.unconv_pos, unconv_pos);
+    add_to(other.conv_pos, conv_pos);
+    add_to(other.unconv_neg, unconv_neg);
+    add_to(other.conv_neg, conv_neg);
+    add_to(other.err_pos, err_pos);
+    add_to(other.err_neg, err_neg);
+    hanging += other.hanging;
+    return *this;
+  }
+
+  void write(std::ostream &out) const;
+
+  std::vector<size_t> unconv_pos;
+  std::vector<size_t> conv_pos;
+  std::vector<size_t> unconv_neg;
+  std::vector<size_t> conv_neg;
+  std::vector<size_t> err_pos;
+  std::vector<size_t> err_neg;
+  size_t hanging;
+
+private:
+  static void
+  add_to(const std::vector<size_t> &a, std::vector<size_t> &b) {
+    for (size_t i = 0; i < a.size(); ++i)
+      b[i] += a[i];
+  }
+
+  void
+  count_base(const char base, const size_t i,
+             std::vector<size_t> &unconv, std::vector<size_t> &conv,
+             std::vector<size_t> &err) {
+    if (is_cytosine(base)) ++unconv[i];
+    else if (is_thymine(base)) ++conv[i];
+    else if (toupper(base) != 'N')
+      ++err[i];
+  }
+
+  void
+  count_pos(const bool INCLUDE_CPGS, const std::string &chrom,
+            const MappedRead &r) {
+    const size_t width =
+      std::min(r.r.get_width(), static_cast<size_t>(OUTPUT_SIZE));
+    const size_t offset = r.r.get_start();
+
+    size_t position = offset;
+    assert(offset < chrom.length()); // at least one bp of read on chr
+    for (size_t i = 0; i < width; ++i, ++position) {
+      if (position >= chrom.length()) { // some overhang
+        ++hanging;
+        continue;
+      }
+      if (is_cytosine(chrom[position]) &&
+          (position + 1 == chrom.length() ||
+           !is_guanine(chrom[position + 1]) ||
+           INCLUDE_CPGS))
+        count_base(r.seq[i], i, unconv_pos, conv_pos, err_pos);
+    }
+  }
+
+  void
+  count_neg(const bool INCLUDE_CPGS, const std::string &chrom,
+            const MappedRead &r) {
+    const size_t width =
+      std::min(r.r.get_width(), static_cast<size_t>(OUTPUT_SIZE));
+    const size_t offset = r.r.get_start();
+
+    size_t position = offset + r.r.get_width() - 1;
+    assert(offset < chrom.length()); // at least one bp of read on chr
+    for (size_t i = 0; i < width; ++i, --position) {
+      if (position >= chrom.length()) {
+        ++hanging;
+        continue;
+      }
+      if (is_guanine(chrom[position]) &&
+          (position == 0 ||
+           !is_cytosine(chrom[position - 1]) ||
+           INCLUDE_CPGS))
+        count_base(r.seq[i], i, unconv_neg, conv_neg, err_neg);
+    }
+  }
+};
+
+
+inline void
+ConversionCounts::write(std::ostream &out) const {
+
+  using std::accumulate;
+  using std::endl;
+  using std::max;
+
+  // Get some totals first
+  const size_t pos_cvt = accumulate(conv_pos.begin(), conv_pos.end(), 0ul);
+  const size_t neg_cvt = accumulate(conv_neg.begin(), conv_neg.end(), 0ul);
+  const size_t total_cvt = pos_cvt + neg_cvt;
+
+  const size_t pos_ucvt = accumulate(unconv_pos.begin(), unconv_pos.end(), 0ul);
+  const size_t neg_ucvt = accumulate(unconv_neg.begin(), unconv_neg.end(), 0ul);
+  const size_t total_ucvt = pos_ucvt + neg_ucvt;
+
+  out << "OVERALL CONVERSION RATE = "
+      << static_cast<double>(total_cvt)/(total_cvt + total_ucvt) << endl
+      << "POS CONVERSION RATE = "
+      << static_cast<double>(pos_cvt)/(pos_cvt + pos_ucvt) << '\t'
+      << std::fixed << static_cast<size_t>(pos_cvt + pos_ucvt) << endl
+      << "NEG CONVERSION RATE = "
+      << static_cast<double>(neg_cvt)/(neg_cvt + neg_ucvt) << '\t'
+      << std::fixed << static_cast<size_t>(neg_cvt + neg_ucvt) << endl;
+
+  out << "BASE" << '\t'
+      << "PTOT" << '\t'
+      << "PCONV" << '\t'
+      << "PRATE" << '\t'
+      << "NTOT" << '\t'
+      << "NCONV" << '\t'
+      << "NRATE" << '\t'
+      << "BTHTOT" << '\t'
+      << "BTHCONV" << '\t'
+      << "BTHRATE" << '\t'
+      << "ERR" << '\t'
+      << "ALL" << '\t'
+      << "ERRRATE"  << endl;
+
+  // Figure out how many positions to print in the output, capped at 1000
+  size_t output_len = (unconv_pos.size() > 1000) ? 1000 : unconv_pos.size();
+
+  while (output_len > 0 &&
+         (unconv_pos[output_len-1] + conv_pos[output_len-1] +
+          unconv_neg[output_len-1] + conv_neg[output_len-1] == 0))
+    --output_len;
+
+  // Now actually output the results
+  static const size_t precision_val = 5;
+  for (size_t i = 0; i < output_len; ++i) {
+
+    const size_t total_p = unconv_pos[i] + conv_pos[i];
+    const size_t total_n = unconv_neg[i] + conv_neg[i];
+    const size_t total_valid = total_p + total_n;
+    out << (i + 1) << "\t";
+
+    out.precision(precision_val);
+    out << total_p << '\t' << conv_pos[i] << '\t'
+        << static_cast<double>(conv_pos[i])/max(size_t(1ul), total_p)
+        << '\t';
+
+    out.precision(precision_val);
+    out << total_n << '\t' << conv_neg[i] << '\t'
+        << static_cast<double>(conv_neg[i])/max(size_t(1ul), total_n)
+        << '\t';
+
+    const double total_cvt = conv_pos[i] + conv_neg[i];
+    out.precision(precision_val);
+    out << static_cast<size_t>(total_valid)
+        << '\t' << conv_pos[i] + conv_neg[i] << '\t'
+        << total_cvt/max(static_cast<size_t>(1), total_valid) << '\t';
+
+    const double total_err = err_pos[i] + err_neg[i];
+    out.precision(precision_val);
+    const size_t total = total_valid + err_pos[i] + err_neg[i];
+    out << err_pos[i] + err_neg[i] << '\t' << static_cast<size_t>(total) << '\t'
+        << total_err/max(static_cast<size_t>(1), total) << endl;
+  }
+}
+
+#endif
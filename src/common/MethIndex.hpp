@@ -0,0 +1,295 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Methylome index files: for the sites of a methcounts file, the
+ * running totals of the counts that roimethstat gives for a region,
+ * so the counts for any interval are the difference of the totals at
+ * its two ends, found by binary search, without reading the sites
+ * in it. The index is written next to the methcounts file (".midx")
+ * by methindex, and is used through a MappedFile, so only the pages
+ * touched by queries are read.
+ *
+ * The file is a header, then for each chrom one record for each of
+ * its sites, in the order of the methcounts file, with the position
+ * of the site and the totals for the sites of the chrom before it;
+ * then one more record with the totals for the chrom. Last is a
+ * table of chroms, each with the index of its first record and its
+ * number of sites. Numbers are stored as on the machine that made the
+ * index, which must be the one that reads it.
+ *
+ * The counts are exact, but the sum of levels for an interval is the
+ * difference of two running sums, which can differ in the last digits
+ * from adding the levels of its sites; the totals start again at each
+ * chrom to keep the sums small.
+ */
+
+#ifndef METH_INDEX_HPP
+#define METH_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "smithlab_utils.hpp"
+#include "MethpipeSite.hpp"
+#include "MappedFile.hpp"
+#include "bsutils.hpp"
+
+inline std::pair<bool, bool>
+meth_unmeth_calls(const size_t n_meth, const size_t n_unmeth) {
+  static const double alpha = 0.95;
+  // get info for binomial test
+  double lower = 0.0, upper = 0.0;
+  const size_t total = n_meth + n_unmeth;
+  wilson_ci_for_binomial(alpha, total,
+                         static_cast<double>(n_meth)/total, lower, upper);
+  return std::make_pair(lower > 0.5, upper < 0.5);
+}
+
+
+// the counts over the sites of a region, as given by roimethstat
+struct RegionStats {
+  RegionStats() : total_cpgs(0), cpgs_with_reads(0), meth(0), reads(0),
+                  called_total(0), called_meth(0), mean_meth(0.0) {}
+  void add(const double meth_freq, const size_t n_reads) {
+    ++total_cpgs;
+    if (n_reads > 0) {
+      const size_t n_meth = roundf(meth_freq*n_reads);
+      const size_t n_unmeth = roundf((1.0 - meth_freq)*n_reads);
+      meth += n_meth;
+      reads += n_reads;
+      ++cpgs_with_reads;
+
+      const std::pair<bool, bool> calls = meth_unmeth_calls(n_meth, n_unmeth);
+      called_total += (calls.first || calls.second);
+      called_meth += calls.first;
+
+      mean_meth += static_cast<double>(n_meth)/n_reads;
+    }
+  }
+  size_t total_cpgs;
+  size_t cpgs_with_reads;
+  size_t meth;
+  size_t reads;
+  size_t called_total;
+  size_t called_meth;
+  double mean_meth;
+};
+
+
+struct MethIndexRecord {
+  MethIndexRecord() {}
+  MethIndexRecord(const size_t p, const RegionStats &s) :
+    pos(p), n_covered(s.cpgs_with_reads), called_meth(s.called_meth),
+    called_total(s.called_total), n_meth(s.meth), n_reads(s.reads),
+    mean_meth(s.mean_meth) {}
+  uint32_t pos;
+  uint32_t n_covered;
+  uint32_t called_meth;
+  uint32_t called_total;
+  uint64_t n_meth;
+  uint64_t n_reads;
+  double mean_meth;
+};
+
+
+static const char METH_INDEX_MAGIC[] = "MPMIDX02";
+static const size_t METH_INDEX_MAGIC_SIZE = 8;
+
+struct MethIndexHeader {
+  char magic[METH_INDEX_MAGIC_SIZE];
+  uint64_t source_size; // of the methcounts file, to find stale indexes
+  uint64_t n_sites;
+  uint64_t n_chroms;
+  uint64_t chroms_offset;
+};
+
+
+inline std::string
+meth_index_name(const std::string &meth_file) {return meth_file + ".midx";}
+
+
+/* writes the index for the methcounts sites in "in", which came from
+   a file of "source_size" bytes, and returns the number of sites; the
+   sites must be sorted. Blank lines and lines starting with '#' are
+   skipped, as by roimethstat. */
+inline size_t
+write_meth_index(std::istream &in, const uint64_t source_size,
+                 const std::string &index_file) {
+  std::ofstream out(index_file.c_str(), std::ios::binary);
+  if (!out)
+    throw SMITHLABException("bad output file: " + index_file);
+
+  MethIndexHeader h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, METH_INDEX_MAGIC, METH_INDEX_MAGIC_SIZE);
+  h.source_size = source_size;
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+  std::vector<std::string> chroms;
+  std::vector<uint64_t> chrom_first, chrom_sites;
+  std::unordered_map<std::string, size_t> seen;
+
+  RegionStats total;
+  MSite site;
+  std::string line;
+  size_t prev_pos = 0;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream iss(line);
+    if (!(iss >> site.chrom >> site.pos >> site.strand
+          >> site.context >> site.meth >> site.n_reads))
+      throw SMITHLABException("bad line in methcounts file:\n" + line);
+    if (chroms.empty() || site.chrom != chroms.back()) {
+      if (!seen.insert(std::make_pair(site.chrom, chroms.size())).second)
+        throw SMITHLABException("sites not sorted: chrom " + site.chrom +
+                                " appears twice");
+      // the totals for the previous chrom end its records
+      if (!chroms.empty()) {
+        const MethIndexRecord end(0, total);
+        out.write(reinterpret_cast<const char *>(&end), sizeof(end));
+      }
+      chroms.push_back(site.chrom);
+      chrom_first.push_back(h.n_sites + chroms.size() - 1);
+      chrom_sites.push_back(0);
+      total = RegionStats();
+    }
+    else if (site.pos < prev_pos)
+      throw SMITHLABException("sites not sorted at " + site.chrom + ":" +
+                              toa(site.pos));
+    if (site.pos > UINT32_MAX)
+      throw SMITHLABException("position too large for index: " +
+                              toa(site.pos));
+    prev_pos = site.pos;
+    const MethIndexRecord r(site.pos, total);
+    out.write(reinterpret_cast<const char *>(&r), sizeof(r));
+    total.add(site.meth, site.n_reads);
+    ++chrom_sites.back();
+    ++h.n_sites;
+  }
+  if (in.bad())
+    throw SMITHLABException("error reading sites for: " + index_file);
+  if (!chroms.empty()) {
+    const MethIndexRecord end(0, total);
+    out.write(reinterpret_cast<const char *>(&end), sizeof(end));
+  }
+
+  // the chrom table: first record, number of sites, name length and
+  // the name, padded to 8 bytes
+  h.n_chroms = chroms.size();
+  h.chroms_offset =
+    sizeof(h) + (h.n_sites + h.n_chroms)*sizeof(MethIndexRecord);
+  for (size_t i = 0; i < chroms.size(); ++i) {
+    const uint64_t entry[] = {chrom_first[i], chrom_sites[i], chroms[i].size()};
+    out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+    out.write(chroms[i].data(), chroms[i].size());
+    const size_t pad = (8 - chroms[i].size() % 8) % 8;
+    out.write("\0\0\0\0\0\0\0", pad);
+  }
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+  if (!out)
+    throw SMITHLABException("error writing file: " + index_file);
+  return h.n_sites;
+}
+
+
+/* MethIndex: queries on an index file, which is mapped into memory.
+   Giving the size of the methcounts file checks that the index was
+   made from it as it is now. */
+class MethIndex {
+public:
+  explicit MethIndex(const std::string &index_file,
+                     const uint64_t source_size = 0) :
+    file(index_file) {
+    const char *data = file.data();
+    if (file.size() < sizeof(MethIndexHeader) ||
+        std::memcmp(data, METH_INDEX_MAGIC, METH_INDEX_MAGIC_SIZE) != 0)
+      throw SMITHLABException("not a methylome index: " + index_file);
+    std::memcpy(&header, data, sizeof(header));
+    if (source_size != 0 && source_size != header.source_size)
+      throw SMITHLABException("index is out of date: " + index_file);
+    const size_t n_records = header.n_sites + header.n_chroms;
+    if (header.chroms_offset != sizeof(header) +
+        n_records*sizeof(MethIndexRecord) ||
+        header.chroms_offset > file.size())
+      throw SMITHLABException("bad methylome index: " + index_file);
+    records = reinterpret_cast<const MethIndexRecord *>(data + sizeof(header));
+
+    const char *p = data + header.chroms_offset;
+    const char *const end = data + file.size();
+    for (size_t i = 0; i < header.n_chroms; ++i) {
+      uint64_t entry[3];
+      if (p + sizeof(entry) > end)
+        throw SMITHLABException("bad methylome index: " + index_file);
+      std::memcpy(entry, p, sizeof(entry));
+      p += sizeof(entry);
+      if (p + entry[2] > end || entry[0] + entry[1] >= n_records)
+        throw SMITHLABException("bad methylome index: " + index_file);
+      chroms[std::string(p, entry[2])] = std::make_pair(entry[0], entry[1]);
+      p += entry[2] + (8 - entry[2] % 8) % 8;
+    }
+  }
+
+  size_t n_sites() const {return header.n_sites;}
+
+  // the counts over sites in [start, end) of "chrom"
+  void query(const std::string &chrom, const size_t start, const size_t end,
+             RegionStats &s) const {
+    s = RegionStats();
+    const auto ch = chroms.find(chrom);
+    if (ch == chroms.end() || end <= start)
+      return;
+    const MethIndexRecord *first = records + ch->second.first;
+    const MethIndexRecord *last = first + ch->second.second;
+    const MethIndexRecord *lo = lower_bound(first, last, start);
+    const MethIndexRecord *hi = lower_bound(lo, last, end);
+    s.total_cpgs = hi - lo;
+    s.cpgs_with_reads = hi->n_covered - lo->n_covered;
+    s.meth = hi->n_meth - lo->n_meth;
+    s.reads = hi->n_reads - lo->n_reads;
+    s.called_meth = hi->called_meth - lo->called_meth;
+    s.called_total = hi->called_total - lo->called_total;
+    s.mean_meth = hi->mean_meth - lo->mean_meth;
+  }
+
+private:
+  static const MethIndexRecord *
+  lower_bound(const MethIndexRecord *first, const MethIndexRecord *last,
+              const size_t pos) {
+    return std::lower_bound(first, last, pos,
+                            [](const MethIndexRecord &r, const size_t p) {
+                              return r.pos < p;
+                            });
+  }
+
+  MappedFile file;
+  MethIndexHeader header;
+  const MethIndexRecord *records;
+  std::unordered_map<std::string, std::pair<size_t, size_t> > chroms;
+};
+
+#endif
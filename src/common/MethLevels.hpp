@@ -0,0 +1,295 @@
+/*
+ *    Copyright (C) 2014-2018 University of Southern California and
+ *                            Andrew D. Smith and Benjamin E Decato
+ *
+ *    Authors: Andrew D. Smith and Benjamin E Decato
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ */
+
+/* The summary statistics computed by levels: coverage, mutations and
+ * three kinds of methylation level, for each context, accumulated one
+ * site at a time in the order of a methcounts file.
+ */
+
+#ifndef METH_LEVELS_HPP
+#define METH_LEVELS_HPP
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "smithlab_utils.hpp"
+#include "MethpipeSite.hpp"
+#include "bsutils.hpp"
+
+struct LevelsCounter {
+  size_t total_sites;
+  size_t sites_covered;
+  size_t max_coverage;
+  size_t mutations;
+  size_t total_c, total_t;
+  size_t called_meth, called_unmeth;
+  double mean_agg;
+  LevelsCounter() : total_sites(0), sites_covered(0), max_coverage(0),
+                    mutations(0), total_c(0), total_t(0),
+                    called_meth(0), called_unmeth(0),
+                    mean_agg(0.0) {}
+
+  void update(const MSite &s, const double alpha) {
+    if (s.is_mutated()) {
+      ++mutations;
+    }
+    else if (s.n_reads > 0) {
+      ++sites_covered;
+      max_coverage = std::max(max_coverage, s.n_reads);
+      total_c += s.n_meth();
+      total_t += s.n_reads - s.n_meth();
+      mean_agg += s.meth;
+      double lower = 0.0, upper = 0.0;
+      wilson_ci_for_binomial(alpha, s.n_reads, s.meth, lower, upper);
+      called_meth += (lower > 0.5);
+      called_unmeth += (upper < 0.5);
+    }
+    ++total_sites;
+  }
+
+  LevelsCounter &operator+=(const LevelsCounter &other) {
+    total_sites += other.total_sites;
+    sites_covered += other.sites_covered;
+    max_coverage = std::max(max_coverage, other.max_coverage);
+    mutations += other.mutations;
+    total_c += other.total_c;
+    total_t += other.total_t;
+    called_meth += other.called_meth;
+    called_unmeth += other.called_unmeth;
+    mean_agg += other.mean_agg;
+    return *this;
+  }
+
+  size_t coverage() const {return total_c + total_t;}
+  size_t total_called() const {return called_meth + called_unmeth;}
+
+  double weighted_mean_meth() const {
+    return static_cast<double>(total_c)/coverage();
+  }
+  double fractional_meth() const {
+    return static_cast<double>(called_meth)/total_called();
+  }
+  double mean_meth() const {
+    return mean_agg/sites_covered;
+  }
+
+  std::string format_summary(const std::string &context) const {
+    std::ostringstream oss;
+    const bool good = (sites_covered != 0);
+    oss << "METHYLATION LEVELS (" + context + " CONTEXT):\n"
+        << '\t' << "sites" << '\t' << total_sites << '\n'
+        << '\t' << "sites_covered" << '\t' << sites_covered << '\n'
+        << '\t' << "fraction_covered" << '\t'
+        << static_cast<double>(sites_covered)/total_sites << '\n'
+        << '\t' << "mean_depth" << '\t'
+        << static_cast<double>(coverage())/total_sites << '\n'
+        << '\t' << "mean_depth_covered" << '\t'
+        << static_cast<double>(coverage())/sites_covered << '\n'
+        << '\t' << "max_depth" << '\t' << max_coverage << '\n'
+        << '\t' << "mutations" << '\t' << mutations << '\n'
+        << '\t' << "mean_meth" << '\t'
+        << (good ? toa(mean_meth()) : "N/A")  << '\n'
+        << '\t' << "w_mean_meth" << '\t'
+        << (good ? toa(weighted_mean_meth()) : "N/A") << '\n'
+        << '\t' << "frac_meth" << '\t'
+        << (good ? toa(fractional_meth()) : "N/A");
+    return oss.str();
+  }
+};
+
+
+// the summaries for each context, as output by levels
+struct LevelsSummary {
+  LevelsCounter all_c, cpg, cpg_symm, chh, ccg, cxg;
+
+  LevelsSummary &operator+=(const LevelsSummary &other) {
+    all_c += other.all_c;
+    cpg += other.cpg;
+    cpg_symm += other.cpg_symm;
+    chh += other.chh;
+    ccg += other.ccg;
+    cxg += other.cxg;
+    return *this;
+  }
+
+  void write(std::ostream &out) const {
+    out << all_c.format_summary("all cytosine") << std::endl
+        << cpg.format_summary("CpG") << std::endl
+        << cpg_symm.format_summary("symmetric CpG") << std::endl
+        << chh.format_summary("CHH") << std::endl
+        << ccg.format_summary("CCG") << std::endl
+        << cxg.format_summary("CXG") << std::endl;
+  }
+};
+
+
+/* MethLevels: sites must be given in the order of a methcounts file,
+   as the symmetric CpG counts need each CpG followed by its mate.
+
+   Optionally the summaries are also kept for each chrom and for sites
+   in bins of coverage, given by the lower ends of the bins after the
+   first, which starts at 0.
+
+   For processing a file in pieces, each piece can be counted in its
+   own MethLevels after calling "begin_chunk", and the pieces added in
+   order with "+=" into a MethLevels that has not been given sites
+   directly. The first site of a chunk may be the mate of the last
+   site in the chunk before it, so its symmetric CpG and all cytosine
+   counts wait until the chunks are added. */
+class MethLevels {
+public:
+  explicit MethLevels(const double a, const bool bc = false,
+                      const std::vector<size_t> &be = std::vector<size_t>()) :
+    alpha(a), by_chrom(bc), bin_edges(be), bins(be.empty() ? 0 : be.size() + 1),
+    is_chunk(false), has_first(false), has_prev(false) {}
+
+  void begin_chunk() {is_chunk = true;}
+
+  // returns true if the site starts a new chrom; "site" is left in an
+  // unspecified state
+  bool update(MSite &site) {
+    const bool new_chrom = (!has_prev || site.chrom != prev_site.chrom);
+    if (new_chrom) {
+      chrom_names.push_back(site.chrom);
+      if (by_chrom)
+        chroms.push_back(LevelsSummary());
+    }
+
+    const bool defer = is_chunk && !has_prev;
+    if (site.is_cpg()) {
+      add(&LevelsSummary::cpg, site);
+      if (!defer && has_prev && site.is_mate_of(prev_site)) {
+        site.add(prev_site);
+        add(&LevelsSummary::cpg_symm, site);
+      }
+    }
+    else if (site.is_chh())
+      add(&LevelsSummary::chh, site);
+    else if (site.is_ccg())
+      add(&LevelsSummary::ccg, site);
+    else if (site.is_cxg())
+      add(&LevelsSummary::cxg, site);
+    else
+      throw SMITHLABException("bad site context: " + site.context);
+
+    if (defer) {
+      first_site = site;
+      has_first = true;
+    }
+    else add(&LevelsSummary::all_c, site);
+
+    std::swap(prev_site, site);
+    has_prev = true;
+    return new_chrom;
+  }
+
+  // "other" must hold the sites that follow those already counted
+  MethLevels &operator+=(const MethLevels &other);
+
+  void write(std::ostream &out) const {
+    out << "NUMBER OF CHROMOSOMES:" << '\t' << chrom_names.size() << std::endl;
+    total.write(out);
+    for (size_t i = 0; i < chroms.size(); ++i) {
+      out << "CHROMOSOME:" << '\t' << chrom_names[i] << std::endl;
+      chroms[i].write(out);
+    }
+    for (size_t i = 0; i < bins.size(); ++i) {
+      out << "COVERAGE BIN:" << '\t' << "[" << (i == 0 ? 0 : bin_edges[i - 1])
+          << ", ";
+      if (i < bin_edges.size()) out << bin_edges[i];
+      else out << "inf";
+      out << ")" << std::endl;
+      bins[i].write(out);
+    }
+  }
+
+  const std::vector<std::string> &get_chrom_names() const {
+    return chrom_names;
+  }
+
+private:
+  typedef LevelsCounter LevelsSummary::*Context;
+
+  void add(const Context c, const MSite &site) {
+    add(c, site, chroms.size());
+  }
+  void add(const Context c, const MSite &site, const size_t chrom_idx) {
+    (total.*c).update(site, alpha);
+    if (by_chrom)
+      (chroms[chrom_idx - 1].*c).update(site, alpha);
+    if (!bins.empty()) {
+      const size_t b = std::upper_bound(bin_edges.begin(), bin_edges.end(),
+                                        site.n_reads) - bin_edges.begin();
+      (bins[b].*c).update(site, alpha);
+    }
+  }
+
+  double alpha;
+  bool by_chrom;
+  std::vector<size_t> bin_edges;
+
+  LevelsSummary total;
+  std::vector<std::string> chrom_names;
+  std::vector<LevelsSummary> chroms;
+  std::vector<LevelsSummary> bins;
+
+  bool is_chunk;
+  bool has_first;
+  MSite first_site;
+  bool has_prev;
+  MSite prev_site;
+};
+
+
+inline MethLevels &
+MethLevels::operator+=(const MethLevels &other) {
+  if (!other.has_prev)
+    return *this;
+
+  // the chrom of the first site in "other" continues the last chrom
+  // here if the names are the same
+  const bool same_chrom =
+    has_prev && other.chrom_names.front() == chrom_names.back();
+  const size_t offset = chrom_names.size() - same_chrom;
+  for (size_t i = same_chrom; i < other.chrom_names.size(); ++i)
+    chrom_names.push_back(other.chrom_names[i]);
+  if (by_chrom) {
+    if (same_chrom)
+      chroms.back() += other.chroms.front();
+    for (size_t i = same_chrom; i < other.chroms.size(); ++i)
+      chroms.push_back(other.chroms[i]);
+  }
+  total += other.total;
+  for (size_t i = 0; i < bins.size(); ++i)
+    bins[i] += other.bins[i];
+
+  if (other.has_first) {
+    MSite site(other.first_site);
+    if (has_prev && site.is_cpg() && site.is_mate_of(prev_site)) {
+      site.add(prev_site);
+      add(&LevelsSummary::cpg_symm, site, offset + 1);
+    }
+    add(&LevelsSummary::all_c, site, offset + 1);
+  }
+  prev_site = other.prev_site;
+  has_prev = true;
+  return *this;
+}
+
+#endif
@@ -25,10 +25,14 @@
 #include <sstream>
 #include <cstdlib>
 
+#include <sys/stat.h>
+
 #include "GenomicRegion.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "MethpipeFiles.hpp"
+#include "RecordCounter.hpp"
+#include "TextFormat.hpp"
 
 using std::vector;
 using std::string;
@@ -39,6 +43,26 @@ using std::istream;
 using std::ostream;
 using std::endl;
 
+// for large files, counting the sites first means the vectors are
+// allocated once rather than grown as the sites are read, which
+// copies them and for a time needs room for both copies; for smaller
+// files the extra pass over the file costs more than it saves. A pipe
+// can only be read once, so its sites are not counted.
+static const size_t RESERVE_SITES_MIN_BYTES = 64ul << 20;
+
+template <class T> static void
+reserve_sites(const string &cpgs_file, vector<T> &cpgs,
+              vector<pair<double, double> > &meths, vector<size_t> &reads) {
+  struct stat st;
+  if (stat(cpgs_file.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+      static_cast<size_t>(st.st_size) < RESERVE_SITES_MIN_BYTES)
+    return;
+  const size_t n_sites = count_records(cpgs_file);
+  cpgs.reserve(cpgs.size() + n_sites);
+  meths.reserve(meths.size() + n_sites);
+  reads.reserve(reads.size() + n_sites);
+}
+
 string
 methpipe::skip_header(std::istream &in){
   string line;
@@ -60,6 +84,7 @@ methpipe::load_cpgs(const string &cpgs_file,
   double meth;
   size_t coverage;
 
+  reserve_sites(cpgs_file, cpgs, meths, reads);
   std::ifstream in(cpgs_file.c_str());
   string line = skip_header(in); // added
   std::istringstream iss(line); //added
@@ -113,6 +138,7 @@ methpipe::load_cpgs(const string &cpgs_file,
   double meth;
   size_t coverage;
 
+  reserve_sites(cpgs_file, cpgs, meths, reads);
   std::ifstream in(cpgs_file.c_str());
   string line = skip_header(in); //added
   std::istringstream iss(line); //added
@@ -160,6 +186,7 @@ methpipe::load_cpgs_old(const string &cpgs_file,
                         vector<pair<double, double> > &meths,
                         vector<size_t> &reads)
 {
+  reserve_sites(cpgs_file, cpgs, meths, reads);
   std::ifstream in(cpgs_file.c_str());
   string line = skip_header(in); // added
   std::istringstream iss(line); //added
@@ -206,6 +233,7 @@ methpipe::load_cpgs_old(const string &cpgs_file,
                         vector<GenomicRegion> &cpgs,
                         vector<pair<double, double> > &meths,
                         vector<size_t> &reads) {
+  reserve_sites(cpgs_file, cpgs, meths, reads);
   std::ifstream in(cpgs_file.c_str());
   string line = skip_header(in); // added
   std::istringstream iss(line); //added
@@ -358,14 +386,25 @@ methpipe::read_site(std::istream &in, string &chrom, size_t &pos,
 }
 
 
+void
+methpipe::write_site(RecordWriter &out,
+                     const string &chrom, const size_t pos,
+                     const string &strand, const string &seq,
+                     const double meth, const size_t coverage) {
+  out.put(chrom).put('\t').put_uint(pos).put('\t').put(strand).put('\t')
+    .put(seq).put('\t').put_double(coverage == 0 ? 0.0 : meth).put('\t')
+    .put_uint(coverage).put('\n');
+}
+
+
 ostream &
 methpipe::write_site(ostream &out,
                      const string &chrom, const size_t &pos,
                      const string &strand, const string &seq,
                      const double &meth, const size_t &coverage) {
-  return (out << chrom << "\t" << pos << "\t" << strand
-          << "\t" << seq << "\t" << (coverage == 0 ? 0.0 : meth) << "\t"
-          << coverage << '\n');
+  RecordWriter w(out);
+  write_site(w, chrom, pos, strand, seq, meth, coverage);
+  return out;
 }
 
 
@@ -392,9 +431,11 @@ ostream &
 methpipe::write_site_old(ostream &out, const string &chrom, const size_t &pos,
                          const string &strand, const string &seq,
                          const double &meth, const size_t &coverage) {
-  return (out << chrom << "\t" << pos << "\t" << pos + 1 << "\t"
-          << (seq + ":" + smithlab::toa(coverage)) << "\t"
-          << (coverage == 0 ? 0.0 : meth) << "\t" << strand << endl);
+  RecordWriter w(out);
+  w.put(chrom).put('\t').put_uint(pos).put('\t').put_uint(pos + 1).put('\t')
+    .put(seq).put(':').put_uint(coverage).put('\t')
+    .put_double(coverage == 0 ? 0.0 : meth).put('\t').put(strand).put('\n');
+  return out;
 }
 
 
@@ -405,9 +446,12 @@ methpipe::write_methdiff_site(ostream &out, const std::string &chrom,
                               const std::string &seq, const double diffscore,
                               const size_t meth_a, const size_t unmeth_a,
                               const size_t meth_b, const size_t unmeth_b) {
-  return (out << chrom << "\t" << pos << "\t" << strand << "\t" << seq << "\t"
-          << diffscore << "\t" << meth_a << "\t" << unmeth_a << "\t"
-          << meth_b << "\t" << unmeth_b << endl);
+  RecordWriter w(out);
+  w.put(chrom).put('\t').put_uint(pos).put('\t').put(strand).put('\t')
+    .put(seq).put('\t').put_double(diffscore).put('\t')
+    .put_uint(meth_a).put('\t').put_uint(unmeth_a).put('\t')
+    .put_uint(meth_b).put('\t').put_uint(unmeth_b).put('\n');
+  return out;
 }
 
 
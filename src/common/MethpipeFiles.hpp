@@ -25,6 +25,8 @@
 #include <utility>
 #include "GenomicRegion.hpp"
 
+class RecordWriter;
+
 namespace methpipe {
   enum FILETYPE {OLD, NEW};
 
@@ -70,6 +72,12 @@ namespace methpipe {
              const std::string &strand, const std::string &seq,
              const double &meth, const size_t &coverage);
 
+  // the same, for writing many sites through one buffer
+  void
+  write_site(RecordWriter &out, const std::string &chrom, const size_t pos,
+             const std::string &strand, const std::string &seq,
+             const double meth, const size_t coverage);
+
   // re-locate the file handler point to the first line
   // that are at or behind location chrom, pos
   void
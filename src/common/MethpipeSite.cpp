@@ -22,8 +22,11 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 
 #include "smithlab_utils.hpp"
+#include "TextFormat.hpp"
 
 using std::string;
 
@@ -43,20 +46,29 @@ operator>>(std::istream &in, MSite &s) {
 
 string
 MSite::tostring() const {
-  std::ostringstream oss;
-  oss << chrom << '\t'
-      << pos << '\t'
-      << strand << '\t'
-      << context << '\t'
-      << meth << '\t'
-      << n_reads;
-  return oss.str();
+  string s;
+  s.reserve(chrom.length() + context.length() + 2*MAX_FORMATTED_NUMBER + 6);
+  s.append(chrom);
+  s += '\t';
+  append_uint(s, pos);
+  s += '\t';
+  s += strand;
+  s += '\t';
+  s.append(context);
+  s += '\t';
+  append_double(s, meth);
+  s += '\t';
+  append_uint(s, n_reads);
+  return s;
 }
 
 
 std::ostream &
 operator<<(std::ostream &out, const MSite &s) {
-  return out << s.tostring();
+  RecordWriter w(out);
+  w.put(s.chrom).put('\t').put_uint(s.pos).put('\t').put(s.strand).put('\t')
+    .put(s.context).put('\t').put_double(s.meth).put('\t').put_uint(s.n_reads);
+  return out;
 }
 
 
@@ -65,3 +77,68 @@ distance(const MSite &a, const MSite &b) {
   return a.chrom == b.chrom ? std::max(a.pos, b.pos) - std::min(a.pos, b.pos) :
     std::numeric_limits<size_t>::max();
 }
+
+
+static bool
+found_symmetric(const MSite &first, const MSite &second) {
+  return first.pos + 1 == second.pos && first.strand == '+' &&
+    second.strand == '-' && first.is_cpg() && second.is_cpg() &&
+    first.chrom == second.chrom;
+}
+
+
+bool
+CpGSymmetrizer::take_single(MSite &out) {
+  if (!prev.is_cpg() || (prev.is_mutated() && !include_mutated))
+    return false;
+  std::swap(out, prev);
+  if (out.strand == '-') {
+    out.strand = '+';
+    --out.pos;
+  }
+  return true;
+}
+
+
+bool
+CpGSymmetrizer::add(const MSite &site, MSite &out) {
+  if (has_prev && found_symmetric(prev, site)) {
+    has_prev = false;
+    // counts are rounded before adding, so that symmetric sites
+    // are the same as from symmetric-cpgs
+    const size_t meth_count = std::round(prev.meth*prev.n_reads) +
+      std::round(site.meth*site.n_reads);
+    prev.n_reads += site.n_reads;
+    prev.meth = (prev.n_reads == 0) ? 0.0 :
+      static_cast<double>(meth_count)/prev.n_reads;
+    if (prev.is_mutated() || site.is_mutated()) {
+      if (!include_mutated)
+        return false;
+      prev.context = "CpGx";
+    }
+    std::swap(out, prev);
+    return true;
+  }
+  const bool ready = has_prev && take_single(out);
+  prev = site;
+  has_prev = true;
+  return ready;
+}
+
+
+bool
+CpGSymmetrizer::finish(MSite &out) {
+  if (!has_prev)
+    return false;
+  has_prev = false;
+  return take_single(out);
+}
+
+
+bool
+CpGSymmetrizer::read(std::istream &in, MSite &out) {
+  while (in >> buf)
+    if (add(buf, out))
+      return true;
+  return finish(out);
+}
@@ -90,4 +90,35 @@ operator<<(std::ostream &out, const MSite &s);
 size_t
 distance(const MSite &a, const MSite &b);
 
+/* CpGSymmetrizer: combines the counts of each CpG on the + strand
+ * with those of the CpG on the - strand that follows it, as done by
+ * symmetric-cpgs, for sites given in the order of a methcounts
+ * file. Non-CpG sites are dropped, a CpG without its mate is given on
+ * the + strand, and pairs with a mutated site are dropped unless
+ * "include_mutated" is set, in which case they get context "CpGx".
+ */
+class CpGSymmetrizer {
+public:
+  explicit CpGSymmetrizer(const bool im = false) :
+    include_mutated(im), has_prev(false) {}
+
+  // returns true if a symmetric site is complete, and puts it in "out"
+  bool add(const MSite &site, MSite &out);
+
+  // call after the last site; returns true if one remained
+  bool finish(MSite &out);
+
+  // reads sites from "in" until a symmetric site is complete or the
+  // input is exhausted; returns false at the end
+  bool read(std::istream &in, MSite &out);
+
+private:
+  bool take_single(MSite &out);
+
+  bool include_mutated;
+  bool has_prev;
+  MSite prev;
+  MSite buf;
+};
+
 #endif
@@ -0,0 +1,312 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+/* Run metrics: time spent in each stage of a program, and counters
+ * and gauges registered by name, written as JSON at the end of the
+ * run when the "--metrics" option gives a file. Until the option is
+ * used every call returns after testing one flag, so stages and
+ * counters can be left in the code. Calls that take a name lock a
+ * mutex, so counts inside loops should be accumulated locally and
+ * added once per batch, chrom or stage.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "OptionParser.hpp"
+
+class Metrics {
+public:
+  static bool enabled() {return state().on;}
+  // call before any threads are started
+  static void enable() {state().on = true;}
+
+  // add to a counter of items, iterations, etc.
+  static void count(const std::string &name, const uint64_t n = 1) {
+    if (!enabled()) return;
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.counters[name] += n;
+  }
+
+  // set a gauge to a value, or keep the largest value seen
+  static void gauge(const std::string &name, const double x) {
+    if (!enabled()) return;
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.gauges[name] = x;
+  }
+  static void gauge_max(const std::string &name, const double x) {
+    if (!enabled()) return;
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    std::map<std::string, double>::iterator i(s.gauges.find(name));
+    if (i == s.gauges.end()) s.gauges[name] = x;
+    else if (x > i->second) i->second = x;
+  }
+
+  // time for one run of a stage; stages are reported in the order
+  // they first finish, with times summed over runs
+  static void add_stage(const std::string &name,
+                        const double wall, const double cpu) {
+    if (!enabled()) return;
+    State &s = state();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    size_t i = 0;
+    while (i < s.stages.size() && s.stages[i].name != name) ++i;
+    if (i == s.stages.size()) {
+      s.stages.push_back(Stage());
+      s.stages.back().name = name;
+    }
+    s.stages[i].calls += 1;
+    s.stages[i].wall += wall;
+    s.stages[i].cpu += cpu;
+  }
+
+  static double
+  wall_now() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // CPU time (user and system) of the whole process, all threads
+  static double
+  cpu_now() {
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return r.ru_utime.tv_sec + r.ru_stime.tv_sec +
+      1e-6*(r.ru_utime.tv_usec + r.ru_stime.tv_usec);
+  }
+
+  static void write_json(std::ostream &out, const std::string &program);
+
+private:
+  struct Stage {
+    Stage() : calls(0), wall(0.0), cpu(0.0) {}
+    std::string name;
+    size_t calls;
+    double wall;
+    double cpu;
+  };
+  struct State {
+    State() : on(false) {}
+    bool on;
+    std::mutex mtx;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, double> gauges;
+    std::vector<Stage> stages;
+  };
+  static State &state() {
+    static State s;
+    return s;
+  }
+};
+
+
+/* StageTimer: times the stage it is named for until it is stopped or
+   destroyed. Its CPU time is for the whole process, so it includes
+   all threads working on the stage, and stages should be timed from
+   the thread that starts and waits for them. For a sequence of stages
+   in one scope, "next" ends one and starts the next. */
+class StageTimer {
+public:
+  explicit StageTimer(const std::string &n) : on(false) {start(n);}
+  ~StageTimer() {stop();}
+
+  void stop() {
+    if (on)
+      Metrics::add_stage(name, Metrics::wall_now() - wall_start,
+                         Metrics::cpu_now() - cpu_start);
+    on = false;
+  }
+
+  void next(const std::string &n) {
+    stop();
+    start(n);
+  }
+
+private:
+  void start(const std::string &n) {
+    if (!Metrics::enabled()) return;
+    on = true;
+    name = n;
+    wall_start = Metrics::wall_now();
+    cpu_start = Metrics::cpu_now();
+  }
+
+  bool on;
+  std::string name;
+  double wall_start;
+  double cpu_start;
+
+  StageTimer(const StageTimer &);
+  StageTimer &operator=(const StageTimer &);
+};
+
+
+namespace metrics_detail {
+  inline void
+  write_string(std::ostream &out, const std::string &s) {
+    out << '"';
+    for (size_t i = 0; i < s.length(); ++i) {
+      const unsigned char c = s[i];
+      if (c == '"' || c == '\\') out << '\\' << c;
+      else if (c < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out << buf;
+      }
+      else out << c;
+    }
+    out << '"';
+  }
+
+  inline void
+  write_number(std::ostream &out, const double x) {
+    if (std::isfinite(x)) out << x;
+    else out << "null";
+  }
+
+  // bytes the process has read and written through system calls, from
+  // /proc on Linux; false where that is not available
+  inline bool
+  io_bytes(uint64_t &read_bytes, uint64_t &written_bytes) {
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    uint64_t value = 0;
+    size_t n_found = 0;
+    while (in >> key >> value) {
+      if (key == "rchar:") {read_bytes = value; ++n_found;}
+      else if (key == "wchar:") {written_bytes = value; ++n_found;}
+    }
+    return n_found == 2;
+  }
+
+  inline uint64_t
+  peak_rss_bytes() {
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+#ifdef __APPLE__
+    return r.ru_maxrss; // bytes on macOS
+#else
+    return 1024ul*r.ru_maxrss; // KB on Linux
+#endif
+  }
+}
+
+
+inline void
+Metrics::write_json(std::ostream &out, const std::string &program) {
+  using metrics_detail::write_string;
+  using metrics_detail::write_number;
+  State &s = state();
+  std::lock_guard<std::mutex> lock(s.mtx);
+  out.precision(6);
+  out << "{\n  \"program\": ";
+  write_string(out, program);
+  out << ",\n  \"peak_rss_bytes\": " << metrics_detail::peak_rss_bytes();
+  uint64_t read_bytes = 0, written_bytes = 0;
+  if (metrics_detail::io_bytes(read_bytes, written_bytes))
+    out << ",\n  \"bytes_read\": " << read_bytes
+        << ",\n  \"bytes_written\": " << written_bytes;
+
+  out << ",\n  \"stages\": [";
+  for (size_t i = 0; i < s.stages.size(); ++i) {
+    out << (i > 0 ? ",\n    " : "\n    ") << "{\"name\": ";
+    write_string(out, s.stages[i].name);
+    out << ", \"calls\": " << s.stages[i].calls << ", \"wall_seconds\": ";
+    write_number(out, s.stages[i].wall);
+    out << ", \"cpu_seconds\": ";
+    write_number(out, s.stages[i].cpu);
+    out << "}";
+  }
+  out << (s.stages.empty() ? "]" : "\n  ]");
+
+  out << ",\n  \"counters\": {";
+  for (std::map<std::string, uint64_t>::const_iterator
+         i(s.counters.begin()); i != s.counters.end(); ++i) {
+    out << (i == s.counters.begin() ? "\n    " : ",\n    ");
+    write_string(out, i->first);
+    out << ": " << i->second;
+  }
+  out << (s.counters.empty() ? "}" : "\n  }");
+
+  out << ",\n  \"gauges\": {";
+  for (std::map<std::string, double>::const_iterator
+         i(s.gauges.begin()); i != s.gauges.end(); ++i) {
+    out << (i == s.gauges.begin() ? "\n    " : ",\n    ");
+    write_string(out, i->first);
+    out << ": ";
+    write_number(out, i->second);
+  }
+  out << (s.gauges.empty() ? "}" : "\n  }") << "\n}\n";
+}
+
+
+/* MetricsReport: made in main once the options are parsed. If the
+   file name is not empty it turns metrics on, times the whole run as
+   the stage "total", and writes the JSON file when it goes out of
+   scope. A failure to write is reported but does not end the run. */
+class MetricsReport {
+public:
+  MetricsReport(const std::string &fn, const std::string &prog) :
+    filename(fn), program(prog) {
+    if (!filename.empty()) {
+      Metrics::enable();
+      total.reset(new StageTimer("total"));
+    }
+  }
+  ~MetricsReport() {
+    if (filename.empty()) return;
+    total.reset();
+    std::ofstream out(filename.c_str());
+    if (out)
+      Metrics::write_json(out, program);
+    if (!out)
+      std::cerr << "WARNING: could not write metrics file: "
+                << filename << std::endl;
+  }
+
+private:
+  const std::string filename;
+  const std::string program;
+  std::unique_ptr<StageTimer> total;
+};
+
+
+inline void
+add_metrics_opt(OptionParser &opt_parse, std::string &metrics_file) {
+  opt_parse.add_opt("metrics", '\0', "write run times, counts and memory "
+                    "use as JSON to this file", false, metrics_file);
+}
+
+#endif
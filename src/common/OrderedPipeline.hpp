@@ -0,0 +1,194 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ORDERED_PIPELINE_HPP
+#define ORDERED_PIPELINE_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+
+/* BoundedQueue: a blocking FIFO with a fixed capacity. The "push"
+ * blocks while the queue is full and "pop" blocks while it is
+ * empty. After "close" has been called, "push" refuses new items and
+ * "pop" drains what remains before returning false.
+ */
+template <class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t c) :
+    capacity(std::max(c, static_cast<size_t>(1))), closed(false) {}
+
+  bool push(T &&item) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_full.wait(lock, [this] {return closed || items.size() < capacity;});
+    if (closed) return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_empty.wait(lock, [this] {return closed || !items.empty();});
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mtx);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mtx;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+};
+
+
+/* run_ordered_pipeline: the calling thread runs "produce" to fill
+ * batches, "n_threads" workers run "work" on filled batches in any
+ * order, and a single writer thread runs "consume" on finished
+ * batches in exactly the order they were produced. The batches in
+ * "slots" are recycled, so any buffers they hold keep their capacity
+ * from one use to the next, and the number of slots bounds how far
+ * the producer can run ahead of the writer.
+ *
+ *   bool produce(Batch &b)           -- false when input is exhausted
+ *   void work(Batch &b, size_t tid)  -- tid in [0, n_threads)
+ *   void consume(Batch &b)
+ *
+ * An exception thrown by any of the three stops the pipeline and is
+ * rethrown in the calling thread. With one thread or one slot
+ * everything runs serially in the calling thread.
+ */
+template <class Batch, class Producer, class Worker, class Consumer>
+void
+run_ordered_pipeline(const size_t n_threads, std::vector<Batch> &slots,
+                     Producer produce, Worker work, Consumer consume) {
+
+  if (n_threads <= 1 || slots.size() <= 1) {
+    while (produce(slots.front())) {
+      work(slots.front(), 0);
+      consume(slots.front());
+    }
+    return;
+  }
+
+  enum {FREE, FILLED, DONE};
+  const size_t n_slots = slots.size();
+  std::vector<int> state(n_slots, FREE);
+  std::deque<size_t> todo;
+  size_t n_produced = 0;
+  bool finished = false;
+  bool failed = false;
+  std::exception_ptr error;
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  auto fail = [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!failed) error = e;
+    failed = true;
+    cv.notify_all();
+  };
+
+  auto worker = [&](const size_t tid) {
+    for (;;) {
+      size_t slot = 0;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] {return failed || finished || !todo.empty();});
+        if (failed || todo.empty()) return;
+        slot = todo.front();
+        todo.pop_front();
+      }
+      try {work(slots[slot], tid);}
+      catch (...) {fail(std::current_exception()); return;}
+      std::lock_guard<std::mutex> lock(mtx);
+      state[slot] = DONE;
+      cv.notify_all();
+    }
+  };
+
+  auto writer = [&]() {
+    for (size_t seq = 0;; ++seq) {
+      const size_t slot = seq % n_slots;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] {
+            return failed || state[slot] == DONE ||
+              (finished && seq == n_produced);
+          });
+        if (failed || state[slot] != DONE) return;
+      }
+      try {consume(slots[slot]);}
+      catch (...) {fail(std::current_exception()); return;}
+      std::lock_guard<std::mutex> lock(mtx);
+      state[slot] = FREE;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < n_threads; ++i)
+    threads.push_back(std::thread(worker, i));
+  threads.push_back(std::thread(writer));
+
+  for (size_t seq = 0;; ++seq) {
+    const size_t slot = seq % n_slots;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&] {return failed || state[slot] == FREE;});
+      if (failed) break;
+    }
+    bool more = false;
+    try {more = produce(slots[slot]);}
+    catch (...) {fail(std::current_exception()); break;}
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!more) {
+      finished = true;
+      cv.notify_all();
+      break;
+    }
+    state[slot] = FILLED;
+    todo.push_back(slot);
+    ++n_produced;
+    cv.notify_all();
+  }
+
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ParallelBGZF.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+/* BGZF blocks are gzip members with a "BC" extra subfield giving the
+   total block size minus one; see the SAM/BAM format specification */
+static const size_t GZIP_FIXED_HEADER = 12;
+static const size_t GZIP_FOOTER = 8;
+static const size_t BLOCKS_PER_BATCH = 64;
+static const size_t BGZF_MAX_BLOCK_SIZE = 65536;
+static const size_t BGZF_BLOCK_HEADER = 18;
+// uncompressed bytes per block, as in bgzf.c, leaving room for the
+// header, footer and any expansion by deflate
+static const size_t BGZF_BLOCK_DATA = 0xff00;
+
+static size_t
+unpack16(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return u[0] | (u[1] << 8);
+}
+
+static size_t
+unpack32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<size_t>(u[3]) << 24);
+}
+
+static void
+pack16(char *p, const size_t x) {
+  p[0] = static_cast<char>(x & 0xff);
+  p[1] = static_cast<char>((x >> 8) & 0xff);
+}
+
+static void
+pack32(char *p, const size_t x) {
+  pack16(p, x & 0xffff);
+  pack16(p + 2, (x >> 16) & 0xffff);
+}
+
+static void
+write_uint64(std::ostream &out, const uint64_t x) {
+  char b[8];
+  pack32(b, x & 0xffffffffu);
+  pack32(b + 4, x >> 32);
+  out.write(b, sizeof(b));
+}
+
+static bool
+is_gzip_header(const char *h) {
+  return (static_cast<unsigned char>(h[0]) == 31 &&
+          static_cast<unsigned char>(h[1]) == 139 &&
+          h[2] == 8 && (h[3] & 4));
+}
+
+// returns the BSIZE field, or zero if the extra field has no "BC"
+static size_t
+find_block_size(const char *extra, const size_t xlen) {
+  size_t i = 0;
+  while (i + 4 <= xlen) {
+    const size_t slen = unpack16(extra + i + 2);
+    if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+      return unpack16(extra + i + 4);
+    i += 4 + slen;
+  }
+  return 0;
+}
+
+
+static void
+inflate_batch(const string &compressed, string &uncompressed) {
+
+  uncompressed.clear();
+
+  z_stream zs;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  zs.next_in = Z_NULL;
+  zs.avail_in = 0;
+  if (inflateInit2(&zs, -15) != Z_OK)
+    throw SMITHLABException("failed to initialize zlib");
+
+  bool good = true;
+  size_t i = 0;
+  while (good && i < compressed.size()) {
+    const char *block = compressed.data() + i;
+    const size_t xlen = unpack16(block + 10);
+    const size_t block_size =
+      find_block_size(block + GZIP_FIXED_HEADER, xlen) + 1;
+    const size_t data_offset = GZIP_FIXED_HEADER + xlen;
+    const char *footer = block + block_size - GZIP_FOOTER;
+    const size_t expected_crc = unpack32(footer);
+    const size_t isize = unpack32(footer + 4);
+
+    const size_t out_offset = uncompressed.size();
+    uncompressed.resize(out_offset + isize);
+    if (isize > 0) {
+      inflateReset(&zs);
+      zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block)) +
+        data_offset;
+      zs.avail_in = block_size - data_offset - GZIP_FOOTER;
+      zs.next_out = reinterpret_cast<Bytef *>(&uncompressed[out_offset]);
+      zs.avail_out = isize;
+      good = (inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == isize &&
+              crc32(crc32(0L, Z_NULL, 0),
+                    reinterpret_cast<const Bytef *>(&uncompressed[out_offset]),
+                    isize) == expected_crc);
+    }
+    i += block_size;
+  }
+  inflateEnd(&zs);
+  if (!good)
+    throw SMITHLABException("corrupt BGZF block");
+}
+
+
+bool
+ParallelBGZFReader::is_bgzf(const string &filename) {
+  std::ifstream f(filename.c_str(), std::ios_base::binary);
+  char h[18];
+  return (f.read(h, sizeof(h)) && is_gzip_header(h) &&
+          unpack16(h + 10) >= 6 && find_block_size(h + 12, 6) > 0);
+}
+
+
+ParallelBGZFReader::ParallelBGZFReader(const string &fn, const size_t nt) :
+  in(fn.c_str(), std::ios_base::binary), filename(fn),
+  n_threads(std::max(nt, static_cast<size_t>(1))), offset(0),
+  ready(2*n_threads), stopping(false) {
+
+  if (!in)
+    throw SMITHLABException("cannot open input file: " + filename);
+
+  background = std::thread([this] {
+      try {
+        vector<Batch> slots(2*n_threads + 1);
+        run_ordered_pipeline(n_threads, slots,
+                             [this](Batch &b) {return read_batch(b);},
+                             [](Batch &b, const size_t) {
+                               inflate_batch(b.compressed, b.uncompressed);
+                             },
+                             [this](Batch &b) {
+                               string s;
+                               s.swap(b.uncompressed);
+                               if (!ready.push(std::move(s)))
+                                 throw SMITHLABException("reader closed");
+                             });
+      }
+      catch (...) {
+        if (!stopping)
+          error = std::current_exception();
+      }
+      ready.close();
+    });
+}
+
+
+ParallelBGZFReader::~ParallelBGZFReader() {
+  stopping = true;
+  ready.close();
+  background.join();
+}
+
+
+bool
+ParallelBGZFReader::read_batch(Batch &b) {
+  b.compressed.clear();
+  char header[GZIP_FIXED_HEADER];
+  for (size_t i = 0; i < BLOCKS_PER_BATCH; ++i) {
+    if (!in.read(header, GZIP_FIXED_HEADER)) {
+      if (in.gcount() == 0) break;
+      throw SMITHLABException("truncated BGZF block: " + filename);
+    }
+    if (!is_gzip_header(header))
+      throw SMITHLABException("not a BGZF file: " + filename);
+
+    const size_t block_start = b.compressed.size();
+    const size_t xlen = unpack16(header + 10);
+    b.compressed.append(header, GZIP_FIXED_HEADER);
+    b.compressed.resize(block_start + GZIP_FIXED_HEADER + xlen);
+    if (!in.read(&b.compressed[block_start + GZIP_FIXED_HEADER], xlen))
+      throw SMITHLABException("truncated BGZF block: " + filename);
+
+    const size_t block_size =
+      find_block_size(b.compressed.data() + block_start + GZIP_FIXED_HEADER,
+                      xlen) + 1;
+    if (block_size < GZIP_FIXED_HEADER + xlen + GZIP_FOOTER)
+      throw SMITHLABException("not a BGZF file: " + filename);
+
+    const size_t remaining = block_size - GZIP_FIXED_HEADER - xlen;
+    b.compressed.resize(block_start + block_size);
+    if (!in.read(&b.compressed[block_start + block_size - remaining],
+                 remaining))
+      throw SMITHLABException("truncated BGZF block: " + filename);
+  }
+  return !b.compressed.empty();
+}
+
+
+bool
+ParallelBGZFReader::next_block() {
+  current.clear();
+  offset = 0;
+  while (current.empty())
+    if (!ready.pop(current)) {
+      if (error)
+        std::rethrow_exception(error);
+      return false;
+    }
+  return true;
+}
+
+
+size_t
+ParallelBGZFReader::read(char *data, const size_t n) {
+  size_t copied = 0;
+  while (copied < n) {
+    if (offset == current.size() && !next_block())
+      break;
+    const size_t k = std::min(n - copied, current.size() - offset);
+    std::copy(current.begin() + offset, current.begin() + offset + k,
+              data + copied);
+    offset += k;
+    copied += k;
+  }
+  return copied;
+}
+
+
+ParallelBGZFInputBuf::ParallelBGZFInputBuf(const string &filename,
+                                           const size_t n_threads) :
+  reader(filename, n_threads), buf(BGZF_MAX_BLOCK_SIZE) {}
+
+
+ParallelBGZFInputBuf::int_type
+ParallelBGZFInputBuf::underflow() {
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  const size_t n = reader.read(&buf[0], buf.size());
+  if (n == 0)
+    return traits_type::eof();
+  setg(&buf[0], &buf[0], &buf[0] + n);
+  return traits_type::to_int_type(buf[0]);
+}
+
+
+/* one BGZF block: a gzip member whose extra field holds the "BC"
+   subfield with the size of the block. If deflate does not shrink the
+   data enough to fit, the block is stored uncompressed, which always
+   fits as BGZF_BLOCK_DATA leaves room for it. */
+static size_t
+append_block(z_stream &zs, const char *data, const size_t n, string &out) {
+  static const char header[BGZF_BLOCK_HEADER] = {
+    31, static_cast<char>(139), 8, 4, 0, 0, 0, 0, 0,
+    static_cast<char>(255), 6, 0, 'B', 'C', 2, 0, 0, 0
+  };
+  const size_t start = out.size();
+  out.resize(start + BGZF_MAX_BLOCK_SIZE);
+  char *block = &out[start];
+  std::copy(header, header + BGZF_BLOCK_HEADER, block);
+
+  const size_t max_data = BGZF_MAX_BLOCK_SIZE - BGZF_BLOCK_HEADER - GZIP_FOOTER;
+  deflateReset(&zs);
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  zs.avail_in = n;
+  zs.next_out = reinterpret_cast<Bytef *>(block + BGZF_BLOCK_HEADER);
+  zs.avail_out = max_data;
+  size_t data_size = 0;
+  if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+    data_size = zs.total_out;
+  else {
+    z_stream stored;
+    stored.zalloc = Z_NULL;
+    stored.zfree = Z_NULL;
+    stored.opaque = Z_NULL;
+    if (deflateInit2(&stored, Z_NO_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      throw SMITHLABException("failed to initialize zlib");
+    stored.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stored.avail_in = n;
+    stored.next_out = reinterpret_cast<Bytef *>(block + BGZF_BLOCK_HEADER);
+    stored.avail_out = max_data;
+    const int status = deflate(&stored, Z_FINISH);
+    data_size = stored.total_out;
+    deflateEnd(&stored);
+    if (status != Z_STREAM_END)
+      throw SMITHLABException("BGZF block too large");
+  }
+
+  const size_t block_size = BGZF_BLOCK_HEADER + data_size + GZIP_FOOTER;
+  pack16(block + 16, block_size - 1);
+  char *footer = block + BGZF_BLOCK_HEADER + data_size;
+  pack32(footer, crc32(crc32(0L, Z_NULL, 0),
+                       reinterpret_cast<const Bytef *>(data), n));
+  pack32(footer + 4, n);
+  out.resize(start + block_size);
+  return block_size;
+}
+
+
+static void
+deflate_batch(const string &uncompressed, string &compressed,
+              vector<size_t> &block_sizes) {
+  compressed.clear();
+  block_sizes.clear();
+
+  z_stream zs;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    throw SMITHLABException("failed to initialize zlib");
+  try {
+    for (size_t i = 0; i < uncompressed.size(); i += BGZF_BLOCK_DATA) {
+      const size_t n = std::min(BGZF_BLOCK_DATA, uncompressed.size() - i);
+      block_sizes.push_back(append_block(zs, uncompressed.data() + i, n,
+                                         compressed));
+    }
+  }
+  catch (...) {
+    deflateEnd(&zs);
+    throw;
+  }
+  deflateEnd(&zs);
+}
+
+
+ParallelBGZFWriter::ParallelBGZFWriter(const string &fn, const size_t nt,
+                                       const string &ifn) :
+  out(fn.c_str(), std::ios_base::binary), filename(fn), index_filename(ifn),
+  n_threads(std::max(nt, static_cast<size_t>(1))),
+  pending(BLOCKS_PER_BATCH*BGZF_BLOCK_DATA, '\0'), todo(2*n_threads),
+  compressed_offset(0), uncompressed_offset(0), closed(false) {
+
+  if (!out)
+    throw SMITHLABException("cannot open output file: " + filename);
+  setp(&pending[0], &pending[0] + pending.size());
+
+  background = std::thread([this] {
+      try {
+        vector<Batch> slots(2*n_threads + 1);
+        run_ordered_pipeline(n_threads, slots,
+                             [this](Batch &b) {return todo.pop(b.uncompressed);},
+                             [](Batch &b, const size_t) {
+                               deflate_batch(b.uncompressed, b.compressed,
+                                             b.block_sizes);
+                             },
+                             [this](Batch &b) {write_batch(b);});
+      }
+      catch (...) {
+        error = std::current_exception();
+      }
+      todo.close();
+    });
+}
+
+
+ParallelBGZFWriter::~ParallelBGZFWriter() {
+  try {close();}
+  catch (...) {}
+}
+
+
+void
+ParallelBGZFWriter::write_batch(const Batch &b) {
+  out.write(b.compressed.data(), b.compressed.size());
+  if (!out)
+    throw SMITHLABException("error writing file: " + filename);
+  for (size_t i = 0; i < b.block_sizes.size(); ++i) {
+    if (compressed_offset > 0)
+      index.push_back(make_pair(compressed_offset, uncompressed_offset));
+    compressed_offset += b.block_sizes[i];
+    uncompressed_offset +=
+      std::min(BGZF_BLOCK_DATA, b.uncompressed.size() - i*BGZF_BLOCK_DATA);
+  }
+}
+
+
+// hands the buffered text to the compressing threads
+bool
+ParallelBGZFWriter::submit() {
+  pending.resize(pptr() - pbase());
+  if (!pending.empty() && !todo.push(std::move(pending)))
+    return false;
+  pending.assign(BLOCKS_PER_BATCH*BGZF_BLOCK_DATA, '\0');
+  setp(&pending[0], &pending[0] + pending.size());
+  return true;
+}
+
+
+ParallelBGZFWriter::int_type
+ParallelBGZFWriter::overflow(int_type c) {
+  if (closed || !submit())
+    return traits_type::eof();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+
+void
+ParallelBGZFWriter::close() {
+  if (closed) return;
+  closed = true;
+  submit();
+  todo.close();
+  background.join();
+  setp(0, 0);
+  if (error)
+    std::rethrow_exception(error);
+
+  // the empty block that marks the end of a BGZF file
+  static const char eof_block[28] = {
+    31, static_cast<char>(139), 8, 4, 0, 0, 0, 0, 0,
+    static_cast<char>(255), 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0,
+    0, 0, 0, 0, 0, 0, 0, 0
+  };
+  out.write(eof_block, sizeof(eof_block));
+  out.close();
+  if (!out)
+    throw SMITHLABException("error writing file: " + filename);
+
+  if (!index_filename.empty()) {
+    std::ofstream idx(index_filename.c_str(), std::ios_base::binary);
+    write_uint64(idx, index.size());
+    for (size_t i = 0; i < index.size(); ++i) {
+      write_uint64(idx, index[i].first);
+      write_uint64(idx, index[i].second);
+    }
+    if (!idx)
+      throw SMITHLABException("error writing index: " + index_filename);
+  }
+}
+
+
+bool
+OutputFile::is_compressed_name(const string &filename) {
+  static const string suffix(".gz");
+  return filename.length() > suffix.length() &&
+    filename.compare(filename.length() - suffix.length(),
+                     suffix.length(), suffix) == 0;
+}
+
+
+OutputFile::OutputFile(const string &fn, const size_t n_threads,
+                       const bool write_index) :
+  filename(fn), buf(std::cout.rdbuf()) {
+  if (filename.empty())
+    return;
+  if (is_compressed_name(filename)) {
+    bgzf.reset(new ParallelBGZFWriter(filename, n_threads,
+                                      write_index ? filename + "i" : ""));
+    buf = bgzf.get();
+  }
+  else {
+    plain.open(filename.c_str());
+    if (!plain)
+      throw SMITHLABException("cannot open output file: " + filename);
+    buf = plain.rdbuf();
+  }
+}
+
+
+void
+OutputFile::close() {
+  if (bgzf)
+    bgzf->close();
+  else if (plain.is_open()) {
+    plain.close();
+    if (!plain)
+      throw SMITHLABException("error writing file: " + filename);
+  }
+  else std::cout.flush();
+}
+
+
+InputFile::InputFile(const string &filename, const size_t n_threads) :
+  buf(0) {
+  if (ParallelBGZFReader::is_bgzf(filename)) {
+    bgzf.reset(new ParallelBGZFInputBuf(filename, n_threads));
+    buf = bgzf.get();
+  }
+  else {
+    plain.open(filename.c_str());
+    if (!plain)
+      throw SMITHLABException("cannot open input file: " + filename);
+    buf = plain.rdbuf();
+  }
+}
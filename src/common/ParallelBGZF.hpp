@@ -0,0 +1,186 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_BGZF_HPP
+#define PARALLEL_BGZF_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <streambuf>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <atomic>
+#include <stdint.h>
+
+#include "OrderedPipeline.hpp"
+
+/* ParallelBGZFReader: reads a BGZF file (e.g. BAM) as one stream of
+ * uncompressed bytes. A background thread reads compressed blocks in
+ * batches, "n_threads" workers inflate the batches, and the
+ * uncompressed data is handed back in file order through "read".
+ */
+class ParallelBGZFReader {
+public:
+  ParallelBGZFReader(const std::string &filename, const size_t n_threads);
+  ~ParallelBGZFReader();
+
+  // copies up to "n" bytes into "data"; returns the number copied,
+  // which is less than "n" only at the end of the file
+  size_t read(char *data, const size_t n);
+
+  // true if the file starts with a BGZF block header
+  static bool is_bgzf(const std::string &filename);
+
+private:
+  struct Batch {
+    std::string compressed;
+    std::string uncompressed;
+  };
+
+  bool read_batch(Batch &b);
+  bool next_block();
+
+  std::ifstream in;
+  const std::string filename;
+  const size_t n_threads;
+  std::string current;
+  size_t offset;
+  BoundedQueue<std::string> ready;
+  std::atomic<bool> stopping;
+  std::exception_ptr error;
+  std::thread background;
+};
+
+
+/* ParallelBGZFInputBuf: a stream buffer over a ParallelBGZFReader, so
+ * a BGZF file can be read through a std::istream. An error in the
+ * compressed data sets badbit on the istream.
+ */
+class ParallelBGZFInputBuf : public std::streambuf {
+public:
+  ParallelBGZFInputBuf(const std::string &filename, const size_t n_threads);
+
+protected:
+  int_type underflow();
+
+private:
+  ParallelBGZFReader reader;
+  std::vector<char> buf;
+};
+
+
+/* ParallelBGZFWriter: a stream buffer that writes a BGZF file. The
+ * text is cut into blocks of 0xff00 bytes, as by bgzip, batches of
+ * blocks are compressed by "n_threads" workers, and a background
+ * thread writes them in order, so the file is the same for any number
+ * of threads and can be read by zcat, bgzip or tabix. If
+ * "index_filename" is given, the offsets of the blocks are written
+ * there as a ".gzi" index, in the format of "bgzip -i". Flushing the
+ * stream does not end a block, so "endl" costs nothing extra. The
+ * "close" call finishes the file and throws if anything went wrong;
+ * the destructor closes without reporting errors.
+ */
+class ParallelBGZFWriter : public std::streambuf {
+public:
+  ParallelBGZFWriter(const std::string &filename, const size_t n_threads,
+                     const std::string &index_filename = "");
+  ~ParallelBGZFWriter();
+
+  void close();
+
+protected:
+  int_type overflow(int_type c);
+  int sync() {return 0;}
+
+private:
+  struct Batch {
+    std::string uncompressed;
+    std::string compressed;
+    std::vector<size_t> block_sizes;
+  };
+
+  bool submit();
+  void write_batch(const Batch &b);
+
+  std::ofstream out;
+  const std::string filename;
+  const std::string index_filename;
+  const size_t n_threads;
+  std::string pending;
+  BoundedQueue<std::string> todo;
+  // (compressed, uncompressed) offsets of each block after the first
+  std::vector<std::pair<uint64_t, uint64_t> > index;
+  uint64_t compressed_offset;
+  uint64_t uncompressed_offset;
+  bool closed;
+  std::exception_ptr error;
+  std::thread background;
+};
+
+
+/* OutputFile: the output of a tool, in place of the usual choice
+ * between an ofstream and cout. Output goes to stdout if "filename"
+ * is empty, to a BGZF file written by a ParallelBGZFWriter if the name
+ * ends in ".gz", and otherwise to a plain file:
+ *
+ *   OutputFile of(outfile, n_threads);
+ *   std::ostream out(of.rdbuf());
+ *   ...
+ *   of.close();
+ */
+class OutputFile {
+public:
+  OutputFile(const std::string &filename, const size_t n_threads,
+             const bool write_index = false);
+
+  std::streambuf *rdbuf() {return buf;}
+
+  // finish the output, throwing if it could not all be written
+  void close();
+
+  static bool is_compressed_name(const std::string &filename);
+
+private:
+  const std::string filename;
+  std::ofstream plain;
+  std::unique_ptr<ParallelBGZFWriter> bgzf;
+  std::streambuf *buf;
+};
+
+
+/* InputFile: the matching input side; a BGZF file is decompressed by
+ * "n_threads" threads in the background and any other file is read
+ * as it is:
+ *
+ *   InputFile inf(infile, n_threads);
+ *   std::istream in(inf.rdbuf());
+ */
+class InputFile {
+public:
+  InputFile(const std::string &filename, const size_t n_threads);
+
+  std::streambuf *rdbuf() {return buf;}
+
+private:
+  std::ifstream plain;
+  std::unique_ptr<ParallelBGZFInputBuf> bgzf;
+  std::streambuf *buf;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RANDOM_STREAM_HPP
+#define RANDOM_STREAM_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+
+#include "smithlab_utils.hpp"
+
+/* the Philox4x32-10 generator of Salmon et al. (SC 2011). It is
+   a keyed bijection on 128-bit counters: the i-th block of random
+   bits in a stream is a function of (key, i) alone, so any position
+   can be reached without generating what comes before it, and there
+   is no state to share between threads. */
+struct Philox4x32 {
+  static void
+  block(const uint32_t ctr_in[4], const uint32_t key_in[2],
+        uint32_t out[4]) {
+    static const uint64_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+    static const uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+    uint32_t c0 = ctr_in[0], c1 = ctr_in[1], c2 = ctr_in[2], c3 = ctr_in[3];
+    uint32_t k0 = key_in[0], k1 = key_in[1];
+    for (size_t r = 0; r < 10; ++r) {
+      const uint64_t p0 = M0*c0, p1 = M1*c2;
+      const uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+      const uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+      c1 = static_cast<uint32_t>(p1);
+      c3 = static_cast<uint32_t>(p0);
+      c0 = n0;
+      c2 = n2;
+      k0 += W0;
+      k1 += W1;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+  }
+};
+
+
+/* RandomStream: the random numbers at positions 0, 1, 2, ... of
+ * stream "stream" under seed "seed". Each (seed, stream) pair is an
+ * independent sequence of 2^66 32-bit values, and "offset" starts
+ * part way along it. A computation split into pieces, for example one
+ * per thread, per chromosome or per permutation, gives each piece its
+ * own stream id and draws the same numbers however the pieces are
+ * scheduled, so results do not depend on the number of threads.
+ *
+ * The class meets the requirements of a uniform random bit generator,
+ * but the std:: distributions and std::shuffle are not specified
+ * exactly and differ between library versions; use "uniform",
+ * "uniform_int" and "shuffle" where results must be reproducible on
+ * any system.
+ */
+class RandomStream {
+public:
+  typedef uint32_t result_type;
+
+  explicit RandomStream(const uint64_t seed = 0, const uint64_t stream = 0,
+                        const uint64_t offset = 0) {
+    key[0] = static_cast<uint32_t>(seed);
+    key[1] = static_cast<uint32_t>(seed >> 32);
+    ctr[2] = static_cast<uint32_t>(stream);
+    ctr[3] = static_cast<uint32_t>(stream >> 32);
+    seek(offset);
+  }
+
+  static constexpr result_type min() {return 0;}
+  static constexpr result_type max() {return UINT32_MAX;}
+
+  // the next 32 random bits
+  result_type operator()() {
+    if (idx == 4) {
+      ++block_id;
+      fill();
+      idx = 0;
+    }
+    return buf[idx++];
+  }
+
+  uint64_t next64() {
+    const uint64_t hi = (*this)();
+    return (hi << 32) | (*this)();
+  }
+
+  // uniform on [0, 1), with 53 random bits
+  double uniform() {return (next64() >> 11)*(1.0/9007199254740992.0);}
+
+  // uniform on [0, n) without modulo bias; the range must not be empty
+  uint64_t uniform_int(const uint64_t n) {
+    if (n == 0)
+      throw SMITHLABException("empty range for uniform_int");
+    // values below "threshold" would favor the small results
+    const uint64_t threshold = (0 - n) % n;
+    uint64_t x = next64();
+    while (x < threshold)
+      x = next64();
+    return x % n;
+  }
+
+  // move to the given position (in 32-bit values) in the stream
+  void seek(const uint64_t offset) {
+    block_id = offset/4;
+    fill();
+    idx = offset % 4;
+  }
+
+  // number of 32-bit values drawn since position 0
+  uint64_t position() const {return 4*block_id + idx;}
+
+  /* a Fisher-Yates shuffle of [first, last); unlike random_shuffle
+     and std::shuffle the permutation is the same with every compiler
+     and standard library */
+  template <class RandomIt>
+  void shuffle(RandomIt first, RandomIt last) {
+    typedef typename std::iterator_traits<RandomIt>::difference_type diff_t;
+    for (diff_t i = (last - first) - 1; i > 0; --i)
+      std::iter_swap(first + i, first + static_cast<diff_t>(uniform_int(i + 1)));
+  }
+
+private:
+  void fill() {
+    ctr[0] = static_cast<uint32_t>(block_id);
+    ctr[1] = static_cast<uint32_t>(block_id >> 32);
+    Philox4x32::block(ctr, key, buf);
+  }
+
+  uint32_t key[2];
+  uint32_t ctr[4];
+  uint32_t buf[4];
+  uint64_t block_id;
+  size_t idx;
+};
+
+
+#endif
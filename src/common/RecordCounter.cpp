@@ -0,0 +1,183 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RecordCounter.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "MappedFile.hpp"
+
+using std::string;
+using std::vector;
+
+/* the newlines are counted eight bytes at a time. In each byte
+   of "x" that was a '\n' the xor leaves zero; adding 0x7f to the low
+   seven bits of a byte sets its high bit unless all eight bits are
+   zero, and this never carries into the next byte. The compiler turns
+   the loop into vector code where it can. */
+static inline size_t
+count_newlines_in_word(const uint64_t w) {
+  static const uint64_t newlines = 0x0a0a0a0a0a0a0a0aull;
+  static const uint64_t low_bits = 0x7f7f7f7f7f7f7f7full;
+  const uint64_t x = w ^ newlines;
+  const uint64_t t = ((x & low_bits) + low_bits) | x;
+  return __builtin_popcountll(~t & ~low_bits);
+}
+
+
+size_t
+count_lines(const char *data, const size_t n_bytes) {
+  size_t n_lines = 0;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n_bytes; i += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, data + i, sizeof(uint64_t));
+    n_lines += count_newlines_in_word(w);
+  }
+  for (; i < n_bytes; ++i)
+    n_lines += (data[i] == '\n');
+  return n_lines + (n_bytes > 0 && data[n_bytes - 1] != '\n');
+}
+
+
+size_t
+count_lines(const string &filename) {
+  const MappedFile mf(filename);
+  mf.advise_sequential();
+  return count_lines(mf.data(), mf.size());
+}
+
+
+static inline const char *
+end_of_line(const char *p, const char *end) {
+  const char *q = static_cast<const char *>(memchr(p, '\n', end - p));
+  return q ? q : end;
+}
+
+
+static inline bool
+is_record(const char *p, const char *eol) {
+  return p != eol && *p != '#' && *p != '\r';
+}
+
+
+size_t
+count_records(const char *data, const size_t n_bytes) {
+  size_t n_records = 0;
+  const char *end = data + n_bytes;
+  for (const char *p = data; p < end;) {
+    const char *eol = end_of_line(p, end);
+    n_records += is_record(p, eol);
+    p = eol + 1;
+  }
+  return n_records;
+}
+
+
+size_t
+count_records(const string &filename) {
+  const MappedFile mf(filename);
+  mf.advise_sequential();
+  return count_records(mf.data(), mf.size());
+}
+
+
+// true if the line at "p" has "chrom" as its first token
+static inline bool
+has_chrom(const char *p, const char *eol, const string &chrom) {
+  const size_t n = chrom.size();
+  return static_cast<size_t>(eol - p) > n &&
+    memcmp(p, chrom.data(), n) == 0 && (p[n] == '\t' || p[n] == ' ');
+}
+
+
+void
+count_records(const char *data, const size_t n_bytes, RecordCounts &counts) {
+  counts = RecordCounts();
+  const char *end = data + n_bytes;
+  for (const char *p = data; p < end;) {
+    const char *eol = end_of_line(p, end);
+    ++counts.n_lines;
+    if (is_record(p, eol)) {
+      ++counts.n_records;
+      if (counts.chroms.empty() ||
+          !has_chrom(p, eol, counts.chroms.back().chrom)) {
+        const char *q = p;
+        while (q < eol && *q != '\t' && *q != ' ' && *q != '\r') ++q;
+        ChromRecords cr;
+        cr.chrom.assign(p, q);
+        cr.n_records = 0;
+        cr.offset = p - data;
+        counts.chroms.push_back(cr);
+      }
+      ChromRecords &cr = counts.chroms.back();
+      ++cr.n_records;
+      cr.n_bytes = (eol - data) + (eol < end) - cr.offset;
+    }
+    p = eol + 1;
+  }
+}
+
+
+void
+count_records(const string &filename, RecordCounts &counts) {
+  const MappedFile mf(filename);
+  mf.advise_sequential();
+  count_records(mf.data(), mf.size(), counts);
+}
+
+
+void
+chunk_boundaries(const char *data, const size_t n_bytes,
+                 const size_t n_chunks, vector<size_t> &offsets) {
+  offsets.clear();
+  offsets.push_back(0);
+  const char *end = data + n_bytes;
+  for (size_t i = 1; i < n_chunks; ++i) {
+    const size_t target = (n_bytes*i)/n_chunks;
+    if (target <= offsets.back())
+      continue;
+    // the chunk starts after the line that holds the byte before it
+    const size_t start = end_of_line(data + target - 1, end) + 1 - data;
+    if (start < n_bytes && start > offsets.back())
+      offsets.push_back(start);
+  }
+  if (n_bytes > 0)
+    offsets.push_back(n_bytes);
+}
+
+
+void
+append_record_counts(const RecordCounts &chunk, const size_t offset,
+                     RecordCounts &counts) {
+  counts.n_lines += chunk.n_lines;
+  counts.n_records += chunk.n_records;
+  for (size_t i = 0; i < chunk.chroms.size(); ++i) {
+    ChromRecords cr(chunk.chroms[i]);
+    cr.offset += offset;
+    if (i == 0 && !counts.chroms.empty() &&
+        counts.chroms.back().chrom == cr.chrom) {
+      ChromRecords &last = counts.chroms.back();
+      last.n_records += cr.n_records;
+      last.n_bytes = cr.offset + cr.n_bytes - last.offset;
+    }
+    else counts.chroms.push_back(cr);
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECORD_COUNTER_HPP
+#define RECORD_COUNTER_HPP
+
+#include <string>
+#include <vector>
+
+/* Exact counts of lines and records in text files, found in one pass
+ * over the file mapped into memory. A record is a line that is not
+ * empty and is not a header line starting with '#', and its chrom is
+ * its first token, as in methcounts, BED and mapped reads files.
+ */
+
+// the number of lines, counting a last line without a '\n'
+size_t
+count_lines(const char *data, const size_t n_bytes);
+
+size_t
+count_lines(const std::string &filename);
+
+size_t
+count_records(const char *data, const size_t n_bytes);
+
+size_t
+count_records(const std::string &filename);
+
+// one run of consecutive records with the same chrom
+struct ChromRecords {
+  std::string chrom;
+  size_t n_records;
+  size_t offset;  // of the first record
+  size_t n_bytes; // up to the end of the line of the last record
+};
+
+struct RecordCounts {
+  RecordCounts() : n_lines(0), n_records(0) {}
+  size_t n_lines;
+  size_t n_records;
+  // in the order of the file; a chrom that appears again after
+  // another chrom starts a new run
+  std::vector<ChromRecords> chroms;
+};
+
+void
+count_records(const char *data, const size_t n_bytes, RecordCounts &counts);
+
+void
+count_records(const std::string &filename, RecordCounts &counts);
+
+/* Offsets that cut the data into at most "n_chunks" pieces of about
+ * equal size, each starting at the beginning of a line, so the chunks
+ * can be counted in parallel. The first offset is 0 and the last is
+ * "n_bytes".
+ */
+void
+chunk_boundaries(const char *data, const size_t n_bytes,
+                 const size_t n_chunks, std::vector<size_t> &offsets);
+
+/* Adds to "counts" those of a chunk that follows its data and starts
+ * "offset" bytes into the file; a run of the chunk's first chrom
+ * continues the last run in "counts" if it has the same chrom.
+ */
+void
+append_record_counts(const RecordCounts &chunk, const size_t offset,
+                     RecordCounts &counts);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXT_FORMAT_HPP
+#define TEXT_FORMAT_HPP
+
+/* Formatting of numbers and output records without ostream
+ * insertion, locales or allocation. The text is the same, byte for
+ * byte, as "out << x" with the default format flags and precision, so
+ * output files do not change with the way they are written.
+ */
+
+#include <string>
+#include <ostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+// room needed for any number written by the functions below
+static const size_t MAX_FORMATTED_NUMBER = 32;
+
+// writes the decimal digits of "x" at "p" and returns the end
+inline char *
+format_uint(char *p, uint64_t x) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + x % 10;
+    x /= 10;
+  } while (x > 0);
+  while (n > 0)
+    *p++ = digits[--n];
+  return p;
+}
+
+inline char *
+format_int(char *p, const int64_t x) {
+  if (x < 0) {
+    *p++ = '-';
+    return format_uint(p, -static_cast<uint64_t>(x));
+  }
+  return format_uint(p, x);
+}
+
+/* format_double: writes "x" as "%g" with 6 significant digits, which
+   is what "out << x" gives by default, and returns the end. Most
+   values are converted from a scaled integer; any that are out of
+   range, or so near half way between two 6-digit values that the
+   scaling could round them the wrong way, go through snprintf. */
+inline char *
+format_double(char *p, double x) {
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15
+  };
+  if (x == 0) {
+    if (std::signbit(x)) *p++ = '-';
+    *p++ = '0';
+    return p;
+  }
+  // also true for nan
+  if (!(std::fabs(x) >= 1e-5 && std::fabs(x) < 1e15))
+    return p + std::snprintf(p, MAX_FORMATTED_NUMBER, "%g", x);
+
+  char *const start = p;
+  if (x < 0) {
+    *p++ = '-';
+    x = -x;
+  }
+  // the decimal exponent, with 10^e <= x < 10^(e + 1)
+  int e = 0;
+  if (x >= 1.0)
+    while (x >= pow10[e + 1]) ++e;
+  else
+    while (x*pow10[-e] < 1.0) --e;
+
+  // x with 6 digits before the decimal point; the powers of 10 are
+  // exact so "y" is within an ulp of the true value
+  const int k = 5 - e;
+  const double y = k >= 0 ? x*pow10[k] : x/pow10[-k];
+  const double whole = std::floor(y);
+  const double frac = y - whole;
+  if (y < 1e5 || y >= 1e6 || std::fabs(frac - 0.5) < 1e-7)
+    return start + std::snprintf(start, MAX_FORMATTED_NUMBER, "%g",
+                                 start == p ? x : -x);
+
+  uint32_t m = static_cast<uint32_t>(whole) + (frac > 0.5);
+  if (m == 1000000) {
+    m = 100000;
+    ++e;
+  }
+  char d[6];
+  for (size_t i = 6; i > 0; --i) {
+    d[i - 1] = '0' + m % 10;
+    m /= 10;
+  }
+  int n_digits = 6;
+  while (n_digits > 1 && d[n_digits - 1] == '0') --n_digits;
+
+  if (e < -4 || e >= 6) {
+    *p++ = d[0];
+    if (n_digits > 1) {
+      *p++ = '.';
+      for (int i = 1; i < n_digits; ++i) *p++ = d[i];
+    }
+    *p++ = 'e';
+    *p++ = (e < 0) ? '-' : '+';
+    const int abs_e = (e < 0) ? -e : e;
+    *p++ = '0' + abs_e/10;
+    *p++ = '0' + abs_e % 10;
+  }
+  else if (e >= 0) {
+    for (int i = 0; i <= e; ++i) *p++ = d[i];
+    if (n_digits > e + 1) {
+      *p++ = '.';
+      for (int i = e + 1; i < n_digits; ++i) *p++ = d[i];
+    }
+  }
+  else {
+    *p++ = '0';
+    *p++ = '.';
+    for (int i = -1; i > e; --i) *p++ = '0';
+    for (int i = 0; i < n_digits; ++i) *p++ = d[i];
+  }
+  return p;
+}
+
+inline void
+append_uint(std::string &s, const uint64_t x) {
+  char buf[MAX_FORMATTED_NUMBER];
+  s.append(buf, format_uint(buf, x));
+}
+
+inline void
+append_double(std::string &s, const double x) {
+  char buf[MAX_FORMATTED_NUMBER];
+  s.append(buf, format_double(buf, x));
+}
+
+
+/* RecordWriter: collects fields in a fixed buffer and hands it to the
+ * ostream only when full, or on "flush" or destruction. Lines are not
+ * flushed individually, so a writer kept for a whole output file
+ * makes one call to the stream buffer for each few KB of text. A
+ * writer given a string appends to it instead, for text that is
+ * built in a batch and written later.
+ */
+class RecordWriter {
+public:
+  explicit RecordWriter(std::ostream &o) : out(&o), str(0), cur(buf) {}
+  explicit RecordWriter(std::string &s) : out(0), str(&s), cur(buf) {}
+  ~RecordWriter() {flush();}
+
+  RecordWriter &put(const char c) {
+    if (cur == buf + capacity) flush();
+    *cur++ = c;
+    return *this;
+  }
+
+  RecordWriter &put(const char *s, const size_t n) {
+    if (n > static_cast<size_t>(buf + capacity - cur)) {
+      flush();
+      if (n > capacity) {
+        write(s, n);
+        return *this;
+      }
+    }
+    std::memcpy(cur, s, n);
+    cur += n;
+    return *this;
+  }
+
+  RecordWriter &put(const std::string &s) {return put(s.data(), s.size());}
+
+  RecordWriter &put_uint(const uint64_t x) {
+    reserve(MAX_FORMATTED_NUMBER);
+    cur = format_uint(cur, x);
+    return *this;
+  }
+
+  RecordWriter &put_double(const double x) {
+    reserve(MAX_FORMATTED_NUMBER);
+    cur = format_double(cur, x);
+    return *this;
+  }
+
+  void flush() {
+    if (cur != buf)
+      write(buf, cur - buf);
+    cur = buf;
+  }
+
+private:
+  void write(const char *s, const size_t n) {
+    if (out) out->write(s, n);
+    else str->append(s, n);
+  }
+
+  void reserve(const size_t n) {
+    if (static_cast<size_t>(buf + capacity - cur) < n) flush();
+  }
+
+  static const size_t capacity = 4096;
+
+  std::ostream *out;
+  std::string *str;
+  char *cur;
+  char buf[capacity];
+
+  RecordWriter(const RecordWriter &);
+  RecordWriter &operator=(const RecordWriter &);
+};
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXT_SCAN_HPP
+#define TEXT_SCAN_HPP
+
+/* Moving over the whitespace separated fields of a line held in a
+ * NUL terminated string, so the fields can be parsed in place with
+ * strtoul and strtod rather than with a stringstream.
+ */
+
+#include <cctype>
+
+inline const char *
+skip_space(const char *p) {
+  while (*p && isspace(static_cast<unsigned char>(*p))) ++p;
+  return p;
+}
+
+inline const char *
+skip_token(const char *p) {
+  while (*p && !isspace(static_cast<unsigned char>(*p))) ++p;
+  return p;
+}
+
+#endif
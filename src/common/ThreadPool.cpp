@@ -0,0 +1,182 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ThreadPool.hpp"
+
+using std::vector;
+using std::unique_ptr;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+
+// the pool, if any, that the current thread is a worker of
+static thread_local const ThreadPool *current_pool = 0;
+static thread_local size_t current_tid = 0;
+
+
+ThreadPool::ThreadPool(const size_t n_threads) :
+  next_queue(0), n_queued(0), n_sleeping(0), stopping(false) {
+  const size_t n = std::max(n_threads, static_cast<size_t>(1));
+  for (size_t i = 0; i < n; ++i)
+    queues.push_back(unique_ptr<JobQueue>(new JobQueue));
+  for (size_t i = 1; i < n; ++i)
+    workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+}
+
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(sleep_mtx);
+    stopping = true;
+  }
+  sleep_cv.notify_all();
+  for (size_t i = 0; i < workers.size(); ++i)
+    workers[i].join();
+}
+
+
+size_t
+ThreadPool::thread_id() const {
+  return current_pool == this ? current_tid : 0;
+}
+
+
+/* a worker puts new jobs on its own queue, where it will find
+   them first; outside threads spread them over all the queues. */
+void
+ThreadPool::push(Job &&job) {
+  const size_t q = (current_pool == this) ?
+    current_tid : next_queue++ % queues.size();
+  {
+    lock_guard<mutex> lock(queues[q]->mtx);
+    queues[q]->jobs.push_back(std::move(job));
+  }
+  bool wake = false;
+  {
+    lock_guard<mutex> lock(sleep_mtx);
+    ++n_queued;
+    wake = (n_sleeping > 0);
+  }
+  if (wake)
+    sleep_cv.notify_one();
+}
+
+
+bool
+ThreadPool::run_one(const size_t tid) {
+  Job job;
+  bool found = false;
+  {
+    JobQueue &own = *queues[tid];
+    lock_guard<mutex> lock(own.mtx);
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.back());
+      own.jobs.pop_back();
+      found = true;
+    }
+  }
+  for (size_t i = 1; !found && i < queues.size(); ++i) {
+    JobQueue &other = *queues[(tid + i) % queues.size()];
+    lock_guard<mutex> lock(other.mtx);
+    if (!other.jobs.empty()) {
+      job = std::move(other.jobs.front());
+      other.jobs.pop_front();
+      found = true;
+    }
+  }
+  if (!found)
+    return false;
+
+  --n_queued;
+  std::exception_ptr error;
+  try {job.task(tid);}
+  catch (...) {error = std::current_exception();}
+  job.group->finish(error);
+  return true;
+}
+
+
+void
+ThreadPool::worker_loop(const size_t tid) {
+  current_pool = this;
+  current_tid = tid;
+  for (;;) {
+    if (run_one(tid))
+      continue;
+    unique_lock<mutex> lock(sleep_mtx);
+    ++n_sleeping;
+    sleep_cv.wait(lock, [this] {return stopping || n_queued > 0;});
+    --n_sleeping;
+    if (stopping && n_queued <= 0)
+      return;
+  }
+}
+
+
+TaskGroup::~TaskGroup() {
+  // jobs refer to this group, so it must outlive them
+  wait_for_tasks();
+}
+
+
+void
+TaskGroup::run(ThreadPool::Task task) {
+  {
+    lock_guard<mutex> lock(mtx);
+    ++pending;
+  }
+  ThreadPool::Job job;
+  job.task = std::move(task);
+  job.group = this;
+  pool.push(std::move(job));
+}
+
+
+/* the waiting thread may destroy the group as soon as it sees the
+   last task finish, so the count goes to 0 and the waiter is woken
+   under the lock, and the group is not used after it is released */
+void
+TaskGroup::finish(std::exception_ptr e) {
+  lock_guard<mutex> lock(mtx);
+  if (e && !error) error = e;
+  if (--pending == 0)
+    done.notify_all();
+}
+
+
+/* only the thread that owns the group adds tasks to it, so once it
+   finds no queued task in any queue, those of the group still pending
+   are running in other threads, and it can sleep until they finish */
+void
+TaskGroup::wait_for_tasks() {
+  const size_t tid = pool.thread_id();
+  while (pool.run_one(tid));
+  unique_lock<mutex> lock(mtx);
+  done.wait(lock, [this] {return pending == 0;});
+}
+
+
+void
+TaskGroup::wait() {
+  wait_for_tasks();
+  if (error) {
+    std::exception_ptr e = error;
+    error = std::exception_ptr();
+    std::rethrow_exception(e);
+  }
+}
@@ -0,0 +1,195 @@
+/*
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+#include "OptionParser.hpp"
+
+// the ordered pipeline (producer -> workers -> in-order writer) is
+// part of the same runtime
+#include "OrderedPipeline.hpp"
+
+class TaskGroup;
+
+/* ThreadPool: a fixed set of threads that run tasks from per-thread
+ * queues. A thread takes tasks from the back of its own queue and,
+ * when that is empty, steals from the front of the queues of the
+ * others, so uneven tasks even out without a central queue.
+ *
+ * A pool of "n" threads starts "n - 1" workers: the thread that waits
+ * on a TaskGroup runs tasks too, as thread 0 if it is not one of the
+ * workers. Tasks are given the id of the thread running them, in
+ * [0, size()), to index any per-thread workspace. Only one thread
+ * outside the pool should use it at a time, as they would all run
+ * tasks with id 0. Tasks may themselves use the pool, for example
+ * calling parallel_for, because a waiting thread runs queued tasks
+ * before it blocks, so the thread that queued a task, if no other,
+ * runs it.
+ */
+class ThreadPool {
+public:
+  typedef std::function<void(size_t)> Task;
+
+  explicit ThreadPool(const size_t n_threads);
+  ~ThreadPool();
+
+  size_t size() const {return queues.size();}
+
+  // id of the calling thread in this pool; 0 for outside threads
+  size_t thread_id() const;
+
+private:
+  friend class TaskGroup;
+
+  struct Job {
+    Task task;
+    TaskGroup *group;
+  };
+  struct JobQueue {
+    std::mutex mtx;
+    std::deque<Job> jobs;
+  };
+
+  void push(Job &&job);
+  bool run_one(const size_t tid);
+  void worker_loop(const size_t tid);
+
+  std::vector<std::unique_ptr<JobQueue> > queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next_queue;
+  std::atomic<long> n_queued;
+  size_t n_sleeping;
+  bool stopping;
+  std::mutex sleep_mtx;
+  std::condition_variable sleep_cv;
+
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+};
+
+
+/* TaskGroup: tasks given to "run" go to the pool, and "wait" returns
+ * once all of them have finished. The calling thread runs queued tasks
+ * meanwhile and, once none are left to take, sleeps until the last of
+ * its tasks running in other threads is done. The first exception
+ * thrown by a task is rethrown from "wait" after the others have
+ * finished.
+ */
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool &p) : pool(p), pending(0) {}
+  ~TaskGroup();
+
+  void run(ThreadPool::Task task);
+  void wait();
+
+private:
+  friend class ThreadPool;
+  void finish(std::exception_ptr e);
+  void wait_for_tasks();
+
+  ThreadPool &pool;
+  size_t pending;
+  std::mutex mtx;
+  std::condition_variable done;
+  std::exception_ptr error;
+
+  TaskGroup(const TaskGroup &);
+  TaskGroup &operator=(const TaskGroup &);
+};
+
+
+/* parallel_for: calls "f(begin, end, tid)" on consecutive ranges of
+ * at most "chunk_size" indices that together cover [0, n). With a
+ * single thread, or a single chunk, "f" is called once in the calling
+ * thread for all of [0, n).
+ */
+template <class F>
+void
+parallel_for(ThreadPool &pool, const size_t n, const size_t chunk_size, F f) {
+  const size_t chunk = std::max(chunk_size, static_cast<size_t>(1));
+  if (pool.size() <= 1 || n <= chunk) {
+    if (n > 0) f(0, n, pool.thread_id());
+    return;
+  }
+  TaskGroup group(pool);
+  for (size_t i = 0; i < n; i += chunk) {
+    const size_t end = std::min(n, i + chunk);
+    group.run([&f, i, end](const size_t tid) {f(i, end, tid);});
+  }
+  group.wait();
+}
+
+
+// parallel_for_each: calls "f(i, tid)" for each i in [0, n)
+template <class F>
+void
+parallel_for_each(ThreadPool &pool, const size_t n, F f,
+                  const size_t chunk_size = 1) {
+  parallel_for(pool, n, chunk_size,
+               [&f](const size_t begin, const size_t end, const size_t tid) {
+                 for (size_t i = begin; i < end; ++i) f(i, tid);
+               });
+}
+
+
+/* parallel_reduce: "map(begin, end, tid)" gives the value for each
+ * chunk of [0, n), as in parallel_for, and the values are folded
+ * into "init" with "combine(acc, value)" in the order of the chunks.
+ * The result depends on the chunk size but not on the number of
+ * threads or the order in which the chunks ran, so floating point
+ * sums are the same from one run to the next; with chunks of one
+ * index a sum is the same as a serial loop.
+ */
+template <class T, class Map, class Combine>
+T
+parallel_reduce(ThreadPool &pool, const size_t n, const size_t chunk_size,
+                T init, Map map, Combine combine) {
+  const size_t chunk = std::max(chunk_size, static_cast<size_t>(1));
+  const size_t n_chunks = (n + chunk - 1)/chunk;
+  std::vector<T> parts(n_chunks, init);
+  parallel_for_each(pool, n_chunks,
+                    [&](const size_t c, const size_t tid) {
+                      parts[c] = map(c*chunk, std::min(n, (c + 1)*chunk), tid);
+                    });
+  for (size_t c = 0; c < n_chunks; ++c)
+    init = combine(init, parts[c]);
+  return init;
+}
+
+
+// the usual "-t/--threads" option
+inline void
+add_threads_opt(OptionParser &opt_parse, size_t &n_threads,
+                const char short_name = 't') {
+  opt_parse.add_opt("threads", short_name, "number of threads (default: 1)",
+                    false, n_threads);
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include "ThreeStateHMM.hpp"
 #include "numerical_utils.hpp"
 #include "BetaBin.hpp"
+#include "Metrics.hpp"
 
 #include <iomanip>
 #include <numeric>
@@ -520,6 +521,7 @@ ThreeStateHMM::BaumWelchTraining()
   
     for (size_t i = 0; i < max_iterations; ++i) 
     {
+        Metrics::count("em_iterations");
         const betabin old_hypo_emission = hypo_emission;
         const betabin old_HYPER_emission = HYPER_emission;
         const betabin old_HYPO_emission = HYPO_emission;
@@ -20,11 +20,14 @@
 */
 
 #include "TwoStateHMM.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
 
 #include <iomanip>
 #include <numeric>
 #include <limits>
 #include <cmath>
+#include <mutex>
 
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
@@ -126,6 +129,42 @@ betabin::fit(const vector<double> &vals_a, const vector<double> &vals_b,
 ////////////////////////////////////////////////////////////////////////
 
 
+TwoStateHMMB::TwoStateHMMB(const double mp, const double tol,
+                           const size_t max_itr, const bool v, bool d,
+                           const size_t n_threads) :
+  MIN_PROB(mp), tolerance(tol), max_iterations(max_itr),
+  VERBOSE(v), DEBUG(d), pool(std::make_shared<ThreadPool>(n_threads)) {}
+
+
+// the blocks are scored by the pool threads, so the message is
+// written under a lock to keep its lines whole
+static void
+check_block_scores(const double score, const double backward_score) {
+  if (fabs(score - backward_score)/max(score, backward_score) > 1e-10) {
+    static std::mutex mtx;
+    std::lock_guard<std::mutex> lock(mtx);
+    cerr << "fabs(score - backward_score)/"
+         << "max(score, backward_score) > 1e-10" << endl;
+  }
+}
+
+
+double
+TwoStateHMMB::sum_over_blocks(const vector<size_t> &reset_points,
+                              const std::function<double(size_t, size_t)>
+                              &block_score) const {
+  const size_t n_blocks = reset_points.empty() ? 0 : reset_points.size() - 1;
+  return parallel_reduce(*pool, n_blocks, 1, 0.0,
+                         [&](const size_t b, const size_t, const size_t) {
+                           return block_score(reset_points[b],
+                                              reset_points[b + 1]);
+                         },
+                         [](const double total, const double score) {
+                           return total + score;
+                         });
+}
+
+
 inline double
 TwoStateHMMB::log_sum_log(const double p, const double q) const {
   if (p == 0) {return q;}
@@ -292,42 +331,24 @@ TwoStateHMMB::single_iteration(const vector<pair<double, double> > &values,
   vector<double> bb_vals(values.size(), 0);
 
 
-  // #pragma omp parallel
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm(values,
-					   reset_points[i],
-					   reset_points[i + 1],
-					   lp_sf, lp_sb,
-					   lp_ff, lp_fb, lp_ft,
-					   lp_bf, lp_bb, lp_bt,
-					   fg_distro, bg_distro, forward);
-    const double backward_score =
-      backward_algorithm(values,
-			 reset_points[i],
-			 reset_points[i + 1],
-			 lp_sf, lp_sb,
-			 lp_ff, lp_fb, lp_ft,
-			 lp_bf, lp_bb, lp_bt,
-			 fg_distro, bg_distro, backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    estimate_transitions(values,
-			 reset_points[i],
-			 reset_points[i + 1],
-			 forward, backward,
-			 score,
-			 fg_distro, bg_distro,
-			 lp_ff, lp_fb, lp_bf,
-			 lp_bb, lp_ft, lp_bt,
-			 ff_vals, fb_vals,
-			 bf_vals, bb_vals);
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm(values, start, end,
+                          lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                          fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm(values, start, end,
+                           lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                           fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      estimate_transitions(values, start, end, forward, backward, score,
+                           fg_distro, bg_distro,
+                           lp_ff, lp_fb, lp_bf, lp_bb, lp_ft, lp_bt,
+                           ff_vals, fb_vals, bf_vals, bb_vals);
+      return score;
+    });
 
   // Subtracting 1 from the limit of the summation because the final
   // term has no meaning since there is no transition to be counted
@@ -454,6 +475,7 @@ TwoStateHMMB::BaumWelchTraining(const vector<pair<double, double> > &values,
   }
 
   for (size_t i = 0; i < max_iterations; ++i) {
+    Metrics::count("em_iterations");
 
     double p_sf_est = p_sf;
     double p_sb_est = p_sb;
@@ -564,31 +586,20 @@ TwoStateHMMB::PosteriorScores(const vector<pair<double, double> > &values,
   vector<pair<double, double> > forward(values.size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values.size(), pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm(values,
-					   reset_points[i],
-					   reset_points[i + 1],
-					   lp_sf, lp_sb,
-					   lp_ff, lp_fb, lp_ft,
-					   lp_bf, lp_bb, lp_bt,
-					   fg_distro, bg_distro, forward);
-
-    const double backward_score =
-      backward_algorithm(values,
-			 reset_points[i],
-			 reset_points[i + 1],
-			 lp_sf, lp_sb,
-			 lp_ff, lp_fb, lp_ft,
-			 lp_bf, lp_bb, lp_bt,
-			 fg_distro, bg_distro, backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm(values, start, end,
+                          lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                          fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm(values, start, end,
+                           lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                           fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   llr_scores.resize(values.size());
   for (size_t i = 0; i < values.size(); ++i) {
@@ -663,24 +674,20 @@ TwoStateHMMB::PosteriorScores(const vector<pair<double, double> > &values,
   vector<pair<double, double> > forward(values.size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values.size(), pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(values, reset_points[i], reset_points[i + 1],
-			lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
-			fg_distro, bg_distro, forward);
-
-    const double backward_score =
-      backward_algorithm(values, reset_points[i], reset_points[i + 1],
-			 lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
-			 lp_bf, lp_bb, lp_bt,
-			 fg_distro, bg_distro, backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm(values, start, end,
+                          lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                          fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm(values, start, end,
+                           lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                           fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   llr_scores.resize(values.size());
   for (size_t i = 0; i < values.size(); ++i) {
@@ -759,28 +766,20 @@ TwoStateHMMB::TransitionPosteriors(const vector<pair<double, double> > &values,
   vector<pair<double, double> > forward(values.size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values.size(), pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm(values,
-					   reset_points[i],
-					   reset_points[i + 1],
-					   lp_sf, lp_sb,
-					   lp_ff, lp_fb, lp_ft,
-					   lp_bf, lp_bb, lp_bt,
-					   fg_distro, bg_distro, forward);
-
-    const double backward_score =
-      backward_algorithm(values, reset_points[i], reset_points[i + 1],
-			 lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
-			 lp_bf, lp_bb, lp_bt,
-			 fg_distro, bg_distro, backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm(values, start, end,
+                          lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                          fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm(values, start, end,
+                           lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                           fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   scores.resize(values.size());
   size_t j = 0;
@@ -872,31 +871,20 @@ TwoStateHMMB::PosteriorDecoding(const vector<pair<double, double> > &values,
   vector<pair<double, double> > forward(values.size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values.size(), pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm(values,
-					   reset_points[i],
-					   reset_points[i + 1],
-					   lp_sf, lp_sb,
-					   lp_ff, lp_fb, lp_ft,
-					   lp_bf, lp_bb, lp_bt,
-					   fg_distro, bg_distro, forward);
-
-    const double backward_score =
-      backward_algorithm(values,
-			 reset_points[i],
-			 reset_points[i + 1],
-			 lp_sf, lp_sb,
-			 lp_ff, lp_fb, lp_ft,
-			 lp_bf, lp_bb, lp_bt,
-			 fg_distro, bg_distro, backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm(values, start, end,
+                          lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                          fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm(values, start, end,
+                           lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                           fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   classes.resize(values.size());
   //   llr_scores.resize(values.size());
@@ -1225,41 +1213,24 @@ TwoStateHMMB::single_iteration_rep(const vector<vector<pair<double, double> > >
   vector<double> bf_vals(values[0].size(), 0);
   vector<double> bb_vals(values[0].size(), 0);
 
-  // #pragma omp parallel
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm_rep(values,
-			    reset_points[i],
-			    reset_points[i + 1],
-			    lp_sf, lp_sb,
-			    lp_ff, lp_fb, lp_ft,
-			    lp_bf, lp_bb, lp_bt,
-			    fg_distro, bg_distro,
-			    forward);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-			     reset_points[i],
-			     reset_points[i + 1],
-			     lp_sf, lp_sb,
-			     lp_ff, lp_fb, lp_ft,
-			     lp_bf, lp_bb, lp_bt,
-			     fg_distro, bg_distro,
-			     backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10) {
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-    }
-
-    estimate_transitions_rep(values, reset_points[i], reset_points[i + 1],
-			     forward, backward, score, fg_distro, bg_distro,
-			     lp_ff, lp_fb, lp_bf, lp_bb, lp_ft, lp_bt,
-			     ff_vals, fb_vals, bf_vals, bb_vals);
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm_rep(values, start, end,
+                              lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                              fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm_rep(values, start, end,
+                               lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                               fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      estimate_transitions_rep(values, start, end, forward, backward, score,
+                               fg_distro, bg_distro,
+                               lp_ff, lp_fb, lp_bf, lp_bb, lp_ft, lp_bt,
+                               ff_vals, fb_vals, bf_vals, bb_vals);
+      return score;
+    });
 
   // Subtracting 1 from the limit of the summation
   // to eliminate the last term in the last block
@@ -1419,6 +1390,7 @@ TwoStateHMMB::BaumWelchTraining_rep(const vector<vector<pair<double, double> > >
   }
 
   for (size_t i = 0; i < max_iterations; ++i) {
+    Metrics::count("em_iterations");
 
     double p_sf_est = p_sf;
     double p_sb_est = p_sb;
@@ -1550,33 +1522,20 @@ TwoStateHMMB::PosteriorScores_rep(const vector<vector<pair<double, double> > > &
   vector<pair<double, double> > forward(values[0].size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values[0].size(), pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm_rep(values,
-					       reset_points[i],
-					       reset_points[i + 1],
-					       lp_sf, lp_sb,
-					       lp_ff, lp_fb, lp_ft,
-					       lp_bf, lp_bb, lp_bt,
-					       fg_distro, bg_distro,
-					       forward);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-			     reset_points[i],
-			     reset_points[i + 1],
-			     lp_sf, lp_sb,
-			     lp_ff, lp_fb, lp_ft,
-			     lp_bf, lp_bb, lp_bt,
-			     fg_distro, bg_distro,
-			     backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm_rep(values, start, end,
+                              lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                              fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm_rep(values, start, end,
+                               lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                               fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   llr_scores.resize(values[0].size());
   for (size_t i = 0; i < values[0].size(); ++i) {
@@ -1653,33 +1612,20 @@ TwoStateHMMB::PosteriorDecoding_rep(const vector<vector<pair<double, double> > >
 
   vector<pair<double, double> > forward(values[0].size(), pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values[0].size(), pair<double, double>(0, 0));
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm_rep(values,
-					       reset_points[i],
-					       reset_points[i + 1],
-					       lp_sf, lp_sb,
-					       lp_ff, lp_fb, lp_ft,
-					       lp_bf, lp_bb, lp_bt,
-					       fg_distro, bg_distro,
-					       forward);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-			     reset_points[i],
-			     reset_points[i + 1],
-			     lp_sf, lp_sb,
-			     lp_ff, lp_fb, lp_ft,
-			     lp_bf, lp_bb, lp_bt,
-			     fg_distro, bg_distro,
-			     backward);
-
-    if (DEBUG && (fabs(score - backward_score)/
-		  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-	   << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  total_score +=
+    sum_over_blocks(reset_points, [&](const size_t start, const size_t end) {
+      const double score =
+        forward_algorithm_rep(values, start, end,
+                              lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                              fg_distro, bg_distro, forward);
+      const double backward_score =
+        backward_algorithm_rep(values, start, end,
+                               lp_sf, lp_sb, lp_ff, lp_fb, lp_ft, lp_bf, lp_bb, lp_bt,
+                               fg_distro, bg_distro, backward);
+      if (DEBUG)
+        check_block_scores(score, backward_score);
+      return score;
+    });
 
   classes.resize(values[0].size());
 
@@ -24,16 +24,17 @@
 
 #include "smithlab_utils.hpp"
 #include <memory>
+#include <functional>
 
 struct betabin;
+class ThreadPool;
 
 class TwoStateHMMB {
 public:
 
   TwoStateHMMB(const double mp, const double tol,
-	       const size_t max_itr, const bool v, bool d = false) :
-    MIN_PROB(mp), tolerance(tol), max_iterations(max_itr),
-    VERBOSE(v), DEBUG(d) {}
+	       const size_t max_itr, const bool v, bool d = false,
+	       const size_t n_threads = 1);
 
   double
   ViterbiDecoding(const std::vector<std::pair<double, double> > &values,
@@ -351,6 +352,12 @@ private:
   double
   log_sum_log(const double p, const double q) const;
 
+  // The blocks between consecutive reset points are independent, so
+  // they are scored in parallel; the scores are added in block order.
+  double
+  sum_over_blocks(const std::vector<size_t> &reset_points,
+		  const std::function<double(size_t, size_t)> &block_score) const;
+
   double MIN_PROB;
   double tolerance;
   size_t max_iterations;
@@ -358,6 +365,8 @@ private:
   bool DEBUG;
 
   mutable size_t emission_correction_count;
+
+  std::shared_ptr<ThreadPool> pool;
 };
 
 #endif
@@ -36,9 +36,11 @@
 #include "Distro.hpp"
 #include "false_discovery_rate.hpp"
 #include "contingency-table.hpp"
-#include "RNG.hpp"
 #include "nonparametric-test.hpp"
 #include "ModelParams.hpp"
+#include "ThreadPool.hpp"
+#include "RandomStream.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -154,15 +156,15 @@ separate_regions(const bool VERBOSE, const size_t desert_size,
 static void
 pick_sample(const vector<double> &diffscores,
             const vector<size_t> &reset_points,
-            const size_t training_size,
+            const size_t training_size, const size_t seed,
             vector<double> &diffscores_sample,
             vector<size_t> &reset_points_sample)
 {
     // random training sample
     vector<size_t> idxs(reset_points.size() - 1);
     for (size_t i = 0; i < idxs.size(); ++i) idxs[i] = i;
-    srand(time(0) + getpid());
-    std::random_shuffle(idxs.begin(), idxs.end());
+    RandomStream rs(seed, 0);
+    rs.shuffle(idxs.begin(), idxs.end());
 
     size_t sample_size = 0;
     size_t i = 0;
@@ -270,38 +272,51 @@ calcualte_domain_p_values_by_wilcoxon_test(
     const vector<SimpleGenomicRegion> &cpgs,
     const vector<size_t> &meth_a, const vector<size_t> &unmeth_a,
     const vector<size_t> &meth_b, const vector<size_t> &unmeth_b,
-    const vector<GenomicRegion> &domains, vector<double> &p_values)
+    const vector<GenomicRegion> &domains, vector<double> &p_values,
+    const size_t n_threads)
 {
     assert(check_sorted(cpgs));
     assert(check_sorted(domains));
 
+    vector<double> methylation_a(cpgs.size()), methylation_b(cpgs.size());
+    for (size_t j = 0; j < cpgs.size(); ++j)
+    {
+        methylation_a[j] =
+            static_cast<double>(meth_a[j]) / (meth_a[j] + unmeth_a[j]);
+        methylation_b[j] =
+            static_cast<double>(meth_b[j]) / (meth_b[j] + unmeth_b[j]);
+    }
+
+    // the CpGs in each domain
+    vector<pair<size_t, size_t> > cpg_ranges(domains.size());
     size_t j = 0;
     for (size_t i = 0; i < domains.size(); ++i)
     {
         const SimpleGenomicRegion simdom(domains[i]);
-        vector<double> methylation_a, methylation_b;
-        size_t domain_size = 0;
-        
         while (j < cpgs.size() && !simdom.contains(cpgs[j])) ++j;
+        cpg_ranges[i].first = j;
+        while (j < cpgs.size() && simdom.contains(cpgs[j])) ++j;
+        cpg_ranges[i].second = j;
+    }
 
-        while (j < cpgs.size() && simdom.contains(cpgs[j]))
-        {	
-            methylation_a.push_back(
-                static_cast<double>(meth_a[j]) / (meth_a[j] + unmeth_a[j]));
-            methylation_b.push_back(
-                static_cast<double>(meth_b[j]) / (meth_b[j] + unmeth_b[j]));
-            ++domain_size;
-            ++j;
-        }
-
+    p_values.resize(domains.size());
+    ThreadPool pool(n_threads);
+    vector<NonParametricTest::WilcoxonWorkspace> workspaces(pool.size());
+    parallel_for_each(pool, domains.size(),
+                      [&](const size_t i, const size_t tid)
+    {
+        const size_t first = cpg_ranges[i].first;
+        const size_t n_cpgs = cpg_ranges[i].second - first;
+        const double *a = methylation_a.empty() ? 0 : &methylation_a[first];
+        const double *b = methylation_b.empty() ? 0 : &methylation_b[first];
         const double p_value =
             (domains[i].get_name().substr(0, 4)
              == STATE_LABEL_STRS[GAIN])
-            ? NonParametricTest::wilcoxon_test(methylation_b, methylation_a)
-            : NonParametricTest::wilcoxon_test(methylation_a, methylation_b);
+            ? NonParametricTest::wilcoxon_test(b, a, n_cpgs, workspaces[tid])
+            : NonParametricTest::wilcoxon_test(a, b, n_cpgs, workspaces[tid]);
         assert(p_value >= 0 && p_value <= 1);
-        p_values.push_back(p_value);
-    }
+        p_values[i] = p_value;
+    });
 
     assert(p_values.size() == domains.size());
 }
@@ -312,14 +327,15 @@ score_domain_by_wilcoxon_test(
     const vector<size_t> &meth_a,  const vector<size_t> &unmeth_a, 
     const vector<size_t> &meth_b,  const vector<size_t> &unmeth_b, 
     const double fdr, double fdr_cutoff, vector<GenomicRegion> &domains,
-    const bool VERBOSE)
+    const size_t n_threads, const bool VERBOSE)
 {
     if (VERBOSE)
         cerr << "Computing FDR cutoff with Wilcoxon signed-rank test" << endl;
 
     vector<double> p_values;
     calcualte_domain_p_values_by_wilcoxon_test(
-        cpgs, meth_a, unmeth_a, meth_b, unmeth_b, domains, p_values);
+        cpgs, meth_a, unmeth_a, meth_b, unmeth_b, domains, p_values,
+        n_threads);
     if (fdr_cutoff == numeric_limits<double>::max())
         fdr_cutoff = FDR::get_fdr_cutoff(p_values, fdr);
     if (VERBOSE)
@@ -341,31 +357,18 @@ score_domain_by_wilcoxon_test(
 
 static void
 calculate_random_scores_from_background(
-    const vector<size_t> &meth_a,
-    const vector<size_t> &unmeth_a,
-    const vector<size_t> &meth_b,
-    const vector<size_t> &unmeth_b,
+    const vector<double> &diffmeth,
     const size_t & cpg_num,
     const size_t & times, 
+    RandomStream &rs,
     vector<double> &random_scores) 
 {
-    assert(meth_a.size() == unmeth_a.size()
-           && meth_a.size() == meth_b.size()
-           && meth_a.size() == unmeth_b.size());
-    
-    vector<double> diffmeth(meth_a.size());
-    for (size_t i = 0; i < meth_a.size(); ++i)
-    {
-        diffmeth[i] =
-            static_cast<double>(meth_b[i]) / (meth_b[i] + unmeth_b[i]) 
-            - static_cast<double>(meth_a[i]) / (meth_a[i] + unmeth_a[i]);
-    }
-
-    Runif rng(std::time(NULL) + getpid());
+    assert(cpg_num <= diffmeth.size());
+    // a domain with every CpG has only the one window, starting at 0
+    const size_t start_range = diffmeth.size() - cpg_num;
     for (size_t j = 0; j < times; ++j)
     {
-        const size_t start = rng.runif(static_cast<size_t>(0),
-                                       meth_a.size() - cpg_num);
+        const size_t start = (start_range > 0) ? rs.uniform_int(start_range) : 0;
         const double sum_diffmeth =
             std::accumulate(diffmeth.begin() + start,
                             diffmeth.begin() + start + cpg_num, 0.0);
@@ -375,16 +378,11 @@ calculate_random_scores_from_background(
     std::sort(random_scores.begin(), random_scores.end());
 }
 
-class DomainSizeCmp:
-    public std::binary_function<GenomicRegion, GenomicRegion, bool>
+static size_t
+domain_cpg_count(const GenomicRegion &domain)
 {
-public:
-    bool operator()(const GenomicRegion &lhs, const GenomicRegion &rhs) const
-    {
-        return atoi(lhs.get_name().substr(5).c_str())
-            < atoi(rhs.get_name().substr(5).c_str());
-    }
-};
+    return atoi(domain.get_name().substr(5).c_str());
+}
 
 static void
 score_domain_by_diff_meth_emp_p_value(
@@ -392,35 +390,55 @@ score_domain_by_diff_meth_emp_p_value(
     const vector<size_t> &meth_a,  const vector<size_t> &unmeth_a, 
     const vector<size_t> &meth_b,  const vector<size_t> &unmeth_b, 
     const double fdr, double fdr_cutoff, vector<GenomicRegion> &domains,
-    const bool VERBOSE)
+    const size_t seed, const size_t n_threads, const bool VERBOSE)
 {
     if (VERBOSE)
         cerr << "Computing FDR cutoff ... ";
 
-    std::sort(domains.begin(), domains.end(), DomainSizeCmp());
-
-    vector<double> p_values(domains.size());
+    assert(meth_a.size() == unmeth_a.size()
+           && meth_a.size() == meth_b.size()
+           && meth_a.size() == unmeth_b.size());
+    
+    vector<double> diffmeth(meth_a.size());
+    for (size_t i = 0; i < meth_a.size(); ++i)
+    {
+        diffmeth[i] =
+            static_cast<double>(meth_b[i]) / (meth_b[i] + unmeth_b[i]) 
+            - static_cast<double>(meth_a[i]) / (meth_a[i] + unmeth_a[i]);
+    }
 
-    size_t domain_cpg_size = 0;
-    vector<double> random_scores;
+    // domains with the same number of CpGs share one empirical null,
+    // and the nulls for different sizes are built in parallel, each
+    // from the random stream for its size
+    vector<pair<size_t, size_t> > by_size(domains.size());
     for (size_t i = 0; i < domains.size(); ++i)
-    {
-        const size_t sz = atoi(domains[i].get_name().substr(5).c_str());
-        const double domain_score = fabs(domains[i].get_score());
+        by_size[i] = make_pair(domain_cpg_count(domains[i]), i);
+    std::sort(by_size.begin(), by_size.end());
+
+    vector<size_t> size_starts;
+    for (size_t i = 0; i < by_size.size(); ++i)
+        if (i == 0 || by_size[i].first != by_size[i - 1].first)
+            size_starts.push_back(i);
+    size_starts.push_back(by_size.size());
 
-        assert(domain_cpg_size <= sz);
-        if (domain_cpg_size < sz)
+    vector<double> p_values(domains.size());
+    ThreadPool pool(n_threads);
+    parallel_for_each(pool, size_starts.size() - 1,
+                      [&](const size_t g, const size_t)
+    {
+        static const size_t random_scores_size = 50000;
+        const size_t cpg_num = by_size[size_starts[g]].first;
+        RandomStream rs(seed, 1 + cpg_num);
+        vector<double> random_scores;
+        calculate_random_scores_from_background(
+            diffmeth, cpg_num, random_scores_size, rs, random_scores);
+        for (size_t k = size_starts[g]; k < size_starts[g + 1]; ++k)
         {
-            static const size_t random_scores_size = 50000;
-            domain_cpg_size = sz;
-            random_scores.clear();
-            calculate_random_scores_from_background(
-                meth_a, unmeth_a, meth_b, unmeth_b, domain_cpg_size,
-                random_scores_size, random_scores);
+            const size_t i = by_size[k].second;
+            p_values[i] = FDR::get_empirical_p_value(
+                random_scores, fabs(domains[i].get_score()));
         }
-        
-        p_values[i] = FDR::get_empirical_p_value(random_scores, domain_score);
-    }
+    });
 
     if (fdr_cutoff == numeric_limits<double>::max())
         fdr_cutoff = FDR::get_fdr_cutoff(p_values, fdr);
@@ -482,10 +500,14 @@ main(int argc, const char **argv)
         // corrections for small values (not parameters):
         double tolerance = 1e-10;
         size_t MAX_LEN = 200;
+        size_t n_threads = 1;
+        size_t seed = 408;
 
         // run mode flags
         bool VERBOSE = false;
     
+        string metrics_file;
+
         /****************** COMMAND LINE OPTIONS ********************/
         OptionParser opt_parse(argv[0], "A program for segmenting DNA "
                                "methylation data");
@@ -520,8 +542,13 @@ main(int argc, const char **argv)
         opt_parse.add_opt("fdr-cutoff", '\0',
                           "P-value cutoff based on false discovery rate",
                           OptionParser::OPTIONAL, fdr_cutoff); 
+        add_threads_opt(opt_parse, n_threads);
+        opt_parse.add_opt("seed", '\0', "random seed for training samples "
+                          "and empirical p-values (default 408)",
+                          OptionParser::OPTIONAL, seed);
         opt_parse.add_opt("verbose", 'v', "print more run info", 
                           OptionParser::OPTIONAL, VERBOSE);
+        add_metrics_opt(opt_parse, metrics_file);
 
         vector<string> leftover_args;
         opt_parse.parse(argc, argv, leftover_args);
@@ -542,6 +569,8 @@ main(int argc, const char **argv)
         }
 
         /****************** END COMMAND LINE OPTIONS *****************/
+
+        MetricsReport metrics(metrics_file, strip_path(argv[0]));
     
         /***********************************
          * STEP 1: READ IN INPUT
@@ -596,7 +625,7 @@ main(int argc, const char **argv)
                 // train with part of the dataset
                 vector<double>  diffscores_sample;
                 vector<size_t> reset_points_sample;
-                pick_sample(diffscores, reset_points, training_size,
+                pick_sample(diffscores, reset_points, training_size, seed,
                             diffscores_sample, reset_points_sample);
                 ThreeStateHDHMM hmm_training(
                     diffscores_sample, reset_points_sample,
@@ -649,12 +678,12 @@ main(int argc, const char **argv)
         if (domain_wilcoxon_test)
             score_domain_by_wilcoxon_test(
                 cpgs, meth_a, unmeth_a, meth_b, unmeth_b,
-                fdr, fdr_cutoff, domains, VERBOSE);
+                fdr, fdr_cutoff, domains, n_threads, VERBOSE);
         
         if (diff_meth_emp_p_value)
             score_domain_by_diff_meth_emp_p_value(
                 cpgs, meth_a, unmeth_a, meth_b, unmeth_b,
-                fdr, 0.01, domains, VERBOSE);
+                fdr, 0.01, domains, seed, n_threads, VERBOSE);
 
         /***********************************
          * STEP 6: WRITE THE RESULTS
@@ -5,6 +5,7 @@
 #include "OptionParser.hpp"
 #include "smithlab_os.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 #include <gsl/gsl_sf_gamma.h>
 #include <gsl/gsl_cdf.h>
@@ -341,6 +342,8 @@ main(int argc, const char **argv) {
     double alpha = 0.05;
     static double tolerance = 1e-10;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "", "");
     opt_parse.add_opt("output", 'o', "Name of output file (default: stdout)",
@@ -360,6 +363,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("outm", 'M', "mC pseudo methcount output file (default: null)",
                       false, out_methcount_pseudo_m);
     opt_parse.add_opt("verbose", 'v', "print run statistics", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
 
     opt_parse.parse(argc, argv, leftover_args);
@@ -393,6 +397,9 @@ main(int argc, const char **argv) {
     tolerance = max(1e-15, min(tolerance, 0.1));
 
     /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     std::ofstream out(outfile.empty() ? "/dev/stdout" : outfile.c_str());
 
     std::ofstream out_m, out_h;
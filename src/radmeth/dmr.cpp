@@ -31,6 +31,7 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -170,6 +171,8 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
     double sig_cutoff = 0.05;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "computes DMRs based on "
         "HMRs and probability of differences at "
@@ -179,6 +182,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("cutoff", 'c', "Significance cutoff (default: 0.05)",
         false, sig_cutoff);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -205,6 +209,8 @@ main(int argc, const char **argv) {
     const string outfile_b = leftover_args[4];
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (VERBOSE)
       cerr << "[LOADING HMRS] " << hmr1_file << endl;
 
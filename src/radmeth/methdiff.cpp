@@ -33,6 +33,7 @@
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 
 using std::string;
@@ -96,6 +97,8 @@ main(int argc, const char **argv) {
     bool ONLY_HIGH_COVERAGE_LOCI = false;
     bool VERBOSE = false;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "compute probability a "
@@ -109,6 +112,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("out", 'o', "output file (BED format)",
                       false, outfile);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -132,6 +136,8 @@ main(int argc, const char **argv) {
     const string cpgs_file_b = leftover_args[1];
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     vector<GenomicRegion> cpgs_a;
     vector<pair<double, double> > meth_unmeth_a;
     vector<size_t> reads_a;
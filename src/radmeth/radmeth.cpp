@@ -37,6 +37,10 @@
 #include "regression.hpp"
 #include "combine_pvals.hpp"
 #include "merge.hpp"
+#include "ThreadPool.hpp"
+#include "ParallelBGZF.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -159,6 +163,102 @@ has_extreme_counts(const Regression &reg) {
   return is_maximally_methylated || is_unmethylated;
 }
 
+// a batch of rows of the proportion table, and the output lines for them
+struct RegressionBatch {
+  RegressionBatch() : n_rows(0), n_tested(0), n_iterations(0) {}
+  vector<SiteProportions> rows;
+  size_t n_rows;
+  std::ostringstream out;
+  size_t n_tested;     // rows with a test, rather than -1, in the output
+  size_t n_iterations; // summed over the fits for those rows
+};
+
+static bool
+read_batch(istream &table_file, const Design &design,
+           const size_t batch_size, RegressionBatch &b) {
+  b.n_rows = 0;
+  while (b.n_rows < batch_size) {
+    if (b.n_rows == b.rows.size())
+      b.rows.push_back(SiteProportions());
+    if (!(table_file >> b.rows[b.n_rows]))
+      break;
+    if (design.sample_names.size() != b.rows[b.n_rows].total.size())
+      throw SMITHLABException("There is a row with"
+                              "incorrect number of proportions.");
+    ++b.n_rows;
+  }
+  return b.n_rows > 0;
+}
+
+// returns true if the regression was fit, and false if the site was
+// not tested
+static bool
+test_site(const size_t test_factor, Regression &full_regression,
+          Regression &null_regression, RecordWriter &out) {
+
+  size_t coverage_factor = 0, coverage_rest = 0,
+         meth_factor = 0, meth_rest = 0;
+
+  for(size_t s = 0; s < full_regression.design.sample_names.size(); ++s) {
+    if(full_regression.design.matrix[s][test_factor] != 0) {
+      coverage_factor += full_regression.props.total[s];
+      meth_factor += full_regression.props.meth[s];
+    } else {
+      coverage_rest += full_regression.props.total[s];
+      meth_rest += full_regression.props.meth[s];
+    }
+  }
+
+  out.put(full_regression.props.chrom).put('\t')
+    .put_uint(full_regression.props.position).put('\t')
+    .put(full_regression.props.strand).put('\t')
+    .put(full_regression.props.context).put('\t');
+
+  // Do not perform the test if there's no coverage in either all case or
+  // all control samples. Also do not test if the site is completely
+  // methylated or completely unmethylated across all samples.
+  bool tested = false;
+  if (has_low_coverage(full_regression, test_factor)) {
+    out.put_double(-1);
+  }
+  else if (has_extreme_counts(full_regression)) {
+    out.put_double(-1);
+  }
+  else {
+    tested = true;
+    fit(full_regression);
+    null_regression.props = full_regression.props;
+    fit(null_regression);
+    const double pval = loglikratio_test(null_regression.max_loglik,
+                                   full_regression.max_loglik);
+
+    // If error occured in the fitting algorithm (i.e. p-val is nan or
+    // -nan).
+    out.put_double((pval != pval) ? -1 : pval);
+  }
+  out.put('\t').put_uint(coverage_factor).put('\t').put_uint(meth_factor)
+    .put('\t').put_uint(coverage_rest).put('\t').put_uint(meth_rest).put('\n');
+  return tested;
+}
+
+static void
+test_batch(const size_t test_factor, Regression &full_regression,
+           Regression &null_regression, RegressionBatch &b) {
+  b.out.str("");
+  b.n_tested = 0;
+  b.n_iterations = 0;
+  RecordWriter out(b.out);
+  for (size_t i = 0; i < b.n_rows; ++i) {
+    std::swap(full_regression.props, b.rows[i]);
+    if (test_site(test_factor, full_regression, null_regression, out)) {
+      ++b.n_tested;
+      b.n_iterations +=
+        full_regression.n_iterations + null_regression.n_iterations;
+    }
+    std::swap(full_regression.props, b.rows[i]);
+  }
+}
+
 int
 main(int argc, const char **argv) {
 
@@ -190,6 +290,8 @@ main(int argc, const char **argv) {
       string outfile;
       string test_factor_name;
       bool VERBOSE = false;
+      size_t n_threads = 1;
+      string metrics_file;
 
       OptionParser opt_parse(prog_name + "\t" + command_name, "Calculates "
                              "multi-factor differential methylation scores.",
@@ -203,6 +305,9 @@ main(int argc, const char **argv) {
       opt_parse.add_opt("factor", 'f', "a factor to test",
                         true, test_factor_name);
 
+      add_threads_opt(opt_parse, n_threads);
+      add_metrics_opt(opt_parse, metrics_file);
+
       vector<string> leftover_args;
       opt_parse.parse(argc - 1, argv + 1, leftover_args);
 
@@ -226,17 +331,19 @@ main(int argc, const char **argv) {
       const string design_filename(leftover_args.front());
       const string table_filename(leftover_args.back());
 
+      MetricsReport metrics(metrics_file, prog_name + " " + command_name);
+
       std::ifstream design_file(design_filename.c_str());
       if (!design_file)
         throw SMITHLABException("could not open file: " + design_filename);
 
-      std::ifstream table_file(table_filename.c_str());
-      if (!table_file)
-        throw SMITHLABException("could not open file: " + table_filename);
+      // the table may be BGZF compressed, and the output is if its
+      // name ends in ".gz"
+      InputFile table_inf(table_filename, n_threads);
+      std::istream table_file(table_inf.rdbuf());
 
-      std::ofstream of;
-      if (!outfile.empty()) of.open(outfile.c_str());
-      std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+      OutputFile of(outfile, n_threads);
+      std::ostream out(of.rdbuf());
 
       Regression full_regression;            // Initialize the full design
       design_file >> full_regression.design; // matrix from file.
@@ -271,60 +378,40 @@ main(int argc, const char **argv) {
                                 "proportion table are correctly formatted.");
 
       // Performing the log-likelihood ratio test on proportions from each row
-      // of the proportion table.
-      while (table_file >> full_regression.props) {
-
-        if (full_regression.design.sample_names.size() !=
-            full_regression.props.total.size())
-              throw SMITHLABException("There is a row with"
-                                      "incorrect number of proportions.");
-
-        size_t coverage_factor = 0, coverage_rest = 0,
-               meth_factor = 0, meth_rest = 0;
-
-        for(size_t s = 0; s < full_regression.design.sample_names.size(); ++s) {
-          if(full_regression.design.matrix[s][test_factor] != 0) {
-            coverage_factor += full_regression.props.total[s];
-            meth_factor += full_regression.props.meth[s];
-          } else {
-            coverage_rest += full_regression.props.total[s];
-            meth_rest += full_regression.props.meth[s];
-          }
-        }
-
-        out << full_regression.props.chrom << "\t"
-            << full_regression.props.position << "\t"
-            << full_regression.props.strand << "\t"
-            << full_regression.props.context << "\t";
-
-        // Do not perform the test if there's no coverage in either all case or
-        // all control samples. Also do not test if the site is completely
-        // methylated or completely unmethylated across all samples.
-        if (has_low_coverage(full_regression, test_factor)) {
-          out << -1;
-        }
-        else if (has_extreme_counts(full_regression)) {
-          out << -1;
-        }
-        else {
-          fit(full_regression);
-          null_regression.props = full_regression.props;
-          fit(null_regression);
-          const double pval = loglikratio_test(null_regression.max_loglik,
-                                         full_regression.max_loglik);
-
-          // If error occured in the fitting algorithm (i.e. p-val is nan or
-          // -nan).
-          out << ( (pval != pval) ? -1 : pval);
-        }
-        out << "\t" << coverage_factor << "\t" << meth_factor
-            << "\t" << coverage_rest << "\t" << meth_rest << endl;
-      }
+      // of the proportion table. The rows are tested in parallel in batches,
+      // and the results written in the order of the rows.
+      static const size_t rows_per_batch = 1000;
+      const size_t n_workers = std::max(n_threads, static_cast<size_t>(1));
+      vector<Regression> full_regressions(n_workers, full_regression);
+      vector<Regression> null_regressions(n_workers, null_regression);
+      vector<RegressionBatch> batches(2*n_threads + 2);
+      StageTimer timer("regression");
+      run_ordered_pipeline(n_threads, batches,
+                           [&](RegressionBatch &b) {
+                             return read_batch(table_file,
+                                               full_regression.design,
+                                               rows_per_batch, b);
+                           },
+                           [&](RegressionBatch &b, const size_t tid) {
+                             test_batch(test_factor, full_regressions[tid],
+                                        null_regressions[tid], b);
+                           },
+                           [&](RegressionBatch &b) {
+                             out << b.out.str() << std::flush;
+                             Metrics::count("sites", b.n_rows);
+                             Metrics::count("sites_tested", b.n_tested);
+                             Metrics::count("fit_iterations", b.n_iterations);
+                           });
+      timer.stop();
+      if (table_file.bad())
+        throw SMITHLABException("error reading file: " + table_filename);
+      of.close();
 
     // Combine p-values using the Z test.
     } else if (command_name == "adjust") {
       string outfile;
       string bin_spec = "1:200:1";
+      string metrics_file;
 
       /****************** GET COMMAND LINE ARGUMENTS ***************************/
       OptionParser opt_parse(prog_name + "\t" + command_name, "computes "
@@ -334,6 +421,7 @@ main(int argc, const char **argv) {
             false , outfile);
       opt_parse.add_opt("bins", 'b', "corrlation bin specification",
             false , bin_spec);
+      add_metrics_opt(opt_parse, metrics_file);
       vector<string> leftover_args;
       opt_parse.parse(argc - 1, argv + 1, leftover_args);
       if (argc == 2 || opt_parse.help_requested()) {
@@ -355,6 +443,8 @@ main(int argc, const char **argv) {
       const string bed_filename = leftover_args.front();
       /*************************************************************************/
 
+      MetricsReport metrics(metrics_file, prog_name + " " + command_name);
+
       BinForDistance bin_for_dist(bin_spec);
 
       std::ifstream bed_file(bed_filename.c_str());
@@ -362,6 +452,7 @@ main(int argc, const char **argv) {
       if (!bed_file)
         throw "could not open file: " + bed_filename;
 
+      StageTimer timer("load_pvals");
       cerr << "Loading input file." << endl;
 
       // Read in all p-value loci. The loci that are not correspond to valid
@@ -403,10 +494,13 @@ main(int argc, const char **argv) {
       }
       cerr << "[done]" << endl;
 
+      Metrics::count("pvals", pvals.size());
+      timer.next("combine_pvals");
       cerr << "Combining p-values." << endl;
       combine_pvals(pvals, bin_for_dist);
       cerr << "[done]" << endl;
 
+      timer.next("fdr");
       cerr << "Running multiple test adjustment." << endl;
       fdr(pvals);
       cerr << "[done]" << endl;
@@ -415,6 +509,7 @@ main(int argc, const char **argv) {
       if (!outfile.empty()) of.open(outfile.c_str());
         std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
 
+      timer.next("write_output");
       std::ifstream original_bed_file(bed_filename.c_str());
 
       update_pval_loci(original_bed_file, pvals, out);
@@ -426,6 +521,7 @@ main(int argc, const char **argv) {
       string outfile;
       string bin_spec = "1:200:25";
       double cutoff = 0.01;
+      string metrics_file;
 
       /****************** GET COMMAND LINE ARGUMENTS ***************************/
       OptionParser opt_parse("dmrs", "a program to merge significantly "
@@ -435,6 +531,7 @@ main(int argc, const char **argv) {
             false , outfile);
       opt_parse.add_opt("cutoff", 'p', "P-value cutoff (default: 0.01)",
             false , cutoff);
+      add_metrics_opt(opt_parse, metrics_file);
       vector<string> leftover_args;
       opt_parse.parse(argc - 1, argv + 1, leftover_args);
       if (argc == 1 || opt_parse.help_requested()) {
@@ -456,6 +553,8 @@ main(int argc, const char **argv) {
       const string bed_filename = leftover_args.front();
       /************************************************************************/
 
+      MetricsReport metrics(metrics_file, prog_name + " " + command_name);
+
       std::ofstream of;
       if (!outfile.empty()) of.open(outfile.c_str());
       std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
@@ -345,6 +345,7 @@ fit(Regression &r, vector<double> initial_parameters) {
   //It it reasonable to reduce the number of iterations to 500?
 
   r.max_loglik = (-1)*neg_loglik(s->x, &r);
+  r.n_iterations = iter;
 
   gsl_multimin_fdfminimizer_free(s);
   gsl_vector_free(parameters);
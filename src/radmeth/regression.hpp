@@ -50,6 +50,7 @@ struct Regression {
   Design design;
   SiteProportions props;
   double max_loglik;
+  size_t n_iterations; // iterations in the most recent fit
 };
 
 bool fit(Regression &r,
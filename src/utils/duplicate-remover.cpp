@@ -19,22 +19,25 @@
  *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <sys/types.h>
-#include <unistd.h>
-
 #include <string>
 #include <vector>
 #include <iostream>
-#include <unordered_map>
-#include <unordered_set>
+#include <fstream>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
 #include "bsutils.hpp"
 
+#include "DuplicateRemoval.hpp"
+#include "OrderedPipeline.hpp"
+#include "ThreadPool.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+
 using std::string;
 using std::vector;
 using std::cin;
@@ -43,82 +46,143 @@ using std::cerr;
 using std::endl;
 using std::ifstream;
 using std::ofstream;
-using std::unordered_map;
-
-
-static bool
-precedes(const MappedRead &a, const MappedRead &b) {
-  return a.r.get_chrom() < b.r.get_chrom() ||
-                           (a.r.get_chrom() == b.r.get_chrom() &&
-                            (a.r.get_start() < b.r.get_start() ||
-                             (a.r.get_start() == b.r.get_start() &&
-                              (a.r.get_end() < b.r.get_end() ||
-                               (a.r.get_end() == b.r.get_end() &&
-                                (a.r.get_strand() < b.r.get_strand()))))));
-}
 
 
-static bool
-equivalent(const MappedRead &a, const MappedRead &b) {
-  return a.r.same_chrom(b.r) &&
-    a.r.get_start() == b.r.get_start() &&
-    a.r.get_end() == b.r.get_end() &&
-    a.r.get_strand() == b.r.get_strand();
+// one batch of whole groups of equivalent reads from one chromosome
+struct ReadBatch {
+  ReadBatch() : n_reads(0), n_groups(0) {}
+  vector<MappedRead> reads;
+  size_t n_reads;
+  vector<size_t> group_starts;
+  vector<ReadKey> group_keys;
+  size_t n_groups;
+  DuplicateStats stats;
+  string out;
+  vector<size_t> keepers;
+};
+
+
+static MappedRead &
+next_slot(ReadBatch &b) {
+  if (b.n_reads == b.reads.size())
+    b.reads.push_back(MappedRead());
+  return b.reads[b.n_reads];
 }
 
 
 static void
-get_cpgs(const vector<MappedRead> &mr, vector<size_t> &cpg_pos) {
-  const size_t lim = mr.front().seq.length();
-  for (size_t i = 1; i < lim; ++i) {
-    size_t j = 0;
-    while (j < mr.size() && !is_cpg(mr[j].seq, i - 1)) ++j;
-    if (j < mr.size())
-      cpg_pos.push_back(i - 1);
-  }
+start_group(ReadBatch &b, const ReadKey &key) {
+  if (b.n_groups == b.group_keys.size())
+    b.group_keys.push_back(key);
+  else b.group_keys[b.n_groups] = key;
+  b.group_starts.push_back(b.n_reads);
+  ++b.n_groups;
 }
 
 
-static void
-get_cytosines(const vector<MappedRead> &mr, vector<size_t> &c_pos) {
-  const size_t lim = mr.front().seq.length();
-  for (size_t i = 0; i < lim; ++i) {
-    size_t j = 0;
-    while (j < mr.size() && !is_cytosine(mr[j].seq[i])) ++j;
-    if (j < mr.size())
-      c_pos.push_back(i);
-  }
+/* DuplicateReader: the serial stage. It checks the sort order and
+   cuts the input into batches that never split a group of equivalent
+   reads and never span two chromosomes. */
+class DuplicateReader {
+public:
+  DuplicateReader(std::istream &i, const string &fn, const bool cs) :
+    reader(i), filename(fn), check_sort(cs), started(false),
+    has_pending(false) {}
+
+  bool fill(ReadBatch &b, const size_t batch_size);
+
+private:
+  bool read(MappedRead &mr, ReadKey &key);
+
+  MappedReadReader reader;
+  const string filename;
+  const bool check_sort;
+  string front_line;
+  ReadKey front;
+  bool started;
+
+  MappedRead pending;
+  ReadKey pending_key;
+  bool has_pending;
+};
+
+
+/* the chrom is kept only in the key: setting it in the
+   GenomicRegion touches the shared chrom name table, which the
+   workers must not do while the reader is adding to it. */
+bool
+DuplicateReader::read(MappedRead &mr, ReadKey &key) {
+  if (!reader.read(mr))
+    return false;
+  key.chrom = reader.chrom();
+  key.start = mr.r.get_start();
+  key.end = mr.r.get_end();
+  key.strand = mr.r.get_strand();
+  return true;
 }
 
 
-static void
-get_meth_patterns(const bool ALL_C, vector<MappedRead> &mr) {
-
-  vector<size_t> sites;
-  if (ALL_C)
-    get_cytosines(mr, sites);
-  else get_cpgs(mr, sites);
-
-  unordered_map<string, vector<size_t> > patterns;
-  for (size_t i = 0; i < mr.size(); ++i) {
-    string s;
-    for (size_t j = 0; j < sites.size(); ++j)
-      s += (is_cytosine(mr[i].seq[sites[j]]) ? '1' : '0');
-    patterns[s].push_back(i);
-  }
+bool
+DuplicateReader::fill(ReadBatch &b, const size_t batch_size) {
+  b.n_reads = 0;
+  b.n_groups = 0;
+  b.group_starts.clear();
 
-  std::unordered_set<size_t> keepers;
-  for (unordered_map<string, vector<size_t> >::iterator i(patterns.begin());
-       i != patterns.end(); ++i)
-    keepers.insert(i->second[rand() % i->second.size()]);
+  if (has_pending) {
+    std::swap(next_slot(b), pending);
+    start_group(b, pending_key);
+    ++b.n_reads;
+    has_pending = false;
+  }
 
-  size_t j = 0;
-  for (size_t i = 0; i < mr.size(); ++i)
-    if (keepers.find(i) != keepers.end()) {
-      mr[j] = mr[i];
-      ++j;
+  ReadKey key;
+  while (read(next_slot(b), key)) {
+    if (!started) {
+      started = true;
+      front = key;
+      front_line.assign(reader.line_begin(), reader.line_end());
+      start_group(b, key);
+      ++b.n_reads;
+      continue;
     }
-  mr.erase(mr.begin() + j, mr.end());
+    if (check_sort && precedes(key, front))
+      throw SMITHLABException("input not properly sorted:\n" +
+                              front_line + "\n" + reader.line());
+    if (!equivalent(key, front)) {
+      front = key;
+      front_line.assign(reader.line_begin(), reader.line_end());
+      if (b.n_reads > 0 &&
+          (b.n_reads >= batch_size || key.chrom != b.group_keys[0].chrom)) {
+        std::swap(pending, b.reads[b.n_reads]);
+        pending_key = key;
+        has_pending = true;
+        break;
+      }
+      start_group(b, key);
+    }
+    ++b.n_reads;
+  }
+  if (!started)
+    throw SMITHLABException("error reading file: " + filename);
+
+  b.group_starts.push_back(b.n_reads);
+  return b.n_reads > 0;
+}
+
+
+static void
+remove_duplicates(DuplicateSelector &selector, ReadBatch &b) {
+  b.stats = DuplicateStats();
+  b.out.clear();
+  RecordWriter out(b.out);
+  for (size_t g = 0; g < b.n_groups; ++g) {
+    const MappedRead *mr = &b.reads[b.group_starts[g]];
+    const size_t n = b.group_starts[g + 1] - b.group_starts[g];
+    selector.select(b.group_keys[g], mr, n, b.keepers);
+    for (size_t j = 0; j < b.keepers.size(); ++j)
+      write_mapped_read(out, b.group_keys[g].chrom, mr[b.keepers[j]]);
+    b.stats.add_group(mr, n, b.keepers);
+  }
 }
 
 
@@ -130,10 +194,14 @@ int main(int argc, const char **argv) {
     bool ALL_C = false;
     bool DISABLE_SORT_TEST = false;
     bool INPUT_FROM_STDIN = false;
+    size_t seed = 408;
+    size_t n_threads = 1;
 
     string outfile;
     string statfile;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "program to remove "
 			   "duplicate reads from sorted mapped reads",
@@ -148,7 +216,11 @@ int main(int argc, const char **argv) {
 		      false, ALL_C);
     opt_parse.add_opt("disable", 'D', "disable sort test",
 		      false, DISABLE_SORT_TEST);
+    opt_parse.add_opt("seed", 'r', "random seed for choosing reads to keep "
+                      "(default: 408)", false, seed);
+    add_threads_opt(opt_parse, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -175,7 +247,7 @@ int main(int argc, const char **argv) {
       infile = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    srand(time(0) + getpid());
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
 
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
@@ -185,71 +257,34 @@ int main(int argc, const char **argv) {
     if (!infile.empty()) ifs.open(infile.c_str());
     std::istream in(infile.empty() ? cin.rdbuf() : ifs.rdbuf());
 
-    MappedRead mr;
-    if (!(in >> mr))
-      throw SMITHLABException("error reading file: " + infile);
-
-
-    size_t reads_in = 1;
-    size_t reads_out = 0;
-    size_t good_bases_in = mr.seq.length();
-    size_t good_bases_out = 0;
-    size_t reads_with_duplicates = 0;
-
-    vector<MappedRead> buffer(1, mr);
-    while (in >> mr) {
-      ++reads_in;
-      good_bases_in += mr.seq.length();
-      if (!DISABLE_SORT_TEST && precedes(mr, buffer.front()))
-	throw SMITHLABException("input not properly sorted:\n" +
-				toa(buffer.front()) + "\n" + toa(mr));
-      if (!equivalent(buffer.front(), mr)) {
-	if (USE_SEQUENCE) {
-	  const size_t orig_buffer_size = buffer.size();
-	  get_meth_patterns(ALL_C, buffer); // get the CpGs for the buffer
-	  copy(buffer.begin(), buffer.end(),
-	       std::ostream_iterator<MappedRead>(out, "\n"));
-	  reads_out += buffer.size();
-          good_bases_out += buffer.size() * buffer[0].seq.length();
-	  reads_with_duplicates += (buffer.size() < orig_buffer_size);
-	}
-	else {
-	  const size_t selected = rand() % buffer.size();
-	  out << buffer[selected] << "\n";
-	  good_bases_out += buffer[selected].seq.length();
-	  ++reads_out;
-	  reads_with_duplicates += (buffer.size() > 1);
-	}
-	buffer.clear();
-      }
-      buffer.push_back(mr);
-    }
-
-    if (USE_SEQUENCE) {
-      const size_t orig_buffer_size = buffer.size();
-      get_meth_patterns(ALL_C, buffer);
-      copy(buffer.begin(), buffer.end(),
-	   std::ostream_iterator<MappedRead>(out, "\n"));
-      reads_out += buffer.size();
-      reads_with_duplicates += (buffer.size() < orig_buffer_size);
-      good_bases_out += buffer.size() * buffer[0].seq.length();
-    }
-    else {
-      const size_t selected = rand() % buffer.size();
-      out << buffer[selected] << "\n";
-      good_bases_out += buffer[selected].seq.length();
-      ++reads_out;
-      reads_with_duplicates += (buffer.size() > 1);
-    }
+    static const size_t reads_per_batch = 100000;
+
+    DuplicateReader reader(in, infile, !DISABLE_SORT_TEST);
+    DuplicateStats stats;
+    const size_t n_workers = std::max(n_threads, static_cast<size_t>(1));
+    vector<DuplicateSelector> selectors(n_workers,
+                                        DuplicateSelector(USE_SEQUENCE,
+                                                          ALL_C, seed));
+    vector<ReadBatch> batches(2*n_threads + 2);
+    StageTimer timer("remove_duplicates");
+    run_ordered_pipeline(n_threads, batches,
+                         [&](ReadBatch &b) {
+                           return reader.fill(b, reads_per_batch);
+                         },
+                         [&](ReadBatch &b, const size_t tid) {
+                           remove_duplicates(selectors[tid], b);
+                         },
+                         [&](ReadBatch &b) {
+                           out.write(b.out.data(), b.out.size());
+                           stats.add(b.stats);
+                         });
+    Metrics::count("reads_in", stats.reads_in);
+    Metrics::count("reads_out", stats.reads_out);
+    timer.stop();
 
     if (!statfile.empty()) {
       std::ofstream out_stat(statfile.c_str());
-      out_stat << "TOTAL READS IN:\t" << reads_in << "\n"
-	       << "GOOD BASES IN:\t" << good_bases_in << "\n"
-	       << "TOTAL READS OUT:\t" << reads_out << "\n"
-	       << "GOOD BASES OUT:\t" << good_bases_out << "\n"
-	       << "DUPLICATES REMOVED:\t" << reads_in - reads_out << "\n"
-	       << "READS WITH DUPLICATES:\t" << reads_with_duplicates << "\n";
+      out_stat << stats.tostring();
     }
   }
   catch (const SMITHLABException &e) {
@@ -30,11 +30,8 @@ chr21   26608683        26608684        chr1:3007015:3007016:-  0       +
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <iostream>
 #include <cstdlib>
-#include <unordered_map>
-#include <stdexcept>
-#include <algorithm>
+#include <cctype>
 
 
 #include "smithlab_utils.hpp"
@@ -43,77 +40,108 @@ chr21   26608683        26608684        chr1:3007015:3007016:-  0       +
 #include "GenomicRegion.hpp"
 #include "MethpipeFiles.hpp"
 
+#include "LiftoverIndex.hpp"
+#include "OrderedPipeline.hpp"
+#include "TextFormat.hpp"
+#include "TextScan.hpp"
+#include "Metrics.hpp"
+
 
 using std::string;
-using std::ios_base;
 using std::vector;
 using std::cout;
 using std::cerr;
 using std::endl;
-using std::unordered_map;
 
-struct GenomicSite {
-  string chrom;
-  size_t pos;
-  string strand;
-  string name;
-  GenomicSite(const string &c = "",
-              const size_t p = 0,
-              const string &s = ""):
-    chrom(c), pos(p), strand(s) {}
-};
 
-struct GenomicSiteMeth {
+// one line of methcounts output, with the fields that pass through
+// unchanged kept as text
+struct SiteLine {
   string chrom;
   size_t pos;
   string strand;
-  string name;
+  string seq;
   double meth;
   size_t coverage;
-  GenomicSiteMeth(const string &c = "",
-                  const size_t p = 0,
-                  const string &s = "",
-                  const string &n = "",
-                  const double m = 0,
-                  const size_t cov = 0):
-    chrom(c), pos(p), strand(s), name(n), meth(m), coverage(cov) {}
 };
 
 
-void
-flip_strand(GenomicSite &site){
-  if (site.strand == "-"){
-    site.pos--;
-    site.strand = "+";
-  }
-  return;
+static void
+parse_site_line(const string &line, SiteLine &s) {
+  const char *p = skip_space(line.c_str());
+  const char *q = skip_token(p);
+  s.chrom.assign(p, q);
+  char *e = 0;
+  s.pos = strtoul(q, &e, 10);
+  p = skip_space(e);
+  q = skip_token(p);
+  s.strand.assign(p, q);
+  p = skip_space(q);
+  q = skip_token(p);
+  s.seq.assign(p, q);
+  s.meth = strtod(q, &e);
+  q = e;
+  s.coverage = strtoul(q, &e, 10);
+  if (s.chrom.empty() || s.strand.empty() || e == q)
+    throw SMITHLABException("bad line in methcounts file:\n" + line);
+}
+
+
+struct LiftBatch {
+  LiftBatch() : n_lines(0), n_good(0) {}
+  vector<string> lines;
+  size_t n_lines;
+  SiteLine site;
+  string lifted;
+  string unlifted;
+  size_t n_good;
+};
+
+
+static bool
+fill_batch(std::istream &in, const size_t batch_size, LiftBatch &b) {
+  if (b.lines.size() < batch_size)
+    b.lines.resize(batch_size);
+  b.n_lines = 0;
+  while (b.n_lines < batch_size && getline(in, b.lines[b.n_lines]))
+    if (!b.lines[b.n_lines].empty() && b.lines[b.n_lines][0] != '#')
+      ++b.n_lines;
+  return b.n_lines > 0;
 }
 
-typedef unordered_map<string,
-                      unordered_map<size_t, GenomicSite> > liftover_index;
 
 static void
-read_index_file(const bool SS, const string &indexFile,
-                unordered_map<string, liftover_index> &index) {
-  std::ifstream in(indexFile.c_str());
-  if (!in)
-    throw SMITHLABException("problem opening index file");
-
-  size_t toPos, toEnd, toScore;
-  string toChrom, fromName, toStrand;
-  while (in >> toChrom >> toPos >> toEnd >> fromName >> toScore >> toStrand){
-    const size_t dim1 = fromName.find_first_of(":");
-    const size_t dim2 = fromName.find(":", dim1+1);
-    const size_t dim3 = fromName.find(":", dim2+1);
-    const string chrom = fromName.substr(0, dim1);
-    const size_t pos = atoi(fromName.substr(dim1 + 1, dim2-dim1).c_str());
-    const string strand = fromName.substr(dim3 + 1);
-    GenomicSite site(toChrom, toPos, toStrand);
-    if (SS) flip_strand(site);
-    index[chrom][strand][pos] = site;
+lift_batch(const LiftoverIndex &index, const bool SS,
+           const bool KEEP_UNMAPPED, LiftBatch &b) {
+  static const string strands[] = {"-", "+"};
+  b.lifted.clear();
+  b.unlifted.clear();
+  RecordWriter lifted(b.lifted), unlifted(b.unlifted);
+  b.n_good = 0;
+  SiteLine &s = b.site;
+  for (size_t i = 0; i < b.n_lines; ++i) {
+    parse_site_line(b.lines[i], s);
+    const string *to_chrom = 0;
+    size_t to_pos = 0;
+    char to_strand = '+';
+    if (s.strand.length() == 1 &&
+        index.lift(s.chrom, s.strand[0], s.pos, to_chrom, to_pos, to_strand)) {
+      if (SS && to_strand == '-') {
+        --to_pos;
+        to_strand = '+';
+      }
+      methpipe::write_site(lifted, *to_chrom, to_pos,
+                           strands[to_strand == '+'],
+                           s.seq, s.meth, s.coverage);
+      ++b.n_good;
+    }
+    else if (KEEP_UNMAPPED)
+      methpipe::write_site(unlifted, s.chrom, s.pos, s.strand,
+                           s.seq, s.meth, s.coverage);
   }
 }
 
+
 int
 main(int argc, const char **argv) {
   try{
@@ -121,22 +149,32 @@ main(int argc, const char **argv) {
     string tofile;
     string fromfile;
     string leftfile;
+    string binary_index_file;
+    size_t n_threads = 1;
 
     bool VERBOSE = false;
     bool SS = false;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "Fast liftOver-all cytosine-by strand" );
     opt_parse.add_opt("indexfile", 'i', "index file", true, indexfile);
-    opt_parse.add_opt("from", 'f', "Original file", true, fromfile);
-    opt_parse.add_opt("to", 't', "Output file liftovered", true, tofile);
+    opt_parse.add_opt("from", 'f', "Original file", false, fromfile);
+    opt_parse.add_opt("to", 't', "Output file liftovered", false, tofile);
     opt_parse.add_opt("unmapped", 'u', "(optional) File for unmapped sites",
                       false, leftfile);
     opt_parse.add_opt("plus-strand", 'p', "(optional) Report sites on + strand",
                       false, SS);
+    opt_parse.add_opt("binary", 'B', "(optional) write the index in binary "
+                      "format, which loads much faster, to this file",
+                      false, binary_index_file);
+    opt_parse.add_opt("threads", 'T', "(optional) number of threads "
+                      "(default: 1)", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "(optional) Print more information",
                       false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -154,51 +192,63 @@ main(int argc, const char **argv) {
     }
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    unordered_map<string, liftover_index> index;
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    if (binary_index_file.empty() && (fromfile.empty() || tofile.empty())) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+
+    LiftoverIndex index;
     if (VERBOSE)
       cerr << "Loading index file " << indexfile << endl;
-    read_index_file(SS, indexfile, index);
+    index.read(indexfile);
+    if (VERBOSE)
+      cerr << "Sites in index: " << index.size() << endl;
+
+    if (!binary_index_file.empty()) {
+      index.write(binary_index_file);
+      if (fromfile.empty())
+        return EXIT_SUCCESS;
+    }
 
     std::ifstream from(fromfile.c_str());
+    if (!from)
+      throw SMITHLABException("cannot open file: " + fromfile);
     std::ofstream to(tofile.c_str());
     std::ofstream unmapped;
     if (!leftfile.empty()) unmapped.open(leftfile.c_str());
 
-    string chrom;
-    size_t pos;
-    string strand;
-    string seq;
-    double meth;
-    size_t coverage;
-
-    size_t total = 0;
-    size_t good = 0;
-    size_t nogood = 0;
-
     if (VERBOSE)
       cerr << "Lifting " << fromfile << " to " << tofile << endl;
 
-    while (methpipe::read_site(from, chrom, pos, strand,
-                               seq, meth, coverage)) {
-      ++total;
-      GenomicSite loc = index[chrom][strand][pos];
-      if (!loc.chrom.empty()){
-        methpipe::write_site(to, loc.chrom, loc.pos, loc.strand,
-                             seq, meth, coverage);
-        ++good;
-      }
-      else {
-        if (unmapped.good())
-          methpipe::write_site(unmapped, chrom, pos, strand,
-                               seq, meth, coverage);
-        ++nogood;
-        index[chrom][strand].erase(pos);
-      }
-    }
+    /* the index is only read once loaded, so workers lift
+       batches of sites independently; the output is written in the
+       order of the input */
+    static const size_t lines_per_batch = 100000;
+    const bool KEEP_UNMAPPED = unmapped.good();
+    size_t total = 0;
+    size_t good = 0;
+    vector<LiftBatch> batches(2*n_threads + 2);
+    run_ordered_pipeline(n_threads, batches,
+                         [&](LiftBatch &b) {
+                           return fill_batch(from, lines_per_batch, b);
+                         },
+                         [&](LiftBatch &b, const size_t) {
+                           lift_batch(index, SS, KEEP_UNMAPPED, b);
+                         },
+                         [&](LiftBatch &b) {
+                           to.write(b.lifted.data(), b.lifted.size());
+                           if (KEEP_UNMAPPED)
+                             unmapped.write(b.unlifted.data(),
+                                            b.unlifted.size());
+                           total += b.n_lines;
+                           good += b.n_good;
+                         });
 
     if (VERBOSE)
       cerr << "Total sites: " << total << ";\tMapped: "
-           << good << ";\tUnmapped: " << nogood << endl;
+           << good << ";\tUnmapped: " << total - good << endl;
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -30,6 +30,11 @@
 #include "smithlab_os.hpp"
 #include "OptionParser.hpp"
 
+#include "RecordCounter.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
+
 using std::string;
 using std::ios_base;
 using std::vector;
@@ -82,6 +87,41 @@ get_approx_line_count(const bool VERBOSE, const string &filename,
 }
 
 
+/* the exact counts cut the file at line starts into a chunk for each
+   thread, count the chunks in parallel and add up their counts in the
+   order of the file */
+static size_t
+count_lines(ThreadPool &pool, const string &filename) {
+  const MappedFile mf(filename);
+  mf.advise_sequential();
+  vector<size_t> offsets;
+  chunk_boundaries(mf.data(), mf.size(), pool.size(), offsets);
+  return parallel_reduce(pool, offsets.size() - 1, 1, static_cast<size_t>(0),
+                         [&](const size_t i, const size_t, const size_t) {
+                           return count_lines(mf.data() + offsets[i],
+                                              offsets[i + 1] - offsets[i]);
+                         },
+                         [](const size_t a, const size_t b) {return a + b;});
+}
+
+
+static void
+count_records(ThreadPool &pool, const string &filename, RecordCounts &counts) {
+  const MappedFile mf(filename);
+  mf.advise_sequential();
+  vector<size_t> offsets;
+  chunk_boundaries(mf.data(), mf.size(), pool.size(), offsets);
+  const size_t n_chunks = offsets.size() - 1;
+  vector<RecordCounts> chunks(n_chunks);
+  parallel_for_each(pool, n_chunks, [&](const size_t i, const size_t) {
+      count_records(mf.data() + offsets[i], offsets[i + 1] - offsets[i],
+                    chunks[i]);
+    });
+  counts = RecordCounts();
+  for (size_t i = 0; i < n_chunks; ++i)
+    append_record_counts(chunks[i], offsets[i], counts);
+}
+
 
 int 
 main(int argc, const char **argv) {
@@ -89,15 +129,26 @@ main(int argc, const char **argv) {
 
     size_t n_samples = 100;
     size_t sample_size = 0;
+    bool EXACT = false;
+    bool BY_CHROM = false;
     bool VERBOSE = false;
+    size_t n_threads = 1;
     
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
-			   "approximate line counting in large files",
+			   "approximate or exact line counting in large files",
 			   "<file1> <file2> ..." );
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("samples", 'n', "number of samples", false, n_samples);
     opt_parse.add_opt("size", 'z', "sample size (bytes)", false, sample_size);
+    opt_parse.add_opt("exact", 'e', "count lines exactly", false, EXACT);
+    opt_parse.add_opt("chroms", 'c', "count records (lines other than "
+                      "empty and # lines) exactly, with the number and "
+                      "byte offset of those for each chrom", false, BY_CHROM);
+    add_threads_opt(opt_parse, n_threads);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -119,12 +170,31 @@ main(int argc, const char **argv) {
     }
     vector<string> filenames(leftover_args);
     /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     //////////////////////////////////////////////////////////////
-    
-    for (size_t i = 0; i < filenames.size(); ++i)
-      cout << filenames[i] << "\t" 
-	   << get_approx_line_count(VERBOSE, filenames[i],
-				    n_samples, sample_size) << endl;
+
+    ThreadPool pool(n_threads);
+
+    for (size_t i = 0; i < filenames.size(); ++i) {
+      if (BY_CHROM) {
+        RecordCounts counts;
+        count_records(pool, filenames[i], counts);
+        cout << filenames[i] << "\t" << counts.n_records << '\n';
+        for (size_t j = 0; j < counts.chroms.size(); ++j)
+          cout << counts.chroms[j].chrom << '\t'
+               << counts.chroms[j].n_records << '\t'
+               << counts.chroms[j].offset << '\t'
+               << counts.chroms[j].n_bytes << '\n';
+      }
+      else if (EXACT)
+        cout << filenames[i] << "\t" << count_lines(pool, filenames[i]) << '\n';
+      else
+        cout << filenames[i] << "\t" 
+             << get_approx_line_count(VERBOSE, filenames[i],
+                                      n_samples, sample_size) << endl;
+    }
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -24,50 +24,347 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
 #include <unordered_map>
 #include <stdexcept>
 #include <algorithm>
 
+#include <unistd.h>
 
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "OptionParser.hpp"
-#include "GenomicRegion.hpp"
+#include "MethpipeSite.hpp"
 #include "MethpipeFiles.hpp"
+#include "OrderedPipeline.hpp"
+#include "ThreadPool.hpp"
+#include "TextFormat.hpp"
+#include "TextScan.hpp"
+#include "Metrics.hpp"
 
 
 using std::string;
-using std::ios_base;
 using std::vector;
+using std::cin;
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::unordered_map;
 
-struct GenomicSiteMeth {
-  string chrom;
-  size_t pos;
-  string strand;
-  string name;
-  double meth;
-  size_t coverage;
-  GenomicSiteMeth(const string &c = "",
-                  const size_t p = 0,
-                  const string &s = "",
-                  const string &n = "",
-                  const double m = 0,
-                  const size_t cov = 0):
-    chrom(c), pos(p), strand(s), name(n), meth(m), coverage(cov) {}
+
+/* A lifted site without its chrom, which is given by the bucket that
+   holds it. The "order" is the line of the site in the input, so
+   sites lifted to the same position are kept or combined in the order
+   they were given, whichever way they reach the bucket. */
+struct LiftedSite {
+  MSite site;
+  size_t order;
+  bool operator<(const LiftedSite &other) const {
+    return site.pos < other.site.pos ||
+      (site.pos == other.site.pos &&
+       (site.strand < other.site.strand ||
+        (site.strand == other.site.strand && order < other.order)));
+  }
 };
 
+
+static void
+parse_lifted_site(const string &line, string &chrom, LiftedSite &ls) {
+  const char *p = skip_space(line.c_str());
+  const char *q = skip_token(p);
+  chrom.assign(p, q);
+
+  char *e = 0;
+  ls.site.pos = strtoul(q, &e, 10);
+
+  p = skip_space(e);
+  ls.site.strand = *p;
+
+  p = skip_space(skip_token(p));
+  q = skip_token(p);
+  ls.site.context.assign(p, q);
+
+  ls.site.meth = strtod(q, &e);
+  ls.site.n_reads = strtoul(e, &e, 10);
+
+  if (chrom.empty() || ls.site.context.empty() ||
+      (ls.site.strand != '+' && ls.site.strand != '-'))
+    throw SMITHLABException("bad methcounts line:\n" + line);
+}
+
+
+/* SpillFile: an unnamed temporary file holding the sites of buckets
+   that were written out to keep memory bounded. Each bucket keeps the
+   byte ranges of its sites, which the workers read back with "pread",
+   so they share the file without sharing a file position. */
+class SpillFile {
+public:
+  SpillFile() : fd(-1), size(0) {}
+  ~SpillFile() {if (fd >= 0) close(fd);}
+
+  struct Segment {
+    size_t offset;
+    size_t n_bytes;
+  };
+
+  Segment write(const vector<LiftedSite> &sites);
+  void read(const Segment &seg, string &buf,
+            vector<LiftedSite> &sites) const;
+
+  void open(const string &tmp_dir);
+
+private:
+  SpillFile(const SpillFile &);
+  SpillFile &operator=(const SpillFile &);
+
+  int fd;
+  size_t size;
+  string buf;
+};
+
+
+void
+SpillFile::open(const string &tmp_dir) {
+  string name(tmp_dir + "/lift-filter.XXXXXX");
+  fd = mkstemp(&name[0]);
+  if (fd < 0)
+    throw SMITHLABException("could not create temporary file in: " + tmp_dir);
+  // the file goes away when it is closed, or if the program dies
+  unlink(name.c_str());
+}
+
+
+template <class T> static void
+append_value(string &buf, const T &x) {
+  buf.append(reinterpret_cast<const char *>(&x), sizeof(T));
+}
+
+template <class T> static const char *
+extract_value(const char *p, T &x) {
+  memcpy(&x, p, sizeof(T));
+  return p + sizeof(T);
+}
+
+
+SpillFile::Segment
+SpillFile::write(const vector<LiftedSite> &sites) {
+  buf.clear();
+  for (size_t i = 0; i < sites.size(); ++i) {
+    const MSite &s = sites[i].site;
+    append_value(buf, sites[i].order);
+    append_value(buf, s.pos);
+    append_value(buf, s.n_reads);
+    append_value(buf, s.meth);
+    buf.push_back(s.strand);
+    append_value(buf, s.context.size());
+    buf.append(s.context);
+  }
+  for (size_t done = 0; done < buf.size();) {
+    const ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+    if (n < 0)
+      throw SMITHLABException("could not write temporary file");
+    done += n;
+  }
+  const Segment seg = {size, buf.size()};
+  size += buf.size();
+  return seg;
+}
+
+
+void
+SpillFile::read(const Segment &seg, string &b,
+                vector<LiftedSite> &sites) const {
+  b.resize(seg.n_bytes);
+  for (size_t done = 0; done < seg.n_bytes;) {
+    const ssize_t n = pread(fd, &b[done], seg.n_bytes - done,
+                            seg.offset + done);
+    if (n <= 0)
+      throw SMITHLABException("could not read temporary file");
+    done += n;
+  }
+  const char *p = b.data();
+  const char *end = p + b.size();
+  while (p < end) {
+    sites.push_back(LiftedSite());
+    LiftedSite &ls = sites.back();
+    p = extract_value(p, ls.order);
+    p = extract_value(p, ls.site.pos);
+    p = extract_value(p, ls.site.n_reads);
+    p = extract_value(p, ls.site.meth);
+    ls.site.strand = *p++;
+    size_t len = 0;
+    p = extract_value(p, len);
+    ls.site.context.assign(p, len);
+    p += len;
+  }
+}
+
+
+/* LiftBuckets: the lifted sites split by the chrom they were lifted
+   to. When more than "max_sites" sites are held in memory, all
+   buckets are written to the spill file, so memory for the whole
+   input is never needed while it is read; the sites for one chrom are
+   brought back together only when that chrom is sorted. */
+class LiftBuckets {
+public:
+  LiftBuckets(const size_t ms, const string &td) :
+    max_sites(ms), tmp_dir(td), n_held(0), n_sites(0), n_spilled(0),
+    last_chrom(0) {}
+
+  void add(const string &chrom, LiftedSite &ls);
+
+  size_t size() const {return chroms.size();}
+  size_t get_n_sites() const {return n_sites;}
+  size_t get_n_spilled() const {return n_spilled;}
+
+  // chrom ids in the order the chroms must be written
+  void sorted_chroms(vector<size_t> &ids) const;
+
+  const string &chrom_name(const size_t id) const {return chroms[id];}
+
+  // moves the sites held in memory for a chrom into "sites"
+  void take(const size_t id, vector<LiftedSite> &sites);
+
+  // appends the spilled sites for a chrom to "sites"
+  void read_spilled(const size_t id, string &buf,
+                    vector<LiftedSite> &sites) const;
+
+private:
+  void spill();
+
+  size_t max_sites;
+  string tmp_dir;
+  size_t n_held;
+  size_t n_sites;
+  size_t n_spilled;
+
+  vector<string> chroms;
+  unordered_map<string, size_t> chrom_ids;
+  size_t last_chrom;
+  vector<vector<LiftedSite> > buckets;
+
+  SpillFile spill_file;
+  vector<vector<SpillFile::Segment> > segments;
+};
+
+
+void
+LiftBuckets::add(const string &chrom, LiftedSite &ls) {
+  // lifted sites mostly come in runs from the same chrom
+  if (chroms.empty() || chroms[last_chrom] != chrom) {
+    auto it = chrom_ids.find(chrom);
+    if (it == chrom_ids.end()) {
+      it = chrom_ids.insert(std::make_pair(chrom, chroms.size())).first;
+      chroms.push_back(chrom);
+      buckets.push_back(vector<LiftedSite>());
+      segments.push_back(vector<SpillFile::Segment>());
+    }
+    last_chrom = it->second;
+  }
+  ls.order = n_sites++;
+  buckets[last_chrom].push_back(ls);
+  if (++n_held >= max_sites)
+    spill();
+}
+
+
+void
+LiftBuckets::spill() {
+  if (n_spilled == 0)
+    spill_file.open(tmp_dir);
+  for (size_t i = 0; i < buckets.size(); ++i)
+    if (!buckets[i].empty()) {
+      segments[i].push_back(spill_file.write(buckets[i]));
+      n_spilled += buckets[i].size();
+      buckets[i].clear();
+    }
+  n_held = 0;
+}
+
+
+void
+LiftBuckets::sorted_chroms(vector<size_t> &ids) const {
+  ids.resize(chroms.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    ids[i] = i;
+  std::sort(ids.begin(), ids.end(), [this](const size_t a, const size_t b) {
+      return chroms[a] < chroms[b];
+    });
+}
+
+
+void
+LiftBuckets::take(const size_t id, vector<LiftedSite> &sites) {
+  sites.clear();
+  std::swap(sites, buckets[id]);
+  vector<LiftedSite>().swap(buckets[id]);
+}
+
+
+void
+LiftBuckets::read_spilled(const size_t id, string &buf,
+                          vector<LiftedSite> &sites) const {
+  for (size_t i = 0; i < segments[id].size(); ++i)
+    spill_file.read(segments[id][i], buf, sites);
+}
+
+
+// the sites lifted to one chrom, sorted, collapsed and formatted
+struct ChromBatch {
+  size_t chrom_id;
+  vector<LiftedSite> sites;
+  string buf;
+  string out;
+  size_t n_kept;
+};
+
+
+/* Sites lifted to the same position and strand are combined with
+   MSite::add, in input order, or only the first of them is kept if
+   "unique" is set. */
+static void
+collapse_chrom(const LiftBuckets &buckets, const bool unique,
+               ChromBatch &b) {
+  static const string strands[] = {"-", "+"};
+  buckets.read_spilled(b.chrom_id, b.buf, b.sites);
+  std::sort(b.sites.begin(), b.sites.end());
+
+  const string &chrom = buckets.chrom_name(b.chrom_id);
+  b.out.clear();
+  RecordWriter out(b.out);
+  b.n_kept = 0;
+  size_t i = 0;
+  while (i < b.sites.size()) {
+    MSite &s = b.sites[i].site;
+    size_t j = i + 1;
+    for (; j < b.sites.size() && b.sites[j].site.pos == s.pos &&
+           b.sites[j].site.strand == s.strand; ++j)
+      if (!unique) {
+        s.add(b.sites[j].site);
+        // sites without reads would otherwise give 0/0
+        if (s.n_reads == 0) s.meth = 0.0;
+      }
+    methpipe::write_site(out, chrom, s.pos, strands[s.strand == '+'],
+                         s.context, s.meth, s.n_reads);
+    ++b.n_kept;
+    i = j;
+  }
+}
+
+
 int
 main(int argc, const char **argv) {
   try{
     string pfile;
     bool VERBOSE = false;
     bool UNIQUE = false;
+    size_t n_threads = 1;
+    size_t max_sites = 10000000;
+    string tmp_dir(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+    string metrics_file;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
@@ -75,7 +372,15 @@ main(int argc, const char **argv) {
                            "<methcount file>");
     opt_parse.add_opt("output", 'o', "Output processed methcount", true, pfile);
     opt_parse.add_opt("unique", 'u', "keep unique sites", false, UNIQUE);
+    add_threads_opt(opt_parse, n_threads);
+    opt_parse.add_opt("max-sites", 'm', "sites held in memory while reading "
+                      "the input before writing to temporary files; each "
+                      "thread still holds all sites of one chrom "
+                      "(default: 10000000)", false, max_sites);
+    opt_parse.add_opt("tmp-dir", 'T', "directory for temporary files "
+                      "(default: $TMPDIR or /tmp)", false, tmp_dir);
     opt_parse.add_opt("verbose", 'v', "print more information", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -98,52 +403,58 @@ main(int argc, const char **argv) {
     const string mfile(leftover_args.front());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     if (VERBOSE)
       cerr << "Loading methcount file " << mfile << endl;
 
     std::ifstream in(mfile.c_str());
-    std::ofstream output(pfile.c_str());
+    if (!in)
+      throw SMITHLABException("could not open file: " + mfile);
 
-    string chrom;
-    size_t pos;
-    string strand;
-    string seq;
-    double meth;
-    size_t coverage;
-
-    vector<GenomicSiteMeth>  newmeth;
-    size_t i = 0;
-    while (methpipe::read_site(in, chrom, pos, strand,
-                               seq, meth, coverage)) {
-      const GenomicSiteMeth loc(chrom, pos, strand, seq, meth, coverage);
-      if (i==0) {
-        newmeth.push_back(loc);
-        ++i;
-      }
-      else if(newmeth.back().chrom == chrom &&
-              newmeth.back().pos == pos &&
-              newmeth.back().strand == strand){
-        if (!UNIQUE) {
-          newmeth[i].meth = (newmeth[i].meth*newmeth[i].coverage +
-                             meth*coverage)/(newmeth[i].coverage + coverage);
-          newmeth[i].coverage =  newmeth[i].coverage + coverage;
-        }
-      }
-      else {
-        newmeth.push_back(loc);
-        ++i;
+    LiftBuckets buckets(std::max(max_sites, static_cast<size_t>(1)), tmp_dir);
+    string line, chrom;
+    LiftedSite ls;
+    while (getline(in, line))
+      if (!line.empty() && line[0] != '#') {
+        parse_lifted_site(line, chrom, ls);
+        buckets.add(chrom, ls);
       }
-    }
 
-    if(VERBOSE)
-      cerr << "Keeping " << i << " sites" << endl;
+    if (VERBOSE)
+      cerr << "Read " << buckets.get_n_sites() << " sites on "
+           << buckets.size() << " chroms ("
+           << buckets.get_n_spilled() << " in temporary files)" << endl;
 
-    for(size_t j=0; j < newmeth.size(); ++j){
-      methpipe::write_site(output, newmeth[j].chrom,
-                           newmeth[j].pos, newmeth[j].strand,
-                           newmeth[j].name, newmeth[j].meth,
-                           newmeth[j].coverage);
-    }
+    std::ofstream output(pfile.c_str());
+    if (!output)
+      throw SMITHLABException("could not open file: " + pfile);
+
+    vector<size_t> chrom_order;
+    buckets.sorted_chroms(chrom_order);
+
+    // each batch holds all the sites of a chrom, whatever "max_sites"
+    size_t next_chrom = 0, n_kept = 0;
+    vector<ChromBatch> batches(n_threads + 1);
+    run_ordered_pipeline(n_threads, batches,
+                         [&](ChromBatch &b) {
+                           if (next_chrom == chrom_order.size())
+                             return false;
+                           b.chrom_id = chrom_order[next_chrom++];
+                           buckets.take(b.chrom_id, b.sites);
+                           return true;
+                         },
+                         [&](ChromBatch &b, const size_t) {
+                           collapse_chrom(buckets, UNIQUE, b);
+                         },
+                         [&](ChromBatch &b) {
+                           output.write(b.out.data(), b.out.size());
+                           n_kept += b.n_kept;
+                           vector<LiftedSite>().swap(b.sites);
+                         });
+
+    if (VERBOSE)
+      cerr << "Keeping " << n_kept << " sites" << endl;
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -38,6 +38,7 @@
 #include "MappedRead.hpp"
 
 #include "bsutils.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -47,17 +48,19 @@ using std::endl;
 using std::setw;
 using std::stringstream;
 
+// reads the next line of each file, or an empty line for a file that
+// has ended, as files have rows only up to their longest read; false
+// once all files have ended
 bool readline(std::vector<std::ifstream*>& infiles,
               std::vector<string>& cur_line) {
+  bool more = false;
   for ( size_t i = 0; i < infiles.size(); ++i) {
-    if (infiles[i]->eof() )
-      return false;
-    else
-      getline(*infiles[i],cur_line[i]);
-    if(!cur_line[i].compare(""))
-      return false;
+    if (!getline(*infiles[i], cur_line[i]))
+      cur_line[i].clear();
+    if (!cur_line[i].empty())
+      more = true;
   }
-  return true;
+  return more;
 }
 
 int 
@@ -67,6 +70,8 @@ main(int argc, const char **argv) {
     bool VERBOSE = false;
     string outfile;
     
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Program to merge the "
 			   "BS conversion rate from two sets of BS-seq "
@@ -75,6 +80,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("output", 'o', "Name of output file (default: stdout)", 
 		      false, outfile);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args; // list of mapped-read files to merge
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -95,6 +101,9 @@ main(int argc, const char **argv) {
       return EXIT_SUCCESS;
     }
     /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     vector<std::ifstream*> infiles(leftover_args.size());
     for (size_t i = 0; i < leftover_args.size(); ++i) {
       infiles[i] = new std::ifstream(leftover_args[i].c_str());
@@ -114,9 +123,9 @@ main(int argc, const char **argv) {
     vector<string> neg_line(infiles.size());
     vector<string> title_line(infiles.size());
 
-    double overall_conversion_rate = 0;
-    double pos_conv_rate = 0;
-    double neg_conv_rate = 0;
+    size_t sum_bth_conv = 0ul;
+    size_t sum_pos_conv = 0ul;
+    size_t sum_neg_conv = 0ul;
     size_t sum_bth = 0ul;
     size_t sum_pos = 0ul;
     size_t sum_neg = 0ul;
@@ -142,15 +151,12 @@ main(int argc, const char **argv) {
       vector<double> n_conv(cur_line.size());
       vector<double> bth_conv(cur_line.size());
 
-      vector<double> p_rate(cur_line.size());
-      vector<double> n_rate(cur_line.size());
-      vector<double> bth_rate(cur_line.size());
-
       vector<double> err(cur_line.size());
       vector<double> all(cur_line.size());
-      vector<double> err_rate(cur_line.size());
 
       for (size_t j=0; j< cur_line.size(); ++j) {
+        if (cur_line[j].empty())
+          continue;
         //parse the line
         stringstream ss(cur_line[j]);     
         string item;
@@ -160,31 +166,21 @@ main(int argc, const char **argv) {
         }
         p_total[j] = strtod(elems[1].c_str(), NULL);
         p_conv[j] = strtod(elems[2].c_str(), NULL);
-        p_rate[j] = strtod(elems[3].c_str(), NULL);
 
         n_total[j] = strtod(elems[4].c_str(), NULL);
         n_conv[j] = strtod(elems[5].c_str(), NULL);
-        n_rate[j] = strtod(elems[6].c_str(), NULL);
 
         bth_total[j] = strtod(elems[7].c_str(), NULL);
         bth_conv[j] = strtod(elems[8].c_str(), NULL);
-        bth_rate[j] = strtod(elems[9].c_str(), NULL);
 
         err[j] = strtod(elems[10].c_str(), NULL);
         all[j] = strtod(elems[11].c_str(), NULL);
-        err_rate[j] = strtod(elems[12].c_str(), NULL);
       }
       size_t ptot_out = 0, ntot_out = 0, bthtot_out = 0, pconv_out = 0;
       size_t nconv_out = 0, bthconv_out = 0;
       size_t err_out = 0, all_out = 0; 
       double prate_out = 0, nrate_out = 0, bthrate_out = 0, errrate_out = 0;
 
-      for (size_t k=0; k<p_total.size(); ++k) {
-        prate_out += p_rate[k]*(p_total[k]);
-        nrate_out += n_rate[k]*(n_total[k]);
-        bthrate_out += bth_rate[k]*(bth_total[k]);
-        errrate_out += err_rate[k]*(all[k]);
-      }
       ptot_out = accumulate(p_total.begin(), p_total.end(), 0.0);
       ntot_out = accumulate(n_total.begin(), n_total.end(), 0.0);
       bthtot_out = accumulate(bth_total.begin(), bth_total.end(), 0.0);
@@ -195,10 +191,13 @@ main(int argc, const char **argv) {
       bthconv_out = accumulate(bth_conv.begin(), bth_conv.end(), 0.0);
       err_out = accumulate(err.begin(), err.end(), 0.0);
 
-      prate_out /= ptot_out;
-      nrate_out /= ntot_out;
-      bthrate_out /= bthtot_out;
-      errrate_out /= all_out;
+      // the rates are found from the added counts, not the rates in
+      // the files, which are rounded and are NaN for a file with no
+      // reads, as methcounts -B gives for a shard with none
+      prate_out = static_cast<double>(pconv_out)/ptot_out;
+      nrate_out = static_cast<double>(nconv_out)/ntot_out;
+      bthrate_out = static_cast<double>(bthconv_out)/bthtot_out;
+      errrate_out = static_cast<double>(err_out)/all_out;
       std::ostringstream x;
       x.precision(precision_val); 
       x << base << "\t" << ptot_out << "\t" << pconv_out << "\t";
@@ -211,9 +210,9 @@ main(int argc, const char **argv) {
       x << setw(precision_val) << errrate_out << endl;
       ostrings.push_back(x.str());
 
-      overall_conversion_rate += bthrate_out*bthtot_out;
-      pos_conv_rate += prate_out*ptot_out;
-      neg_conv_rate += nrate_out*ntot_out;
+      sum_bth_conv += bthconv_out;
+      sum_pos_conv += pconv_out;
+      sum_neg_conv += nconv_out;
       sum_bth += bthtot_out;
       sum_pos += ptot_out;
       sum_neg += ntot_out;
@@ -221,11 +220,14 @@ main(int argc, const char **argv) {
     } 
 
     out << "OVERALL CONVERSION RATE = ";
-    out << setw(precision_val) << overall_conversion_rate/sum_bth << endl;
+    out << setw(precision_val)
+        << static_cast<double>(sum_bth_conv)/sum_bth << endl;
     out << "POS CONVERSION RATE = ";
-    out << setw(precision_val) << pos_conv_rate/sum_pos << "\t";
+    out << setw(precision_val)
+        << static_cast<double>(sum_pos_conv)/sum_pos << "\t";
     out << sum_pos << endl << "NEG CONVERSION RATE = ";
-    out << setw(precision_val) << neg_conv_rate/sum_neg << "\t";
+    out << setw(precision_val)
+        << static_cast<double>(sum_neg_conv)/sum_neg << "\t";
     out << sum_neg << endl;
 
     out << "BASE" << '\t'
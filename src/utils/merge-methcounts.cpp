@@ -34,6 +34,7 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MethpipeFiles.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
@@ -217,6 +218,8 @@ main(int argc, const char **argv) {
 
     string header_info;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "merge multiple methcounts files",
@@ -227,6 +230,7 @@ main(int argc, const char **argv) {
                       false, header_info);
     opt_parse.add_opt("verbose", 'v',"print more run info", false, VERBOSE);
     opt_parse.add_opt("tabular", 't', "output as table", false, TABULAR);
+    add_metrics_opt(opt_parse, metrics_file);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -250,6 +254,8 @@ main(int argc, const char **argv) {
     vector<string> methcounts_files(leftover_args);
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     vector<std::ifstream*> infiles(methcounts_files.size());
     for (size_t i = 0; i < methcounts_files.size(); ++i)
       infiles[i] = new std::ifstream(methcounts_files[i].c_str());
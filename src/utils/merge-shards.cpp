@@ -0,0 +1,191 @@
+/*    merge-shards: put together the outputs of methcounts run on
+ *    regions or shards of the genome
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Each shard of "methcounts --shard" or "-r" outputs the sites of its
+ * own part of the genome, so the output for the whole genome is the
+ * shard outputs one after another in the order of their first sites.
+ * Here the files may be given in any order; they are sorted by their
+ * first site, and the last site of each must come before the first
+ * site of the next, or the shards overlap. This works the same for
+ * the symmetric CpG outputs. The conversion rates (-B) of shards are
+ * added by merge-bsrate, and count states (-R) by merge-count-states.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <utility>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "ParallelBGZF.hpp"
+#include "TextFormat.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+struct SiteKey {
+  SiteKey() : pos(0) {}
+  bool operator<(const SiteKey &other) const {
+    const int cmp = chrom.compare(other.chrom);
+    return cmp < 0 || (cmp == 0 && pos < other.pos);
+  }
+  string chrom;
+  size_t pos;
+};
+
+
+static SiteKey
+get_key(const string &line, const string &filename) {
+  SiteKey k;
+  std::istringstream iss(line);
+  if (!(iss >> k.chrom >> k.pos))
+    throw SMITHLABException("bad line in " + filename + ":\n" + line);
+  return k;
+}
+
+
+// the first site of a file; false if it has none
+static bool
+get_first_site(const string &filename, SiteKey &first) {
+  InputFile file(filename, 1);
+  std::istream in(file.rdbuf());
+  string line;
+  while (getline(in, line))
+    if (!line.empty()) {
+      first = get_key(line, filename);
+      return true;
+    }
+  return false;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    size_t n_threads = 1;
+    string outfile;
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "put together the outputs "
+                           "of methcounts on regions or shards of the "
+                           "genome", "<shard-1> <shard-2> ...");
+    opt_parse.add_opt("output", 'o', "output file (default: stdout)",
+                      false, outfile);
+    add_threads_opt(opt_parse, n_threads);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const vector<string> shard_files(leftover_args);
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    if (!outfile.empty() && !is_valid_output_file(outfile))
+      throw SMITHLABException("bad output file: " + outfile);
+
+    // the files are put in order by their first lines, and only
+    // one is open at a time, as there may be many
+    vector<std::pair<SiteKey, string> > shards;
+    SiteKey first;
+    for (size_t i = 0; i < shard_files.size(); ++i)
+      if (get_first_site(shard_files[i], first))
+        shards.push_back(std::make_pair(first, shard_files[i]));
+    std::stable_sort(shards.begin(), shards.end(),
+                     [](const std::pair<SiteKey, string> &a,
+                        const std::pair<SiteKey, string> &b) {
+                       return a.first < b.first;
+                     });
+
+    OutputFile of(outfile, n_threads);
+    std::ostream out_stream(of.rdbuf());
+    RecordWriter out(out_stream);
+
+    StageTimer timer("merge");
+    string line, prev_line, prev_file;
+    for (size_t i = 0; i < shards.size(); ++i) {
+      const string &filename = shards[i].second;
+      if (VERBOSE)
+        cerr << "[SHARD] " << filename << endl;
+      if (!prev_line.empty() &&
+          !(get_key(prev_line, prev_file) < shards[i].first))
+        throw SMITHLABException("shards overlap: " + prev_file + " and " +
+                                filename);
+      InputFile file(filename, n_threads);
+      std::istream in(file.rdbuf());
+      size_t n_lines = 0;
+      while (getline(in, line))
+        if (!line.empty()) {
+          out.put(line).put('\n');
+          std::swap(prev_line, line);
+          ++n_lines;
+        }
+      if (in.bad())
+        throw SMITHLABException("error reading file: " + filename);
+      prev_file = filename;
+      Metrics::count("shards");
+      Metrics::count("sites", n_lines);
+    }
+    out.flush();
+    of.close();
+    timer.stop();
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+/*    methindex: make an index of a methcounts file, so that the
+ *    methylation in any region can be found without reading its sites
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The index goes next to the methcounts file, with ".midx" added to
+ * its name, where "roimethstat -I" looks for it. It has 40 bytes for
+ * each site, and must be made again if the methcounts file changes.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "MethpipeSite.hpp"
+#include "MethIndex.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    string outfile;
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "make an index of a "
+                           "methcounts file for region queries",
+                           "<methcounts-file>");
+    opt_parse.add_opt("output", 'o', "index file name (default: "
+                      "methcounts file name with .midx added)",
+                      false, outfile);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string meth_file(leftover_args.front());
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    if (outfile.empty())
+      outfile = meth_index_name(meth_file);
+
+    std::ifstream in(meth_file.c_str());
+    if (!in)
+      throw SMITHLABException("cannot open input file: " + meth_file);
+
+    StageTimer timer("index");
+    const size_t n_sites =
+      write_meth_index(in, get_filesize(meth_file), outfile);
+    timer.stop();
+    Metrics::count("sites", n_sites);
+    if (VERBOSE)
+      cerr << "[SITES INDEXED] " << n_sites << endl;
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
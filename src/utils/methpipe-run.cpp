@@ -0,0 +1,628 @@
+/*    methpipe-run: convert, deduplicate, count and summarize the reads
+ *    for one sample in a single process, as would be done by running
+ *    to-mr, sort, duplicate-remover, methcounts and levels
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <exception>
+#include <memory>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "GenomicRegion.hpp"
+#include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
+#include "MethpipeFiles.hpp"
+
+#include "OrderedPipeline.hpp"
+#include "MatePairing.hpp"
+#include "DuplicateRemoval.hpp"
+#include "MethCounts.hpp"
+#include "MethLevels.hpp"
+#include "ParallelBGZF.hpp"
+#include "ThreadPool.hpp"
+#include "TextFormat.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::unordered_map;
+
+
+typedef unordered_map<string, string> chrom_file_map;
+static void
+get_chrom(const string &chrom_name, const chrom_file_map &chrom_files,
+          string &chrom) {
+
+  const chrom_file_map::const_iterator fn(chrom_files.find(chrom_name));
+  if (fn == chrom_files.end())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+
+  chrom.clear();
+  read_fasta_file(fn->second, chrom_name, chrom);
+  if (chrom.empty())
+    throw SMITHLABException("could not find chrom: " + chrom_name);
+}
+
+
+/* A batch of jobs for the to-mr stage, along with the reads they give
+ * and the position in the input before which no later batch can give
+ * a read. The chrom names are a copy, as for SAM input the names held
+ * by the MatePairer grow while the batch is in the pipeline.
+ */
+struct ReadBatch {
+  ReadBatch() : n_jobs(0), n_reads(0), frontier_chrom(0),
+                frontier_pos(0), last(false) {}
+  vector<ReadJob> jobs;
+  size_t n_jobs;
+  MappedRead merged;
+  vector<MappedRead> reads;
+  vector<size_t> chrom_ids;
+  size_t n_reads;
+  vector<string> chrom_names;
+  size_t frontier_chrom;
+  size_t frontier_pos;
+  bool last;
+};
+
+
+static void
+convert_reads(const size_t suffix_len, const size_t max_segment_length,
+              ReadBatch &b) {
+  b.n_reads = 0;
+  for (size_t i = 0; i < b.n_jobs; ++i) {
+    const MappedRead *out[2];
+    const size_t n = finish_read_job(suffix_len, max_segment_length,
+                                     b.chrom_names, b.jobs[i], b.merged, out);
+    for (size_t j = 0; j < n; ++j) {
+      if (b.n_reads == b.reads.size()) {
+        b.reads.push_back(MappedRead());
+        b.chrom_ids.push_back(0);
+      }
+      b.reads[b.n_reads] = *out[j];
+      b.chrom_ids[b.n_reads++] = b.jobs[i].mates[j].chrom_id;
+    }
+  }
+}
+
+
+// consecutive sorted reads from one chrom, never splitting a group of
+// equivalent reads
+struct ReadChunk {
+  string chrom_name;
+  vector<MappedRead> reads;
+};
+
+
+/* ReadSorter: puts the reads into the order of "sort -k 1,1 -k 2,2n
+   -k 3,3n -k 6,6", except that chroms are in order of the input,
+   breaking ties by read name; ChromSpill puts the chroms in order for
+   the output. Reads are held until the MatePairer has
+   moved past their start, so memory is bounded by the reads over the
+   longest held fragment plus one batch. */
+class ReadSorter {
+public:
+  explicit ReadSorter(BoundedQueue<ReadChunk> &q) :
+    chunks(q), flushed_chrom(0), flushed_pos(0), n_flushed(0) {}
+
+  void add(ReadBatch &b);
+  void flush_all() {flush(pending.size());}
+
+private:
+  struct SortedRead {
+    size_t chrom_id;
+    MappedRead mr;
+  };
+  static bool
+  read_order(const SortedRead &a, const SortedRead &b) {
+    if (a.chrom_id != b.chrom_id) return a.chrom_id < b.chrom_id;
+    const GenomicRegion &x = a.mr.r;
+    const GenomicRegion &y = b.mr.r;
+    if (x.get_start() != y.get_start()) return x.get_start() < y.get_start();
+    if (x.get_end() != y.get_end()) return x.get_end() < y.get_end();
+    if (x.get_strand() != y.get_strand())
+      return x.get_strand() < y.get_strand();
+    return x.get_name() < y.get_name();
+  }
+  void flush(const size_t n);
+
+  BoundedQueue<ReadChunk> &chunks;
+  vector<string> chrom_names;
+  vector<SortedRead> pending;
+  size_t flushed_chrom;
+  size_t flushed_pos;
+  size_t n_flushed;
+};
+
+
+void
+ReadSorter::add(ReadBatch &b) {
+  if (chrom_names.size() < b.chrom_names.size())
+    chrom_names = b.chrom_names;
+
+  const size_t n_sorted = pending.size();
+  for (size_t i = 0; i < b.n_reads; ++i) {
+    const size_t start = b.reads[i].r.get_start();
+    if (n_flushed > 0 && (b.chrom_ids[i] < flushed_chrom ||
+                          (b.chrom_ids[i] == flushed_chrom &&
+                           start < flushed_pos)))
+      throw SMITHLABException("input not sorted by position near read: " +
+                              b.reads[i].r.get_name());
+    pending.push_back(SortedRead());
+    pending.back().chrom_id = b.chrom_ids[i];
+    std::swap(pending.back().mr, b.reads[i]);
+  }
+  std::stable_sort(pending.begin() + n_sorted, pending.end(), read_order);
+  std::inplace_merge(pending.begin(), pending.begin() + n_sorted,
+                     pending.end(), read_order);
+
+  if (b.last)
+    flush_all();
+  else {
+    // reads starting at the frontier might still have equivalent reads
+    // to come, so only those strictly before are given out
+    size_t n = 0;
+    while (n < pending.size() &&
+           (pending[n].chrom_id < b.frontier_chrom ||
+            (pending[n].chrom_id == b.frontier_chrom &&
+             pending[n].mr.r.get_start() < b.frontier_pos)))
+      ++n;
+    flush(n);
+  }
+}
+
+
+void
+ReadSorter::flush(const size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    ReadChunk c;
+    const size_t chrom_id = pending[i].chrom_id;
+    c.chrom_name = chrom_names[chrom_id];
+    for (; i < n && pending[i].chrom_id == chrom_id; ++i) {
+      flushed_chrom = chrom_id;
+      flushed_pos = pending[i].mr.r.get_start();
+      ++n_flushed;
+      c.reads.push_back(MappedRead());
+      std::swap(c.reads.back(), pending[i].mr);
+    }
+    if (!chunks.push(std::move(c)))
+      throw SMITHLABException("pipeline stopped");
+  }
+  pending.erase(pending.begin(), pending.begin() + n);
+}
+
+
+/* ChromSpill: the output for each chrom, held in an unnamed temporary
+   file until every chrom is done and then copied out in order of chrom
+   name, which is the order of "sort -k 1,1" as used with the separate
+   programs. The input is sorted, so the text for a chrom is added in
+   one run and kept as a single byte range of the file. */
+class ChromSpill {
+public:
+  explicit ChromSpill(const string &tmp_dir);
+  ~ChromSpill() {if (fd >= 0) close(fd);}
+
+  void write(const string &chrom, const string &text);
+  void copy(std::ostream &out) const;
+
+private:
+  ChromSpill(const ChromSpill &);
+  ChromSpill &operator=(const ChromSpill &);
+
+  struct Segment {
+    size_t offset;
+    size_t n_bytes;
+  };
+
+  int fd;
+  size_t size;
+  std::map<string, Segment> segments;
+};
+
+
+ChromSpill::ChromSpill(const string &tmp_dir) : fd(-1), size(0) {
+  string name(tmp_dir + "/methpipe-run.XXXXXX");
+  fd = mkstemp(&name[0]);
+  if (fd < 0)
+    throw SMITHLABException("could not create temporary file in: " + tmp_dir);
+  // the file goes away when it is closed, or if the program dies
+  unlink(name.c_str());
+}
+
+
+void
+ChromSpill::write(const string &chrom, const string &text) {
+  for (size_t done = 0; done < text.size();) {
+    const ssize_t n = ::write(fd, text.data() + done, text.size() - done);
+    if (n < 0)
+      throw SMITHLABException("could not write temporary file");
+    done += n;
+  }
+  const Segment seg = {size, 0};
+  Segment &s = segments.insert(std::make_pair(chrom, seg)).first->second;
+  if (s.offset + s.n_bytes != size)
+    throw SMITHLABException("input not sorted by chrom at: " + chrom);
+  s.n_bytes += text.size();
+  size += text.size();
+}
+
+
+void
+ChromSpill::copy(std::ostream &out) const {
+  static const size_t buffer_size = 1ul << 20;
+  vector<char> buf(buffer_size);
+  for (std::map<string, Segment>::const_iterator i(segments.begin());
+       i != segments.end(); ++i)
+    for (size_t done = 0; done < i->second.n_bytes;) {
+      const ssize_t n = pread(fd, &buf[0],
+                              std::min(buffer_size, i->second.n_bytes - done),
+                              i->second.offset + done);
+      if (n <= 0)
+        throw SMITHLABException("could not read temporary file");
+      out.write(&buf[0], n);
+      done += n;
+    }
+}
+
+
+/* PipelineStage: runs one stage in its own thread. A stage that fails
+   closes its queues, so the stages on either side stop, and keeps the
+   exception to be rethrown by the main thread. */
+class PipelineStage {
+public:
+  template <class Body, class In, class Out>
+  PipelineStage(Body body, BoundedQueue<In> &in, BoundedQueue<Out> &out) {
+    t = std::thread([this, body, &in, &out] {
+        try {body();}
+        catch (...) {error = std::current_exception();}
+        in.close();
+        out.close();
+      });
+  }
+  void join() {if (t.joinable()) t.join();}
+  std::exception_ptr error;
+
+private:
+  std::thread t;
+};
+
+
+int
+main(int argc, const char **argv) {
+  try {
+    string outfile;
+    string levels_file;
+    string reads_file;
+    string stats_file;
+    string chrom_file;
+    string fasta_suffix = "fa";
+    string mapper;
+    string tmp_dir(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    size_t MAX_SEGMENT_LENGTH = 1000;
+    size_t suffix_len = 1;
+    bool USE_SEQUENCE = false;
+    bool ALL_C = false;
+    bool CPG_ONLY = false;
+    double alpha = 0.95;
+    size_t seed = 408;
+    size_t n_threads = 1;
+    bool VERBOSE = false;
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "convert sorted mapped "
+                           "reads in SAM/BAM format to methylation levels, "
+                           "removing duplicates, in one process",
+                           "-c <chroms> -m <mapper> <sam/bam_file>");
+    opt_parse.add_opt("output", 'o', "methcounts output file "
+                      "(default: stdout)", false, outfile);
+    opt_parse.add_opt("levels", 'l', "levels output file", false, levels_file);
+    opt_parse.add_opt("reads", 'R', "also write the reads remaining after "
+                      "removing duplicates to this file", false, reads_file);
+    opt_parse.add_opt("stats", 'S', "duplicate removal statistics output file",
+                      false, stats_file);
+    opt_parse.add_opt("chrom", 'c', "file or dir of chroms (FASTA format; "
+                      ".fa suffix)", true, chrom_file);
+    opt_parse.add_opt("suffix", '\0', "suffix of FASTA files "
+                      "(assumes -c specifies dir)", false, fasta_suffix);
+    opt_parse.add_opt("mapper", 'm',
+                      "Original mapper: bismark, bs_seeker or general",
+                      true, mapper);
+    opt_parse.add_opt("suff", 's', "read name suffix length (default: 1)",
+                      false, suffix_len);
+    opt_parse.add_opt("max-frag", 'L', "maximum allowed insert size",
+                      false, MAX_SEGMENT_LENGTH);
+    opt_parse.add_opt("seq", '\0', "use sequence info to remove duplicates",
+                      false, USE_SEQUENCE);
+    opt_parse.add_opt("all-cytosines", 'A', "use all cytosines to remove "
+                      "duplicates (default: CpG)", false, ALL_C);
+    opt_parse.add_opt("seed", 'r', "random seed for choosing reads to keep "
+                      "(default: 408)", false, seed);
+    opt_parse.add_opt("cpg-only", 'n', "print only CpG context cytosines",
+                      false, CPG_ONLY);
+    opt_parse.add_opt("alpha", 'a', "alpha for confidence interval in levels",
+                      false, alpha);
+    opt_parse.add_opt("tmp-dir", 'T', "directory for the temporary files "
+                      "that put chroms in order (default: $TMPDIR or /tmp)",
+                      false, tmp_dir);
+    add_threads_opt(opt_parse, n_threads);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string mapped_reads_file = leftover_args.front();
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    if (!outfile.empty() && !is_valid_output_file(outfile))
+      throw SMITHLABException("bad output file: " + outfile);
+
+    chrom_file_map chrom_files;
+    identify_and_read_chromosomes(chrom_file, fasta_suffix, chrom_files);
+    if (VERBOSE)
+      cerr << "CHROMS_FOUND=" << chrom_files.size() << endl;
+
+    // outputs with names ending in ".gz" are written BGZF compressed
+    OutputFile of(outfile, n_threads);
+    std::ostream out(of.rdbuf());
+
+    std::unique_ptr<OutputFile> reads_of;
+    std::unique_ptr<std::ostream> reads_stream;
+    if (!reads_file.empty()) {
+      reads_of.reset(new OutputFile(reads_file, n_threads));
+      reads_stream.reset(new std::ostream(reads_of->rdbuf()));
+    }
+    std::ostream *reads_out = reads_stream.get();
+
+    /* the chroms come in the order of the input, which for SAM and
+       BAM is that of the reference, but are written in order of name
+       like those from sort; the text for the chroms is spilled as it
+       is made and copied out once all of them are done */
+    static const size_t spill_bytes = 1ul << 20;
+    ChromSpill sites_spill(tmp_dir);
+    std::unique_ptr<ChromSpill> reads_spill;
+    if (reads_out)
+      reads_spill.reset(new ChromSpill(tmp_dir));
+
+    /* the stages are those of the separate programs. Converting
+       from SAM/BAM uses the calling thread to pair mates, "n_threads"
+       workers to build the reads and one thread to sort them. Then
+       removing duplicates, counting and the summary for levels each
+       have one thread. Stages pass batches through bounded queues, so
+       only a few batches of reads or sites are in memory at once. */
+    static const size_t jobs_per_batch = 8192;
+    static const size_t sites_per_batch = 100000;
+    static const size_t queue_size = 4;
+
+    // the stages run at once, so they are timed together
+    StageTimer timer("pipeline");
+    BoundedQueue<ReadChunk> sorted_reads(queue_size);
+    BoundedQueue<ReadChunk> unique_reads(queue_size);
+    BoundedQueue<vector<MSite> > sites(queue_size);
+
+    DuplicateStats stats;
+    PipelineStage dedup([&] {
+        DuplicateSelector selector(USE_SEQUENCE, ALL_C, seed);
+        string text;
+        std::unique_ptr<RecordWriter> reads_writer;
+        if (reads_spill)
+          reads_writer.reset(new RecordWriter(text));
+        vector<size_t> keepers;
+        ReadKey key;
+        ReadChunk c;
+        while (sorted_reads.pop(c)) {
+          ReadChunk u;
+          u.chrom_name = c.chrom_name;
+          key.chrom = c.chrom_name;
+          for (size_t i = 0, j = 0; i < c.reads.size(); i = j) {
+            const GenomicRegion &r = c.reads[i].r;
+            key.start = r.get_start();
+            key.end = r.get_end();
+            key.strand = r.get_strand();
+            for (j = i + 1; j < c.reads.size() &&
+                   c.reads[j].r.get_start() == key.start &&
+                   c.reads[j].r.get_end() == key.end &&
+                   c.reads[j].r.get_strand() == key.strand; ++j);
+            selector.select(key, &c.reads[i], j - i, keepers);
+            stats.add_group(&c.reads[i], j - i, keepers);
+            for (size_t k = 0; k < keepers.size(); ++k) {
+              u.reads.push_back(MappedRead());
+              std::swap(u.reads.back(), c.reads[i + keepers[k]]);
+              if (reads_writer)
+                write_mapped_read(*reads_writer, u.chrom_name, u.reads.back());
+            }
+          }
+          if (reads_writer) {
+            reads_writer->flush();
+            reads_spill->write(u.chrom_name, text);
+            text.clear();
+          }
+          if (!unique_reads.push(std::move(u)))
+            throw SMITHLABException("pipeline stopped");
+        }
+      }, sorted_reads, unique_reads);
+
+    PipelineStage counts([&] {
+        static const string strands[] = {"-", "+"};
+        vector<CountSet<unsigned short> > counts;
+        string chrom_name, chrom;
+        vector<MSite> batch;
+        string text;
+        RecordWriter sites_out(text);
+        auto emit = [&] {
+          get_sites(chrom_name, chrom, counts, CPG_ONLY, [&](const MSite &s) {
+              methpipe::write_site(sites_out, s.chrom, s.pos,
+                                   strands[s.strand == '+'], s.context,
+                                   s.meth, s.n_reads);
+              if (text.size() >= spill_bytes) {
+                sites_spill.write(chrom_name, text);
+                text.clear();
+              }
+              batch.push_back(s);
+              if (batch.size() == sites_per_batch) {
+                if (!sites.push(std::move(batch)))
+                  throw SMITHLABException("pipeline stopped");
+                batch.clear();
+              }
+            });
+          sites_out.flush();
+          sites_spill.write(chrom_name, text);
+          text.clear();
+        };
+        ReadChunk c;
+        while (unique_reads.pop(c)) {
+          if (chrom.empty() || c.chrom_name != chrom_name) {
+            if (!chrom.empty())
+              emit();
+            chrom_name = c.chrom_name;
+            get_chrom(chrom_name, chrom_files, chrom);
+            if (VERBOSE)
+              cerr << "PROCESSING:\t" << chrom_name << endl;
+            counts.clear();
+            counts.resize(chrom.size());
+          }
+          for (size_t i = 0; i < c.reads.size(); ++i)
+            if (c.reads[i].r.pos_strand())
+              count_states_pos(chrom, c.reads[i], counts);
+            else count_states_neg(chrom, c.reads[i], counts);
+        }
+        if (!chrom.empty())
+          emit();
+        if (!batch.empty() && !sites.push(std::move(batch)))
+          throw SMITHLABException("pipeline stopped");
+      }, unique_reads, sites);
+
+    MethLevels levels(alpha);
+    PipelineStage summary([&] {
+        vector<MSite> batch;
+        while (sites.pop(batch))
+          for (size_t i = 0; i < batch.size(); ++i)
+            levels.update(batch[i]);
+      }, sites, sites);
+
+    std::exception_ptr error;
+    try {
+      MatePairer pairer(mapped_reads_file, mapper, suffix_len,
+                        MAX_SEGMENT_LENGTH, n_threads);
+      pairer.require_sorted();
+      const vector<string> &chrom_names = pairer.get_chrom_names();
+      ReadSorter sorter(sorted_reads);
+
+      vector<ReadBatch> batches(2*n_threads + 2);
+      run_ordered_pipeline(n_threads, batches,
+                           [&](ReadBatch &b) {
+                             const bool more =
+                               pairer.fill(b.jobs, b.n_jobs, jobs_per_batch);
+                             if (b.chrom_names.size() != chrom_names.size())
+                               b.chrom_names = chrom_names;
+                             b.last = !pairer.get_frontier(b.frontier_chrom,
+                                                           b.frontier_pos);
+                             return more;
+                           },
+                           [&](ReadBatch &b, const size_t) {
+                             convert_reads(suffix_len, MAX_SEGMENT_LENGTH, b);
+                           },
+                           [&](ReadBatch &b) {
+                             sorter.add(b);
+                           });
+      sorter.flush_all();
+      Metrics::count("records", pairer.get_n_records());
+      if (VERBOSE)
+        cerr << "RECORDS READ:\t" << pairer.get_n_records() << endl;
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+    sorted_reads.close();
+    dedup.join();
+    counts.join();
+    summary.join();
+
+    // a failure downstream stops the stages before it, so the error
+    // from the last failed stage is the one to report
+    if (summary.error) std::rethrow_exception(summary.error);
+    if (counts.error) std::rethrow_exception(counts.error);
+    if (dedup.error) std::rethrow_exception(dedup.error);
+    if (error) std::rethrow_exception(error);
+    sites_spill.copy(out);
+    of.close();
+    if (reads_of) {
+      reads_spill->copy(*reads_out);
+      reads_of->close();
+    }
+    timer.stop();
+    Metrics::count("reads_in", stats.reads_in);
+    Metrics::count("reads_out", stats.reads_out);
+
+    if (!levels_file.empty()) {
+      std::ofstream levels_out(levels_file.c_str());
+      if (!levels_out)
+        throw SMITHLABException("bad output file: " + levels_file);
+      levels.write(levels_out);
+    }
+    if (!stats_file.empty()) {
+      std::ofstream out_stat(stats_file.c_str());
+      out_stat << stats.tostring();
+    }
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,690 @@
+/*    methpipe-sort: sort mapped reads in the order that methcounts and
+ *    duplicate-remover expect, optionally removing duplicates
+ *
+ *    Copyright (C) 2026 The methpipe contributors
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* An external merge sort. The input is cut into runs that fit in
+ * memory; threads parse and sort the runs and write them to temporary
+ * files in a compact binary form, with the chrom written only when it
+ * changes and numbers as varints (as in ChromBlocks.hpp). The runs are
+ * then merged, in parallel passes if there are too many to open at
+ * once, and the final merge writes the mapped reads as text.
+ *
+ * The order is that of "precedes" in DuplicateRemoval.hpp: chrom (as
+ * strings), start, end, then strand. Reads with equal keys keep their
+ * order in the input, so the output is the same as from
+ *
+ *   LC_ALL=C sort -s -k1,1 -k2,2n -k3,3n -k6,6
+ *
+ * for any number of threads or amount of memory. With -d the final
+ * merge also removes duplicates, keeping the same reads as
+ * duplicate-remover with the same options would from the sorted
+ * reads, which saves writing and reading them all once more.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "GenomicRegion.hpp"
+#include "MappedRead.hpp"
+#include "MappedReadReader.hpp"
+
+#include "DuplicateRemoval.hpp"
+#include "ThreadPool.hpp"
+#include "TextFormat.hpp"
+#include "ChromBlocks.hpp"
+#include "Metrics.hpp"
+
+using std::string;
+using std::vector;
+using std::cin;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+// sizes like "500M" or "4G", with decimal suffixes
+static size_t
+parse_size(const string &s) {
+  char *end = 0;
+  double x = strtod(s.c_str(), &end);
+  const string suffix(end);
+  if (suffix == "K" || suffix == "k") x *= 1e3;
+  else if (suffix == "M" || suffix == "m") x *= 1e6;
+  else if (suffix == "G" || suffix == "g") x *= 1e9;
+  else if (!suffix.empty() || end == s.c_str())
+    throw SMITHLABException("bad size: " + s);
+  if (!(x >= 1.0))
+    throw SMITHLABException("bad size: " + s);
+  return static_cast<size_t>(x);
+}
+
+
+/* A record of a run is a flags byte, the chrom if it differs from the
+ * previous record (a varint length and the name), then the body:
+ * start and length as varints, the read name, the score as a varint
+ * if it is a whole number and otherwise as 8 bytes, and the sequence
+ * and quality scores.
+ */
+enum {NEG_STRAND = 1, NEW_CHROM = 2, RAW_SCORE = 4};
+
+static void
+put_bytes(vector<char> &b, const char *s, const size_t n) {
+  put_varint(b, n);
+  b.insert(b.end(), s, s + n);
+}
+
+
+// appends the body of a record and gives its flags
+static char
+encode_body(const MappedRead &mr, vector<char> &b) {
+  put_varint(b, mr.r.get_start());
+  put_varint(b, mr.r.get_end() - mr.r.get_start());
+  const string name(mr.r.get_name());
+  put_bytes(b, name.data(), name.size());
+  const double score = mr.r.get_score();
+  char flags = (mr.r.get_strand() == '-') ? NEG_STRAND : 0;
+  if (score >= 0.0 && !std::signbit(score) && score < 9007199254740992.0 &&
+      score == std::floor(score))
+    put_varint(b, static_cast<uint64_t>(score));
+  else {
+    flags |= RAW_SCORE;
+    const char *p = reinterpret_cast<const char *>(&score);
+    b.insert(b.end(), p, p + sizeof(double));
+  }
+  put_bytes(b, mr.seq.data(), mr.seq.size());
+  put_bytes(b, mr.scr.data(), mr.scr.size());
+  return flags;
+}
+
+
+class RunWriter {
+public:
+  explicit RunWriter(const string &fn) :
+    out(fn.c_str(), std::ios::binary), filename(fn), started(false) {
+    if (!out)
+      throw SMITHLABException("cannot write temporary file: " + fn);
+  }
+  // without a call to flush, a write error is not reported
+  ~RunWriter() {out.write(buf.data(), buf.size());}
+
+  // a record whose body is already encoded
+  void write(const char *chrom, const size_t chrom_len, char flags,
+             const char *body, const size_t body_len) {
+    const bool new_chrom = !started || chrom_len != prev_chrom.size() ||
+      prev_chrom.compare(0, chrom_len, chrom, chrom_len) != 0;
+    if (new_chrom) {
+      prev_chrom.assign(chrom, chrom_len);
+      started = true;
+      flags |= NEW_CHROM;
+    }
+    buf.push_back(flags);
+    if (new_chrom)
+      put_bytes(buf, chrom, chrom_len);
+    buf.insert(buf.end(), body, body + body_len);
+    if (buf.size() >= buffer_size)
+      flush();
+  }
+
+  void write(const string &chrom, const MappedRead &mr) {
+    body.clear();
+    const char flags = encode_body(mr, body);
+    write(chrom.data(), chrom.size(), flags, body.data(), body.size());
+  }
+
+  void flush() {
+    if (buf.empty()) return;
+    out.write(buf.data(), buf.size());
+    buf.clear();
+    if (!out)
+      throw SMITHLABException("error writing temporary file: " + filename);
+  }
+
+private:
+  static const size_t buffer_size = 1ul << 20;
+  std::ofstream out;
+  const string filename;
+  vector<char> buf;
+  vector<char> body;
+  string prev_chrom;
+  bool started;
+};
+
+
+/* RunReader: the records of a run, one at a time, into a MappedRead
+   that is reused, with the chrom kept in the key as in
+   duplicate-remover */
+class RunReader {
+public:
+  explicit RunReader(const string &fn) :
+    in(fn.c_str(), std::ios::binary), filename(fn),
+    buf(buffer_size), pos(0), len(0) {
+    if (!in)
+      throw SMITHLABException("cannot read temporary file: " + fn);
+  }
+
+  bool read();
+
+  ReadKey key;
+  MappedRead mr;
+
+private:
+  bool available(const size_t n);
+  char get_byte() {
+    if (!available(1)) truncated();
+    return buf[pos++];
+  }
+  uint64_t get_varint();
+  void get_bytes(string &s);
+  void truncated() const {
+    throw SMITHLABException("truncated temporary file: " + filename);
+  }
+
+  static const size_t buffer_size = 1ul << 20;
+  std::ifstream in;
+  const string filename;
+  vector<char> buf;
+  size_t pos;
+  size_t len;
+  string name;
+};
+
+
+// true if "n" bytes are in the buffer, after reading more if needed
+bool
+RunReader::available(const size_t n) {
+  if (len - pos >= n)
+    return true;
+  std::memmove(buf.data(), buf.data() + pos, len - pos);
+  len -= pos;
+  pos = 0;
+  if (buf.size() < n)
+    buf.resize(n);
+  while (len < n && in) {
+    in.read(buf.data() + len, buf.size() - len);
+    len += in.gcount();
+  }
+  return len >= n;
+}
+
+
+uint64_t
+RunReader::get_varint() {
+  uint64_t x = 0;
+  if (!decode_varint([this]() {return get_byte();}, x))
+    truncated();
+  return x;
+}
+
+
+void
+RunReader::get_bytes(string &s) {
+  const size_t n = get_varint();
+  if (!available(n)) truncated();
+  s.assign(buf.data() + pos, n);
+  pos += n;
+}
+
+
+bool
+RunReader::read() {
+  if (!available(1))
+    return false;
+  const char flags = get_byte();
+  if (flags & NEW_CHROM)
+    get_bytes(key.chrom);
+  key.start = get_varint();
+  key.end = key.start + get_varint();
+  key.strand = (flags & NEG_STRAND) ? '-' : '+';
+  get_bytes(name);
+  double score = 0.0;
+  if (flags & RAW_SCORE) {
+    if (!available(sizeof(double))) truncated();
+    std::memcpy(&score, buf.data() + pos, sizeof(double));
+    pos += sizeof(double);
+  }
+  else score = get_varint();
+  get_bytes(mr.seq);
+  get_bytes(mr.scr);
+  mr.r.set_start(key.start);
+  mr.r.set_end(key.end);
+  mr.r.set_name(name);
+  mr.r.set_score(score);
+  mr.r.set_strand(key.strand);
+  return true;
+}
+
+
+/* merge_runs: calls "emit(key, mr)" for the reads of all runs in
+   order; among equal keys, the reads of earlier runs come first, so
+   merging consecutive runs keeps the order of the input */
+template <class Emit>
+static void
+merge_runs(const vector<string> &run_files, Emit emit) {
+  vector<std::unique_ptr<RunReader> > runs;
+  vector<size_t> heap;
+  for (size_t i = 0; i < run_files.size(); ++i) {
+    runs.push_back(std::unique_ptr<RunReader>(new RunReader(run_files[i])));
+    if (runs.back()->read())
+      heap.push_back(i);
+  }
+  // a min-heap, so "later" means the read comes after
+  auto later = [&runs](const size_t a, const size_t b) {
+    const ReadKey &ka = runs[a]->key, &kb = runs[b]->key;
+    return precedes(kb, ka) || (!precedes(ka, kb) && b < a);
+  };
+  std::make_heap(heap.begin(), heap.end(), later);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    RunReader &r = *runs[heap.back()];
+    emit(r.key, r.mr);
+    if (r.read())
+      std::push_heap(heap.begin(), heap.end(), later);
+    else heap.pop_back();
+  }
+}
+
+
+/* TempRuns: names for the run files, which are removed when they are
+   no longer needed or, after an error, when the program ends */
+class TempRuns {
+public:
+  explicit TempRuns(const string &d) : dir(d), n_made(0) {}
+  ~TempRuns() {
+    for (size_t i = 0; i < files.size(); ++i)
+      remove_file(files[i]);
+  }
+
+  string make() {
+    std::lock_guard<std::mutex> lock(mtx);
+    files.push_back(dir + "/methpipe-sort." + toa(getpid()) + "." +
+                    toa(n_made++) + ".run");
+    return files.back();
+  }
+
+  void remove(const vector<string> &done) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (size_t i = 0; i < done.size(); ++i) {
+      remove_file(done[i]);
+      files.erase(std::find(files.begin(), files.end(), done[i]));
+    }
+  }
+
+private:
+  static void remove_file(const string &fn) {std::remove(fn.c_str());}
+  const string dir;
+  size_t n_made;
+  vector<string> files;
+  std::mutex mtx;
+};
+
+
+// the fields of a line that sort it, and where its record body is
+struct SortKey {
+  const char *chrom;
+  size_t chrom_len;
+  size_t start;
+  size_t end;
+  char strand;
+  char flags;
+  size_t body;
+  size_t body_len;
+};
+
+
+static bool
+key_less(const SortKey &a, const SortKey &b) {
+  const int c = std::memcmp(a.chrom, b.chrom, std::min(a.chrom_len,
+                                                      b.chrom_len));
+  if (c != 0) return c < 0;
+  if (a.chrom_len != b.chrom_len) return a.chrom_len < b.chrom_len;
+  if (a.start != b.start) return a.start < b.start;
+  if (a.end != b.end) return a.end < b.end;
+  if (a.strand != b.strand) return a.strand < b.strand;
+  return a.body < b.body; // bodies are in input order
+}
+
+
+// the lines of one run, as text, then sorted and written
+struct SortBatch {
+  vector<char> text;
+  vector<size_t> line_ends;
+  vector<SortKey> keys;
+  vector<char> bodies;
+  MappedRead mr;
+  string name;
+  string run_file;
+};
+
+
+static bool
+fill_batch(MappedReadReader &reader, const size_t max_bytes, SortBatch &b) {
+  b.text.clear();
+  b.line_ends.clear();
+  const char *line = 0, *end = 0;
+  while (b.text.size() < max_bytes && reader.next_line(line, end)) {
+    b.text.insert(b.text.end(), line, end);
+    b.text.push_back('\n');
+    b.line_ends.push_back(b.text.size() - 1);
+  }
+  return !b.line_ends.empty();
+}
+
+
+static void
+sort_batch(TempRuns &temp, SortBatch &b) {
+  using namespace mapped_read_format;
+  b.keys.clear();
+  b.bodies.clear();
+  const char *p = b.text.data();
+  for (size_t i = 0; i < b.line_ends.size(); ++i) {
+    const char *end = b.text.data() + b.line_ends[i];
+    parse_mapped_read(p, end, b.name, b.mr);
+    SortKey k;
+    k.chrom = skip_space(p, end);
+    k.chrom_len = skip_token(k.chrom, end) - k.chrom;
+    k.start = b.mr.r.get_start();
+    k.end = b.mr.r.get_end();
+    k.strand = b.mr.r.get_strand();
+    k.body = b.bodies.size();
+    k.flags = encode_body(b.mr, b.bodies);
+    k.body_len = b.bodies.size() - k.body;
+    b.keys.push_back(k);
+    p = end + 1;
+  }
+  std::sort(b.keys.begin(), b.keys.end(), key_less);
+
+  b.run_file = temp.make();
+  RunWriter out(b.run_file);
+  for (size_t i = 0; i < b.keys.size(); ++i) {
+    const SortKey &k = b.keys[i];
+    out.write(k.chrom, k.chrom_len, k.flags, b.bodies.data() + k.body,
+              k.body_len);
+  }
+  out.flush();
+}
+
+
+/* the most runs each of "n_merges" merges at the same time may open,
+   so that they, with their outputs, stay within the open file limit;
+   a few files are left for the input, the output and stdio */
+static size_t
+merge_fan_in(const size_t n_merges) {
+  static const size_t max_fan_in = 128;
+  static const size_t reserved_files = 16;
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur == RLIM_INFINITY)
+    return max_fan_in;
+  const size_t available = (lim.rlim_cur > reserved_files) ?
+    lim.rlim_cur - reserved_files : 0;
+  const size_t per_merge = available/n_merges;
+  return std::max(static_cast<size_t>(2),
+                  std::min(max_fan_in, per_merge > 0 ? per_merge - 1 : 0));
+}
+
+
+/* merges groups of consecutive runs, in parallel, until there are few
+   enough for the final merge to open at once; the groups are smaller
+   than that, as one merge runs on each thread */
+static void
+reduce_runs(ThreadPool &pool, TempRuns &temp, vector<string> &runs) {
+  const size_t final_fan_in = merge_fan_in(1);
+  while (runs.size() > final_fan_in) {
+    const size_t fan_in = merge_fan_in(std::min(pool.size(), runs.size()));
+    const size_t n_groups = (runs.size() + fan_in - 1)/fan_in;
+    vector<string> merged(n_groups);
+    parallel_for_each(pool, n_groups, [&](const size_t g, const size_t) {
+        const vector<string> group(runs.begin() + g*fan_in,
+                                   runs.begin() + std::min(runs.size(),
+                                                           (g + 1)*fan_in));
+        merged[g] = temp.make();
+        RunWriter out(merged[g]);
+        merge_runs(group, [&out](const ReadKey &key, MappedRead &mr) {
+            out.write(key.chrom, mr);
+          });
+        out.flush();
+        temp.remove(group);
+      });
+    runs.swap(merged);
+    Metrics::count("merge_passes");
+  }
+}
+
+
+/* DuplicateGroups: reads from the final merge, in groups of equivalent
+   reads, from which a DuplicateSelector chooses the reads to keep */
+class DuplicateGroups {
+public:
+  DuplicateGroups(RecordWriter &o, DuplicateSelector &s) :
+    out(o), selector(s), n_reads(0) {}
+
+  void add(const ReadKey &key, MappedRead &mr) {
+    if (n_reads > 0 && !equivalent(key, group_key))
+      flush();
+    if (n_reads == 0)
+      group_key = key;
+    if (n_reads == group.size())
+      group.push_back(MappedRead());
+    std::swap(group[n_reads++], mr);
+  }
+
+  void flush() {
+    if (n_reads == 0) return;
+    selector.select(group_key, group.data(), n_reads, keepers);
+    for (size_t j = 0; j < keepers.size(); ++j)
+      write_mapped_read(out, group_key.chrom, group[keepers[j]]);
+    stats.add_group(group.data(), n_reads, keepers);
+    n_reads = 0;
+  }
+
+  DuplicateStats stats;
+
+private:
+  RecordWriter &out;
+  DuplicateSelector &selector;
+  vector<MappedRead> group;
+  size_t n_reads;
+  ReadKey group_key;
+  vector<size_t> keepers;
+};
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+    bool VERBOSE = false;
+    bool REMOVE_DUPLICATES = false;
+    bool USE_SEQUENCE = false;
+    bool ALL_C = false;
+    bool INPUT_FROM_STDIN = false;
+    size_t seed = 408;
+    size_t n_threads = 1;
+    string memory_arg = "1G";
+    string temp_dir;
+
+    string outfile;
+    string statfile;
+
+    string metrics_file;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "sort mapped reads for "
+                           "methcounts and duplicate-remover, optionally "
+                           "removing duplicates", "<mapped-reads>");
+    opt_parse.add_opt("output", 'o', "output file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("stdin", '\0', "take input from stdin",
+                      false, INPUT_FROM_STDIN);
+    opt_parse.add_opt("mem", 'm', "memory for sorting, e.g. 500M or 4G "
+                      "(default: 1G)", false, memory_arg);
+    opt_parse.add_opt("tmp", 'T', "directory for temporary files "
+                      "(default: $TMPDIR or /tmp)", false, temp_dir);
+    opt_parse.add_opt("remove-duplicates", 'd', "remove duplicates, as "
+                      "duplicate-remover", false, REMOVE_DUPLICATES);
+    opt_parse.add_opt("stats", 'S', "duplicate statistics output file "
+                      "(with -d)", false, statfile);
+    opt_parse.add_opt("seq", 's', "use sequence info for duplicates",
+                      false, USE_SEQUENCE);
+    opt_parse.add_opt("all-cytosines", 'A', "use all cytosines for "
+                      "duplicates (default: CpG)", false, ALL_C);
+    opt_parse.add_opt("seed", 'r', "random seed for choosing reads to keep "
+                      "(default: 408)", false, seed);
+    add_threads_opt(opt_parse, n_threads);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (INPUT_FROM_STDIN ? !leftover_args.empty() :
+        leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    string infile;
+    if (!leftover_args.empty())
+      infile = leftover_args.front();
+    if (!statfile.empty() && !REMOVE_DUPLICATES)
+      throw SMITHLABException("statistics are only given with -d");
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
+    n_threads = std::max(n_threads, static_cast<size_t>(1));
+    const size_t memory = parse_size(memory_arg);
+    if (temp_dir.empty()) {
+      const char *t = getenv("TMPDIR");
+      temp_dir = (t && *t) ? t : "/tmp";
+    }
+    if (!isdir(temp_dir.c_str()))
+      throw SMITHLABException("not a directory: " + temp_dir);
+
+    std::ifstream ifs;
+    if (!infile.empty()) ifs.open(infile.c_str());
+    std::istream in(infile.empty() ? cin.rdbuf() : ifs.rdbuf());
+    if (!in)
+      throw SMITHLABException("cannot open input file: " + infile);
+
+    /* a batch holds its text, its keys and the encoded records,
+       so about twice the text; with a slot per worker and one more
+       being filled, this keeps all of them within the memory given */
+    const size_t n_slots = (n_threads == 1) ? 1 : n_threads + 1;
+    const size_t batch_bytes = std::max(memory/(2*n_slots),
+                                        static_cast<size_t>(1) << 20);
+
+    TempRuns temp(temp_dir);
+    vector<string> runs;
+    size_t reads_in = 0;
+
+    StageTimer timer("sort_runs");
+    {
+      MappedReadReader reader(in);
+      vector<SortBatch> batches(n_slots);
+      run_ordered_pipeline(n_threads, batches,
+                           [&](SortBatch &b) {
+                             return fill_batch(reader, batch_bytes, b);
+                           },
+                           [&](SortBatch &b, const size_t) {
+                             sort_batch(temp, b);
+                           },
+                           [&](SortBatch &b) {
+                             runs.push_back(b.run_file);
+                             reads_in += b.keys.size();
+                           });
+    }
+    Metrics::count("reads_in", reads_in);
+    Metrics::count("runs", runs.size());
+    if (VERBOSE)
+      cerr << "[READS: " << reads_in << ", RUNS: " << runs.size() << "]"
+           << endl;
+
+    timer.next("merge_runs");
+    ThreadPool pool(n_threads);
+    reduce_runs(pool, temp, runs);
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
+    if (!out)
+      throw SMITHLABException("bad output file: " + outfile);
+
+    RecordWriter writer(out);
+    if (REMOVE_DUPLICATES) {
+      DuplicateSelector selector(USE_SEQUENCE, ALL_C, seed);
+      DuplicateGroups groups(writer, selector);
+      merge_runs(runs, [&groups](const ReadKey &key, MappedRead &mr) {
+          groups.add(key, mr);
+        });
+      groups.flush();
+      writer.flush();
+      Metrics::count("reads_out", groups.stats.reads_out);
+      if (VERBOSE)
+        cerr << groups.stats.tostring();
+      if (!statfile.empty()) {
+        std::ofstream out_stat(statfile.c_str());
+        out_stat << groups.stats.tostring();
+      }
+    }
+    else {
+      merge_runs(runs, [&writer](const ReadKey &key, MappedRead &mr) {
+          write_mapped_read(writer, key.chrom, mr);
+        });
+      writer.flush();
+      Metrics::count("reads_out", reads_in);
+    }
+    temp.remove(runs);
+    timer.stop();
+  }
+  catch (const SMITHLABException &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
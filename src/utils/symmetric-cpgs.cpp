@@ -25,80 +25,18 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
-#include <algorithm>
-#include <numeric>
-#include <cmath>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
+#include "MethpipeSite.hpp"
+#include "Metrics.hpp"
 
 using std::string;
 using std::vector;
 using std::cout;
 using std::cerr;
 using std::endl;
-using std::round;
-
-struct SiteInfo {
-  bool is_cpg() const {return context.compare(0, 3, "CpG") == 0;}
-  void add_meth_info(const SiteInfo &other) {
-    const size_t other_meth_count =
-      static_cast<size_t>(std::round(other.meth*other.total));
-    const size_t meth_count =
-      static_cast<size_t>(std::round(meth*total));
-    total += other.total;
-    meth = (total == 0) ? 0.0 :
-      static_cast<double>(meth_count + other_meth_count)/total;
-  }
-  string chrom;
-  string context;
-  size_t pos;
-  size_t total;
-  double meth;
-  char strand;
-};
-
-
-static std::istream &
-operator>>(std::istream &in, SiteInfo &si) {
-  string line;
-  if (getline(in, line)) {
-    std::istringstream iss(line);
-    if (!(iss >> si.chrom >> si.pos >> si.strand
-          >> si.context >> si.meth >> si.total))
-      in.setstate(std::ios_base::badbit);
-  }
-  return in;
-}
-
-
-static std::ostream &
-operator<<(std::ostream &out, const SiteInfo &si) {
-  return out << si.chrom << '\t' << si.pos << '\t'
-             << si.strand << '\t' << si.context << '\t'
-             << si.meth << '\t' << si.total;
-}
-
-
-static bool
-not_mutated(const SiteInfo &si) {
-  const size_t len = si.context.length();
-  //assert(len > 0);
-  // when dealing with the first site, the previous one is empty
-  if (si.context.empty()) return true;
-  return si.context[len-1] != 'x';
-}
-
-
-static bool
-found_symmetric(const SiteInfo &first, const SiteInfo &second) {
-  return (first.is_cpg() &&
-          second.is_cpg() &&
-          (first.strand == '+') &&
-          (second.strand == '-') &&
-          (first.pos + 1 == second.pos));
-}
 
 
 int
@@ -110,6 +48,8 @@ main(int argc, const char **argv) {
     bool VERBOSE;
     bool include_mutated = false;
 
+    string metrics_file;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "get CpG sites and make methylation levels symmetric",
@@ -119,6 +59,7 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("muts", 'm', "include mutated CpG sites",
                       false, include_mutated);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    add_metrics_opt(opt_parse, metrics_file);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -141,6 +82,8 @@ main(int argc, const char **argv) {
     const string filename(leftover_args.front());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    MetricsReport metrics(metrics_file, strip_path(argv[0]));
+
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
     std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
@@ -149,40 +92,10 @@ main(int argc, const char **argv) {
     if (!in)
       throw SMITHLABException("could not open file: " + filename);
 
-    SiteInfo prev, si;
-    while (in >> si) {
-      if (found_symmetric(prev, si)) {
-        prev.add_meth_info(si);
-        if (not_mutated(si) && not_mutated(prev)) {
-          out << prev << '\n';
-        }
-        else if (include_mutated) {
-          prev.context = "CpGx";
-          out << prev << '\n';
-        }
-        prev = SiteInfo();
-      }
-      else {
-        if (prev.is_cpg() &&
-            (not_mutated(prev) || include_mutated)) {
-          if (prev.strand == '-') {
-            prev.strand = '+';
-            --prev.pos;
-          }
-          out << prev << '\n';
-        }
-        prev = si;
-      }
-    }
-
-    if (prev.is_cpg() &&
-        (not_mutated(prev) || include_mutated)) {
-      if (prev.strand == '-') {
-        prev.strand = '+';
-        --prev.pos;
-      }
-      out << prev << '\n';
-    }
+    CpGSymmetrizer symmetrizer(include_mutated);
+    MSite site;
+    while (symmetrizer.read(in, site))
+      out << site << '\n';
 
   }
   catch (const SMITHLABException &e)  {